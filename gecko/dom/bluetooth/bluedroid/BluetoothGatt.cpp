@@ -2,23 +2,50 @@
 
 #include "base/basictypes.h"
 
+#include <algorithm>
+#include <deque>
+#include <set>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
 #include "DOMRequest.h"
 #include "nsContentUtils.h"
 
 #include "BluetoothCommon.h"
+#include "BluetoothGattRequest.h"
 #include "BluetoothService.h"
 #include "BluetoothSocket.h"
 #include "BluetoothUtils.h"
+#ifdef MOZ_BT_GATT_FAKE
+#include "BluetoothGattFake.h"
+#endif
 
 #include "mozilla/dom/bluetooth/BluetoothTypes.h"
 #include "mozilla/Services.h"
+#include "mozilla/ArrayUtils.h"
+#include "mozilla/Atomics.h"
+#include "mozilla/HashFunctions.h"
+#include "mozilla/MathAlgorithms.h"
+#include "mozilla/StaticMutex.h"
 #include "mozilla/StaticPtr.h"
+#include "mozilla/TimeStamp.h"
 #include "MainThreadUtils.h"
+#include "nsAutoPtr.h"
+#include "nsCharSeparatedTokenizer.h"
+#include "nsComponentManagerUtils.h"
 #include "nsIObserverService.h"
+#include "nsITimer.h"
 #include "nsThreadUtils.h"
 #include "nsIObserver.h"
 
+// Per-call logging is only built in on request; errors are always logged
+#ifdef MOZ_BT_GATT_DEBUG
 #define __DEBUG__
+#endif
 
 #define LOG_TAG "BluetoothGatt"
 
@@ -30,7 +57,7 @@
 #else
 #define DN_LOGV(...)
 #define DN_LOGW(...)
-#define DN_LOGE(...)
+#define DN_LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
 #define DN_LOGI(...)
 #endif
 
@@ -54,1267 +81,8651 @@
     sBluetoothGatt->func(args);            \
   } while(0)
 
-#define STREAM_TO_UINT8(u8, p)   {u8 = (uint8_t)(*(p)); (p) += 1;}
-#define HCI_EXT_INQ_RESPONSE_LEN        240
+// Advertising data plus scan response, as bluedroid hands it over
+#define GATT_ADV_DATA_LEN               62
+#define BT_EIR_FLAGS_TYPE                   0x01
+#define BT_EIR_MORE_16BITS_UUID_TYPE        0x02
+#define BT_EIR_COMPLETE_16BITS_UUID_TYPE    0x03
+#define BT_EIR_MORE_32BITS_UUID_TYPE        0x04
+#define BT_EIR_COMPLETE_32BITS_UUID_TYPE    0x05
+#define BT_EIR_MORE_128BITS_UUID_TYPE       0x06
+#define BT_EIR_COMPLETE_128BITS_UUID_TYPE   0x07
 #define BT_EIR_SHORTENED_LOCAL_NAME_TYPE    0x08
 #define BT_EIR_COMPLETE_LOCAL_NAME_TYPE     0x09
+#define BT_EIR_TX_POWER_LEVEL_TYPE          0x0A
+#define BT_EIR_SERVICE_DATA_16BITS_UUID_TYPE 0x16
+#define BT_EIR_APPEARANCE_TYPE              0x19
+#define BT_EIR_SERVICE_DATA_32BITS_UUID_TYPE 0x20
+#define BT_EIR_SERVICE_DATA_128BITS_UUID_TYPE 0x21
 #define BT_EIR_MANUFACTURER_SPECIFIC_TYPE   0xFF
+// Service UUIDs and service data entries kept per advertisement
+#define GATT_ADV_MAX_UUIDS 16
+#define GATT_ADV_MAX_SERVICE_DATA 4
 
 #define MAX_LEN_UUID_STR 37
-#define MAX_HEX_VAL_STR_LEN 100
-#define MAX_HEX_DESCRIPTOR_VAL_STR_LEN 200
+// Longest attribute value allowed by the ATT protocol
+#define GATT_MAX_ATTR_VALUE_LEN 512
+// ATT_MTU until an exchange raises it, and the most one may ask for
+#define GATT_DEFAULT_MTU 23
+#define GATT_MAX_MTU 517
+// write_type of a Write Command, which carries at most ATT_MTU - 3 bytes
+#define GATT_WRITE_TYPE_NO_RSP 1
+// write_type of a Write Request. The stack sends one longer than
+// ATT_MTU - 3 as Prepare Write Requests of ATT_MTU - 5 and an Execute Write
+#define GATT_WRITE_TYPE_DEFAULT 2
+// Operations a connection may have waiting behind the one in flight
+#define MAX_GATT_OP_QUEUE_DEPTH 64
+// An operation the stack never answered is failed after this long. It is
+// above the stack's own 30 s ATT timeout, so only lost callbacks hit it
+#define GATT_OP_TIMEOUT_MS 35000
+#define GATT_OP_WATCHDOG_TICK_MS 1000
+// Bytes a write stream holds ahead of the link
+#define GATT_STREAM_MAX_BUFFER 65536
+// Pause of a stream after congestion or a segment the stack refused
+#define GATT_STREAM_BACKOFF_MS 20
+// Status of a Write Command L2CAP took while becoming congested
+#define GATT_STATUS_CONGESTED 0x8f
+// Status of an operation the stack never got, as GATT_ERROR
+#define GATT_STATUS_ERROR 0x85
+// Waiting operations, or notifications per tick, that make a link with
+// automatic profiles switch to low latency
+#define GATT_CONN_BURST_DEPTH 4
+#define GATT_CONN_BURST_NOTIFICATIONS 20
+// How often such links are checked, and how long they stay fast once idle
+#define GATT_CONN_PROFILE_TICK_MS 1000
+#define GATT_CONN_IDLE_MS 3000
+// Backoff of an auto-reconnect target whose background connect failed
+#define GATT_RECONNECT_MIN_BACKOFF_MS 1000
+#define GATT_RECONNECT_MAX_BACKOFF_MS 60000
+#define MAX_NOTIFY_BATCH_EVENTS 256
+// Devices a scan keeps track of before it forgets the stalest one
+#define DEFAULT_SCAN_DEVICES 512
+#define MAX_SCAN_DEVICES 65536
+// Occupied slots compared to pick the device a full table evicts
+#define GATT_SCAN_EVICT_SAMPLES 8
+// Entries of each list of a scan filter
+#define MAX_SCAN_FILTER_ENTRIES 32
+// Floor between two reports of one device, whatever its RSSI does
+#define GATT_SCAN_MIN_UPDATE_MS 50
+#define GATT_SCAN_DEFAULT_RSSI_DELTA 6
+#define GATT_SCAN_DEFAULT_RSSI_WEIGHT 25
+// Events one benchmark run may ask for
+#define MAX_GATT_BENCH_EVENTS 100000
+// A benchmark run ends once no event arrived for this long
+#define GATT_BENCH_IDLE_MS 2000
+// Self-test, see GattSelfTestCheck: ATT_MTU the chunks check gives its
+// link and the length it writes, and the operation timeout of every link
+// during the timeout check
+#define GATT_SELF_TEST_MTU 50
+#define GATT_SELF_TEST_CHUNKED_LEN 100
+#define GATT_SELF_TEST_OP_TIMEOUT_MS 300
+// How often a check looks whether its requests are through, and for how long
+#define GATT_SELF_TEST_POLL_MS 50
+#define GATT_SELF_TEST_DEADLINE_MS 5000
+// Made-up address of the cache file the cache check writes
+#define GATT_SELF_TEST_CACHE_KEY 0x0be7ffffffffULL
+// GattEvents kept for reuse, allocated when the stack comes up
+#define GATT_EVENT_POOL_SIZE 64
+
+// Where the attribute database of each peer is kept between connections
+#ifndef GATT_CACHE_DIR
+#define GATT_CACHE_DIR "/data/misc/bluedroid/owb_gatt_cache"
+#endif
+
+#ifndef BLEGATT_NOTIFY_BATCH_ID
+#define BLEGATT_NOTIFY_BATCH_ID "notifybatch"
+#endif
+#ifndef GATT_PARA_SAMPLES
+#define GATT_PARA_SAMPLES "samples"
+#endif
+#ifndef GATT_PARA_SAMPLE
+#define GATT_PARA_SAMPLE "sample"
+#endif
+#ifndef BLEGATT_OP_QUEUE_ID
+#define BLEGATT_OP_QUEUE_ID "opqueue"
+#endif
+#ifndef GATT_PARA_QUEUE_DEPTH
+#define GATT_PARA_QUEUE_DEPTH "queue_depth"
+#endif
+#ifndef BLEGATT_SCAN_UPDATE_ID
+#define BLEGATT_SCAN_UPDATE_ID "scanupdate"
+#endif
+#ifndef GATT_PARA_RAW_RSSI
+#define GATT_PARA_RAW_RSSI "raw_rssi"
+#endif
+#ifndef BLEGATT_CACHE_STATS_ID
+#define BLEGATT_CACHE_STATS_ID "cachestats"
+#endif
+#ifndef GATT_PARA_CACHE_HITS
+#define GATT_PARA_CACHE_HITS "cache_hits"
+#endif
+#ifndef GATT_PARA_CACHE_INVALIDATIONS
+#define GATT_PARA_CACHE_INVALIDATIONS "cache_invalidations"
+#endif
+#ifndef GATT_PARA_REFRESH_ISSUED
+#define GATT_PARA_REFRESH_ISSUED "refresh_issued"
+#endif
+#ifndef GATT_PARA_REFRESH_AVOIDED
+#define GATT_PARA_REFRESH_AVOIDED "refresh_avoided"
+#endif
+#ifndef BLEGATT_BENCHMARK_ID
+#define BLEGATT_BENCHMARK_ID "benchmark"
+#endif
+#ifndef GATT_PARA_WORKLOAD
+#define GATT_PARA_WORKLOAD "workload"
+#endif
+#ifndef GATT_PARA_EVENTS
+#define GATT_PARA_EVENTS "events"
+#endif
+#ifndef GATT_PARA_DROPPED
+#define GATT_PARA_DROPPED "dropped"
+#endif
+#ifndef GATT_PARA_ELAPSED_MS
+#define GATT_PARA_ELAPSED_MS "elapsed_ms"
+#endif
+#ifndef GATT_PARA_EVENTS_PER_SEC
+#define GATT_PARA_EVENTS_PER_SEC "events_per_sec"
+#endif
+#ifndef GATT_PARA_LATENCY_P50_US
+#define GATT_PARA_LATENCY_P50_US "latency_p50_us"
+#endif
+#ifndef GATT_PARA_LATENCY_P99_US
+#define GATT_PARA_LATENCY_P99_US "latency_p99_us"
+#endif
+#ifndef GATT_PARA_LATENCY_P999_US
+#define GATT_PARA_LATENCY_P999_US "latency_p999_us"
+#endif
+#ifndef GATT_PARA_ALLOCATIONS_PER_EVENT
+#define GATT_PARA_ALLOCATIONS_PER_EVENT "allocations_per_event"
+#endif
+#ifndef GATT_PARA_DISPATCH_NS
+#define GATT_PARA_DISPATCH_NS "dispatch_ns"
+#endif
+#ifndef GATT_PARA_NAME_LOOKUP_NS
+#define GATT_PARA_NAME_LOOKUP_NS "name_lookup_ns"
+#endif
+#ifndef GATT_PARA_LATENCY_P90_US
+#define GATT_PARA_LATENCY_P90_US "latency_p90_us"
+#endif
+#ifndef GATT_PARA_LATENCY_MAX_US
+#define GATT_PARA_LATENCY_MAX_US "latency_max_us"
+#endif
+#ifndef BLEGATT_METRICS_ID
+#define BLEGATT_METRICS_ID "metrics"
+#endif
+#ifndef GATT_PARA_HISTOGRAMS
+#define GATT_PARA_HISTOGRAMS "histograms"
+#endif
+#ifndef GATT_PARA_HISTOGRAM
+#define GATT_PARA_HISTOGRAM "histogram"
+#endif
+#ifndef GATT_PARA_NAME
+#define GATT_PARA_NAME "name"
+#endif
+#ifndef GATT_PARA_CONNS
+#define GATT_PARA_CONNS "conns"
+#endif
+#ifndef GATT_PARA_CONN
+#define GATT_PARA_CONN "conn"
+#endif
+#ifndef GATT_PARA_NOTIFICATIONS
+#define GATT_PARA_NOTIFICATIONS "notifications"
+#endif
+#ifndef GATT_PARA_ADV_FLAGS
+#define GATT_PARA_ADV_FLAGS "adv_flags"
+#endif
+#ifndef GATT_PARA_TX_POWER
+#define GATT_PARA_TX_POWER "tx_power"
+#endif
+#ifndef GATT_PARA_APPEARANCE
+#define GATT_PARA_APPEARANCE "appearance"
+#endif
+#ifndef GATT_PARA_SERVICE_UUIDS
+#define GATT_PARA_SERVICE_UUIDS "service_uuids"
+#endif
+#ifndef GATT_PARA_UUID
+#define GATT_PARA_UUID "uuid"
+#endif
+#ifndef GATT_PARA_SERVICE_DATA
+#define GATT_PARA_SERVICE_DATA "service_data"
+#endif
+#ifndef GATT_PARA_MANUFACTURER_ID
+#define GATT_PARA_MANUFACTURER_ID "manufacturer_id"
+#endif
+#ifndef GATT_PARA_MANUFACTURER_DATA
+#define GATT_PARA_MANUFACTURER_DATA "manufacturer_data"
+#endif
+#ifndef GATT_PARA_BEACON_TYPE
+#define GATT_PARA_BEACON_TYPE "beacon_type"
+#endif
+#ifndef GATT_PARA_BEACON_ID
+#define GATT_PARA_BEACON_ID "beacon_id"
+#endif
+#ifndef GATT_PARA_BEACON_MAJOR
+#define GATT_PARA_BEACON_MAJOR "beacon_major"
+#endif
+#ifndef GATT_PARA_BEACON_MINOR
+#define GATT_PARA_BEACON_MINOR "beacon_minor"
+#endif
+#ifndef GATT_PARA_BEACON_POWER
+#define GATT_PARA_BEACON_POWER "beacon_power"
+#endif
+#ifndef GATT_PARA_BEACON_URL
+#define GATT_PARA_BEACON_URL "beacon_url"
+#endif
+#ifndef BLEGATT_SCAN_DEVICES_ID
+#define BLEGATT_SCAN_DEVICES_ID "scandevices"
+#endif
+#ifndef GATT_PARA_DEVICES
+#define GATT_PARA_DEVICES "devices"
+#endif
+#ifndef GATT_PARA_DEVICE
+#define GATT_PARA_DEVICE "device"
+#endif
+#ifndef GATT_PARA_AGE_MS
+#define GATT_PARA_AGE_MS "age_ms"
+#endif
+#ifndef GATT_PARA_ADV_COUNT
+#define GATT_PARA_ADV_COUNT "adv_count"
+#endif
+#ifndef BLEGATT_CONFIGURE_MTU_ID
+#define BLEGATT_CONFIGURE_MTU_ID "configuremtu"
+#endif
+#ifndef GATT_PARA_MTU
+#define GATT_PARA_MTU "mtu"
+#endif
+#ifndef BLEGATT_LONG_WRITE_ID
+#define BLEGATT_LONG_WRITE_ID "longwrite"
+#endif
+#ifndef GATT_PARA_SEGMENTS
+#define GATT_PARA_SEGMENTS "segments"
+#endif
+#ifndef BLEGATT_WRITE_STREAM_ID
+#define BLEGATT_WRITE_STREAM_ID "writestream"
+#endif
+#ifndef GATT_PARA_BYTES_SENT
+#define GATT_PARA_BYTES_SENT "bytes_sent"
+#endif
+#ifndef GATT_PARA_BUFFERED
+#define GATT_PARA_BUFFERED "buffered"
+#endif
+#ifndef GATT_PARA_CREDIT
+#define GATT_PARA_CREDIT "credit"
+#endif
+#ifndef GATT_PARA_BYTES_PER_SEC
+#define GATT_PARA_BYTES_PER_SEC "bytes_per_sec"
+#endif
+#ifndef GATT_PARA_CONGESTED
+#define GATT_PARA_CONGESTED "congested"
+#endif
+#ifndef BLEGATT_CONN_PARAMS_ID
+#define BLEGATT_CONN_PARAMS_ID "connparams"
+#endif
+#ifndef GATT_PARA_PROFILE
+#define GATT_PARA_PROFILE "profile"
+#endif
+#ifndef GATT_PARA_MIN_INTERVAL
+#define GATT_PARA_MIN_INTERVAL "min_interval"
+#endif
+#ifndef GATT_PARA_MAX_INTERVAL
+#define GATT_PARA_MAX_INTERVAL "max_interval"
+#endif
+#ifndef GATT_PARA_LATENCY
+#define GATT_PARA_LATENCY "latency"
+#endif
+#ifndef GATT_PARA_TIMEOUT
+#define GATT_PARA_TIMEOUT "timeout"
+#endif
+#ifndef GATT_PARA_AUTO
+#define GATT_PARA_AUTO "auto"
+#endif
+#ifndef BLEGATT_AUTO_RECONNECT_ID
+#define BLEGATT_AUTO_RECONNECT_ID "autoreconnect"
+#endif
+#ifndef GATT_PARA_ATTEMPTS
+#define GATT_PARA_ATTEMPTS "attempts"
+#endif
+#ifndef GATT_PARA_RESTORED
+#define GATT_PARA_RESTORED "restored"
+#endif
+#ifndef BLEGATT_SELF_TEST_ID
+#define BLEGATT_SELF_TEST_ID "selftest"
+#endif
+
+/**
+ * Operations handled natively in this file in addition to the BleFunType_*
+ * values declared in BluetoothCommon.h. They start at 0x100 so they never
+ * collide with the DOM-facing ones.
+ */
+enum {
+  BleFunType_setNotifyBatching = 0x100,
+  BleFunType_setValueFormat,
+  BleFunType_getOpQueueDepth,
+  BleFunType_setRefreshPolicy,
+  BleFunType_getCacheStats,
+  BleFunType_setScanStreaming,
+  BleFunType_runBenchmark,
+  BleFunType_setTraceFilter,
+  BleFunType_flushTrace,
+  BleFunType_getMetrics,
+  BleFunType_dumpMetrics,
+  BleFunType_setScanFilter,
+  BleFunType_setScanDeviceTable,
+  BleFunType_getScanDevices,
+  BleFunType_configureMtu,
+  BleFunType_longWriteCharacteristic,
+  BleFunType_writeStream,
+  BleFunType_stopStream,
+  BleFunType_setConnParams,
+  BleFunType_setConnProfile,
+  BleFunType_setAutoReconnect,
+  BleFunType_runSelfTest,
+};
 
 using namespace mozilla;
 USING_BLUETOOTH_NAMESPACE
 
-static uint8_t char2int(char input)
-{
-  if(input >= '0' && input <= '9')
-    return input - '0';
-  if(input >= 'A' && input <= 'F')
-    return input - 'A' + 10;
-  if(input >= 'a' && input <= 'f')
-    return input - 'a' + 10;
-  return 0;
-}
-
-// This function assumes src to be a zero terminated sanitized string with
-// an even number of [0-9a-f] characters, and target to be sufficiently large
-static void hex2bin(const char* src, uint8_t* tar)
-{
-  memset(tar, 0, sizeof(tar));
-  while(*src && src[1])
-  {
-    *(tar++) = char2int(*src)*16 + char2int(src[1]);
-    src += 2;
-  }
-}
+/**
+ * Binary trace of the scan, notify and request paths, cheap enough to
+ * stay in release builds; MOZ_BT_GATT_NO_TRACE compiles it out. A
+ * GATT_TRACE whose category is enabled and whose level is within the
+ * threshold stores a fixed-size record in a ring. Nothing is formatted
+ * until the flushTrace operation writes the ring to the log.
+ */
+enum GattTraceLevel {
+  GATT_TRACE_ERROR,
+  GATT_TRACE_WARN,
+  GATT_TRACE_INFO,
+  GATT_TRACE_VERBOSE,
+};
 
-static inline void ntoh128(const bt_uuid_t *src, bt_uuid_t *dst)
-{
-    int i;
+enum GattTraceCategory {
+  GATT_TRACE_CAT_SCAN,
+  GATT_TRACE_CAT_NOTIFY,
+  GATT_TRACE_CAT_OP,
+};
 
-    for (i = 0; i < 16; i++)
-        dst->uu[15 - i] = src->uu[i];
-}
+enum GattTraceEvent {
+  GATT_TRACE_SCAN_RESULT,
+  GATT_TRACE_EIR_FIELD,
+  GATT_TRACE_BEACON,
+  GATT_TRACE_NOTIFY,
+  GATT_TRACE_NOTIFY_BATCH,
+  GATT_TRACE_OP_ISSUE,
+  GATT_TRACE_READ,
+  GATT_TRACE_WRITE,
+  GATT_TRACE_EVENT_COUNT
+};
 
-void
-BtUuidToString(bt_uuid_t* uuid, nsAString& btUuid)
+struct GattTraceEventInfo
 {
-    char bdstr[48];
-
-    unsigned int   data0;
-    unsigned short data1;
-    unsigned short data2;
-    unsigned short data3;
-    unsigned int   data4;
-    unsigned short data5;
+  const char* name;
+  int category;
+  // Formats the three arguments of a record, unused ones are ignored
+  const char* format;
+};
 
-    bt_uuid_t nvalue;
-    const uint8_t *data = (uint8_t *) &nvalue;
+// Indexed by GattTraceEvent
+static const GattTraceEventInfo kGattTraceEvents[GATT_TRACE_EVENT_COUNT] = {
+  { "scan_result", GATT_TRACE_CAT_SCAN, "rssi:%d report:%d device_type:%d" },
+  { "eir_field", GATT_TRACE_CAT_SCAN, "type:0x%02x len:%d offset:%d" },
+  { "beacon", GATT_TRACE_CAT_SCAN, "type:%d len:%d" },
+  { "notify", GATT_TRACE_CAT_NOTIFY, "conn_id:%d len:%d is_notify:%d" },
+  { "notify_batch", GATT_TRACE_CAT_NOTIFY, "samples:%d" },
+  { "op_issue", GATT_TRACE_CAT_OP, "type:%d conn_id:%d" },
+  { "read", GATT_TRACE_CAT_OP, "conn_id:%d status:%d len:%d" },
+  { "write", GATT_TRACE_CAT_OP, "conn_id:%d status:%d" },
+};
 
-    ntoh128(uuid, &nvalue);
+struct GattTraceRecord
+{
+  uint64_t timeUs;
+  // Write count once filled; a record overwritten during a flush may
+  // still show mixed fields
+  uint32_t seq;
+  uint16_t event;
+  uint8_t level;
+  int32_t args[3];
+};
 
-    memcpy(&data0, &data[0], 4);
-    memcpy(&data1, &data[4], 2);
-    memcpy(&data2, &data[6], 2);
-    memcpy(&data3, &data[8], 2);
-    memcpy(&data4, &data[10], 4);
-    memcpy(&data5, &data[14], 2);
+#define GATT_TRACE_RING_SIZE 1024
 
-    snprintf(bdstr, MAX_LEN_UUID_STR, "%.8x-%.4x-%.4x-%.4x-%.8x%.4x",
-            ntohl(data0), ntohs(data1),
-            ntohs(data2), ntohs(data3),
-            ntohl(data4), ntohs(data5));
+namespace {
+// Bit per GattTraceCategory
+static Atomic<uint32_t> sTraceMask(UINT32_MAX);
+static Atomic<uint32_t> sTraceLevel(GATT_TRACE_WARN);
+}
 
-      btUuid = NS_ConvertUTF8toUTF16(bdstr);
+#ifndef MOZ_BT_GATT_NO_TRACE
+namespace {
+static Atomic<uint32_t> sTraceNext(0);
+static GattTraceRecord sTraceRing[GATT_TRACE_RING_SIZE];
 }
 
-void
-StringToUuid(nsAString& strUuid,
-        bt_uuid_t *uuid)
+static void
+GattTrace(int aEvent, int aLevel, int32_t aArg0, int32_t aArg1, int32_t aArg2)
 {
-    NS_ConvertUTF16toUTF8 uuidUTF8(strUuid);
-    const char* str = uuidUTF8.get();
-
-    uint32_t data0, data4;
-    uint16_t data1, data2, data3, data5;
-    bt_uuid_t n128, u128;
-    uint8_t *val = (uint8_t *) &n128;
-
-    if (sscanf(str, "%08x-%04hx-%04hx-%04hx-%08x%04hx",
-                &data0, &data1, &data2,
-                &data3, &data4, &data5) != 6)
-    {
-        return;
-    }
-
-    data0 = htonl(data0);
-    data1 = htons(data1);
-    data2 = htons(data2);
-    data3 = htons(data3);
-    data4 = htonl(data4);
-    data5 = htons(data5);
-
-    memcpy(&val[0], &data0, 4);
-    memcpy(&val[4], &data1, 2);
-    memcpy(&val[6], &data2, 2);
-    memcpy(&val[8], &data3, 2);
-    memcpy(&val[10], &data4, 4);
-    memcpy(&val[14], &data5, 2);
-
-    ntoh128(&n128, uuid);
+    uint32_t n = sTraceNext++;
+    GattTraceRecord& record = sTraceRing[n % GATT_TRACE_RING_SIZE];
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    record.seq = 0;
+    record.timeUs = (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    record.event = aEvent;
+    record.level = aLevel;
+    record.args[0] = aArg0;
+    record.args[1] = aArg1;
+    record.args[2] = aArg2;
+    record.seq = n + 1;
 }
 
+#define GATT_TRACE(level, event, a0, a1, a2)                                  \
+  do {                                                                        \
+    if ((uint32_t)(level) <= sTraceLevel &&                                   \
+        (sTraceMask & (1u << kGattTraceEvents[event].category))) {            \
+      GattTrace((event), (level), (a0), (a1), (a2));                          \
+    }                                                                         \
+  } while (0)
 
-uint8_t *CheckBeaconData( uint8_t *p_eir, uint8_t type, uint8_t *p_length, char *str )
-{
-    uint8_t *p = p_eir;
-    p += 5;
-    uint8_t cid0;
-    uint8_t cid1;
-    uint8_t typ;
-    uint8_t len;
-    STREAM_TO_UINT8(cid0, p);
-    STREAM_TO_UINT8(cid1, p);
-    STREAM_TO_UINT8(typ, p);
-    STREAM_TO_UINT8(len, p);
-    LOGI("manufacturer_data: %02X %02X %02X %02X", cid0, cid1, typ, len);
-    LOGI("beacon_uuid: %02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X", 
-        p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
-    if (0x4C == cid0 && 0x00 == cid1 && 0x02 == typ && 0x15 == len) {
-        sprintf(str, "iBeacon (%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-%02X%02X%02X%02X%02X%02X)", 
-            p[0], p[1], p[2], p[3], p[4], p[5], p[6], p[7], p[8], p[9], p[10], p[11], p[12], p[13], p[14], p[15]);
-        *p_length = 46;
-        return (uint8_t *)str;
-    }
-    return NULL;
-}
-/*******************************************************************************
-**
-** Function         BTM_CheckEirData
-**
-** Description      This function is called to get EIR data from significant part.
-**
-** Parameters       p_eir - pointer of EIR significant part
-**                  type   - finding EIR data type
-**                  p_length - return the length of EIR data not including type
-**
-** Returns          pointer of EIR data
-**
-*******************************************************************************/
-uint8_t *CheckEirData( uint8_t *p_eir, uint8_t type, uint8_t *p_length )
+/* Writes the records still in the ring to the log, oldest first */
+static void
+FlushGattTrace()
 {
-    uint8_t *p = p_eir;
-    uint8_t length;
-    uint8_t eir_type;
-    LOGI("CheckEirData type=0x%02X", type);
+    uint32_t end = sTraceNext;
+    uint32_t begin = end > GATT_TRACE_RING_SIZE ? end - GATT_TRACE_RING_SIZE : 0;
 
-    STREAM_TO_UINT8(length, p);
-    LOGI("CheckEirData length=%d", length);
-    while( length && (p - p_eir <= HCI_EXT_INQ_RESPONSE_LEN))
+    for(uint32_t n = begin; n != end; ++n)
     {
-        STREAM_TO_UINT8(eir_type, p);
-        LOGI("CheckEirData eir_type=0x%02X", eir_type);
-        if( eir_type == type )
+        const GattTraceRecord& record = sTraceRing[n % GATT_TRACE_RING_SIZE];
+        if(record.seq != n + 1 || record.event >= GATT_TRACE_EVENT_COUNT)
         {
-            /* length doesn't include itself */
-            *p_length = length - 1; /* minus the length of type */
-            return p;
+            continue;
         }
-        p += length - 1; /* skip the length of data */
-        STREAM_TO_UINT8(length, p);
-        LOGI("CheckEirData length=%d", length);
-    }
 
-    *p_length = 0;
-    return NULL;
+        const GattTraceEventInfo& info = kGattTraceEvents[record.event];
+        char args[96];
+        snprintf(args, sizeof(args), info.format,
+                 record.args[0], record.args[1], record.args[2]);
+        __android_log_print(ANDROID_LOG_INFO, LOG_TAG, "trace %u %llu.%06llu L%d %s %s",
+                            n, (unsigned long long)(record.timeUs / 1000000),
+                            (unsigned long long)(record.timeUs % 1000000),
+                            record.level, info.name, args);
+    }
 }
+#else
+#define GATT_TRACE(level, event, a0, a1, a2) do {} while (0)
 
-/* Converts array of uint8_t to string representation */
-static char *array2str(const uint8_t *v, int size, char *buf, int out_size)
+static void
+FlushGattTrace()
 {
-    int limit = size;
-    int i;
+}
+#endif
 
-    if (out_size > 0) {
-        *buf = '\0';
-        if (size >= 2 * out_size)
-            limit = (out_size - 2) / 2;
+/**
+ * Counters and latency histograms of the hot paths. They are updated
+ * lock-free from any thread and reported by the getMetrics and
+ * dumpMetrics operations.
+ */
+enum GattCounter {
+  GATT_COUNTER_SCAN_RESULTS,
+  GATT_COUNTER_SCAN_NEW,
+  GATT_COUNTER_SCAN_UPDATES,
+  GATT_COUNTER_SCAN_SUPPRESSED,
+  GATT_COUNTER_SCAN_FILTERED,
+  GATT_COUNTER_NOTIFICATIONS,
+  GATT_COUNTER_NOTIFY_BATCHES,
+  GATT_COUNTER_OPS_COMPLETED,
+  GATT_COUNTER_OPS_QUEUED,
+  GATT_COUNTER_OPS_REJECTED,
+  GATT_COUNTER_STACK_ERRORS,
+  GATT_COUNTER_ATT_ERRORS,
+  GATT_COUNTER_CONNECTS,
+  GATT_COUNTER_DISCONNECTS,
+  GATT_COUNTER_OP_TIMEOUTS,
+  // Heap blocks the event pipeline took for itself: events and tasks, and
+  // the queues and signal arrays growing. The stack and the signal
+  // distribution are not counted.
+  GATT_COUNTER_EVENT_ALLOCATIONS,
+  GATT_COUNTER_COUNT
+};
+
+// Signal keys, indexed by GattCounter
+static const char* const kGattCounterNames[GATT_COUNTER_COUNT] = {
+  "scan_results",
+  "scan_new",
+  "scan_updates",
+  "scan_suppressed",
+  "scan_filtered",
+  "notifications",
+  "notify_batches",
+  "ops_completed",
+  "ops_queued",
+  "ops_rejected",
+  "stack_errors",
+  "att_errors",
+  "connects",
+  "disconnects",
+  "op_timeouts",
+  "event_allocations",
+};
 
-        for (i = 0; i < limit; ++i)
-            sprintf(buf + 2 * i, "%02x", v[i]);
+// Request to response time of each queued operation, same order as GattOpType
+enum GattHistogramKind {
+  GATT_HISTOGRAM_READ_CHARACTERISTIC,
+  GATT_HISTOGRAM_WRITE_CHARACTERISTIC,
+  GATT_HISTOGRAM_READ_DESCRIPTOR,
+  GATT_HISTOGRAM_WRITE_DESCRIPTOR,
+  GATT_HISTOGRAM_LONG_WRITE_CHARACTERISTIC,
+  GATT_HISTOGRAM_STREAM_WRITE,
+  GATT_HISTOGRAM_RESTORE_DESCRIPTOR,
+  GATT_HISTOGRAM_COUNT
+};
 
-        /* output buffer not enough to hold whole field fill with ...*/
-        if (limit < size)
-            sprintf(buf + 2 * i, "...");
-    }
-
-    return buf;
-}
+static const char* const kGattHistogramNames[GATT_HISTOGRAM_COUNT] = {
+  "read_characteristic",
+  "write_characteristic",
+  "read_descriptor",
+  "write_descriptor",
+  "long_write_characteristic",
+  "stream_write",
+  "restore_descriptor",
+};
 
 /*
- * Tries to convert hex string of given size into out buffer.
- * Output buffer is little endian.
+ * Log-linear buckets in microseconds, as in HDR histograms: values below
+ * 16 are exact and every power of two above is split in 8, so a bucket
+ * is never wider than 12.5% of its values.
  */
-static void scan_field(const char *str, int len, uint8_t *out, int out_size)
+#define GATT_HISTOGRAM_SUB_BITS 3
+#define GATT_HISTOGRAM_BUCKETS ((32 - GATT_HISTOGRAM_SUB_BITS + 1) << GATT_HISTOGRAM_SUB_BITS)
+
+struct GattHistogram
 {
-    int i;
-    memset(out, 0, out_size);
-    if (out_size * 2 > len + 1)
-        out_size = (len + 1) / 2;
-    for (i = 0; i < out_size && len > 0; ++i) {
-        len -= 2;
-        if (len >= 0)
-            sscanf(str + len, "%02hhx", &out[out_size - i - 1]);
-        else
-            sscanf(str, "%1hhx", &out[out_size - i - 1]);
-    }
-}
+  Atomic<uint32_t> buckets[GATT_HISTOGRAM_BUCKETS];
+  Atomic<uint32_t> count;
+  Atomic<uint32_t> maxUs;
+};
 
 namespace {
-//StaticRefPtr<BluetoothGatt> sBluetoothGatt;
-static BluetoothGatt* sBluetoothGatt;
-static const btgatt_interface_t* sBluetoothGattInterface;
-static nsString mTest;
+static Atomic<uint32_t> sGattCounters[GATT_COUNTER_COUNT];
+static GattHistogram sGattHistograms[GATT_HISTOGRAM_COUNT];
 }
 
-// Main thread task commands
-enum MainThreadTaskCmd {
-  NOTIFY_GATT_CALLBACKS,
-};
+static inline void
+GattCount(GattCounter aCounter, uint32_t aBy = 1)
+{
+    sGattCounters[aCounter] += aBy;
+}
 
-/** Callback invoked in response to register_client */
-static void
-GattRegisterClientCallback(int status, int client_if, bt_uuid_t *app_uuid)
+static uint32_t
+GattHistogramIndex(uint32_t aValue)
 {
-    LOGW("GattRegisterClientCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    if(aValue < (1u << GATT_HISTOGRAM_SUB_BITS))
     {
-        sBluetoothGatt->ProcessRegisterClient(status, client_if, app_uuid);
+        return aValue;
     }
-    LOGI("callback--RegisterClient status:%d, client_if:%d, uuid : %s", status, client_if, "333333333333");
+    uint32_t exp = FloorLog2(aValue);
+    uint32_t sub = (aValue >> (exp - GATT_HISTOGRAM_SUB_BITS)) &
+                   ((1u << GATT_HISTOGRAM_SUB_BITS) - 1);
+    return ((exp - GATT_HISTOGRAM_SUB_BITS + 1) << GATT_HISTOGRAM_SUB_BITS) + sub;
 }
 
-/** Callback for scan results */
-static void
-GattScanResultCallback(bt_bdaddr_t* bda, int rssi, uint8_t* adv_data)
+/* Largest value falling into a bucket */
+static uint32_t
+GattHistogramUpperBound(uint32_t aIndex)
 {
-    LOGW("GattScanResultCallback temp line:%d", __LINE__);
-
-    if(sBluetoothGatt)
+    if(aIndex < (1u << GATT_HISTOGRAM_SUB_BITS))
     {
-        sBluetoothGatt->ProcessScanLEDevice(bda, rssi, adv_data);
+        return aIndex;
     }
+    uint32_t exp = (aIndex >> GATT_HISTOGRAM_SUB_BITS) + GATT_HISTOGRAM_SUB_BITS - 1;
+    uint32_t sub = aIndex & ((1u << GATT_HISTOGRAM_SUB_BITS) - 1);
+    uint64_t width = 1ull << (exp - GATT_HISTOGRAM_SUB_BITS);
+    uint64_t upper = (1ull << exp) + (sub + 1) * width - 1;
+    return upper > UINT32_MAX ? UINT32_MAX : (uint32_t)upper;
 }
 
-/** GATT open callback invoked in response to open */
 static void
-GattConnectCallback(int conn_id, int status, int client_if, bt_bdaddr_t* bda)
+RecordGattLatency(int aKind, uint32_t aUs)
 {
-    LOGW("GattConnectCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    GattHistogram& histogram = sGattHistograms[aKind];
+    ++histogram.buckets[GattHistogramIndex(aUs)];
+    ++histogram.count;
+
+    uint32_t max = histogram.maxUs;
+    while(aUs > max && !histogram.maxUs.compareExchange(max, aUs))
     {
-        sBluetoothGatt->ProcessConnectBle(conn_id, status, client_if, bda);
+        max = histogram.maxUs;
     }
 }
 
-/** Callback invoked in response to close */
-static void
-GattDisconnectCallback(int conn_id, int status,
-        int client_if, bt_bdaddr_t* bda)
+/* Upper bound of the bucket holding the aPermille-th value */
+static uint32_t
+GattHistogramPercentile(const GattHistogram& aHistogram, int aPermille)
 {
-    LOGW("GattDisconnectCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    uint32_t count = aHistogram.count;
+    if(!count)
     {
-        sBluetoothGatt->ProcessDisconnectBle(conn_id, status, client_if, bda);
+        return 0;
     }
-}
 
-/**
- * Invoked in response to search_service when the GATT service search
- * has been completed.sBluetoothGatt
- */
-static void
-GattSearchCompleteCallback(int conn_id, int status)
-{
-    LOGW("GattSearchCompleteCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    uint64_t rank = ((uint64_t)count * aPermille + 999) / 1000;
+    uint64_t seen = 0;
+    for(uint32_t i = 0; i < GATT_HISTOGRAM_BUCKETS; ++i)
     {
-        sBluetoothGatt->ProcessSearchComplete(conn_id, status);
+        seen += aHistogram.buckets[i];
+        if(seen >= rank)
+        {
+            return GattHistogramUpperBound(i);
+        }
     }
+    return aHistogram.maxUs;
 }
 
-/** Reports GATT services on a remote device */
 static void
-GattSearchResultCallback( int conn_id, btgatt_srvc_id_t *srvc_id)
+ResetGattMetrics()
 {
-    LOGW("GattSearchResultCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    for(int i = 0; i < GATT_COUNTER_COUNT; ++i)
     {
-        sBluetoothGatt->ProcessSearchResult(conn_id, srvc_id);
+        sGattCounters[i] = 0;
+    }
+    for(int i = 0; i < GATT_HISTOGRAM_COUNT; ++i)
+    {
+        GattHistogram& histogram = sGattHistograms[i];
+        for(int j = 0; j < GATT_HISTOGRAM_BUCKETS; ++j)
+        {
+            histogram.buckets[j] = 0;
+        }
+        histogram.count = 0;
+        histogram.maxUs = 0;
     }
 }
 
-/** GATT characteristic enumeration result callback */
-static void
-GattGetCharacteristicCallback(int conn_id, int status,
-        btgatt_srvc_id_t *srvc_id, btgatt_gatt_id_t *char_id, int char_prop)
+static uint8_t char2int(char16_t input)
 {
-    LOGW("GattGetCharacteristicCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
-    {
-        sBluetoothGatt->ProcessGetCharacteristic(conn_id, status, srvc_id, char_id, char_prop);
-    }
+  if(input >= '0' && input <= '9')
+    return input - '0';
+  if(input >= 'A' && input <= 'F')
+    return input - 'A' + 10;
+  if(input >= 'a' && input <= 'f')
+    return input - 'a' + 10;
+  return 0;
 }
 
-/** GATT descriptor enumeration result callback */
-static void
-GattGetDescriptorCallback(int conn_id, int status,
-        btgatt_srvc_id_t *srvc_id, btgatt_gatt_id_t *char_id,
-        btgatt_gatt_id_t *descr_id)
+// Lowercase hex digits, indexed by nibble
+static const char16_t kHexDigits[] = {
+    '0', '1', '2', '3', '4', '5', '6', '7',
+    '8', '9', 'a', 'b', 'c', 'd', 'e', 'f'
+};
+
+// Value of each ASCII hex digit, -1 for anything else
+static const int8_t kHexValues[128] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+};
+
+static inline int HexValue(char16_t c)
 {
-    LOGW("GattGetDescriptorCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
-    {
-        sBluetoothGatt->ProcessGetDescriptor(conn_id, status, srvc_id, char_id, descr_id);
-    }
+    return c < 128 ? kHexValues[c] : -1;
 }
 
-/** GATT included service enumeration result callback */
-static void
-GattGetIncluded_serviceCallback(int conn_id, int status,
-        btgatt_srvc_id_t *srvc_id, btgatt_srvc_id_t *incl_srvc_id)
+/*
+ * bt_uuid_t keeps the least significant byte first. The string form
+ * starts with the most significant one and has a dash after the bytes at
+ * these indices.
+ */
+static inline bool UuidDashAfter(int aIndex)
 {
-    LOGW("GattGetIncluded_serviceCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
-    {
-        sBluetoothGatt->ProcessGetIncludeService(conn_id, status, srvc_id, incl_srvc_id);
-    }
+    return 12 == aIndex || 10 == aIndex || 8 == aIndex || 6 == aIndex;
 }
 
-/** Callback invoked in response to [de]register_for_notification */
 static void
-GattRegisterForNotificationCallback(int conn_id,
-        int registered, int status, btgatt_srvc_id_t *srvc_id,
-        btgatt_gatt_id_t *char_id)
+FormatUuid(const bt_uuid_t& aUuid, nsAString& aOut)
 {
-    LOGW("GattRegisterForNotificationCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    aOut.SetLength(MAX_LEN_UUID_STR - 1);
+    char16_t* p = aOut.BeginWriting();
+    for(int i = 15; i >= 0; --i)
     {
-        sBluetoothGatt->ProcessRegisterForNotification(conn_id, registered, status, srvc_id, char_id);
+        *p++ = kHexDigits[aUuid.uu[i] >> 4];
+        *p++ = kHexDigits[aUuid.uu[i] & 0x0f];
+        if(UuidDashAfter(i))
+        {
+            *p++ = '-';
+        }
     }
 }
 
-/**
- * Remote device notification callback, invoked when a remote device sends
- * a notification or indication that a client has registered for.
+/*
+ * Recently formatted UUIDs. The handful of services and characteristics
+ * an app talks to keep hitting the same entries, and handing out the
+ * cached string only shares its buffer.
  */
-static void
-GattNotifyCallback(int conn_id, btgatt_notify_params_t *p_data)
+#define GATT_UUID_CACHE_SIZE 256
+
+struct GattUuidCache
 {
-    LOGW("GattNotifyCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+  struct Entry
+  {
+    bt_uuid_t uuid;
+    // Empty while the entry is unused
+    nsString str;
+  };
+
+  Entry entries[GATT_UUID_CACHE_SIZE];
+};
+
+namespace {
+// Main thread only
+static StaticAutoPtr<GattUuidCache> sUuidCache;
+}
+
+void
+BtUuidToString(bt_uuid_t* uuid, nsAString& btUuid)
+{
+    if(!NS_IsMainThread())
     {
-        sBluetoothGatt->ProcessNotify(conn_id, p_data);
+        FormatUuid(*uuid, btUuid);
+        return;
+    }
+
+    if(!sUuidCache)
+    {
+        sUuidCache = new GattUuidCache();
+    }
+
+    GattUuidCache::Entry& entry =
+        sUuidCache->entries[HashBytes(uuid->uu, sizeof(uuid->uu)) % GATT_UUID_CACHE_SIZE];
+    if(entry.str.IsEmpty() || memcmp(entry.uuid.uu, uuid->uu, sizeof(uuid->uu)))
+    {
+        entry.uuid = *uuid;
+        FormatUuid(*uuid, entry.str);
     }
+    btUuid.Assign(entry.str);
 }
 
-/** Reports result of a GATT read operation */
-static void
-GattReadCharacteristicCallback(int conn_id, int status,
-        btgatt_read_params_t *p_data)
+/* Leaves uuid untouched unless strUuid is a well-formed 128-bit UUID */
+void
+StringToUuid(nsAString& strUuid,
+        bt_uuid_t *uuid)
 {
-    LOGW("GattReadCharacteristicCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    if(MAX_LEN_UUID_STR - 1 != strUuid.Length())
     {
-        sBluetoothGatt->ProcessReadCharacteristic(conn_id, status, p_data);
+        return;
+    }
+
+    const char16_t* p = strUuid.BeginReading();
+    bt_uuid_t parsed;
+    for(int i = 15; i >= 0; --i)
+    {
+        int high = HexValue(*p++);
+        int low = HexValue(*p++);
+        if(high < 0 || low < 0)
+        {
+            return;
+        }
+        parsed.uu[i] = (high << 4) | low;
+        if(UuidDashAfter(i) && '-' != *p++)
+        {
+            return;
+        }
     }
+
+    *uuid = parsed;
 }
 
-/** GATT write characteristic operation callback */
+// Position of one field within GattAdvData::raw
+struct GattAdvField
+{
+  uint8_t offset;
+  uint8_t len;
+};
+
+enum GattBeaconType {
+  GATT_BEACON_NONE,
+  GATT_BEACON_IBEACON,
+  GATT_BEACON_EDDYSTONE_UID,
+  GATT_BEACON_EDDYSTONE_URL,
+  GATT_BEACON_EDDYSTONE_TLM,
+  GATT_BEACON_COUNT
+};
+
+// Signal values, indexed by GattBeaconType
+static const char* const kGattBeaconNames[GATT_BEACON_COUNT] = {
+  "",
+  "ibeacon",
+  "eddystone_uid",
+  "eddystone_url",
+  "eddystone_tlm",
+};
+
+/**
+ * Advertising data of a scan result, decoded in one pass by ParseAdvData.
+ * Fields point into a copy of the raw bytes rather than holding their own,
+ * so the whole thing stays flat and is copied with the event. A field with
+ * len 0 is absent.
+ */
+struct GattAdvData
+{
+  uint8_t raw[GATT_ADV_DATA_LEN];
+  bool hasFlags;
+  uint8_t flags;
+  bool hasTxPower;
+  int8_t txPower;
+  bool hasAppearance;
+  uint16_t appearance;
+  // Complete name if advertised, shortened one otherwise
+  GattAdvField name;
+  // 2, 4 or 16 bytes each, little-endian
+  uint8_t uuidCount;
+  GattAdvField uuids[GATT_ADV_MAX_UUIDS];
+  uint8_t serviceDataCount;
+  GattAdvField serviceDataUuid[GATT_ADV_MAX_SERVICE_DATA];
+  GattAdvField serviceData[GATT_ADV_MAX_SERVICE_DATA];
+  // Company id first, little-endian
+  GattAdvField manufacturer;
+  uint8_t beaconType;
+  // Whole iBeacon manufacturer data, or Eddystone frame from its type byte
+  GattAdvField beacon;
+};
+
+static const uint8_t kEddystoneUuid[2] = { 0xaa, 0xfe };
+
+// Bluetooth base UUID, 16- and 32-bit UUIDs go into its bytes 12 to 15
+static const uint8_t kBaseUuid[16] = {
+    0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+    0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+/* Expands a 16-, 32- or 128-bit UUID of an advertisement to 128 bits */
 static void
-GattWriteCharacteristicCallback(int conn_id, int status,
-        btgatt_write_params_t *p_data)
+AdvUuid(const GattAdvData& aAdv, const GattAdvField& aField, bt_uuid_t& aUuid)
 {
-    LOGW("GattWriteCharacteristicCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
-    {
-        sBluetoothGatt->ProcessWriteCharacteristic(conn_id, status, p_data);
-    }
+    memcpy(aUuid.uu, kBaseUuid, sizeof(kBaseUuid));
+    memcpy(aUuid.uu + (16 == aField.len ? 0 : 12), aAdv.raw + aField.offset, aField.len);
 }
 
-/** GATT execute prepared write callback */
+/* Reads the proximity UUID of an iBeacon, which is sent big-endian */
 static void
-GattExecuteWriteCallback(int conn_id, int status)
+AdvBeaconUuid(const GattAdvData& aAdv, bt_uuid_t& aUuid)
 {
-    LOGW("GattExecuteWriteCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    const uint8_t* p = aAdv.raw + aAdv.beacon.offset + 4;
+    for(int i = 0; i < 16; ++i)
     {
-        sBluetoothGatt->ProcessExecuteWrite(conn_id, status);
+        aUuid.uu[i] = p[15 - i];
     }
 }
 
-/** Callback invoked in response to read_descriptor */
+/* Recognizes an iBeacon or Eddystone frame in the fields found so far */
 static void
-GattReadDescriptorCallback(int conn_id, int status,
-        btgatt_read_params_t *p_data)
+FindAdvBeacon(GattAdvData& aAdv)
 {
-    LOGW("GattReadDescriptorCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    const uint8_t* mfr = aAdv.raw + aAdv.manufacturer.offset;
+    // company 0x004c, type 0x02, length 0x15: uuid, major, minor, power
+    if(aAdv.manufacturer.len >= 25 && 0x4c == mfr[0] && 0x00 == mfr[1] &&
+       0x02 == mfr[2] && 0x15 == mfr[3])
     {
-        sBluetoothGatt->ProcessReadDescriptor(conn_id, status, p_data);
+        aAdv.beaconType = GATT_BEACON_IBEACON;
+        aAdv.beacon = aAdv.manufacturer;
+        return;
+    }
+
+    for(int i = 0; i < aAdv.serviceDataCount; ++i)
+    {
+        const GattAdvField& uuid = aAdv.serviceDataUuid[i];
+        const GattAdvField& frame = aAdv.serviceData[i];
+        if(2 != uuid.len || memcmp(aAdv.raw + uuid.offset, kEddystoneUuid, 2) || frame.len < 2)
+        {
+            continue;
+        }
+
+        // Frame type, then the smallest length of each frame
+        switch(aAdv.raw[frame.offset])
+        {
+        case 0x00:
+            aAdv.beaconType = frame.len >= 18 ? GATT_BEACON_EDDYSTONE_UID : GATT_BEACON_NONE;
+            break;
+        case 0x10:
+            aAdv.beaconType = frame.len >= 3 ? GATT_BEACON_EDDYSTONE_URL : GATT_BEACON_NONE;
+            break;
+        case 0x20:
+            aAdv.beaconType = frame.len >= 14 ? GATT_BEACON_EDDYSTONE_TLM : GATT_BEACON_NONE;
+            break;
+        }
+        if(GATT_BEACON_NONE != aAdv.beaconType)
+        {
+            aAdv.beacon = frame;
+            return;
+        }
     }
 }
 
-/** Callback invoked in response to write_descriptor */
+/* Adds the UUIDs of a service UUID list, aSize bytes each */
 static void
-GattWriteDescriptorCallback(int conn_id, int status,
-        btgatt_write_params_t *p_data)
+AddAdvUuids(GattAdvData& aAdv, uint8_t aOffset, uint8_t aLen, uint8_t aSize)
 {
-    LOGW("GattWriteDescriptorCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    for(uint8_t i = 0; i + aSize <= aLen && aAdv.uuidCount < GATT_ADV_MAX_UUIDS; i += aSize)
     {
-        sBluetoothGatt->ProcessWriteDescriptor(conn_id, status, p_data);
+        GattAdvField& uuid = aAdv.uuids[aAdv.uuidCount++];
+        uuid.offset = aOffset + i;
+        uuid.len = aSize;
     }
 }
 
-/** Callback triggered in response to read_remote_rssi */
+/* Records a service data field whose UUID takes its first aSize bytes */
 static void
-GattReadRemoteRssiCallback(int client_if, bt_bdaddr_t* bda,
-        int rssi, int status)
+AddAdvServiceData(GattAdvData& aAdv, uint8_t aOffset, uint8_t aLen, uint8_t aSize)
 {
-    LOGW("GattReadRemoteRssiCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    if(aLen < aSize || aAdv.serviceDataCount >= GATT_ADV_MAX_SERVICE_DATA)
     {
-        sBluetoothGatt->ProcessReadRemoteRssi(client_if, bda, rssi, status);
+        return;
     }
+    int i = aAdv.serviceDataCount++;
+    aAdv.serviceDataUuid[i].offset = aOffset;
+    aAdv.serviceDataUuid[i].len = aSize;
+    aAdv.serviceData[i].offset = aOffset + aSize;
+    aAdv.serviceData[i].len = aLen - aSize;
 }
 
-/**
- * Callback indicationg the status of a listen() operation
+/*
+ * Decodes the AD structures of aAdvData, GATT_ADV_DATA_LEN bytes, into
+ * aAdv. Parsing stops at the first empty structure or one that would run
+ * past the end; what was decoded before it is kept.
  */
 static void
-GattListenCallback(int status, int server_if)
+ParseAdvData(const uint8_t* aAdvData, GattAdvData& aAdv)
 {
-    LOGW("GattListenCallback temp line:%d", __LINE__);
-    if(sBluetoothGatt)
+    memset(&aAdv, 0, sizeof(aAdv));
+    memcpy(aAdv.raw, aAdvData, GATT_ADV_DATA_LEN);
+
+    bool completeName = false;
+    const uint8_t* raw = aAdv.raw;
+    for(int pos = 0; pos < GATT_ADV_DATA_LEN; )
     {
-        sBluetoothGatt->ProcessListen(status, server_if);
+        // The length covers the type byte and the data
+        int length = raw[pos];
+        if(!length || pos + 1 + length > GATT_ADV_DATA_LEN)
+        {
+            break;
+        }
+        uint8_t type = raw[pos + 1];
+        uint8_t offset = pos + 2;
+        uint8_t len = length - 1;
+        const uint8_t* data = raw + offset;
+        GATT_TRACE(GATT_TRACE_VERBOSE, GATT_TRACE_EIR_FIELD, type, len, offset);
+
+        switch(type)
+        {
+        case BT_EIR_FLAGS_TYPE:
+            if(len >= 1)
+            {
+                aAdv.hasFlags = true;
+                aAdv.flags = data[0];
+            }
+            break;
+        case BT_EIR_MORE_16BITS_UUID_TYPE:
+        case BT_EIR_COMPLETE_16BITS_UUID_TYPE:
+            AddAdvUuids(aAdv, offset, len, 2);
+            break;
+        case BT_EIR_MORE_32BITS_UUID_TYPE:
+        case BT_EIR_COMPLETE_32BITS_UUID_TYPE:
+            AddAdvUuids(aAdv, offset, len, 4);
+            break;
+        case BT_EIR_MORE_128BITS_UUID_TYPE:
+        case BT_EIR_COMPLETE_128BITS_UUID_TYPE:
+            AddAdvUuids(aAdv, offset, len, 16);
+            break;
+        case BT_EIR_SHORTENED_LOCAL_NAME_TYPE:
+            if(!completeName)
+            {
+                aAdv.name.offset = offset;
+                aAdv.name.len = len;
+            }
+            break;
+        case BT_EIR_COMPLETE_LOCAL_NAME_TYPE:
+            completeName = true;
+            aAdv.name.offset = offset;
+            aAdv.name.len = len;
+            break;
+        case BT_EIR_TX_POWER_LEVEL_TYPE:
+            if(len >= 1)
+            {
+                aAdv.hasTxPower = true;
+                aAdv.txPower = (int8_t)data[0];
+            }
+            break;
+        case BT_EIR_SERVICE_DATA_16BITS_UUID_TYPE:
+            AddAdvServiceData(aAdv, offset, len, 2);
+            break;
+        case BT_EIR_SERVICE_DATA_32BITS_UUID_TYPE:
+            AddAdvServiceData(aAdv, offset, len, 4);
+            break;
+        case BT_EIR_SERVICE_DATA_128BITS_UUID_TYPE:
+            AddAdvServiceData(aAdv, offset, len, 16);
+            break;
+        case BT_EIR_APPEARANCE_TYPE:
+            if(len >= 2)
+            {
+                aAdv.hasAppearance = true;
+                aAdv.appearance = data[0] | (data[1] << 8);
+            }
+            break;
+        case BT_EIR_MANUFACTURER_SPECIFIC_TYPE:
+            if(len >= 2 && !aAdv.manufacturer.len)
+            {
+                aAdv.manufacturer.offset = offset;
+                aAdv.manufacturer.len = len;
+            }
+            break;
+        default:
+            break;
+        }
+        pos += 1 + length;
     }
-}
 
-static btgatt_callbacks_t sBtGattCallbacks;
-static btgatt_client_callbacks_t sBtGattClientCallbacks = {
-  GattRegisterClientCallback,
-  GattScanResultCallback,
-  GattConnectCallback,
-  GattDisconnectCallback,
-  GattSearchCompleteCallback,
-  GattSearchResultCallback,
-  GattGetCharacteristicCallback,
-  GattGetDescriptorCallback,
-  GattGetIncluded_serviceCallback,
-  GattRegisterForNotificationCallback,
-  GattNotifyCallback,
-  GattReadCharacteristicCallback,
-  GattWriteCharacteristicCallback,
-  GattReadDescriptorCallback,
-  GattWriteDescriptorCallback,
-  GattExecuteWriteCallback,
-  GattReadRemoteRssiCallback,
-  GattListenCallback
-};
+    FindAdvBeacon(aAdv);
+    if(GATT_BEACON_NONE != aAdv.beaconType)
+    {
+        GATT_TRACE(GATT_TRACE_VERBOSE, GATT_TRACE_BEACON, aAdv.beaconType, aAdv.beacon.len, 0);
+    }
+}
 
-class BluetoothGatt::MainThreadTask : public nsRunnable
+/* Converts array of uint8_t to its lowercase hex representation */
+static void array2str(const uint8_t *v, int size, nsAString& out)
 {
-public:
-  MainThreadTask(const int aCommand,
-                 const nsAString& aParameter = EmptyString())
-    : mCommand(aCommand), mParameter(aParameter)
-  {
-  }
+    out.SetLength(2 * size);
+    char16_t* p = out.BeginWriting();
+    for (int i = 0; i < size; ++i) {
+        *p++ = kHexDigits[v[i] >> 4];
+        *p++ = kHexDigits[v[i] & 0x0f];
+    }
+}
 
-  nsresult Run()
-  {
-    MOZ_ASSERT(NS_IsMainThread());
-    MOZ_ASSERT(sBluetoothGatt);
+/*
+ * Converts a hex string into bytes. An odd-length string is read as if
+ * it had a leading '0', so "100" gives { 0x01, 0x00 }.
+ */
+static void str2array(const nsAString& str, nsTArray<uint8_t>& out)
+{
+    int len = str.Length();
+    const char16_t* src = str.BeginReading();
 
-    switch (mCommand) {
-      case MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS:
-          sBluetoothGatt->NotifyGattCallback(mParameter);
-        break;
-      default:
-        LOGW("MainThreadTask: Unknown command %d", mCommand);
-        break;
+    out.SetLength((len + 1) / 2);
+    for (int i = out.Length() - 1; i >= 0; --i) {
+        len -= 2;
+        if (len >= 0)
+            out[i] = char2int(src[len]) * 16 + char2int(src[len + 1]);
+        else
+            out[i] = char2int(src[0]);
     }
+}
 
-    return NS_OK;
-  }
+namespace {
+//StaticRefPtr<BluetoothGatt> sBluetoothGatt;
+static BluetoothGatt* sBluetoothGatt;
+static const btgatt_interface_t* sBluetoothGattInterface;
+static nsString mTest;
+// Services reported by search_result since the last search_complete,
+// keyed by conn_id. Only touched on the bluedroid callback thread.
+static std::map<int, std::vector<btgatt_srvc_id_t> > sPendingServices;
+}
 
-private:
-  int mCommand;
-  nsString mParameter;
+/* Sends aData, callback name first, to the apps as a GATT callback signal */
+static void
+DistributeGattSignal(const InfallibleTArray<BluetoothNamedValue>& aData)
+{
+    BluetoothSignal signal(NS_LITERAL_STRING(BLUETOOTH_GATT_CALLBACKS_ID),
+                           NS_LITERAL_STRING(KEY_ADAPTER), aData);
+    BluetoothService* bs = BluetoothService::Get();
+    if(bs)
+    {
+        bs->DistributeSignal(signal);
+    }
+    else
+    {
+        LOGE("BluetoothService is null");
+    }
+}
+
+// Encoding of attribute values exchanged with an app, chosen per client
+enum GattValueFormat {
+  // Hex string, the historical format
+  GATT_VALUE_FORMAT_HEX,
+  // uint8_t[] in signals, one byte per character in requests
+  GATT_VALUE_FORMAT_BINARY,
 };
 
-// static
-void
-BluetoothGatt::InitGattInterface()
+/* Bounds a value length reported by the stack to what its buffer holds */
+static int
+ClampAttrValueLen(int aLen, int aMaxLen)
 {
-    const bt_interface_t* btInf = GetBluetoothInterface();
-    if(!btInf)
+    if(aLen > aMaxLen)
     {
-        LOGE("GetBluetoothInterface is null");
-        return;
+        aLen = aMaxLen;
     }
-
-    sBluetoothGattInterface = (btgatt_interface_t *) btInf->get_profile_interface(BT_PROFILE_GATT_ID);
-    if(!sBluetoothGattInterface)
+    if(aLen > GATT_MAX_ATTR_VALUE_LEN)
     {
-        LOGE("sBluetoothGattInterface is null");
-        return;
+        aLen = GATT_MAX_ATTR_VALUE_LEN;
     }
-
-    /**register callbacks***/
-    sBtGattCallbacks.client = &sBtGattClientCallbacks;
-    if(BT_STATUS_SUCCESS != sBluetoothGattInterface->init(&sBtGattCallbacks)) //register gatt callback
+    if(aLen < 0)
     {
-        LOGE("BluetoothGatt register gatt callbacks function failed");
+        aLen = 0;
     }
+    return aLen;
 }
 
-void
-BluetoothGatt::DeInitGattInterface()
+/* Appends an attribute value to a signal in aFormat */
+static void
+AppendAttrValue(const uint8_t* aValue, int aLen, int aMaxLen, int aFormat,
+        InfallibleTArray<BluetoothNamedValue>& aData)
 {
-    if (sBluetoothGattInterface) {
-        sBluetoothGattInterface->cleanup();
-        sBluetoothGattInterface = nullptr;
+    aLen = ClampAttrValueLen(aLen, aMaxLen);
+
+    if(GATT_VALUE_FORMAT_BINARY == aFormat)
+    {
+        nsTArray<uint8_t> bytes;
+        bytes.AppendElements(aValue, aLen);
+        aData.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DESCRID_VALUE), bytes));
+        return;
     }
-}
 
-BluetoothGatt::BluetoothGatt()
-{
-    LOGW("start BluetoothGatt construct");
-    LOGW("end BluetoothGatt construct");
+    nsString data_value;
+    array2str(aValue, aLen, data_value);
+
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DESCRID_VALUE), data_value));
 }
 
-// static
-BluetoothGatt*
-BluetoothGatt::Get()
+/*
+ * Converts a value received from an app in aFormat into bytes.
+ * Returns false if it is longer than aMaxLen, by default the longest an
+ * attribute value can be.
+ */
+static bool
+ParseAttrValue(const nsString& aValue, int aFormat, nsTArray<uint8_t>& aOut,
+               uint32_t aMaxLen = GATT_MAX_ATTR_VALUE_LEN)
 {
-    LOGI("start get");
-    MOZ_ASSERT(NS_IsMainThread());
+    if(GATT_VALUE_FORMAT_BINARY == aFormat)
+    {
+        uint32_t len = aValue.Length();
+        if(len > aMaxLen)
+        {
+            LOGE("Attribute value too long:%d", len);
+            return false;
+        }
 
-    // If sBluetoothgatt already exists, exit early
-    if (sBluetoothGatt) {
-        LOGI("sBluetoothGatt is not null");
-        return sBluetoothGatt;
+        const char16_t* src = aValue.BeginReading();
+        aOut.SetLength(len);
+        for(uint32_t i = 0; i < len; ++i)
+        {
+            aOut[i] = (uint8_t)(src[i] & 0xFF);
+        }
+        return true;
     }
 
-    // If we're in shutdown, don't create a new instance
-    //  NS_ENSURE_FALSE(sInShutdown, nullptr);
+    if((aValue.Length() + 1) / 2 > aMaxLen)
+    {
+        LOGE("Attribute value too long:%d", aValue.Length());
+        return false;
+    }
 
-    // Create a new instance, register, and return
-    BluetoothGatt* bluetoothGatt = new BluetoothGatt();
-    sBluetoothGatt = bluetoothGatt;
+    str2array(aValue, aOut);
+    return true;
+}
 
-    LOGI("end get");
-    return sBluetoothGatt;
+// Main thread task commands
+enum MainThreadTaskCmd {
+  // Delivers the GattEvents queued by MainThreadTask::PostEvent
+  NOTIFY_GATT_CALLBACKS,
+  ARM_NOTIFY_BATCH_TIMER,
+};
+
+namespace {
+// Set while a benchmark run wants events timestamped
+static Atomic<bool> sGattBenchActive(false);
 }
 
-nsString
-BluetoothGatt::getTest()
+// Kind of bluedroid callback carried by a GattEvent
+enum GattEventType {
+  GATT_EVENT_REGISTER_CLIENT,
+  GATT_EVENT_SCAN_RESULT,
+  GATT_EVENT_CONNECT_BLE,
+  GATT_EVENT_DISCONNECT_BLE,
+  GATT_EVENT_BLE_LISTEN,
+  GATT_EVENT_SEARCH_COMPLETE,
+  GATT_EVENT_GET_CHARACTERISTIC,
+  GATT_EVENT_GET_DESCRIPTOR,
+  GATT_EVENT_GET_INCLUDED_SERVICE,
+  GATT_EVENT_REGISTER_FOR_NOTIFICATION,
+  GATT_EVENT_NOTIFY,
+  GATT_EVENT_READ_CHARACTERISTIC,
+  GATT_EVENT_WRITE_CHARACTERISTIC,
+  GATT_EVENT_READ_DESCRIPTOR,
+  GATT_EVENT_WRITE_DESCRIPTOR,
+  GATT_EVENT_EXECUTE_WRITE,
+  GATT_EVENT_READ_REMOTE_RSSI,
+  GATT_EVENT_NOTIFY_BATCH,
+  GATT_EVENT_SCAN_UPDATE,
+  GATT_EVENT_LONG_WRITE,
+  GATT_EVENT_COUNT
+};
+
+// One notification held in a GATT_EVENT_NOTIFY_BATCH event
+struct GattNotifySample
 {
-    return mTest;
-}
+  int connId;
+  btgatt_notify_params_t params;
+};
 
-BluetoothGatt::~BluetoothGatt()
+/**
+ * Snapshot of one bluedroid callback. Each Process* handler fills its own
+ * instance on the bluedroid thread and hands it over to the MainThreadTask,
+ * so a burst of callbacks can never overwrite a payload that the main thread
+ * has not delivered yet. Instances come from a pool, see AcquireGattEvent.
+ */
+struct GattEvent
 {
-    sBluetoothGattInterface->cleanup();
+  explicit GattEvent(GattEventType aType)
+  {
+    Reset(aType);
+  }
+
+  // Readies the event for another callback, its strings and vectors keep
+  // their buffers
+  void Reset(GattEventType aType)
+  {
+    type = aType;
+    connId = 0;
+    status = 0;
+    clientIf = 0;
+    serverIf = 0;
+    registered = 0;
+    charProp = 0;
+    rssi = 0;
+    rawRssi = 0;
+    deviceType = 0;
+    valueLen = 0;
+    elapsedUs = 0;
+    created = sGattBenchActive ? TimeStamp::Now() : TimeStamp();
+    memset(&bda, 0, sizeof(bda));
+    memset(&appUuid, 0, sizeof(appUuid));
+    memset(&srvcId, 0, sizeof(srvcId));
+    memset(&inclSrvcId, 0, sizeof(inclSrvcId));
+    memset(&charId, 0, sizeof(charId));
+    memset(&descrId, 0, sizeof(descrId));
+    deviceAddr.Truncate();
+    deviceName.Truncate();
+    services.clear();
+    samples.clear();
+  }
+
+  GattEventType type;
+  int connId;
+  int status;
+  int clientIf;
+  int serverIf;
+  int registered;
+  int charProp;
+  int rssi;
+  // Unsmoothed RSSI of a GATT_EVENT_SCAN_UPDATE
+  int rawRssi;
+  int deviceType;
+  // Length and duration of a GATT_EVENT_LONG_WRITE
+  uint32_t valueLen;
+  uint32_t elapsedUs;
+  // Only set during a benchmark run
+  TimeStamp created;
+  bt_bdaddr_t bda;
+  bt_uuid_t appUuid;
+  btgatt_srvc_id_t srvcId;
+  btgatt_srvc_id_t inclSrvcId;
+  btgatt_gatt_id_t charId;
+  btgatt_gatt_id_t descrId;
+  nsString deviceAddr;
+  nsString deviceName;
+  std::vector<btgatt_srvc_id_t> services;
+  std::vector<GattNotifySample> samples;
+  // Only filled for scan results and updates
+  GattAdvData adv;
+  union {
+    btgatt_read_params_t read;
+    btgatt_write_params_t write;
+    btgatt_notify_params_t notify;
+  } params;
+};
+
+namespace {
+static StaticMutex sGattEventPoolMutex;
+// Delivered events ready for reuse, guarded by sGattEventPoolMutex
+static std::vector<GattEvent*> sGattEventPool;
 }
 
-void
-BluetoothGatt::NotifyGattCallback(const nsAString& aType)
+/* Fills the event pool so that steady-state delivery does not allocate */
+static void
+PreallocGattEvents()
 {
-    MOZ_ASSERT(NS_IsMainThread());
+    StaticMutexAutoLock lock(sGattEventPoolMutex);
+    sGattEventPool.reserve(GATT_EVENT_POOL_SIZE);
+    while(sGattEventPool.size() < GATT_EVENT_POOL_SIZE)
+    {
+        sGattEventPool.push_back(AcquireGattEvent(GATT_EVENT_COUNT));
+    }
+}
 
-    // Dispatch an event of status change
-    bool status;
-    nsAutoString eventName;
-    if (aType.EqualsLiteral(BLEGATT_REGISTER_CLIENT_ID)) {
-        SendRegisterClientCallback();
-    } else if(aType.EqualsLiteral(BLEGATT_SCAN_RESULT_ID))
+/* Takes an event from the pool, or allocates one if a burst emptied it. Any thread. */
+static GattEvent*
+AcquireGattEvent(GattEventType aType)
+{
+    GattEvent* event = nullptr;
     {
-        SendScanLEDeviceCallback();
-    } else if(aType.EqualsLiteral(BLEGATT_CONNECT_BLE_ID))
+        StaticMutexAutoLock lock(sGattEventPoolMutex);
+        if(!sGattEventPool.empty())
+        {
+            event = sGattEventPool.back();
+            sGattEventPool.pop_back();
+        }
+    }
+
+    if(!event)
     {
-        SendConnectBleCallback();
-    } else if(aType.EqualsLiteral(BLEGATT_DISCONNECT_BLE_ID))
+        GattCount(GATT_COUNTER_EVENT_ALLOCATIONS);
+        return new GattEvent(aType);
+    }
+    event->Reset(aType);
+    return event;
+}
+
+/* Returns an event to the pool, freeing what a burst allocated beyond it */
+static void
+ReleaseGattEvent(GattEvent* aEvent)
+{
+    if(!aEvent)
     {
-        SendDisconnectBleCallback();
+        return;
     }
-    else if(aType.EqualsLiteral(BLEGATT_BLE_LISTEN_ID))
+
     {
-        SendListenCallback();
+        StaticMutexAutoLock lock(sGattEventPoolMutex);
+        if(sGattEventPool.size() < GATT_EVENT_POOL_SIZE)
+        {
+            sGattEventPool.push_back(aEvent);
+            return;
+        }
     }
-    else if(aType.EqualsLiteral(BLEGATT_SEARCH_COMPLETE_ID))
+    delete aEvent;
+}
+
+namespace {
+static StaticMutex sGattEventQueueMutex;
+// Events posted for the main thread in callback order, guarded by
+// sGattEventQueueMutex like the two below
+static std::vector<GattEvent*> sGattEventQueue;
+// The one task that delivers sGattEventQueue, dispatched again when needed
+static StaticRefPtr<nsIRunnable> sGattEventTask;
+static bool sGattEventTaskPosted;
+// Main thread only, the events being delivered
+static std::vector<GattEvent*> sGattEventsDelivering;
+}
+
+/** Callback invoked in response to register_client */
+static void
+GattRegisterClientCallback(int status, int client_if, bt_uuid_t *app_uuid)
+{
+    if(sBluetoothGatt)
     {
-        SendSearchCompleteCallback();
+        sBluetoothGatt->ProcessRegisterClient(status, client_if, app_uuid);
     }
-    else if(aType.EqualsLiteral(BLEGATT_GET_CHRACTERISTIC_ID))
+    LOGI("callback--RegisterClient status:%d, client_if:%d, uuid : %s", status, client_if, "333333333333");
+}
+
+/** Callback for scan results */
+static void
+GattScanResultCallback(bt_bdaddr_t* bda, int rssi, uint8_t* adv_data)
+{
+    if(sBluetoothGatt)
     {
-        SendGetCharacteristicCallback();
+        sBluetoothGatt->ProcessScanLEDevice(bda, rssi, adv_data);
     }
-    else if(aType.EqualsLiteral(BLEGATT_GET_DESCRIPTOR_ID))
+}
+
+/** GATT open callback invoked in response to open */
+static void
+GattConnectCallback(int conn_id, int status, int client_if, bt_bdaddr_t* bda)
+{
+    if(sBluetoothGatt)
     {
-        SendGetDescriptorCallback();
+        sBluetoothGatt->ProcessConnectBle(conn_id, status, client_if, bda);
     }
-    else if(aType.EqualsLiteral(BLEGATT_GET_INCLUDED_SERVICE_ID))
+}
+
+/** Callback invoked in response to close */
+static void
+GattDisconnectCallback(int conn_id, int status,
+        int client_if, bt_bdaddr_t* bda)
+{
+    if(sBluetoothGatt)
     {
-        SendGetIncludeServiceCallback();
+        sBluetoothGatt->ProcessDisconnectBle(conn_id, status, client_if, bda);
     }
-    else if(aType.EqualsLiteral(BLEGATT_REGISTER_FOR_NOTIFICATION_ID))
+}
+
+/**
+ * Invoked in response to search_service when the GATT service search
+ * has been completed.sBluetoothGatt
+ */
+static void
+GattSearchCompleteCallback(int conn_id, int status)
+{
+    if(sBluetoothGatt)
     {
-        SendRegisterForNotificationCallback();
+        sBluetoothGatt->ProcessSearchComplete(conn_id, status);
     }
-    else if(aType.EqualsLiteral(BLEGATT_NOTIFY_ID))
+}
+
+/** Reports GATT services on a remote device */
+static void
+GattSearchResultCallback( int conn_id, btgatt_srvc_id_t *srvc_id)
+{
+    if(sBluetoothGatt)
     {
-        SendNotifyCallback();
+        sBluetoothGatt->ProcessSearchResult(conn_id, srvc_id);
     }
-    else if(aType.EqualsLiteral(BLEGATT_READ_CHARACTERISTIC_ID))
+}
+
+/** GATT characteristic enumeration result callback */
+static void
+GattGetCharacteristicCallback(int conn_id, int status,
+        btgatt_srvc_id_t *srvc_id, btgatt_gatt_id_t *char_id, int char_prop)
+{
+    if(sBluetoothGatt)
     {
-        SendReadCharacteristicCallback();
+        sBluetoothGatt->ProcessGetCharacteristic(conn_id, status, srvc_id, char_id, char_prop);
     }
-    else if(aType.EqualsLiteral(BLEGATT_WRITER_HARACTERISTIC_ID))
+}
+
+/** GATT descriptor enumeration result callback */
+static void
+GattGetDescriptorCallback(int conn_id, int status,
+        btgatt_srvc_id_t *srvc_id, btgatt_gatt_id_t *char_id,
+        btgatt_gatt_id_t *descr_id)
+{
+    if(sBluetoothGatt)
     {
-        SendWriteCharacteristicCallback();
+        sBluetoothGatt->ProcessGetDescriptor(conn_id, status, srvc_id, char_id, descr_id);
     }
-    else if(aType.EqualsLiteral(BLEGATT_READ_DESCRIPTOR_ID))
+}
+
+/** GATT included service enumeration result callback */
+static void
+GattGetIncluded_serviceCallback(int conn_id, int status,
+        btgatt_srvc_id_t *srvc_id, btgatt_srvc_id_t *incl_srvc_id)
+{
+    if(sBluetoothGatt)
     {
-        SendReadDescriptorCallback();
+        sBluetoothGatt->ProcessGetIncludeService(conn_id, status, srvc_id, incl_srvc_id);
     }
-    else if(aType.EqualsLiteral(BLEGATT_WRITE_DESCRIPTOR_ID))
+}
+
+/** Callback invoked in response to [de]register_for_notification */
+static void
+GattRegisterForNotificationCallback(int conn_id,
+        int registered, int status, btgatt_srvc_id_t *srvc_id,
+        btgatt_gatt_id_t *char_id)
+{
+    if(sBluetoothGatt)
     {
-        SendWriteDescriptorCallback();
+        sBluetoothGatt->ProcessRegisterForNotification(conn_id, registered, status, srvc_id, char_id);
     }
-    else if(aType.EqualsLiteral(BLEGATT_EXECUTE_WRITE_ID))
+}
+
+/**
+ * Remote device notification callback, invoked when a remote device sends
+ * a notification or indication that a client has registered for.
+ */
+static void
+GattNotifyCallback(int conn_id, btgatt_notify_params_t *p_data)
+{
+    if(sBluetoothGatt)
     {
-        SendExecuteWriteCallback();
+        sBluetoothGatt->ProcessNotify(conn_id, p_data);
     }
-    else if(aType.EqualsLiteral(BLEGATT_READ_REMOTERSSI_ID))
+}
+
+/** Reports result of a GATT read operation */
+static void
+GattReadCharacteristicCallback(int conn_id, int status,
+        btgatt_read_params_t *p_data)
+{
+    if(sBluetoothGatt)
     {
-        SendReadRemoteRssiCallback();
+        sBluetoothGatt->ProcessReadCharacteristic(conn_id, status, p_data);
     }
-    else {
-        MOZ_ASSERT(false);
-        return;
+}
+
+/** GATT write characteristic operation callback */
+static void
+GattWriteCharacteristicCallback(int conn_id, int status,
+        btgatt_write_params_t *p_data)
+{
+    if(sBluetoothGatt)
+    {
+        sBluetoothGatt->ProcessWriteCharacteristic(conn_id, status, p_data);
     }
+}
 
+/** GATT execute prepared write callback */
+static void
+GattExecuteWriteCallback(int conn_id, int status)
+{
+    if(sBluetoothGatt)
+    {
+        sBluetoothGatt->ProcessExecuteWrite(conn_id, status);
+    }
 }
 
-bool BluetoothGatt::BluetoothGattOperate(uint32_t gattFunType, const nsTArray<nsString>& bleGattPara)
+/** Callback invoked in response to read_descriptor */
+static void
+GattReadDescriptorCallback(int conn_id, int status,
+        btgatt_read_params_t *p_data)
 {
-    LOGI("BluetoothGatt BluetoothGattOperate, gattFunType : %d", gattFunType);
+    if(sBluetoothGatt)
+    {
+        sBluetoothGatt->ProcessReadDescriptor(conn_id, status, p_data);
+    }
+}
 
-    bool result = true;
-    nsresult rv;
+/** Callback invoked in response to write_descriptor */
+static void
+GattWriteDescriptorCallback(int conn_id, int status,
+        btgatt_write_params_t *p_data)
+{
+    if(sBluetoothGatt)
+    {
+        sBluetoothGatt->ProcessWriteDescriptor(conn_id, status, p_data);
+    }
+}
 
-    if(!sBluetoothGattInterface)
+/** Callback triggered in response to read_remote_rssi */
+static void
+GattReadRemoteRssiCallback(int client_if, bt_bdaddr_t* bda,
+        int rssi, int status)
+{
+    if(sBluetoothGatt)
     {
-        LOGE("sBluetoothGattInterface is null");
-        result = false;
+        sBluetoothGatt->ProcessReadRemoteRssi(client_if, bda, rssi, status);
     }
-    else
+}
+
+/**
+ * Callback indicationg the status of a listen() operation
+ */
+static void
+GattListenCallback(int status, int server_if)
+{
+    if(sBluetoothGatt)
     {
-        LOGI("xxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
-        //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
-        switch(gattFunType)
-        {
-        case BleFunType_RegisterClient:
-        {
-            //bleGattPara'size ------ BluetoothBleManager::RegisterClient 1
-            if(1 != bleGattPara.Length())
+        sBluetoothGatt->ProcessListen(status, server_if);
+    }
+}
+
+static btgatt_callbacks_t sBtGattCallbacks;
+static btgatt_client_callbacks_t sBtGattClientCallbacks = {
+  GattRegisterClientCallback,
+  GattScanResultCallback,
+  GattConnectCallback,
+  GattDisconnectCallback,
+  GattSearchCompleteCallback,
+  GattSearchResultCallback,
+  GattGetCharacteristicCallback,
+  GattGetDescriptorCallback,
+  GattGetIncluded_serviceCallback,
+  GattRegisterForNotificationCallback,
+  GattNotifyCallback,
+  GattReadCharacteristicCallback,
+  GattWriteCharacteristicCallback,
+  GattReadDescriptorCallback,
+  GattWriteDescriptorCallback,
+  GattExecuteWriteCallback,
+  GattReadRemoteRssiCallback,
+  GattListenCallback
+};
+
+/**
+ * What each app registered through register_client and each LE link is
+ * doing. Requests carry their own ids, so these tell which app a per-link
+ * callback belongs to and keep per-app state apart.
+ *
+ * Main thread only. Links are added and dropped while their connect and
+ * disconnect events are staged, so they stay in order with every other
+ * callback of the same link.
+ */
+struct GattClientContext
+{
+  GattClientContext() : clientIf(0), scanning(false), valueFormat(GATT_VALUE_FORMAT_HEX)
+  {
+    memset(&appUuid, 0, sizeof(appUuid));
+  }
+
+  int clientIf;
+  bt_uuid_t appUuid;
+  bool scanning;
+  // GattValueFormat of the values exchanged with this app
+  int valueFormat;
+};
+
+/**
+ * Connection parameters in the units of the link layer: intervals of
+ * 1.25 ms, latency in connection events and a supervision timeout of
+ * 10 ms. A link keeps what the stack picked until an app sets parameters
+ * or a profile. With automatic switching it runs the low latency profile
+ * while requests queue up, a write stream is buffered or notifications
+ * pour in, and goes back to its own profile once idle for
+ * GATT_CONN_IDLE_MS.
+ */
+enum GattConnProfile {
+  GATT_CONN_PROFILE_LOW_LATENCY,
+  GATT_CONN_PROFILE_BALANCED,
+  GATT_CONN_PROFILE_LOW_POWER,
+  GATT_CONN_PROFILE_COUNT
+};
+
+struct GattConnParams
+{
+  int minInterval;
+  int maxInterval;
+  int latency;
+  int timeout;
+};
+
+// Indexed by GattConnProfile
+static const GattConnParams kGattConnProfiles[GATT_CONN_PROFILE_COUNT] = {
+  // 7.5 to 15 ms
+  { 6, 12, 0, 500 },
+  // 30 to 50 ms
+  { 24, 40, 0, 500 },
+  // 100 to 125 ms, skipping up to 2 events when idle
+  { 80, 100, 2, 500 },
+};
+
+struct GattConnContext
+{
+  GattConnContext()
+    : connId(0), clientIf(0), notifications(0), mtu(GATT_DEFAULT_MTU),
+      profile(-1), activeProfile(-1), autoProfile(false), tickNotifications(0)
+  {
+    memset(&bda, 0, sizeof(bda));
+  }
+
+  int connId;
+  // App that opened the link
+  int clientIf;
+  bt_bdaddr_t bda;
+  // Delivered to the apps since the link came up
+  uint32_t notifications;
+  // ATT_MTU of the link, as last exchanged
+  int mtu;
+  // GattConnProfile the apps chose, and the one last asked for; -1 for
+  // none or parameters set explicitly
+  int profile;
+  int activeProfile;
+  bool autoProfile;
+  // notifications at the last profile tick
+  uint32_t tickNotifications;
+  // Last time the link was found busy
+  TimeStamp lastBusy;
+};
+
+namespace {
+// Keyed by client_if
+static std::map<int, GattClientContext> sGattClients;
+// Keyed by conn_id
+static std::map<int, GattConnContext> sGattConns;
+}
+
+/* ATT_MTU of a link, the default one if it is not up */
+static int
+GetGattConnMtu(int conn_id)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    std::map<int, GattConnContext>::iterator conn = sGattConns.find(conn_id);
+    return conn != sGattConns.end() ? conn->second.mtu : GATT_DEFAULT_MTU;
+}
+
+/* Records the outcome of an MTU exchange and reports it to the apps */
+static void
+ApplyGattMtu(int conn_id, int status, int mtu)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    std::map<int, GattConnContext>::iterator conn = sGattConns.find(conn_id);
+    if(conn != sGattConns.end())
+    {
+        if(BT_STATUS_SUCCESS == status && mtu >= GATT_DEFAULT_MTU)
+        {
+            conn->second.mtu = mtu;
+        }
+        mtu = conn->second.mtu;
+    }
+    LOGI("conn_id:%d MTU:%d status:%d", conn_id, mtu, status);
+
+    nsAutoString callbackName;
+    callbackName.AssignLiteral(BLEGATT_CONFIGURE_MTU_ID);
+    nsString data_conn_id;
+    data_conn_id.AppendInt(conn_id);
+    nsString data_status;
+    data_status.AppendInt(status);
+    nsString data_mtu;
+    data_mtu.AppendInt(mtu);
+
+    InfallibleTArray<BluetoothNamedValue> data;
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_MTU), data_mtu));
+
+    DistributeGattSignal(data);
+}
+
+#ifdef MOZ_BT_GATT_MTU
+/*
+ * Carries an MTU exchange result to the main thread. Dispatched behind
+ * the callbacks already posted, so it stays in order with its link's
+ * connect and disconnect.
+ */
+class GattMtuTask : public nsRunnable
+{
+public:
+  GattMtuTask(int aConnId, int aStatus, int aMtu)
+    : mConnId(aConnId), mStatus(aStatus), mMtu(aMtu)
+  {
+  }
+
+  nsresult Run()
+  {
+    ApplyGattMtu(mConnId, mStatus, mMtu);
+    return NS_OK;
+  }
+
+private:
+  int mConnId;
+  int mStatus;
+  int mMtu;
+};
+
+/** Callback invoked in response to configure_mtu */
+static void
+GattConfigureMtuCallback(int conn_id, int status, int mtu)
+{
+    NS_DispatchToMainThread(new GattMtuTask(conn_id, status, mtu));
+}
+#endif
+
+/* Counts a notification delivered on a link, for the metrics */
+static void
+CountConnNotification(int conn_id)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    std::map<int, GattConnContext>::iterator iter = sGattConns.find(conn_id);
+    if(iter != sGattConns.end())
+    {
+        ++iter->second.notifications;
+    }
+}
+
+/* Adds the app owning conn_id to a per-link signal, so apps can tell theirs apart */
+static void
+AppendConnClientIf(int conn_id, InfallibleTArray<BluetoothNamedValue>& aData)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    std::map<int, GattConnContext>::iterator iter = sGattConns.find(conn_id);
+    if(iter == sGattConns.end())
+    {
+        return;
+    }
+
+    nsString data_client_if;
+    data_client_if.AppendInt(iter->second.clientIf);
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CLIENTIF), data_client_if));
+}
+
+/* Value format of the app a link belongs to, hex if it has none */
+static int
+GetConnValueFormat(int conn_id)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    std::map<int, GattConnContext>::iterator conn = sGattConns.find(conn_id);
+    if(conn == sGattConns.end())
+    {
+        return GATT_VALUE_FORMAT_HEX;
+    }
+    std::map<int, GattClientContext>::iterator client =
+        sGattClients.find(conn->second.clientIf);
+    return client != sGattClients.end() ? client->second.valueFormat : GATT_VALUE_FORMAT_HEX;
+}
+
+/* Appends the fields describing one notification to a signal */
+static void
+AppendNotifyValues(int conn_id, const btgatt_notify_params_t& aParams,
+        InfallibleTArray<BluetoothNamedValue>& aData)
+{
+    nsString data_conn_id;
+    data_conn_id.AppendInt(conn_id);
+
+    // The string helpers take non-const pointers but do not modify them
+    btgatt_notify_params_t* params = const_cast<btgatt_notify_params_t*>(&aParams);
+
+    nsString data_bdAddr;
+    BdAddressTypeToString(&params->bda, data_bdAddr);
+
+    nsString data_srvc_id_id_uuid;
+    BtUuidToString(&params->srvc_id.id.uuid, data_srvc_id_id_uuid);
+    nsString data_srvc_id_id_inst_id;
+    data_srvc_id_id_inst_id.AppendInt(aParams.srvc_id.id.inst_id);
+    nsString data_srvc_id_is_primary;
+    data_srvc_id_is_primary.AppendInt(aParams.srvc_id.is_primary);
+
+    nsString data_char_id_uuid;
+    BtUuidToString(&params->char_id.uuid, data_char_id_uuid);
+    nsString data_char_id_inst_id;
+    data_char_id_inst_id.AppendInt(aParams.char_id.inst_id);
+
+    nsString data_len;
+    data_len.AppendInt(aParams.len);
+
+    nsString data_is_notify;
+    data_is_notify.AppendInt(aParams.is_notify);
+
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(conn_id, aData);
+
+    AppendAttrValue(aParams.value, aParams.len, sizeof(aParams.value),
+            GetConnValueFormat(conn_id), aData);
+
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_BDA), data_bdAddr));
+
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ID_UUID), data_srvc_id_id_uuid));
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ID_INSTID), data_srvc_id_id_inst_id));
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ISPRIMARY), data_srvc_id_is_primary));
+
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CHARID_UUID), data_char_id_uuid));
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CHARID_INSTID), data_char_id_inst_id));
+
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LEN), data_len));
+
+    aData.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_IS_NOTIFY), data_is_notify));
+}
+
+/*
+ * Reports a long write as one signal once the stack has written all of
+ * it, or given up. GATT_PARA_SEGMENTS is the number of Prepare Write
+ * Requests the value took at the MTU of the link, 1 if it fit a single
+ * Write Request.
+ */
+static void
+SendLongWriteCallback(const GattEvent& aEvent)
+{
+    nsAutoString callbackName;
+    callbackName.AssignLiteral(BLEGATT_LONG_WRITE_ID);
+
+    // The string helpers take non-const pointers but do not modify them
+    btgatt_write_params_t* params = const_cast<btgatt_write_params_t*>(&aEvent.params.write);
+
+    uint32_t segment = GetGattConnMtu(aEvent.connId) - 5;
+    uint32_t segments = 1;
+    if(aEvent.valueLen > segment + 2)
+    {
+        segments = (aEvent.valueLen + segment - 1) / segment;
+    }
+
+    LOGI("Long write on conn_id:%d len:%d segments:%d status:%d in %dus", aEvent.connId,
+         aEvent.valueLen, segments, aEvent.status, aEvent.elapsedUs);
+
+    nsString data_conn_id;
+    data_conn_id.AppendInt(aEvent.connId);
+    nsString data_status;
+    data_status.AppendInt(aEvent.status);
+
+    nsString data_srvc_id_id_uuid;
+    BtUuidToString(&params->srvc_id.id.uuid, data_srvc_id_id_uuid);
+    nsString data_srvc_id_id_inst_id;
+    data_srvc_id_id_inst_id.AppendInt(params->srvc_id.id.inst_id);
+    nsString data_srvc_id_is_primary;
+    data_srvc_id_is_primary.AppendInt(params->srvc_id.is_primary);
+
+    nsString data_char_id_uuid;
+    BtUuidToString(&params->char_id.uuid, data_char_id_uuid);
+    nsString data_char_id_inst_id;
+    data_char_id_inst_id.AppendInt(params->char_id.inst_id);
+
+    nsString data_len;
+    data_len.AppendInt(aEvent.valueLen);
+    nsString data_segments;
+    data_segments.AppendInt(segments);
+    nsString data_elapsed_ms;
+    data_elapsed_ms.AppendInt(aEvent.elapsedUs / 1000);
+
+    InfallibleTArray<BluetoothNamedValue> data;
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(aEvent.connId, data);
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
+
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ID_UUID), data_srvc_id_id_uuid));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ID_INSTID), data_srvc_id_id_inst_id));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ISPRIMARY), data_srvc_id_is_primary));
+
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CHARID_UUID), data_char_id_uuid));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CHARID_INSTID), data_char_id_inst_id));
+
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LEN), data_len));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SEGMENTS), data_segments));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_ELAPSED_MS), data_elapsed_ms));
+
+    DistributeGattSignal(data);
+}
+
+/**
+ * Signal reused by the callbacks sent once per notification or scan
+ * result. Its named values are laid out once per shape and each send
+ * overwrites them in place, so the array keeps its storage and the strings
+ * keep their buffers unless a listener still holds them. Main thread only.
+ */
+class GattSignalTemplate
+{
+public:
+  GattSignalTemplate()
+    : mShape(UINT32_MAX)
+    , mSignal(NS_LITERAL_STRING(BLUETOOTH_GATT_CALLBACKS_ID),
+              NS_LITERAL_STRING(KEY_ADAPTER),
+              InfallibleTArray<BluetoothNamedValue>())
+  {
+  }
+
+  /*
+   * Returns true if the values must be laid out again with Add*, in
+   * which case they are cleared. aShape must differ whenever the names
+   * or value types would.
+   */
+  bool NeedsLayout(uint32_t aShape)
+  {
+    MOZ_ASSERT(NS_IsMainThread());
+    if (aShape == mShape) {
+      return false;
+    }
+    mShape = aShape;
+    Values().Clear();
+    GattCount(GATT_COUNTER_EVENT_ALLOCATIONS);
+    return true;
+  }
+
+  void AddString(const char* aName, const char* aValue = "")
+  {
+    Values().AppendElement(
+      BluetoothNamedValue(NS_ConvertASCIItoUTF16(aName), NS_ConvertASCIItoUTF16(aValue)));
+  }
+
+  void AddBytes(const char* aName)
+  {
+    Values().AppendElement(
+      BluetoothNamedValue(NS_ConvertASCIItoUTF16(aName), nsTArray<uint8_t>()));
+  }
+
+  void AddValues(const char* aName)
+  {
+    Values().AppendElement(
+      BluetoothNamedValue(NS_ConvertASCIItoUTF16(aName),
+                          InfallibleTArray<BluetoothNamedValue>()));
+  }
+
+  InfallibleTArray<BluetoothNamedValue>& Values()
+  {
+    return mSignal.value().get_ArrayOfBluetoothNamedValue();
+  }
+
+  InfallibleTArray<BluetoothNamedValue>& ValuesAt(size_t aIndex)
+  {
+    return Values()[aIndex].value().get_ArrayOfBluetoothNamedValue();
+  }
+
+  nsString& StringAt(size_t aIndex)
+  {
+    return Values()[aIndex].value().get_nsString();
+  }
+
+  nsTArray<uint8_t>& BytesAt(size_t aIndex)
+  {
+    return Values()[aIndex].value().get_ArrayOfuint8_t();
+  }
+
+  /*
+   * Sizes the nested values at aIndex to aCount entries. The entries
+   * already there are kept for their buffers; new ones hold aBlank until
+   * filled.
+   */
+  InfallibleTArray<BluetoothNamedValue>& SizeValuesAt(size_t aIndex, size_t aCount,
+                                                      const BluetoothValue& aBlank)
+  {
+    InfallibleTArray<BluetoothNamedValue>& values = ValuesAt(aIndex);
+    if (values.Length() > aCount) {
+      values.RemoveElementsAt(aCount, values.Length() - aCount);
+    }
+    while (values.Length() < aCount) {
+      GattCount(GATT_COUNTER_EVENT_ALLOCATIONS);
+      values.AppendElement(BluetoothNamedValue(EmptyString(), aBlank));
+    }
+    return values;
+  }
+
+  void SetInt(size_t aIndex, int aValue)
+  {
+    nsAutoString value;
+    value.AppendInt(aValue);
+    StringAt(aIndex).Assign(value);
+  }
+
+  void Send()
+  {
+    BluetoothService* bs = BluetoothService::Get();
+    if (bs) {
+      bs->DistributeSignal(mSignal);
+    } else {
+      LOGE("BluetoothService is null");
+    }
+  }
+
+private:
+  uint32_t mShape;
+  BluetoothSignal mSignal;
+};
+
+enum GattSignalKind {
+  GATT_SIGNAL_NOTIFY,
+  GATT_SIGNAL_SCAN_RESULT,
+  GATT_SIGNAL_SCAN_UPDATE,
+  GATT_SIGNAL_COUNT
+};
+
+namespace {
+// Main thread only
+static StaticAutoPtr<GattSignalTemplate> sSignalTemplates[GATT_SIGNAL_COUNT];
+}
+
+static GattSignalTemplate*
+GetSignalTemplate(GattSignalKind aKind)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    if(!sSignalTemplates[aKind])
+    {
+        sSignalTemplates[aKind] = new GattSignalTemplate();
+    }
+    return sSignalTemplates[aKind];
+}
+
+/* Writes an attribute value into a template slot laid out for aFormat */
+static void
+SetAttrValue(GattSignalTemplate* aTemplate, size_t aIndex,
+        const uint8_t* aValue, int aLen, int aMaxLen, int aFormat)
+{
+    aLen = ClampAttrValueLen(aLen, aMaxLen);
+
+    if(GATT_VALUE_FORMAT_BINARY == aFormat)
+    {
+        nsTArray<uint8_t>& bytes = aTemplate->BytesAt(aIndex);
+        if(bytes.Capacity() < (size_t)aLen)
+        {
+            GattCount(GATT_COUNTER_EVENT_ALLOCATIONS);
+        }
+        bytes.SetLength(aLen);
+        memcpy(bytes.Elements(), aValue, aLen);
+        return;
+    }
+
+    array2str(aValue, aLen, aTemplate->StringAt(aIndex));
+}
+
+/* Sends one notification through the reused notify signal */
+static void
+SendNotifySignal(int conn_id, const btgatt_notify_params_t& aParams)
+{
+    std::map<int, GattConnContext>::iterator conn = sGattConns.find(conn_id);
+    bool hasClientIf = conn != sGattConns.end();
+    int format = GetConnValueFormat(conn_id);
+    bool binary = GATT_VALUE_FORMAT_BINARY == format;
+
+    GattSignalTemplate* signal = GetSignalTemplate(GATT_SIGNAL_NOTIFY);
+    if(signal->NeedsLayout((hasClientIf ? 1 : 0) | (binary ? 2 : 0)))
+    {
+        signal->AddString(GATT_PARA_CALLBACK_NAME, BLEGATT_NOTIFY_ID);
+        signal->AddString(GATT_PARA_CONNID);
+        if(hasClientIf)
+        {
+            signal->AddString(GATT_PARA_CLIENTIF);
+        }
+        if(binary)
+        {
+            signal->AddBytes(GATT_PARA_DESCRID_VALUE);
+        }
+        else
+        {
+            signal->AddString(GATT_PARA_DESCRID_VALUE);
+        }
+        signal->AddString(GATT_PARA_BDA);
+        signal->AddString(GATT_PARA_SRVCID_ID_UUID);
+        signal->AddString(GATT_PARA_SRVCID_ID_INSTID);
+        signal->AddString(GATT_PARA_SRVCID_ISPRIMARY);
+        signal->AddString(GATT_PARA_CHARID_UUID);
+        signal->AddString(GATT_PARA_CHARID_INSTID);
+        signal->AddString(GATT_PARA_LEN);
+        signal->AddString(GATT_PARA_IS_NOTIFY);
+    }
+
+    // The string helpers take non-const pointers but do not modify them
+    btgatt_notify_params_t* params = const_cast<btgatt_notify_params_t*>(&aParams);
+
+    // Same order as the layout above
+    size_t i = 1;
+    signal->SetInt(i++, conn_id);
+    if(hasClientIf)
+    {
+        signal->SetInt(i++, conn->second.clientIf);
+    }
+    SetAttrValue(signal, i++, aParams.value, aParams.len, sizeof(aParams.value), format);
+    BdAddressTypeToString(&params->bda, signal->StringAt(i++));
+    BtUuidToString(&params->srvc_id.id.uuid, signal->StringAt(i++));
+    signal->SetInt(i++, aParams.srvc_id.id.inst_id);
+    signal->SetInt(i++, aParams.srvc_id.is_primary);
+    BtUuidToString(&params->char_id.uuid, signal->StringAt(i++));
+    signal->SetInt(i++, aParams.char_id.inst_id);
+    signal->SetInt(i++, aParams.len);
+    signal->SetInt(i++, aParams.is_notify);
+
+    signal->Send();
+}
+
+/**
+ * Sends all notifications of a batch as one signal. Each element of
+ * GATT_PARA_SAMPLES carries the same fields as a single notify callback.
+ */
+static void
+SendNotifyBatchCallback(const GattEvent& aEvent)
+{
+    nsAutoString callbackName;
+    callbackName.AssignLiteral(BLEGATT_NOTIFY_BATCH_ID);
+
+    // Built afresh: the samples and data arrays, and one array per sample
+    GattCount(GATT_COUNTER_EVENT_ALLOCATIONS, 2 + aEvent.samples.size());
+
+    InfallibleTArray<BluetoothNamedValue> samples;
+    for(size_t i = 0; i < aEvent.samples.size(); ++i)
+    {
+        InfallibleTArray<BluetoothNamedValue> sample;
+        CountConnNotification(aEvent.samples[i].connId);
+        AppendNotifyValues(aEvent.samples[i].connId, aEvent.samples[i].params, sample);
+        samples.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SAMPLE), sample));
+    }
+
+    InfallibleTArray<BluetoothNamedValue> data;
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SAMPLES), samples));
+
+    DistributeGattSignal(data);
+
+    GATT_TRACE(GATT_TRACE_INFO, GATT_TRACE_NOTIFY_BATCH, (int)aEvent.samples.size(), 0, 0);
+    GattCount(GATT_COUNTER_NOTIFY_BATCHES);
+}
+
+namespace {
+// Notify batching window in ms, 0 when every notification is sent alone
+static Atomic<uint32_t> sNotifyBatchWindowMs(0);
+// Batch size that flushes a batch before its window ends
+static Atomic<uint32_t> sNotifyBatchMaxEvents(MAX_NOTIFY_BATCH_EVENTS);
+static StaticMutex sNotifyBatchMutex;
+// Batch being filled by the bluedroid thread, guarded by sNotifyBatchMutex
+static GattEvent* sNotifyBatch;
+// Main thread only
+static StaticRefPtr<nsITimer> sNotifyBatchTimer;
+}
+
+/* Detaches the batch being filled, if any */
+static GattEvent*
+TakeNotifyBatch()
+{
+    StaticMutexAutoLock lock(sNotifyBatchMutex);
+    GattEvent* batch = sNotifyBatch;
+    sNotifyBatch = nullptr;
+    return batch;
+}
+
+/**
+ * Per-connection scheduling of ATT requests. Bluedroid accepts one
+ * outstanding read or write per connection, so requests beyond that wait
+ * here and are issued as soon as the previous one completes.
+ */
+enum GattOpType {
+  GATT_OP_READ_CHARACTERISTIC,
+  GATT_OP_WRITE_CHARACTERISTIC,
+  GATT_OP_READ_DESCRIPTOR,
+  GATT_OP_WRITE_DESCRIPTOR,
+  // A Write Request of up to GATT_MAX_ATTR_VALUE_LEN, reported on its own
+  GATT_OP_LONG_WRITE_CHARACTERISTIC,
+  // A Write Command taken from the connection's GattStream
+  GATT_OP_STREAM_WRITE,
+  // A CCCD write replayed after an auto-reconnect, not reported
+  GATT_OP_RESTORE_DESCRIPTOR,
+};
+
+enum GattOpPriority {
+  GATT_OP_PRIORITY_HIGH,
+  GATT_OP_PRIORITY_NORMAL,
+  GATT_OP_PRIORITY_LOW,
+  GATT_OP_PRIORITY_COUNT
+};
+
+struct GattOp
+{
+  GattOp()
+    : type(GATT_OP_READ_CHARACTERISTIC), priority(GATT_OP_PRIORITY_NORMAL),
+      connId(0), writeType(0), authReq(0), writeId(0), lastChunk(false)
+  {
+    memset(&srvcId, 0, sizeof(srvcId));
+    memset(&charId, 0, sizeof(charId));
+    memset(&descrId, 0, sizeof(descrId));
+  }
+
+  GattOpType type;
+  int priority;
+  int connId;
+  btgatt_srvc_id_t srvcId;
+  btgatt_gatt_id_t charId;
+  btgatt_gatt_id_t descrId;
+  int writeType;
+  int authReq;
+  nsTArray<uint8_t> value;
+  // Set on the chunks of one Write Command split by ATT_MTU, 0 otherwise
+  uint32_t writeId;
+  bool lastChunk;
+};
+
+/*
+ * Write Commands fed to one characteristic from a buffer the apps fill.
+ * A segment of ATT_MTU - 3 goes out whenever the connection has no other
+ * operation waiting, so the stack is handed the next one as soon as it
+ * took the last. After congestion, or a segment it refuses, the stream pauses
+ * for a backoff.
+ */
+struct GattStream
+{
+  GattStream()
+    : active(false), stalled(false), authReq(0), segment(GATT_DEFAULT_MTU - 3),
+      head(0), inFlight(0), bytesSent(0), congested(0), creditOwed(false)
+  {
+    memset(&srvcId, 0, sizeof(srvcId));
+    memset(&charId, 0, sizeof(charId));
+  }
+
+  bool active;
+  // Waiting for the backoff timer
+  bool stalled;
+  btgatt_srvc_id_t srvcId;
+  btgatt_gatt_id_t charId;
+  int authReq;
+  uint32_t segment;
+  // Bytes before head are written, the inFlight ones after it are with the stack
+  std::vector<uint8_t> buffer;
+  size_t head;
+  uint32_t inFlight;
+  uint64_t bytesSent;
+  // Pauses for a congested link or a refused segment
+  uint32_t congested;
+  TimeStamp startedAt;
+  // Set once the buffer was more than half full, until credit is reported
+  bool creditOwed;
+};
+
+struct GattOpQueue
+{
+  GattOpQueue()
+    : busy(false), gated(false), closing(false), dropped(false), issuedType(0),
+      issuedLen(0), issuedWriteId(0), issuedLastChunk(false)
+  {
+    memset(&issuedSrvcId, 0, sizeof(issuedSrvcId));
+    memset(&issuedCharId, 0, sizeof(issuedCharId));
+    memset(&issuedDescrId, 0, sizeof(issuedDescrId));
+  }
+
+  bool busy;
+  // Nothing new is issued while set, see SetGattOpGate
+  bool gated;
+  // The link went down, what is left is reported as failed
+  bool closing;
+  // The in-flight operation never reached the stack
+  bool dropped;
+  // When the in-flight operation was handed to the stack, for the metrics
+  TimeStamp issuedAt;
+  int issuedType;
+  uint32_t issuedLen;
+  uint32_t issuedWriteId;
+  bool issuedLastChunk;
+  // Attribute of the in-flight operation, to fail it if it times out
+  btgatt_srvc_id_t issuedSrvcId;
+  btgatt_gatt_id_t issuedCharId;
+  btgatt_gatt_id_t issuedDescrId;
+  std::deque<GattOp> pending[GATT_OP_PRIORITY_COUNT];
+  GattStream stream;
+};
+
+namespace {
+static StaticMutex sGattOpMutex;
+// Keyed by conn_id, guarded by sGattOpMutex
+static std::map<int, GattOpQueue> sGattOpQueues;
+// Main thread only
+static StaticRefPtr<nsITimer> sGattStreamTimer;
+static bool sGattStreamBackoffArmed;
+// Last writeId handed to a split Write Command
+static Atomic<uint32_t> sGattWriteIds(0);
+// Main thread only
+static StaticRefPtr<nsITimer> sGattOpWatchdog;
+static bool sGattOpWatchdogArmed;
+static uint32_t sGattOpTimeoutMs = GATT_OP_TIMEOUT_MS;
+}
+
+static void IssueNextGattOp(int conn_id);
+static void ArmGattOpWatchdog();
+
+/* Records aOp as the in-flight operation of aQueue. Must hold sGattOpMutex. */
+static void
+MarkGattOpIssuedLocked(GattOpQueue& aQueue, const GattOp& aOp)
+{
+    aQueue.issuedAt = TimeStamp::Now();
+    aQueue.issuedType = aOp.type;
+    aQueue.issuedLen = aOp.value.Length();
+    aQueue.issuedWriteId = aOp.writeId;
+    aQueue.issuedLastChunk = aOp.lastChunk;
+    aQueue.issuedSrvcId = aOp.srvcId;
+    aQueue.issuedCharId = aOp.charId;
+    aQueue.issuedDescrId = aOp.descrId;
+}
+
+// Progress of a write stream, as sent in a BLEGATT_WRITE_STREAM_ID signal
+struct GattStreamReport
+{
+  int connId;
+  int status;
+  uint64_t bytesSent;
+  uint32_t buffered;
+  uint32_t congested;
+  uint32_t bytesPerSec;
+};
+
+/* Must hold sGattOpMutex */
+static void
+FillGattStreamReport(int conn_id, const GattStream& aStream, int status,
+                     GattStreamReport& aReport)
+{
+    aReport.connId = conn_id;
+    aReport.status = status;
+    aReport.bytesSent = aStream.bytesSent;
+    aReport.buffered = aStream.buffer.size() - aStream.head;
+    aReport.congested = aStream.congested;
+    aReport.bytesPerSec = 0;
+
+    double seconds = (TimeStamp::Now() - aStream.startedAt).ToSeconds();
+    if(seconds > 0)
+    {
+        aReport.bytesPerSec = (uint32_t)(aStream.bytesSent / seconds);
+    }
+}
+
+static void
+SendGattStreamReport(const GattStreamReport& aReport)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    LOGI("Write stream of conn_id:%d status:%d sent:%llu buffered:%d at %dB/s",
+         aReport.connId, aReport.status, (unsigned long long)aReport.bytesSent,
+         aReport.buffered, aReport.bytesPerSec);
+
+    nsAutoString callbackName;
+    callbackName.AssignLiteral(BLEGATT_WRITE_STREAM_ID);
+    nsString data_conn_id;
+    data_conn_id.AppendInt(aReport.connId);
+    nsString data_status;
+    data_status.AppendInt(aReport.status);
+    nsString data_bytes_sent;
+    data_bytes_sent.AppendInt((int64_t)aReport.bytesSent);
+    nsString data_buffered;
+    data_buffered.AppendInt(aReport.buffered);
+    nsString data_credit;
+    data_credit.AppendInt(GATT_STREAM_MAX_BUFFER - aReport.buffered);
+    nsString data_bytes_per_sec;
+    data_bytes_per_sec.AppendInt(aReport.bytesPerSec);
+    nsString data_congested;
+    data_congested.AppendInt(aReport.congested);
+
+    InfallibleTArray<BluetoothNamedValue> data;
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(aReport.connId, data);
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_BYTES_SENT), data_bytes_sent));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_BUFFERED), data_buffered));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CREDIT), data_credit));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_BYTES_PER_SEC), data_bytes_per_sec));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONGESTED), data_congested));
+
+    DistributeGattSignal(data);
+}
+
+/* Resumes the streams paused for a backoff */
+static void
+GattStreamBackoffCallback(nsITimer* aTimer, void* aClosure)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    sGattStreamBackoffArmed = false;
+
+    std::vector<int> idle;
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        std::map<int, GattOpQueue>::iterator iter;
+        for(iter = sGattOpQueues.begin(); iter != sGattOpQueues.end(); ++iter)
+        {
+            GattOpQueue& queue = iter->second;
+            if(!queue.stream.stalled)
+            {
+                continue;
+            }
+            queue.stream.stalled = false;
+            if(!queue.busy && !queue.gated)
+            {
+                queue.busy = true;
+                idle.push_back(iter->first);
+            }
+        }
+    }
+
+    for(size_t i = 0; i < idle.size(); ++i)
+    {
+        IssueNextGattOp(idle[i]);
+    }
+}
+
+static void
+ArmGattStreamBackoff()
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    if(sGattStreamBackoffArmed)
+    {
+        return;
+    }
+
+    if(!sGattStreamTimer)
+    {
+        nsCOMPtr<nsITimer> timer = do_CreateInstance(NS_TIMER_CONTRACTID);
+        if(!timer)
+        {
+            LOGE("Failed to create write stream timer");
+            GattStreamBackoffCallback(nullptr, nullptr);
+            return;
+        }
+        sGattStreamTimer = timer;
+    }
+
+    sGattStreamBackoffArmed = true;
+    sGattStreamTimer->InitWithFuncCallback(GattStreamBackoffCallback, nullptr,
+                                           GATT_STREAM_BACKOFF_MS,
+                                           nsITimer::TYPE_ONE_SHOT);
+}
+
+/* Hands a write stream report or a backoff over to the main thread */
+class GattStreamTask : public nsRunnable
+{
+public:
+  GattStreamTask()
+    : mBackoff(true)
+  {
+    memset(&mReport, 0, sizeof(mReport));
+  }
+
+  explicit GattStreamTask(const GattStreamReport& aReport)
+    : mBackoff(false), mReport(aReport)
+  {
+  }
+
+  nsresult Run()
+  {
+    if(mBackoff)
+    {
+      ArmGattStreamBackoff();
+    }
+    else
+    {
+      SendGattStreamReport(mReport);
+    }
+    return NS_OK;
+  }
+
+private:
+  bool mBackoff;
+  GattStreamReport mReport;
+};
+
+/*
+ * Fills aOp with the next segment of a stream if it has one to send.
+ * Must hold sGattOpMutex.
+ */
+static bool
+TakeGattStreamSegment(GattStream& aStream, int conn_id, GattOp& aOp)
+{
+    uint32_t buffered = aStream.buffer.size() - aStream.head;
+    if(!aStream.active || aStream.stalled || aStream.inFlight || !buffered)
+    {
+        return false;
+    }
+
+    uint32_t len = std::min(aStream.segment, buffered);
+    aOp.type = GATT_OP_STREAM_WRITE;
+    aOp.priority = GATT_OP_PRIORITY_LOW;
+    aOp.connId = conn_id;
+    aOp.srvcId = aStream.srvcId;
+    aOp.charId = aStream.charId;
+    aOp.writeType = GATT_WRITE_TYPE_NO_RSP;
+    aOp.authReq = aStream.authReq;
+    aOp.value.ReplaceElementsAt(0, aOp.value.Length(), &aStream.buffer[aStream.head], len);
+    aStream.inFlight = len;
+    return true;
+}
+
+/*
+ * Accounts for the stream segment of a connection the stack completed
+ * with status, or refused when aRefused. Only a refused segment is sent
+ * again. A congested status means L2CAP took it and is full now, so the
+ * stream just pauses. The apps hear of it once the buffer drained, has
+ * room again or the stream failed.
+ */
+static void
+FinishGattStreamSegment(int conn_id, int status, bool aRefused)
+{
+    GattStreamReport report;
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.find(conn_id);
+        if(iter == sGattOpQueues.end())
+        {
+            return;
+        }
+
+        GattStream& stream = iter->second.stream;
+        uint32_t len = stream.inFlight;
+        stream.inFlight = 0;
+        if(!stream.active || !len)
+        {
+            // Stopped while the segment was with the stack
+            return;
+        }
+
+        if(aRefused || GATT_STATUS_CONGESTED == status)
+        {
+            ++stream.congested;
+            stream.stalled = true;
+            NS_DispatchToMainThread(new GattStreamTask());
+            if(aRefused)
+            {
+                return;
+            }
+        }
+
+        if(status && GATT_STATUS_CONGESTED != status)
+        {
+            LOGE("Write stream of conn_id:%d failed, status:%d", conn_id, status);
+            FillGattStreamReport(conn_id, stream, status, report);
+            stream = GattStream();
+        }
+        else
+        {
+            stream.head += len;
+            stream.bytesSent += len;
+
+            uint32_t buffered = stream.buffer.size() - stream.head;
+            if(buffered && (!stream.creditOwed || buffered > GATT_STREAM_MAX_BUFFER / 2))
+            {
+                return;
+            }
+
+            stream.creditOwed = false;
+            FillGattStreamReport(conn_id, stream, status, report);
+            if(!buffered)
+            {
+                stream.buffer.clear();
+                stream.head = 0;
+            }
+        }
+    }
+
+    NS_DispatchToMainThread(new GattStreamTask(report));
+}
+
+/*
+ * Queues aValue behind what a connection's stream still holds, starting
+ * the stream if needed. Returns false if it is streaming to another
+ * characteristic or the value does not fit its buffer.
+ */
+static bool
+AppendGattStream(int conn_id, const btgatt_srvc_id_t& aSrvcId,
+                 const btgatt_gatt_id_t& aCharId, int aAuthReq,
+                 const nsTArray<uint8_t>& aValue)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    ArmGattOpWatchdog();
+    uint32_t segment = GetGattConnMtu(conn_id) - 3;
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        GattOpQueue& queue = sGattOpQueues[conn_id];
+        GattStream& stream = queue.stream;
+        uint32_t buffered = stream.buffer.size() - stream.head;
+
+        if(stream.active && (buffered || stream.inFlight) &&
+           (memcmp(&stream.srvcId, &aSrvcId, sizeof(aSrvcId)) ||
+            memcmp(&stream.charId, &aCharId, sizeof(aCharId))))
+        {
+            LOGE("conn_id:%d is still streaming to another characteristic", conn_id);
+            return false;
+        }
+        if(buffered + aValue.Length() > GATT_STREAM_MAX_BUFFER)
+        {
+            LOGE("Write stream of conn_id:%d is full, %d bytes buffered", conn_id, buffered);
+            return false;
+        }
+
+        if(!stream.active)
+        {
+            stream.active = true;
+            stream.startedAt = TimeStamp::Now();
+        }
+        stream.srvcId = aSrvcId;
+        stream.charId = aCharId;
+        stream.authReq = aAuthReq;
+        stream.segment = segment;
+
+        // Drop what was written so the buffer does not grow with the stream
+        if(stream.head > stream.buffer.size() / 2)
+        {
+            stream.buffer.erase(stream.buffer.begin(), stream.buffer.begin() + stream.head);
+            stream.head = 0;
+        }
+        stream.buffer.insert(stream.buffer.end(), aValue.Elements(),
+                             aValue.Elements() + aValue.Length());
+        if(buffered + aValue.Length() > GATT_STREAM_MAX_BUFFER / 2)
+        {
+            stream.creditOwed = true;
+        }
+
+        if(queue.busy || queue.gated)
+        {
+            return true;
+        }
+        queue.busy = true;
+    }
+
+    IssueNextGattOp(conn_id);
+    return true;
+}
+
+/* Ends a connection's stream, dropping what it still holds */
+static bool
+StopGattStream(int conn_id)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    GattStreamReport report;
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.find(conn_id);
+        if(iter == sGattOpQueues.end() || !iter->second.stream.active)
+        {
+            LOGE("No write stream on conn_id:%d", conn_id);
+            return false;
+        }
+
+        FillGattStreamReport(conn_id, iter->second.stream, BT_STATUS_SUCCESS, report);
+        iter->second.stream = GattStream();
+    }
+
+    SendGattStreamReport(report);
+    return true;
+}
+
+// Client Characteristic Configuration descriptor, 0x2902
+static const uint8_t kCccdUuid[16] = {
+    0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+    0x00, 0x10, 0x00, 0x00, 0x02, 0x29, 0x00, 0x00
+};
+
+/*
+ * Default priority of an operation: CCCD writes go ahead of everything
+ * so that enabling notifications is not stuck behind bulk transfers.
+ */
+static int
+DefaultGattOpPriority(const GattOp& aOp)
+{
+    if(GATT_OP_WRITE_DESCRIPTOR == aOp.type &&
+       !memcmp(aOp.descrId.uuid.uu, kCccdUuid, sizeof(kCccdUuid)))
+    {
+        return GATT_OP_PRIORITY_HIGH;
+    }
+    return GATT_OP_PRIORITY_NORMAL;
+}
+
+static bt_status_t
+IssueGattOp(GattOp& aOp)
+{
+    GATT_TRACE(GATT_TRACE_INFO, GATT_TRACE_OP_ISSUE, aOp.type, aOp.connId, 0);
+
+    // Refused like any other request once the stack was cleaned up
+    if(!sBluetoothGattInterface)
+    {
+        return BT_STATUS_NOT_READY;
+    }
+    const btgatt_client_interface_t* client = sBluetoothGattInterface->client;
+    switch(aOp.type)
+    {
+    case GATT_OP_READ_CHARACTERISTIC:
+        return client->read_characteristic(aOp.connId, &aOp.srvcId,
+                &aOp.charId, aOp.authReq);
+    case GATT_OP_WRITE_CHARACTERISTIC:
+        return client->write_characteristic(aOp.connId, &aOp.srvcId,
+                &aOp.charId, aOp.writeType, aOp.value.Length(), aOp.authReq,
+                (char *)aOp.value.Elements());
+    case GATT_OP_READ_DESCRIPTOR:
+        return client->read_descriptor(aOp.connId, &aOp.srvcId,
+                &aOp.charId, &aOp.descrId, aOp.authReq);
+    case GATT_OP_WRITE_DESCRIPTOR:
+    case GATT_OP_RESTORE_DESCRIPTOR:
+        return client->write_descriptor(aOp.connId, &aOp.srvcId,
+                &aOp.charId, &aOp.descrId, aOp.writeType, aOp.value.Length(),
+                aOp.authReq, (char *)aOp.value.Elements());
+    case GATT_OP_LONG_WRITE_CHARACTERISTIC:
+        return client->write_characteristic(aOp.connId, &aOp.srvcId,
+                &aOp.charId, GATT_WRITE_TYPE_DEFAULT, aOp.value.Length(), aOp.authReq,
+                (char *)aOp.value.Elements());
+    case GATT_OP_STREAM_WRITE:
+        return client->write_characteristic(aOp.connId, &aOp.srvcId,
+                &aOp.charId, GATT_WRITE_TYPE_NO_RSP, aOp.value.Length(), aOp.authReq,
+                (char *)aOp.value.Elements());
+    default:
+        return BT_STATUS_PARM_INVALID;
+    }
+}
+
+/*
+ * Answers an operation the stack never got with the callback of a failed
+ * one. It takes the same Process* path as a completion from the stack,
+ * which also completes it in its queue and moves on to the next.
+ */
+static void
+ReportDroppedGattOp(const GattOp& aOp)
+{
+    if(!sBluetoothGatt)
+    {
+        return;
+    }
+
+    switch(aOp.type)
+    {
+    case GATT_OP_READ_CHARACTERISTIC:
+    case GATT_OP_READ_DESCRIPTOR:
+    {
+        btgatt_read_params_t params;
+        memset(&params, 0, sizeof(params));
+        params.srvc_id = aOp.srvcId;
+        params.char_id = aOp.charId;
+        params.descr_id = aOp.descrId;
+        params.status = GATT_STATUS_ERROR;
+        if(GATT_OP_READ_CHARACTERISTIC == aOp.type)
+        {
+            sBluetoothGatt->ProcessReadCharacteristic(aOp.connId, GATT_STATUS_ERROR, &params);
+        }
+        else
+        {
+            sBluetoothGatt->ProcessReadDescriptor(aOp.connId, GATT_STATUS_ERROR, &params);
+        }
+        break;
+    }
+    default:
+    {
+        btgatt_write_params_t params;
+        memset(&params, 0, sizeof(params));
+        params.srvc_id = aOp.srvcId;
+        params.char_id = aOp.charId;
+        params.descr_id = aOp.descrId;
+        params.status = GATT_STATUS_ERROR;
+        if(GATT_OP_WRITE_DESCRIPTOR == aOp.type || GATT_OP_RESTORE_DESCRIPTOR == aOp.type)
+        {
+            sBluetoothGatt->ProcessWriteDescriptor(aOp.connId, GATT_STATUS_ERROR, &params);
+        }
+        else
+        {
+            sBluetoothGatt->ProcessWriteCharacteristic(aOp.connId, GATT_STATUS_ERROR, &params);
+        }
+        break;
+    }
+    }
+}
+
+/*
+ * Issues the next queued operation of a connection or marks it idle. One
+ * the stack refuses, or any left once the link went down, is reported as
+ * failed; the queue of a closed link goes away once it drained.
+ */
+static void
+IssueNextGattOp(int conn_id)
+{
+    while(true)
+    {
+        GattOp next;
+        bool closing;
+        {
+            StaticMutexAutoLock lock(sGattOpMutex);
+            std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.find(conn_id);
+            if(iter == sGattOpQueues.end())
+            {
+                return;
+            }
+
+            GattOpQueue& queue = iter->second;
+            closing = queue.closing;
+            if(queue.gated && !closing)
+            {
+                queue.busy = false;
+                queue.issuedAt = TimeStamp();
+                return;
+            }
+
+            int i = 0;
+            while(i < GATT_OP_PRIORITY_COUNT && queue.pending[i].empty())
+            {
+                ++i;
+            }
+            if(i < GATT_OP_PRIORITY_COUNT)
+            {
+                next = queue.pending[i].front();
+                queue.pending[i].pop_front();
+            }
+            else if(closing)
+            {
+                if(queue.stream.active)
+                {
+                    GattStreamReport report;
+                    FillGattStreamReport(conn_id, queue.stream, GATT_STATUS_ERROR, report);
+                    NS_DispatchToMainThread(new GattStreamTask(report));
+                }
+                sGattOpQueues.erase(iter);
+                return;
+            }
+            else if(!TakeGattStreamSegment(queue.stream, conn_id, next))
+            {
+                queue.busy = false;
+                queue.issuedAt = TimeStamp();
+                return;
+            }
+
+            MarkGattOpIssuedLocked(queue, next);
+            queue.dropped = closing;
+        }
+
+        if(!closing)
+        {
+            if(BT_STATUS_SUCCESS == IssueGattOp(next))
+            {
+                return;
+            }
+            if(GATT_OP_STREAM_WRITE == next.type)
+            {
+                // Bluedroid refuses what it has no buffer for yet
+                FinishGattStreamSegment(conn_id, BT_STATUS_BUSY, true);
+                continue;
+            }
+            GattCount(GATT_COUNTER_STACK_ERRORS);
+            LOGE("Queued GATT operation %d on conn_id:%d failed", next.type, conn_id);
+
+            StaticMutexAutoLock lock(sGattOpMutex);
+            std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.find(conn_id);
+            if(iter != sGattOpQueues.end())
+            {
+                iter->second.dropped = true;
+            }
+        }
+
+        // Issues the next operation in turn
+        ReportDroppedGattOp(next);
+        return;
+    }
+}
+
+// The operation CompleteGattOp found in flight, type -1 if none
+struct GattOpDone
+{
+  GattOpDone() : type(-1), len(0), elapsedUs(0), writeId(0), lastChunk(false) {}
+
+  int type;
+  uint32_t len;
+  uint32_t elapsedUs;
+  // Chunk of a split Write Command, see GattOp
+  uint32_t writeId;
+  bool lastChunk;
+};
+
+/*
+ * Drops the chunks of a split Write Command still waiting, so the peer
+ * never gets the rest of a value with a hole in it. Must hold
+ * sGattOpMutex.
+ */
+static void
+CancelGattWriteChunksLocked(GattOpQueue& aQueue, uint32_t aWriteId)
+{
+    for(int i = 0; i < GATT_OP_PRIORITY_COUNT; ++i)
+    {
+        std::deque<GattOp>::iterator iter = aQueue.pending[i].begin();
+        while(iter != aQueue.pending[i].end())
+        {
+            if(iter->writeId == aWriteId)
+            {
+                iter = aQueue.pending[i].erase(iter);
+            }
+            else
+            {
+                ++iter;
+            }
+        }
+    }
+}
+
+/*
+ * Marks the in-flight operation of a connection as done with the ATT
+ * status the stack reported, and issues the next queued one.
+ */
+static GattOpDone
+CompleteGattOp(int conn_id, int status)
+{
+    if(status)
+    {
+        GattCount(GATT_COUNTER_ATT_ERRORS);
+    }
+
+    TimeStamp issuedAt;
+    GattOpDone done;
+    bool dropped = false;
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.find(conn_id);
+        if(iter != sGattOpQueues.end())
+        {
+            issuedAt = iter->second.issuedAt;
+            done.type = iter->second.issuedType;
+            done.len = iter->second.issuedLen;
+            done.writeId = iter->second.issuedWriteId;
+            done.lastChunk = iter->second.issuedLastChunk;
+            dropped = iter->second.dropped;
+            iter->second.issuedAt = TimeStamp();
+            iter->second.dropped = false;
+            if(done.writeId && status && GATT_STATUS_CONGESTED != status)
+            {
+                CancelGattWriteChunksLocked(iter->second, done.writeId);
+            }
+        }
+    }
+
+    if(dropped)
+    {
+        // Never reached the stack, so there is no latency to record
+    }
+    else if(!issuedAt.IsNull())
+    {
+        done.elapsedUs = (uint32_t)(TimeStamp::Now() - issuedAt).ToMicroseconds();
+        GattCount(GATT_COUNTER_OPS_COMPLETED);
+        RecordGattLatency(done.type, done.elapsedUs);
+    }
+    else
+    {
+        done.type = -1;
+    }
+
+    if(GATT_OP_STREAM_WRITE == done.type)
+    {
+        FinishGattStreamSegment(conn_id, status, false);
+    }
+    IssueNextGattOp(conn_id);
+    return done;
+}
+
+/*
+ * Runs every GATT_OP_WATCHDOG_TICK_MS while an operation is in flight and
+ * fails those the stack did not answer within sGattOpTimeoutMs, as if it
+ * had reported an error, so their queue moves on.
+ */
+static void
+GattOpWatchdogCallback(nsITimer* aTimer, void* aClosure)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    TimeStamp now = TimeStamp::Now();
+    bool any = false;
+    std::vector<GattOp> expired;
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        std::map<int, GattOpQueue>::iterator iter;
+        for(iter = sGattOpQueues.begin(); iter != sGattOpQueues.end(); ++iter)
+        {
+            GattOpQueue& queue = iter->second;
+            if(queue.issuedAt.IsNull())
+            {
+                continue;
+            }
+            any = true;
+            if(queue.dropped || (now - queue.issuedAt).ToMilliseconds() < sGattOpTimeoutMs)
+            {
+                continue;
+            }
+
+            GattOp op;
+            op.type = (GattOpType)queue.issuedType;
+            op.connId = iter->first;
+            op.srvcId = queue.issuedSrvcId;
+            op.charId = queue.issuedCharId;
+            op.descrId = queue.issuedDescrId;
+            expired.push_back(op);
+            // Its answer no longer counts towards the latencies
+            queue.dropped = true;
+        }
+    }
+
+    for(size_t i = 0; i < expired.size(); ++i)
+    {
+        GattCount(GATT_COUNTER_OP_TIMEOUTS);
+        LOGE("GATT operation %d on conn_id:%d timed out", expired[i].type, expired[i].connId);
+        ReportDroppedGattOp(expired[i]);
+    }
+
+    if(!any && sGattOpWatchdog)
+    {
+        sGattOpWatchdog->Cancel();
+        sGattOpWatchdogArmed = false;
+    }
+}
+
+static void
+ArmGattOpWatchdog()
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    if(sGattOpWatchdogArmed)
+    {
+        return;
+    }
+
+    if(!sGattOpWatchdog)
+    {
+        nsCOMPtr<nsITimer> timer = do_CreateInstance(NS_TIMER_CONTRACTID);
+        if(!timer)
+        {
+            LOGE("Failed to create GATT operation watchdog");
+            return;
+        }
+        sGattOpWatchdog = timer;
+    }
+
+    sGattOpWatchdogArmed = true;
+    sGattOpWatchdog->InitWithFuncCallback(GattOpWatchdogCallback, nullptr,
+                                          GATT_OP_WATCHDOG_TICK_MS,
+                                          nsITimer::TYPE_REPEATING_SLACK);
+}
+
+/*
+ * Runs aOp now if its connection is idle, queues it otherwise.
+ * Returns false if the stack refused it or the queue is full.
+ */
+static bool
+SubmitGattOp(GattOp& aOp)
+{
+    ArmGattOpWatchdog();
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        GattOpQueue& queue = sGattOpQueues[aOp.connId];
+        if(queue.busy || queue.gated)
+        {
+            size_t depth = 0;
+            for(int i = 0; i < GATT_OP_PRIORITY_COUNT; ++i)
+            {
+                depth += queue.pending[i].size();
+            }
+            if(depth >= MAX_GATT_OP_QUEUE_DEPTH)
+            {
+                GattCount(GATT_COUNTER_OPS_REJECTED);
+                LOGE("GATT operation queue of conn_id:%d is full", aOp.connId);
+                return false;
+            }
+
+            GattCount(GATT_COUNTER_OPS_QUEUED);
+            queue.pending[aOp.priority].push_back(aOp);
+            return true;
+        }
+        queue.busy = true;
+        MarkGattOpIssuedLocked(queue, aOp);
+    }
+
+    if(BT_STATUS_SUCCESS != IssueGattOp(aOp))
+    {
+        GattCount(GATT_COUNTER_STACK_ERRORS);
+        LOGE("GATT operation %d on conn_id:%d failed", aOp.type, aOp.connId);
+        IssueNextGattOp(aOp.connId);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Holds back the operations of a connection while the stack cannot
+ * resolve attributes yet, and issues what was queued once released.
+ */
+static void
+SetGattOpGate(int conn_id, bool aGated)
+{
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        GattOpQueue& queue = sGattOpQueues[conn_id];
+        queue.gated = aGated;
+        if(aGated || queue.busy)
+        {
+            return;
+        }
+        queue.busy = true;
+    }
+
+    IssueNextGattOp(conn_id);
+}
+
+/* Number of operations waiting behind the in-flight one */
+static int
+GetGattOpQueueDepth(int conn_id)
+{
+    StaticMutexAutoLock lock(sGattOpMutex);
+    std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.find(conn_id);
+    if(iter == sGattOpQueues.end())
+    {
+        return 0;
+    }
+
+    int depth = 0;
+    for(int i = 0; i < GATT_OP_PRIORITY_COUNT; ++i)
+    {
+        depth += iter->second.pending[i].size();
+    }
+    return depth;
+}
+
+/* Drops the queue of a connection that went away, failing what waits in it */
+static void
+ResetGattOpQueue(int conn_id)
+{
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.find(conn_id);
+        if(iter == sGattOpQueues.end())
+        {
+            return;
+        }
+        LOGI("Dropping GATT operation queue of conn_id:%d", conn_id);
+        iter->second.closing = true;
+        iter->second.busy = true;
+    }
+
+    IssueNextGattOp(conn_id);
+}
+
+/*
+ * Reads the optional trailing priority parameter of a read/write request.
+ * aBaseLength is the parameter count without it. Returns -1 for the
+ * default priority of the operation.
+ */
+static int
+ParseGattOpPriority(const nsTArray<nsString>& aPara, uint32_t aBaseLength)
+{
+    if(aPara.Length() <= aBaseLength)
+    {
+        return -1;
+    }
+
+    nsresult rv;
+    int priority = aPara[aBaseLength].ToInteger(&rv);
+    return NS_FAILED(rv) ? -1 : priority;
+}
+
+/* Bytes a connection's write stream still has to send */
+static uint32_t
+GetGattStreamBuffered(int conn_id)
+{
+    StaticMutexAutoLock lock(sGattOpMutex);
+    std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.find(conn_id);
+    if(iter == sGattOpQueues.end())
+    {
+        return 0;
+    }
+
+    const GattStream& stream = iter->second.stream;
+    return stream.buffer.size() - stream.head;
+}
+
+namespace {
+// Main thread only
+static StaticRefPtr<nsITimer> sGattConnProfileTimer;
+}
+
+/* Checks parameters against the ranges and the timeout rule of the spec */
+static bool
+ValidGattConnParams(const GattConnParams& aParams)
+{
+    if(aParams.minInterval < 6 || aParams.minInterval > aParams.maxInterval ||
+       aParams.maxInterval > 3200 || aParams.latency < 0 || aParams.latency > 499 ||
+       aParams.timeout < 10 || aParams.timeout > 3200)
+    {
+        return false;
+    }
+
+    // The timeout has to outlast two intervals of the longest wait
+    return aParams.timeout * 4 > (1 + aParams.latency) * aParams.maxInterval;
+}
+
+static void
+SendConnParamsCallback(const GattConnContext& aConn, const GattConnParams& aParams)
+{
+    nsAutoString callbackName;
+    callbackName.AssignLiteral(BLEGATT_CONN_PARAMS_ID);
+    nsString data_conn_id;
+    data_conn_id.AppendInt(aConn.connId);
+    nsString data_client_if;
+    data_client_if.AppendInt(aConn.clientIf);
+    nsString data_profile;
+    data_profile.AppendInt(aConn.activeProfile);
+    nsString data_min_interval;
+    data_min_interval.AppendInt(aParams.minInterval);
+    nsString data_max_interval;
+    data_max_interval.AppendInt(aParams.maxInterval);
+    nsString data_latency;
+    data_latency.AppendInt(aParams.latency);
+    nsString data_timeout;
+    data_timeout.AppendInt(aParams.timeout);
+    nsString data_auto;
+    data_auto.AppendInt(aConn.autoProfile ? 1 : 0);
+
+    InfallibleTArray<BluetoothNamedValue> data;
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CLIENTIF), data_client_if));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_PROFILE), data_profile));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_MIN_INTERVAL), data_min_interval));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_MAX_INTERVAL), data_max_interval));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LATENCY), data_latency));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_TIMEOUT), data_timeout));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_AUTO), data_auto));
+
+    DistributeGattSignal(data);
+}
+
+/*
+ * Asks the controller to move a link to aParams, aProfile being the
+ * GattConnProfile they come from or -1. The stack does not report the
+ * outcome, so the apps are told what was asked for.
+ */
+static bool
+RequestGattConnParams(GattConnContext& aConn, const GattConnParams& aParams, int aProfile)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+#ifdef MOZ_BT_GATT_CONN_PARAMS
+    if(BT_STATUS_SUCCESS != sBluetoothGattInterface->client->conn_parameter_update(
+            &aConn.bda, aParams.minInterval, aParams.maxInterval,
+            aParams.latency, aParams.timeout))
+    {
+        LOGE("conn_parameter_update failed for conn_id:%d", aConn.connId);
+        return false;
+    }
+
+    LOGI("conn_id:%d profile:%d interval:%d-%d latency:%d timeout:%d", aConn.connId,
+         aProfile, aParams.minInterval, aParams.maxInterval, aParams.latency, aParams.timeout);
+    aConn.activeProfile = aProfile;
+    SendConnParamsCallback(aConn, aParams);
+    return true;
+#else
+    LOGE("Connection parameter updates are not supported by this stack");
+    return false;
+#endif
+}
+
+/* Whether a link has more to transfer than one interval at a time suits */
+static bool
+IsGattConnBusy(int conn_id)
+{
+    return GetGattOpQueueDepth(conn_id) >= GATT_CONN_BURST_DEPTH ||
+           GetGattStreamBuffered(conn_id) > 0;
+}
+
+/* Moves a link with automatic profiles to low latency once it gets busy */
+static void
+NoteGattConnActivity(int conn_id)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    std::map<int, GattConnContext>::iterator iter = sGattConns.find(conn_id);
+    if(iter == sGattConns.end() || !iter->second.autoProfile || !IsGattConnBusy(conn_id))
+    {
+        return;
+    }
+
+    GattConnContext& conn = iter->second;
+    conn.lastBusy = TimeStamp::Now();
+    if(GATT_CONN_PROFILE_LOW_LATENCY != conn.activeProfile)
+    {
+        RequestGattConnParams(conn, kGattConnProfiles[GATT_CONN_PROFILE_LOW_LATENCY],
+                              GATT_CONN_PROFILE_LOW_LATENCY);
+    }
+}
+
+/*
+ * Runs every GATT_CONN_PROFILE_TICK_MS while a link switches profiles
+ * automatically: keeps busy links fast and relaxes the idle ones.
+ */
+static void
+GattConnProfileTimerCallback(nsITimer* aTimer, void* aClosure)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    TimeStamp now = TimeStamp::Now();
+    bool any = false;
+    std::map<int, GattConnContext>::iterator iter;
+    for(iter = sGattConns.begin(); iter != sGattConns.end(); ++iter)
+    {
+        GattConnContext& conn = iter->second;
+        if(!conn.autoProfile)
+        {
+            continue;
+        }
+        any = true;
+
+        uint32_t notifications = conn.notifications - conn.tickNotifications;
+        conn.tickNotifications = conn.notifications;
+        if(notifications >= GATT_CONN_BURST_NOTIFICATIONS || IsGattConnBusy(conn.connId))
+        {
+            conn.lastBusy = now;
+            if(GATT_CONN_PROFILE_LOW_LATENCY != conn.activeProfile)
+            {
+                RequestGattConnParams(conn, kGattConnProfiles[GATT_CONN_PROFILE_LOW_LATENCY],
+                                      GATT_CONN_PROFILE_LOW_LATENCY);
+            }
+        }
+        else if(conn.profile != conn.activeProfile &&
+                (conn.lastBusy.IsNull() ||
+                 (now - conn.lastBusy).ToMilliseconds() >= GATT_CONN_IDLE_MS))
+        {
+            RequestGattConnParams(conn, kGattConnProfiles[conn.profile], conn.profile);
+        }
+    }
+
+    if(!any && sGattConnProfileTimer)
+    {
+        sGattConnProfileTimer->Cancel();
+    }
+}
+
+static void
+StartGattConnProfileTimer()
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    if(!sGattConnProfileTimer)
+    {
+        nsCOMPtr<nsITimer> timer = do_CreateInstance(NS_TIMER_CONTRACTID);
+        if(!timer)
+        {
+            LOGE("Failed to create connection profile timer");
+            return;
+        }
+        sGattConnProfileTimer = timer;
+    }
+
+    sGattConnProfileTimer->InitWithFuncCallback(GattConnProfileTimerCallback, nullptr,
+                                                GATT_CONN_PROFILE_TICK_MS,
+                                                nsITimer::TYPE_REPEATING_SLACK);
+}
+
+/**
+ * Attribute database of each peer, as discovered through search_service,
+ * get_characteristic and get_descriptor, kept per device address and
+ * persisted under GATT_CACHE_DIR. A list is only served from the cache once
+ * the stack has reported its end, so a partial walk never hides anything.
+ */
+struct GattCacheChar
+{
+  GattCacheChar()
+    : prop(0), descrsComplete(false), descrsWalking(false), descrsEndStatus(0)
+  {
+    memset(&id, 0, sizeof(id));
+  }
+
+  btgatt_gatt_id_t id;
+  int prop;
+  bool descrsComplete;
+  // A walk from the first descriptor is being recorded
+  bool descrsWalking;
+  int descrsEndStatus;
+  std::vector<btgatt_gatt_id_t> descrs;
+};
+
+struct GattCacheService
+{
+  GattCacheService()
+    : charsComplete(false), charsWalking(false), charsEndStatus(0)
+  {
+    memset(&id, 0, sizeof(id));
+  }
+
+  btgatt_srvc_id_t id;
+  bool charsComplete;
+  // A walk from the first characteristic is being recorded
+  bool charsWalking;
+  int charsEndStatus;
+  std::vector<GattCacheChar> chars;
+};
+
+struct GattCacheEntry
+{
+  GattCacheEntry() : servicesComplete(false), dirty(false) {}
+
+  bool servicesComplete;
+  // Changed since it was loaded or last saved
+  bool dirty;
+  std::vector<GattCacheService> services;
+};
+
+// Cache state of one connection
+struct GattCacheConn
+{
+  GattCacheConn() : addr(0), clientIf(0), replayed(false), filtered(false)
+  {
+    memset(&bda, 0, sizeof(bda));
+  }
+
+  uint64_t addr;
+  int clientIf;
+  bt_bdaddr_t bda;
+  // The apps got the services from the cache, the stack search that runs
+  // behind it is only checked against them
+  bool replayed;
+  // The running search_service has a filter, so it does not list them all
+  bool filtered;
+};
+
+/**
+ * When the stack is told to drop its own attribute cache through refresh().
+ * Our cache is dropped on Service Changed and on a discovery mismatch in
+ * every mode.
+ */
+enum GattRefreshPolicy {
+  // Before every disconnect, as this file always used to
+  GATT_REFRESH_ON_DISCONNECT,
+  // On Refresh, Service Changed and discovery mismatch
+  GATT_REFRESH_AUTO,
+  // On Refresh only
+  GATT_REFRESH_EXPLICIT,
+};
+
+namespace {
+static Atomic<uint32_t> sRefreshPolicy(GATT_REFRESH_AUTO);
+// Searches answered from the cache
+static Atomic<uint32_t> sCacheHits(0);
+static Atomic<uint32_t> sCacheInvalidations(0);
+// refresh() calls made on the stack, for any reason
+static Atomic<uint32_t> sRefreshIssued(0);
+// Disconnects that kept the stack's cache
+static Atomic<uint32_t> sRefreshAvoided(0);
+}
+
+namespace {
+static StaticMutex sGattCacheMutex;
+// Keyed by BdAddrKey, guarded by sGattCacheMutex
+static std::map<uint64_t, GattCacheEntry> sGattCache;
+// Keyed by conn_id, guarded by sGattCacheMutex
+static std::map<int, GattCacheConn> sGattCacheConns;
+// Peers whose file is being read, guarded by sGattCacheMutex
+static std::set<uint64_t> sGattCacheLoading;
+// Runs all cache file I/O in order, guarded by sGattCacheMutex
+static StaticRefPtr<nsIThread> sGattCacheThread;
+}
+
+// Generic Attribute service, 0x1801
+static const uint8_t kGattServiceUuid[16] = {
+    0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+    0x00, 0x10, 0x00, 0x00, 0x01, 0x18, 0x00, 0x00
+};
+
+// Service Changed characteristic, 0x2a05
+static const uint8_t kServiceChangedUuid[16] = {
+    0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+    0x00, 0x10, 0x00, 0x00, 0x05, 0x2a, 0x00, 0x00
+};
+
+/*
+ * On-disk layout, one file per address. All records have a fixed size and
+ * are stored back to back, so a mapped file is read in place:
+ *   GattCacheFileHeader
+ *   GattCacheFileService[serviceCount]
+ *   GattCacheFileChar[charCount]
+ *   GattCacheFileDescr[descrCount]
+ */
+#define GATT_CACHE_MAGIC 0x3143474f // "OGC1"
+#define GATT_CACHE_VERSION 1
+#define GATT_CACHE_FLAG_COMPLETE 0x01
+
+struct GattCacheFileHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t flags;
+  uint16_t serviceCount;
+  uint16_t charCount;
+  uint16_t descrCount;
+  uint16_t reserved;
+};
+
+struct GattCacheFileService
+{
+  uint8_t uuid[16];
+  uint8_t instId;
+  uint8_t isPrimary;
+  uint8_t endStatus;
+  uint8_t flags;
+  uint16_t firstChar;
+  uint16_t charCount;
+};
+
+struct GattCacheFileChar
+{
+  uint8_t uuid[16];
+  uint8_t instId;
+  uint8_t prop;
+  uint8_t endStatus;
+  uint8_t flags;
+  uint16_t firstDescr;
+  uint16_t descrCount;
+};
+
+struct GattCacheFileDescr
+{
+  uint8_t uuid[16];
+  uint8_t instId;
+  uint8_t reserved[3];
+};
+
+static uint64_t
+BdAddrKey(const bt_bdaddr_t* aAddr)
+{
+    uint64_t key = 0;
+    for(int i = 0; i < 6; ++i)
+    {
+        key = (key << 8) | aAddr->address[i];
+    }
+    return key;
+}
+
+static bool
+SameGattId(const btgatt_gatt_id_t& a, const btgatt_gatt_id_t& b)
+{
+    return a.inst_id == b.inst_id &&
+           !memcmp(a.uuid.uu, b.uuid.uu, sizeof(a.uuid.uu));
+}
+
+static bool
+SameSrvcId(const btgatt_srvc_id_t& a, const btgatt_srvc_id_t& b)
+{
+    return a.is_primary == b.is_primary && SameGattId(a.id, b.id);
+}
+
+static GattCacheService*
+FindCacheService(GattCacheEntry& aEntry, const btgatt_srvc_id_t& aId)
+{
+    for(size_t i = 0; i < aEntry.services.size(); ++i)
+    {
+        if(SameSrvcId(aEntry.services[i].id, aId))
+        {
+            return &aEntry.services[i];
+        }
+    }
+    return nullptr;
+}
+
+static GattCacheChar*
+FindCacheChar(GattCacheService& aService, const btgatt_gatt_id_t& aId)
+{
+    for(size_t i = 0; i < aService.chars.size(); ++i)
+    {
+        if(SameGattId(aService.chars[i].id, aId))
+        {
+            return &aService.chars[i];
+        }
+    }
+    return nullptr;
+}
+
+/* Entry of the peer behind conn_id. Must hold sGattCacheMutex. */
+static GattCacheEntry*
+GattCacheForConn(int conn_id)
+{
+    std::map<int, GattCacheConn>::iterator conn = sGattCacheConns.find(conn_id);
+    if(conn == sGattCacheConns.end())
+    {
+        return nullptr;
+    }
+    return &sGattCache[conn->second.addr];
+}
+
+static void
+GattCachePath(uint64_t aKey, char* aBuf, size_t aLen)
+{
+    snprintf(aBuf, aLen, "%s/%012llx.bin", GATT_CACHE_DIR,
+             (unsigned long long)aKey);
+}
+
+static bool
+ParseGattCache(const uint8_t* aData, size_t aSize, GattCacheEntry& aEntry)
+{
+    if(aSize < sizeof(GattCacheFileHeader))
+    {
+        return false;
+    }
+
+    const GattCacheFileHeader* header = (const GattCacheFileHeader*)aData;
+    if(GATT_CACHE_MAGIC != header->magic || GATT_CACHE_VERSION != header->version)
+    {
+        return false;
+    }
+    if(aSize != sizeof(GattCacheFileHeader) +
+                header->serviceCount * sizeof(GattCacheFileService) +
+                header->charCount * sizeof(GattCacheFileChar) +
+                header->descrCount * sizeof(GattCacheFileDescr))
+    {
+        return false;
+    }
+
+    const GattCacheFileService* services =
+        (const GattCacheFileService*)(aData + sizeof(GattCacheFileHeader));
+    const GattCacheFileChar* chars =
+        (const GattCacheFileChar*)(services + header->serviceCount);
+    const GattCacheFileDescr* descrs =
+        (const GattCacheFileDescr*)(chars + header->charCount);
+
+    std::vector<GattCacheService> parsed(header->serviceCount);
+    for(int i = 0; i < header->serviceCount; ++i)
+    {
+        const GattCacheFileService& s = services[i];
+        if(s.firstChar + s.charCount > header->charCount)
+        {
+            return false;
+        }
+
+        GattCacheService& service = parsed[i];
+        memcpy(service.id.id.uuid.uu, s.uuid, sizeof(s.uuid));
+        service.id.id.inst_id = s.instId;
+        service.id.is_primary = s.isPrimary;
+        service.charsComplete = s.flags & GATT_CACHE_FLAG_COMPLETE;
+        service.charsEndStatus = s.endStatus;
+        service.chars.resize(s.charCount);
+
+        for(int j = 0; j < s.charCount; ++j)
+        {
+            const GattCacheFileChar& c = chars[s.firstChar + j];
+            if(c.firstDescr + c.descrCount > header->descrCount)
+            {
+                return false;
+            }
+
+            GattCacheChar& ch = service.chars[j];
+            memcpy(ch.id.uuid.uu, c.uuid, sizeof(c.uuid));
+            ch.id.inst_id = c.instId;
+            ch.prop = c.prop;
+            ch.descrsComplete = c.flags & GATT_CACHE_FLAG_COMPLETE;
+            ch.descrsEndStatus = c.endStatus;
+            ch.descrs.resize(c.descrCount);
+
+            for(int k = 0; k < c.descrCount; ++k)
+            {
+                const GattCacheFileDescr& d = descrs[c.firstDescr + k];
+                memcpy(ch.descrs[k].uuid.uu, d.uuid, sizeof(d.uuid));
+                ch.descrs[k].inst_id = d.instId;
+            }
+        }
+    }
+
+    aEntry.services.swap(parsed);
+    aEntry.servicesComplete = header->flags & GATT_CACHE_FLAG_COMPLETE;
+    aEntry.dirty = false;
+    return true;
+}
+
+static bool
+LoadGattCache(uint64_t aKey, GattCacheEntry& aEntry)
+{
+    char path[PATH_MAX];
+    GattCachePath(aKey, path, sizeof(path));
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        return false;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st) < 0 || st.st_size <= 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    size_t size = st.st_size;
+    void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(MAP_FAILED == map)
+    {
+        LOGE("Failed to map GATT cache %s", path);
+        return false;
+    }
+
+    bool ok = ParseGattCache((const uint8_t*)map, size, aEntry);
+    munmap(map, size);
+
+    if(!ok)
+    {
+        LOGE("Dropping corrupt GATT cache %s", path);
+        unlink(path);
+        return false;
+    }
+
+    LOGI("Loaded GATT cache %s, %d services", path, (int)aEntry.services.size());
+    return true;
+}
+
+static void
+SaveGattCache(uint64_t aKey, const GattCacheEntry& aEntry)
+{
+    size_t charCount = 0;
+    size_t descrCount = 0;
+    for(size_t i = 0; i < aEntry.services.size(); ++i)
+    {
+        const GattCacheService& service = aEntry.services[i];
+        charCount += service.chars.size();
+        for(size_t j = 0; j < service.chars.size(); ++j)
+        {
+            descrCount += service.chars[j].descrs.size();
+        }
+    }
+    if(aEntry.services.size() > 0xFFFF || charCount > 0xFFFF || descrCount > 0xFFFF)
+    {
+        LOGE("GATT database too large to cache");
+        return;
+    }
+
+    std::vector<uint8_t> buf(sizeof(GattCacheFileHeader) +
+                             aEntry.services.size() * sizeof(GattCacheFileService) +
+                             charCount * sizeof(GattCacheFileChar) +
+                             descrCount * sizeof(GattCacheFileDescr));
+
+    GattCacheFileHeader* header = (GattCacheFileHeader*)&buf[0];
+    header->magic = GATT_CACHE_MAGIC;
+    header->version = GATT_CACHE_VERSION;
+    header->flags = aEntry.servicesComplete ? GATT_CACHE_FLAG_COMPLETE : 0;
+    header->serviceCount = aEntry.services.size();
+    header->charCount = charCount;
+    header->descrCount = descrCount;
+
+    GattCacheFileService* services = (GattCacheFileService*)(header + 1);
+    GattCacheFileChar* chars = (GattCacheFileChar*)(services + header->serviceCount);
+    GattCacheFileDescr* descrs = (GattCacheFileDescr*)(chars + charCount);
+
+    int c = 0;
+    int d = 0;
+    for(size_t i = 0; i < aEntry.services.size(); ++i)
+    {
+        const GattCacheService& service = aEntry.services[i];
+        GattCacheFileService& s = services[i];
+        memcpy(s.uuid, service.id.id.uuid.uu, sizeof(s.uuid));
+        s.instId = service.id.id.inst_id;
+        s.isPrimary = service.id.is_primary;
+        s.endStatus = service.charsEndStatus;
+        s.flags = service.charsComplete ? GATT_CACHE_FLAG_COMPLETE : 0;
+        s.firstChar = c;
+        s.charCount = service.chars.size();
+
+        for(size_t j = 0; j < service.chars.size(); ++j, ++c)
+        {
+            const GattCacheChar& ch = service.chars[j];
+            GattCacheFileChar& fc = chars[c];
+            memcpy(fc.uuid, ch.id.uuid.uu, sizeof(fc.uuid));
+            fc.instId = ch.id.inst_id;
+            fc.prop = ch.prop;
+            fc.endStatus = ch.descrsEndStatus;
+            fc.flags = ch.descrsComplete ? GATT_CACHE_FLAG_COMPLETE : 0;
+            fc.firstDescr = d;
+            fc.descrCount = ch.descrs.size();
+
+            for(size_t k = 0; k < ch.descrs.size(); ++k, ++d)
+            {
+                memcpy(descrs[d].uuid, ch.descrs[k].uuid.uu, sizeof(descrs[d].uuid));
+                descrs[d].instId = ch.descrs[k].inst_id;
+            }
+        }
+    }
+
+    char path[PATH_MAX];
+    char tmpPath[PATH_MAX];
+    GattCachePath(aKey, path, sizeof(path));
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", path);
+
+    mkdir(GATT_CACHE_DIR, 0700);
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if(fd < 0)
+    {
+        LOGE("Failed to create GATT cache %s", tmpPath);
+        return;
+    }
+
+    // Written aside and renamed so a crash never leaves a torn file
+    bool ok = write(fd, &buf[0], buf.size()) == (ssize_t)buf.size();
+    close(fd);
+    if(!ok || rename(tmpPath, path) < 0)
+    {
+        LOGE("Failed to write GATT cache %s", path);
+        unlink(tmpPath);
+        return;
+    }
+
+    LOGI("Saved GATT cache %s, %d bytes", path, (int)buf.size());
+}
+
+/*
+ * Cache file I/O, run on sGattCacheThread so that no GATT callback waits
+ * for flash. Loads, saves and deletes of a peer happen in the order they
+ * were posted.
+ */
+class GattCacheFileTask : public nsRunnable
+{
+public:
+  enum Action {
+    LOAD,
+    SAVE,
+    REMOVE
+  };
+
+  GattCacheFileTask(Action aAction, uint64_t aKey)
+    : mAction(aAction), mKey(aKey)
+  {
+  }
+
+  // Takes the entry over
+  GattCacheFileTask(uint64_t aKey, GattCacheEntry& aEntry)
+    : mAction(SAVE), mKey(aKey)
+  {
+    mEntry.services.swap(aEntry.services);
+    mEntry.servicesComplete = aEntry.servicesComplete;
+  }
+
+  nsresult Run()
+  {
+    switch(mAction)
+    {
+    case LOAD:
+    {
+        bool loaded = LoadGattCache(mKey, mEntry);
+
+        StaticMutexAutoLock lock(sGattCacheMutex);
+        // Dropped if the peer was invalidated meanwhile; what a search
+        // recorded meanwhile is newer than the file
+        if(sGattCacheLoading.erase(mKey) && loaded)
+        {
+            sGattCache.insert(std::make_pair(mKey, mEntry));
+        }
+        break;
+    }
+    case SAVE:
+        SaveGattCache(mKey, mEntry);
+        break;
+    case REMOVE:
+    {
+        char path[PATH_MAX];
+        GattCachePath(mKey, path, sizeof(path));
+        unlink(path);
+        LOGI("Invalidated GATT cache %s", path);
+        break;
+    }
+    }
+    return NS_OK;
+  }
+
+private:
+  Action mAction;
+  uint64_t mKey;
+  GattCacheEntry mEntry;
+};
+
+/* Must hold sGattCacheMutex */
+static void
+PostGattCacheTaskLocked(GattCacheFileTask* aTask)
+{
+    nsCOMPtr<nsIRunnable> task = aTask;
+    if(!sGattCacheThread)
+    {
+        LOGE("GATT cache thread is not running");
+        return;
+    }
+    sGattCacheThread->Dispatch(task, NS_DISPATCH_NORMAL);
+}
+
+/* Starts the cache I/O thread. Main thread only. */
+static void
+StartGattCacheThread()
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    nsCOMPtr<nsIThread> thread;
+    if(NS_FAILED(NS_NewNamedThread("GattCache", getter_AddRefs(thread))))
+    {
+        LOGE("Failed to start the GATT cache thread");
+        return;
+    }
+
+    StaticMutexAutoLock lock(sGattCacheMutex);
+    sGattCacheThread = thread;
+}
+
+/* Stops the cache I/O thread once the saves posted to it are done. Main thread only. */
+static void
+StopGattCacheThread()
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    nsCOMPtr<nsIThread> thread;
+    {
+        StaticMutexAutoLock lock(sGattCacheMutex);
+        thread = sGattCacheThread.get();
+        sGattCacheThread = nullptr;
+        sGattCacheLoading.clear();
+    }
+    if(thread)
+    {
+        thread->Shutdown();
+    }
+}
+
+/* Forgets everything known about a peer, in memory and on disk */
+static void
+InvalidateGattCache(uint64_t aKey)
+{
+    {
+        StaticMutexAutoLock lock(sGattCacheMutex);
+        sGattCache.erase(aKey);
+        sGattCacheLoading.erase(aKey);
+        PostGattCacheTaskLocked(new GattCacheFileTask(GattCacheFileTask::REMOVE, aKey));
+    }
+    ++sCacheInvalidations;
+}
+
+/*
+ * Drops the cache of the peer behind conn_id after it changed, and the
+ * stack's copy too unless refreshes are explicit only.
+ */
+static void
+InvalidateGattCacheForConn(int conn_id)
+{
+    GattCacheConn conn;
+    {
+        StaticMutexAutoLock lock(sGattCacheMutex);
+        std::map<int, GattCacheConn>::iterator iter = sGattCacheConns.find(conn_id);
+        if(iter == sGattCacheConns.end())
+        {
+            return;
+        }
+        conn = iter->second;
+    }
+
+    InvalidateGattCache(conn.addr);
+
+    // Read once, DeInitGattInterface may clear it meanwhile; without a stack
+    // only the cache is dropped
+    const btgatt_interface_t* gatt = sBluetoothGattInterface;
+    if(!gatt)
+    {
+        return;
+    }
+    if(GATT_REFRESH_EXPLICIT != sRefreshPolicy)
+    {
+        gatt->client->refresh(conn.clientIf, &conn.bda);
+        ++sRefreshIssued;
+    }
+}
+
+/*
+ * Binds a new connection to the cache of its peer. One not in memory is
+ * loaded from disk in the background; searches until then go to the stack.
+ */
+static void
+OpenGattCacheConn(int conn_id, int client_if, const bt_bdaddr_t* aAddr)
+{
+    uint64_t key = BdAddrKey(aAddr);
+
+    StaticMutexAutoLock lock(sGattCacheMutex);
+    GattCacheConn& conn = sGattCacheConns[conn_id];
+    conn = GattCacheConn();
+    conn.addr = key;
+    conn.clientIf = client_if;
+    memcpy(&conn.bda, aAddr, sizeof(bt_bdaddr_t));
+
+    if(sGattCache.find(key) == sGattCache.end() &&
+       sGattCacheLoading.insert(key).second)
+    {
+        PostGattCacheTaskLocked(new GattCacheFileTask(GattCacheFileTask::LOAD, key));
+    }
+}
+
+/* Unbinds a connection and saves what was learnt through it in the background */
+static void
+CloseGattCacheConn(int conn_id)
+{
+    StaticMutexAutoLock lock(sGattCacheMutex);
+    std::map<int, GattCacheConn>::iterator conn = sGattCacheConns.find(conn_id);
+    if(conn == sGattCacheConns.end())
+    {
+        return;
+    }
+    uint64_t key = conn->second.addr;
+    sGattCacheConns.erase(conn);
+
+    std::map<uint64_t, GattCacheEntry>::iterator iter = sGattCache.find(key);
+    if(iter == sGattCache.end() || !iter->second.dirty)
+    {
+        return;
+    }
+    iter->second.dirty = false;
+
+    GattCacheEntry entry = iter->second;
+    PostGattCacheTaskLocked(new GattCacheFileTask(key, entry));
+}
+
+/*
+ * Builds the search complete event for a search_service the cache can
+ * answer, or returns null if the stack has to discover the services.
+ */
+static GattEvent*
+ReplayCachedServices(int conn_id, const bt_uuid_t* aFilter)
+{
+    StaticMutexAutoLock lock(sGattCacheMutex);
+    std::map<int, GattCacheConn>::iterator conn = sGattCacheConns.find(conn_id);
+    if(conn == sGattCacheConns.end())
+    {
+        return nullptr;
+    }
+    conn->second.filtered = aFilter != nullptr;
+    conn->second.replayed = false;
+
+    GattCacheEntry& entry = sGattCache[conn->second.addr];
+    if(!entry.servicesComplete)
+    {
+        return nullptr;
+    }
+
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_SEARCH_COMPLETE);
+    event->connId = conn_id;
+    event->status = BT_STATUS_SUCCESS;
+    for(size_t i = 0; i < entry.services.size(); ++i)
+    {
+        const btgatt_srvc_id_t& id = entry.services[i].id;
+        if(!aFilter || !memcmp(id.id.uuid.uu, aFilter->uu, sizeof(aFilter->uu)))
+        {
+            event->services.push_back(id);
+        }
+    }
+
+    conn->second.replayed = true;
+    ++sCacheHits;
+    return event;
+}
+
+/* Undoes ReplayCachedServices when the stack refused the search */
+static void
+CancelCachedServices(int conn_id)
+{
+    StaticMutexAutoLock lock(sGattCacheMutex);
+    std::map<int, GattCacheConn>::iterator conn = sGattCacheConns.find(conn_id);
+    if(conn != sGattCacheConns.end())
+    {
+        conn->second.replayed = false;
+    }
+}
+
+/*
+ * Takes in the result of a search_service. Returns true if the apps were
+ * already answered from the cache and agree with the stack, in which case
+ * the result must not be sent again.
+ */
+static bool
+RecordCachedServices(int conn_id, int status,
+        const std::vector<btgatt_srvc_id_t>& aServices)
+{
+    {
+        StaticMutexAutoLock lock(sGattCacheMutex);
+        std::map<int, GattCacheConn>::iterator conn = sGattCacheConns.find(conn_id);
+        if(conn == sGattCacheConns.end())
+        {
+            return false;
+        }
+
+        GattCacheEntry& entry = sGattCache[conn->second.addr];
+        bool replayed = conn->second.replayed;
+        conn->second.replayed = false;
+
+        if(BT_STATUS_SUCCESS != status)
+        {
+            if(replayed)
+            {
+                LOGE("Search behind cached services of conn_id:%d failed:%d", conn_id, status);
+            }
+            return replayed;
+        }
+
+        bool same = conn->second.filtered ||
+                    aServices.size() == entry.services.size();
+        for(size_t i = 0; same && i < aServices.size(); ++i)
+        {
+            same = FindCacheService(entry, aServices[i]) != nullptr;
+        }
+
+        if(same && (replayed || entry.servicesComplete))
+        {
+            return replayed;
+        }
+        if(conn->second.filtered)
+        {
+            return false;
+        }
+
+        if(!replayed)
+        {
+            // First full search of this peer, or it has changed since.
+            // Services that are still there keep what is known about them.
+            std::vector<GattCacheService> services(aServices.size());
+            for(size_t i = 0; i < aServices.size(); ++i)
+            {
+                GattCacheService* known = FindCacheService(entry, aServices[i]);
+                if(known)
+                {
+                    services[i] = *known;
+                }
+                services[i].id = aServices[i];
+            }
+            entry.services.swap(services);
+            entry.servicesComplete = true;
+            entry.dirty = true;
+            return false;
+        }
+    }
+
+    LOGW("GATT database of conn_id:%d differs from the cache", conn_id);
+    InvalidateGattCacheForConn(conn_id);
+    return false;
+}
+
+/*
+ * Answers get_characteristic from the cache, or returns null if the
+ * characteristics of that service have not been fully discovered yet.
+ */
+static GattEvent*
+ReplayCachedCharacteristic(int conn_id, const btgatt_srvc_id_t* srvc_id,
+        const btgatt_gatt_id_t* start_char_id)
+{
+    StaticMutexAutoLock lock(sGattCacheMutex);
+    GattCacheEntry* entry = GattCacheForConn(conn_id);
+    GattCacheService* service = entry ? FindCacheService(*entry, *srvc_id) : nullptr;
+    if(!service)
+    {
+        return nullptr;
+    }
+
+    if(!service->charsComplete)
+    {
+        if(!start_char_id)
+        {
+            service->chars.clear();
+            service->charsWalking = true;
+        }
+        return nullptr;
+    }
+
+    size_t next = 0;
+    if(start_char_id)
+    {
+        while(next < service->chars.size() &&
+              !SameGattId(service->chars[next].id, *start_char_id))
+        {
+            ++next;
+        }
+        if(next == service->chars.size())
+        {
+            return nullptr;
+        }
+        ++next;
+    }
+
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_GET_CHARACTERISTIC);
+    event->connId = conn_id;
+    event->srvcId = *srvc_id;
+    if(next < service->chars.size())
+    {
+        event->status = BT_STATUS_SUCCESS;
+        event->charId = service->chars[next].id;
+        event->charProp = service->chars[next].prop;
+    }
+    else
+    {
+        event->status = service->charsEndStatus;
+    }
+    return event;
+}
+
+static void
+RecordCachedCharacteristic(int conn_id, int status, const btgatt_srvc_id_t* srvc_id,
+        const btgatt_gatt_id_t* char_id, int char_prop)
+{
+    if(!srvc_id)
+    {
+        return;
+    }
+
+    StaticMutexAutoLock lock(sGattCacheMutex);
+    GattCacheEntry* entry = GattCacheForConn(conn_id);
+    GattCacheService* service = entry ? FindCacheService(*entry, *srvc_id) : nullptr;
+    if(!service || !service->charsWalking)
+    {
+        return;
+    }
+
+    if(BT_STATUS_SUCCESS == status && char_id)
+    {
+        if(!FindCacheChar(*service, *char_id))
+        {
+            GattCacheChar ch;
+            ch.id = *char_id;
+            ch.prop = char_prop;
+            service->chars.push_back(ch);
+        }
+        return;
+    }
+
+    service->charsWalking = false;
+    service->charsComplete = true;
+    service->charsEndStatus = status;
+    entry->dirty = true;
+}
+
+/*
+ * Answers get_descriptor from the cache, or returns null if the
+ * descriptors of that characteristic have not been fully discovered yet.
+ */
+static GattEvent*
+ReplayCachedDescriptor(int conn_id, const btgatt_srvc_id_t* srvc_id,
+        const btgatt_gatt_id_t* char_id, const btgatt_gatt_id_t* start_descr_id)
+{
+    StaticMutexAutoLock lock(sGattCacheMutex);
+    GattCacheEntry* entry = GattCacheForConn(conn_id);
+    GattCacheService* service = entry ? FindCacheService(*entry, *srvc_id) : nullptr;
+    GattCacheChar* ch = service ? FindCacheChar(*service, *char_id) : nullptr;
+    if(!ch)
+    {
+        return nullptr;
+    }
+
+    if(!ch->descrsComplete)
+    {
+        if(!start_descr_id)
+        {
+            ch->descrs.clear();
+            ch->descrsWalking = true;
+        }
+        return nullptr;
+    }
+
+    size_t next = 0;
+    if(start_descr_id)
+    {
+        while(next < ch->descrs.size() &&
+              !SameGattId(ch->descrs[next], *start_descr_id))
+        {
+            ++next;
+        }
+        if(next == ch->descrs.size())
+        {
+            return nullptr;
+        }
+        ++next;
+    }
+
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_GET_DESCRIPTOR);
+    event->connId = conn_id;
+    event->srvcId = *srvc_id;
+    event->charId = *char_id;
+    if(next < ch->descrs.size())
+    {
+        event->status = BT_STATUS_SUCCESS;
+        event->descrId = ch->descrs[next];
+    }
+    else
+    {
+        event->status = ch->descrsEndStatus;
+    }
+    return event;
+}
+
+static void
+RecordCachedDescriptor(int conn_id, int status, const btgatt_srvc_id_t* srvc_id,
+        const btgatt_gatt_id_t* char_id, const btgatt_gatt_id_t* descr_id)
+{
+    if(!srvc_id || !char_id)
+    {
+        return;
+    }
+
+    StaticMutexAutoLock lock(sGattCacheMutex);
+    GattCacheEntry* entry = GattCacheForConn(conn_id);
+    GattCacheService* service = entry ? FindCacheService(*entry, *srvc_id) : nullptr;
+    GattCacheChar* ch = service ? FindCacheChar(*service, *char_id) : nullptr;
+    if(!ch || !ch->descrsWalking)
+    {
+        return;
+    }
+
+    if(BT_STATUS_SUCCESS == status && descr_id)
+    {
+        for(size_t i = 0; i < ch->descrs.size(); ++i)
+        {
+            if(SameGattId(ch->descrs[i], *descr_id))
+            {
+                return;
+            }
+        }
+        ch->descrs.push_back(*descr_id);
+        return;
+    }
+
+    ch->descrsWalking = false;
+    ch->descrsComplete = true;
+    ch->descrsEndStatus = status;
+    entry->dirty = true;
+}
+
+/* True for a Service Changed indication, after which the cache is stale */
+static bool
+IsServiceChanged(const btgatt_notify_params_t& aParams)
+{
+    return !memcmp(aParams.srvc_id.id.uuid.uu, kGattServiceUuid, sizeof(kGattServiceUuid)) &&
+           !memcmp(aParams.char_id.uuid.uu, kServiceChangedUuid, sizeof(kServiceChangedUuid));
+}
+
+/**
+ * Links kept up natively for the apps. While a target's link is down a
+ * background connect stays pending in the stack, so the controller opens
+ * the link on the first advertisement of the device without a round trip
+ * through the apps. A connect the stack refuses or fails is retried with
+ * exponential backoff. The notification registrations and CCCD values the
+ * apps set on a target are remembered and restored once it is back.
+ */
+struct GattNotifyRegistration
+{
+  btgatt_srvc_id_t srvcId;
+  btgatt_gatt_id_t charId;
+};
+
+struct GattRestoreCccd
+{
+  btgatt_srvc_id_t srvcId;
+  btgatt_gatt_id_t charId;
+  btgatt_gatt_id_t descrId;
+  int authReq;
+  uint8_t value[2];
+};
+
+struct GattReconnectTarget
+{
+  GattReconnectTarget()
+    : clientIf(0), connId(0), backoffMs(0), attempts(0), restoreAttempts(0),
+      restorePending(0), restored(0)
+  {
+    memset(&bda, 0, sizeof(bda));
+  }
+
+  // App the link is kept up for
+  int clientIf;
+  bt_bdaddr_t bda;
+  // conn_id while the link is up, 0 otherwise
+  int connId;
+  // Delay of the next retry, doubled by each failure
+  uint32_t backoffMs;
+  // Null unless a retry is scheduled
+  TimeStamp retryAt;
+  // Connects issued since the link went down
+  uint32_t attempts;
+  // Of the reconnect being restored: connects it took, registrations and
+  // CCCD writes not answered yet, and those that succeeded
+  uint32_t restoreAttempts;
+  uint32_t restorePending;
+  uint32_t restored;
+  std::vector<GattNotifyRegistration> registrations;
+  std::vector<GattRestoreCccd> cccds;
+};
+
+// A search issued to restore a target, which app searches join
+struct GattRestoreSearch
+{
+  GattRestoreSearch() : appWaiting(false), hasFilter(false)
+  {
+    memset(&filter, 0, sizeof(filter));
+  }
+
+  bool appWaiting;
+  bool hasFilter;
+  bt_uuid_t filter;
+};
+
+namespace {
+// Keyed by BdAddrKey, main thread only
+static std::map<uint64_t, GattReconnectTarget> sReconnectTargets;
+static StaticRefPtr<nsITimer> sReconnectTimer;
+static StaticMutex sRestoreMutex;
+// Keyed by conn_id, guarded by sRestoreMutex
+static std::map<int, GattRestoreSearch> sRestoreSearches;
+// Registrations whose callback is not for the apps, guarded by sRestoreMutex
+static std::vector<std::pair<int, GattNotifyRegistration> > sRestoreRegistrations;
+}
+
+static GattReconnectTarget*
+FindReconnectTarget(const bt_bdaddr_t* aBda)
+{
+    std::map<uint64_t, GattReconnectTarget>::iterator iter =
+        sReconnectTargets.find(BdAddrKey(aBda));
+    return iter != sReconnectTargets.end() ? &iter->second : nullptr;
+}
+
+static GattReconnectTarget*
+FindReconnectTargetByConn(int conn_id)
+{
+    std::map<uint64_t, GattReconnectTarget>::iterator iter;
+    for(iter = sReconnectTargets.begin(); iter != sReconnectTargets.end(); ++iter)
+    {
+        if(conn_id && iter->second.connId == conn_id)
+        {
+            return &iter->second;
+        }
+    }
+    return nullptr;
+}
+
+static void StartReconnect(GattReconnectTarget& aTarget);
+
+static void
+ReconnectTimerCallback(nsITimer* aTimer, void* aClosure);
+
+/* Arms the retry timer for the earliest scheduled retry, if any */
+static void
+ArmReconnectTimer()
+{
+    TimeStamp next;
+    std::map<uint64_t, GattReconnectTarget>::iterator iter;
+    for(iter = sReconnectTargets.begin(); iter != sReconnectTargets.end(); ++iter)
+    {
+        const TimeStamp& retryAt = iter->second.retryAt;
+        if(!retryAt.IsNull() && (next.IsNull() || retryAt < next))
+        {
+            next = retryAt;
+        }
+    }
+
+    if(next.IsNull())
+    {
+        if(sReconnectTimer)
+        {
+            sReconnectTimer->Cancel();
+        }
+        return;
+    }
+
+    if(!sReconnectTimer)
+    {
+        nsCOMPtr<nsITimer> timer = do_CreateInstance(NS_TIMER_CONTRACTID);
+        if(!timer)
+        {
+            LOGE("Failed to create the reconnect timer");
+            return;
+        }
+        sReconnectTimer = timer;
+    }
+
+    double delayMs = (next - TimeStamp::Now()).ToMilliseconds();
+    sReconnectTimer->InitWithFuncCallback(ReconnectTimerCallback, nullptr,
+            delayMs > 0 ? (uint32_t)delayMs : 0, nsITimer::TYPE_ONE_SHOT);
+}
+
+static void
+ScheduleReconnect(GattReconnectTarget& aTarget)
+{
+    aTarget.backoffMs = aTarget.backoffMs ?
+        std::min<uint32_t>(aTarget.backoffMs * 2, GATT_RECONNECT_MAX_BACKOFF_MS) :
+        GATT_RECONNECT_MIN_BACKOFF_MS;
+    aTarget.retryAt = TimeStamp::Now() + TimeDuration::FromMilliseconds(aTarget.backoffMs);
+    LOGI("Reconnect of client_if:%d retried in %u ms", aTarget.clientIf, aTarget.backoffMs);
+    ArmReconnectTimer();
+}
+
+/* Leaves a background connect pending for a target whose link is down */
+static void
+StartReconnect(GattReconnectTarget& aTarget)
+{
+    if(!sBluetoothGattInterface)
+    {
+        // Nothing to reconnect through any more; aTarget is gone on return
+        LOGE("No GATT interface, dropping the auto-reconnect of client_if:%d", aTarget.clientIf);
+        sReconnectTargets.erase(BdAddrKey(&aTarget.bda));
+        return;
+    }
+
+    ++aTarget.attempts;
+    aTarget.retryAt = TimeStamp();
+    if(BT_STATUS_SUCCESS ==
+       sBluetoothGattInterface->client->connect(aTarget.clientIf, &aTarget.bda, false))
+    {
+        return;
+    }
+
+    LOGE("Background connect of client_if:%d refused", aTarget.clientIf);
+    ScheduleReconnect(aTarget);
+}
+
+static void
+ReconnectTimerCallback(nsITimer* aTimer, void* aClosure)
+{
+    // Fired after the stack went down: the targets cannot be reconnected
+    if(!sBluetoothGattInterface)
+    {
+        sReconnectTargets.clear();
+        return;
+    }
+
+    TimeStamp now = TimeStamp::Now();
+    std::map<uint64_t, GattReconnectTarget>::iterator iter;
+    for(iter = sReconnectTargets.begin(); iter != sReconnectTargets.end(); ++iter)
+    {
+        GattReconnectTarget& target = iter->second;
+        if(!target.connId && !target.retryAt.IsNull() && target.retryAt <= now)
+        {
+            StartReconnect(target);
+        }
+    }
+    ArmReconnectTimer();
+}
+
+/*
+ * Starts or stops keeping the link of a client to aBda up. A device is
+ * the target of a single client. Returns false if it belongs to another.
+ */
+static bool
+SetReconnectTarget(int client_if, const bt_bdaddr_t* aBda, bool aEnable)
+{
+    uint64_t key = BdAddrKey(aBda);
+    if(!sBluetoothGattInterface)
+    {
+        LOGE("sBluetoothGattInterface is null");
+        sReconnectTargets.erase(key);
+        return false;
+    }
+
+    std::map<uint64_t, GattReconnectTarget>::iterator iter = sReconnectTargets.find(key);
+    if(!aEnable)
+    {
+        if(iter == sReconnectTargets.end())
+        {
+            return true;
+        }
+        if(iter->second.clientIf != client_if)
+        {
+            LOGE("Auto-reconnect target belongs to client_if:%d", iter->second.clientIf);
+            return false;
+        }
+        if(!iter->second.connId)
+        {
+            // conn_id 0 cancels the pending background connect
+            sBluetoothGattInterface->client->disconnect(client_if, aBda, 0);
+        }
+        sReconnectTargets.erase(iter);
+        ArmReconnectTimer();
+        return true;
+    }
+
+    if(iter != sReconnectTargets.end())
+    {
+        if(iter->second.clientIf != client_if)
+        {
+            LOGE("Auto-reconnect target belongs to client_if:%d", iter->second.clientIf);
+            return false;
+        }
+        return true;
+    }
+
+    GattReconnectTarget& target = sReconnectTargets[key];
+    target.clientIf = client_if;
+    target.bda = *aBda;
+
+    // A link the client already has is adopted as it is
+    std::map<int, GattConnContext>::iterator conn;
+    for(conn = sGattConns.begin(); conn != sGattConns.end(); ++conn)
+    {
+        if(conn->second.clientIf == client_if &&
+           !memcmp(&conn->second.bda, aBda, sizeof(bt_bdaddr_t)))
+        {
+            target.connId = conn->first;
+            break;
+        }
+    }
+    if(!target.connId)
+    {
+        StartReconnect(target);
+    }
+    return true;
+}
+
+/* Ends auto-reconnect of a device its client disconnects explicitly */
+static void
+ForgetReconnectTarget(int client_if, const bt_bdaddr_t* aBda)
+{
+    std::map<uint64_t, GattReconnectTarget>::iterator iter =
+        sReconnectTargets.find(BdAddrKey(aBda));
+    if(iter != sReconnectTargets.end() && iter->second.clientIf == client_if)
+    {
+        sReconnectTargets.erase(iter);
+        ArmReconnectTimer();
+    }
+}
+
+/* Drops the targets of a client that goes away, as the stack does its connects */
+static void
+RemoveReconnectTargets(int client_if)
+{
+    std::map<uint64_t, GattReconnectTarget>::iterator iter = sReconnectTargets.begin();
+    while(iter != sReconnectTargets.end())
+    {
+        if(iter->second.clientIf == client_if)
+        {
+            sReconnectTargets.erase(iter++);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+    ArmReconnectTimer();
+}
+
+/* Remembers a notification (de)registration the apps made on a target */
+static void
+TrackTargetRegistration(const BluetoothGattRequest& aRequest, bool aRegister)
+{
+    // Only those of the client the link is kept up for are replayed as its own
+    GattReconnectTarget* target = FindReconnectTarget(&aRequest.bdAddr);
+    if(!target || target->clientIf != aRequest.clientIf)
+    {
+        return;
+    }
+
+    std::vector<GattNotifyRegistration>& regs = target->registrations;
+    size_t i = 0;
+    while(i < regs.size() &&
+          !(SameSrvcId(regs[i].srvcId, aRequest.srvcId) &&
+            SameGattId(regs[i].charId, aRequest.charId)))
+    {
+        ++i;
+    }
+
+    if(aRegister && i == regs.size())
+    {
+        GattNotifyRegistration reg;
+        reg.srvcId = aRequest.srvcId;
+        reg.charId = aRequest.charId;
+        regs.push_back(reg);
+    }
+    else if(!aRegister && i < regs.size())
+    {
+        regs.erase(regs.begin() + i);
+    }
+}
+
+/* Remembers the value the apps write to a CCCD of a target, 0 forgets it */
+static void
+TrackTargetCccd(const BluetoothGattRequest& aRequest)
+{
+    if(memcmp(aRequest.descrId.uuid.uu, kCccdUuid, sizeof(kCccdUuid)) ||
+       aRequest.value.Length() != 2)
+    {
+        return;
+    }
+    GattReconnectTarget* target = FindReconnectTargetByConn(aRequest.connId);
+    if(!target)
+    {
+        return;
+    }
+
+    std::vector<GattRestoreCccd>& cccds = target->cccds;
+    size_t i = 0;
+    while(i < cccds.size() &&
+          !(SameSrvcId(cccds[i].srvcId, aRequest.srvcId) &&
+            SameGattId(cccds[i].charId, aRequest.charId) &&
+            SameGattId(cccds[i].descrId, aRequest.descrId)))
+    {
+        ++i;
+    }
+
+    if(!aRequest.value[0] && !aRequest.value[1])
+    {
+        if(i < cccds.size())
+        {
+            cccds.erase(cccds.begin() + i);
+        }
+        return;
+    }
+
+    if(i == cccds.size())
+    {
+        cccds.push_back(GattRestoreCccd());
+        cccds[i].srvcId = aRequest.srvcId;
+        cccds[i].charId = aRequest.charId;
+        cccds[i].descrId = aRequest.descrId;
+    }
+    cccds[i].authReq = aRequest.authReq;
+    cccds[i].value[0] = aRequest.value[0];
+    cccds[i].value[1] = aRequest.value[1];
+}
+
+/* Reports a reconnect once everything it restored was answered */
+static void
+SendAutoReconnectCallback(const GattReconnectTarget& aTarget)
+{
+    nsAutoString callbackName;
+    callbackName.AssignLiteral(BLEGATT_AUTO_RECONNECT_ID);
+    nsString data_conn_id;
+    data_conn_id.AppendInt(aTarget.connId);
+    nsString data_client_if;
+    data_client_if.AppendInt(aTarget.clientIf);
+    nsString data_bda;
+    BdAddressTypeToString(&aTarget.bda, data_bda);
+    nsString data_attempts;
+    data_attempts.AppendInt(aTarget.restoreAttempts);
+    nsString data_restored;
+    data_restored.AppendInt(aTarget.restored);
+
+    InfallibleTArray<BluetoothNamedValue> data;
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CLIENTIF), data_client_if));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_BDA), data_bda));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_ATTEMPTS), data_attempts));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_RESTORED), data_restored));
+
+    DistributeGattSignal(data);
+}
+
+/*
+ * Accounts for aCount registrations or CCCD writes restored on conn_id,
+ * and reports the reconnect once none is left. Main thread only.
+ */
+static void
+NoteRestoreResult(int conn_id, bool aOk, uint32_t aCount)
+{
+    GattReconnectTarget* target = FindReconnectTargetByConn(conn_id);
+    if(!target || !target->restorePending)
+    {
+        return;
+    }
+
+    aCount = std::min(aCount, target->restorePending);
+    target->restorePending -= aCount;
+    if(aOk)
+    {
+        target->restored += aCount;
+    }
+    if(!target->restorePending)
+    {
+        SendAutoReconnectCallback(*target);
+    }
+}
+
+/*
+ * Takes over a target's link once it is up, or schedules a retry if the
+ * background connect failed. Registrations go back at once. The CCCDs
+ * wait for the stack to rediscover the device, which the operations of
+ * the link are gated on in the meantime.
+ */
+static void
+OnReconnectTargetConnected(int conn_id, int status, int client_if, const bt_bdaddr_t* aBda)
+{
+    GattReconnectTarget* target = FindReconnectTarget(aBda);
+    if(!target || target->clientIf != client_if)
+    {
+        return;
+    }
+    if(BT_STATUS_SUCCESS != status)
+    {
+        LOGE("Background connect of client_if:%d failed:%d", client_if, status);
+        ScheduleReconnect(*target);
+        return;
+    }
+
+    uint32_t attempts = target->attempts;
+    target->connId = conn_id;
+    target->backoffMs = 0;
+    target->retryAt = TimeStamp();
+    target->attempts = 0;
+    if(!attempts)
+    {
+        // A link the apps opened themselves, nothing to restore
+        return;
+    }
+
+    // Counted as pending up front so no early answer reports the reconnect
+    target->restoreAttempts = attempts;
+    target->restorePending = target->registrations.size() + target->cccds.size() + 1;
+    target->restored = 0;
+
+    const btgatt_client_interface_t* client = sBluetoothGattInterface->client;
+    for(size_t i = 0; i < target->registrations.size(); ++i)
+    {
+        // Submitted as the app's own request, which is already tracked
+        BluetoothGattRequest request(BleFunType_registerForNotification);
+        request.clientIf = client_if;
+        request.bdAddr = target->bda;
+        request.srvcId = target->registrations[i].srvcId;
+        request.charId = target->registrations[i].charId;
+        {
+            StaticMutexAutoLock lock(sRestoreMutex);
+            sRestoreRegistrations.push_back(std::make_pair(conn_id, target->registrations[i]));
+        }
+        if(!BluetoothGattSubmitRequest(request))
+        {
+            LOGE("Restoring a registration on conn_id:%d refused", conn_id);
+            {
+                StaticMutexAutoLock lock(sRestoreMutex);
+                sRestoreRegistrations.pop_back();
+            }
+            NoteRestoreResult(conn_id, false, 1);
+        }
+    }
+
+    if(!target->cccds.empty())
+    {
+        {
+            StaticMutexAutoLock lock(sRestoreMutex);
+            sRestoreSearches[conn_id] = GattRestoreSearch();
+        }
+        SetGattOpGate(conn_id, true);
+        if(BT_STATUS_SUCCESS != client->search_service(conn_id, NULL))
+        {
+            LOGE("Rediscovering conn_id:%d refused", conn_id);
+            {
+                StaticMutexAutoLock lock(sRestoreMutex);
+                sRestoreSearches.erase(conn_id);
+            }
+            SetGattOpGate(conn_id, false);
+            NoteRestoreResult(conn_id, false, target->cccds.size());
+        }
+    }
+
+    NoteRestoreResult(conn_id, true, 1);
+}
+
+/* Leaves a background connect pending again as soon as a target drops */
+static void
+OnReconnectTargetDisconnected(int conn_id)
+{
+    GattReconnectTarget* target = FindReconnectTargetByConn(conn_id);
+    if(!target)
+    {
+        return;
+    }
+
+    target->connId = 0;
+    target->backoffMs = 0;
+    target->attempts = 0;
+    // What was still being restored went down with the link
+    target->restorePending = 0;
+    StartReconnect(*target);
+}
+
+/*
+ * Hands a restore search running on conn_id to an app search instead of
+ * issuing another. Returns false if none is running. Any thread.
+ */
+static bool
+JoinRestoreSearch(int conn_id, const bt_uuid_t* aFilter)
+{
+    StaticMutexAutoLock lock(sRestoreMutex);
+    std::map<int, GattRestoreSearch>::iterator iter = sRestoreSearches.find(conn_id);
+    if(iter == sRestoreSearches.end())
+    {
+        return false;
+    }
+
+    iter->second.appWaiting = true;
+    iter->second.hasFilter = aFilter != NULL;
+    if(aFilter)
+    {
+        iter->second.filter = *aFilter;
+    }
+    return true;
+}
+
+static bool
+TakeRestoreSearch(int conn_id, GattRestoreSearch& aSearch)
+{
+    StaticMutexAutoLock lock(sRestoreMutex);
+    std::map<int, GattRestoreSearch>::iterator iter = sRestoreSearches.find(conn_id);
+    if(iter == sRestoreSearches.end())
+    {
+        return false;
+    }
+
+    aSearch = iter->second;
+    sRestoreSearches.erase(iter);
+    return true;
+}
+
+/* True for the callback of a registration restored on conn_id, which is consumed */
+static bool
+TakeRestoreRegistration(int conn_id, const btgatt_srvc_id_t& aSrvcId,
+                        const btgatt_gatt_id_t& aCharId)
+{
+    StaticMutexAutoLock lock(sRestoreMutex);
+    std::vector<std::pair<int, GattNotifyRegistration> >::iterator iter;
+    for(iter = sRestoreRegistrations.begin(); iter != sRestoreRegistrations.end(); ++iter)
+    {
+        if(iter->first == conn_id && SameSrvcId(iter->second.srvcId, aSrvcId) &&
+           SameGattId(iter->second.charId, aCharId))
+        {
+            sRestoreRegistrations.erase(iter);
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Forgets what was being restored on a link that went down. Any thread. */
+static void
+DropRestoreState(int conn_id)
+{
+    StaticMutexAutoLock lock(sRestoreMutex);
+    sRestoreSearches.erase(conn_id);
+
+    std::vector<std::pair<int, GattNotifyRegistration> >::iterator iter =
+        sRestoreRegistrations.begin();
+    while(iter != sRestoreRegistrations.end())
+    {
+        if(iter->first == conn_id)
+        {
+            iter = sRestoreRegistrations.erase(iter);
+        }
+        else
+        {
+            ++iter;
+        }
+    }
+}
+
+/* Writes the remembered CCCDs of a target back once it is rediscovered */
+static void
+RestoreTargetCccds(int conn_id, int status)
+{
+    GattReconnectTarget* target = FindReconnectTargetByConn(conn_id);
+    if(!target)
+    {
+        return;
+    }
+    if(BT_STATUS_SUCCESS != status)
+    {
+        LOGE("Rediscovering conn_id:%d failed:%d", conn_id, status);
+        NoteRestoreResult(conn_id, false, target->cccds.size());
+        return;
+    }
+
+    for(size_t i = 0; i < target->cccds.size(); ++i)
+    {
+        const GattRestoreCccd& cccd = target->cccds[i];
+        GattOp op;
+        op.type = GATT_OP_RESTORE_DESCRIPTOR;
+        op.priority = GATT_OP_PRIORITY_HIGH;
+        op.connId = conn_id;
+        op.srvcId = cccd.srvcId;
+        op.charId = cccd.charId;
+        op.descrId = cccd.descrId;
+        op.writeType = GATT_WRITE_TYPE_DEFAULT;
+        op.authReq = cccd.authReq;
+        op.value.AppendElements(cccd.value, 2);
+        if(!SubmitGattOp(op))
+        {
+            NoteRestoreResult(conn_id, false, 1);
+        }
+    }
+}
+
+/*
+ * Carries to the main thread the end of a restore search, or the answer
+ * to a restored registration or CCCD write when aSearch is false.
+ */
+class GattRestoreTask : public nsRunnable
+{
+public:
+  GattRestoreTask(int aConnId, int aStatus, bool aSearch)
+    : mConnId(aConnId), mStatus(aStatus), mSearch(aSearch)
+  {
+  }
+
+  nsresult Run()
+  {
+    if(mSearch)
+    {
+      RestoreTargetCccds(mConnId, mStatus);
+    }
+    else
+    {
+      NoteRestoreResult(mConnId, BT_STATUS_SUCCESS == mStatus, 1);
+    }
+    return NS_OK;
+  }
+
+private:
+  int mConnId;
+  int mStatus;
+  bool mSearch;
+};
+
+/**
+ * Per-device state of a running scan. By default only the first
+ * advertisement of a device is reported. With streaming on, a device is
+ * reported again at most every sScanUpdateIntervalMs, or sooner when its
+ * smoothed RSSI moved by sScanRssiDelta, but never more often than
+ * GATT_SCAN_MIN_UPDATE_MS.
+ */
+struct GattScanDevice
+{
+  GattScanDevice()
+    : used(false), hash(0), smoothedRssi(0), reportedRssi(0), lastRssi(0),
+      advCount(0), flags(0), beaconType(GATT_BEACON_NONE), uuidCount(0),
+      companyId(-1)
+  {
+    memset(&bda, 0, sizeof(bda));
+  }
+
+  bool used;
+  uint32_t hash;
+  bt_bdaddr_t bda;
+  // Exponentially weighted RSSI, in 1/16 dBm
+  int smoothedRssi;
+  int reportedRssi;
+  int lastRssi;
+  TimeStamp lastReport;
+  TimeStamp lastSeen;
+  // Summary of the last advertisement
+  uint32_t advCount;
+  uint8_t flags;
+  uint8_t beaconType;
+  uint8_t uuidCount;
+  // -1 without manufacturer data
+  int companyId;
+};
+
+enum GattScanReport {
+  GATT_SCAN_REPORT_NONE,
+  // First advertisement of the device in this scan
+  GATT_SCAN_REPORT_NEW,
+  GATT_SCAN_REPORT_UPDATE,
+};
+
+namespace {
+// 0 reports each device once per scan
+static Atomic<uint32_t> sScanUpdateIntervalMs(0);
+// 0 disables RSSI-triggered updates
+static Atomic<uint32_t> sScanRssiDelta(GATT_SCAN_DEFAULT_RSSI_DELTA);
+// Weight of a new sample in the smoothed RSSI, in percent
+static Atomic<uint32_t> sScanRssiWeight(GATT_SCAN_DEFAULT_RSSI_WEIGHT);
+static StaticMutex sScanMutex;
+/*
+ * Open-addressing table with linear probing, a power of two in size and
+ * at most 3/4 full. Guarded by sScanMutex, like everything below.
+ */
+static std::vector<GattScanDevice> sScanDevices;
+static uint32_t sScanDeviceCount;
+// Devices kept before the stalest of a few is evicted for a new one
+static uint32_t sScanDeviceCapacity = DEFAULT_SCAN_DEVICES;
+// A device not seen for this long is forgotten, 0 keeps it for the scan
+static uint32_t sScanDeviceMaxAgeMs;
+// Where the next eviction looks for a victim
+static uint32_t sScanEvictCursor;
+}
+
+/* Must hold sScanMutex */
+static void
+ResetScanDevicesLocked()
+{
+    uint32_t size = 4;
+    while(size * 3 < sScanDeviceCapacity * 4)
+    {
+        size <<= 1;
+    }
+    sScanDevices.assign(size, GattScanDevice());
+    sScanDeviceCount = 0;
+    sScanEvictCursor = 0;
+}
+
+static void
+ResetScanDevices()
+{
+    StaticMutexAutoLock lock(sScanMutex);
+    ResetScanDevicesLocked();
+}
+
+/* Sets the table size and entry lifetime, which drops every entry */
+static void
+SetScanDeviceTable(uint32_t aCapacity, uint32_t aMaxAgeMs)
+{
+    StaticMutexAutoLock lock(sScanMutex);
+    sScanDeviceCapacity = aCapacity;
+    sScanDeviceMaxAgeMs = aMaxAgeMs;
+    ResetScanDevicesLocked();
+}
+
+static uint32_t
+ScanDeviceHash(const bt_bdaddr_t* bda)
+{
+    return HashBytes(bda->address, sizeof(bda->address));
+}
+
+/* Must hold sScanMutex */
+static bool
+IsScanDeviceExpired(const GattScanDevice& aDevice, const TimeStamp& aNow)
+{
+    return sScanDeviceMaxAgeMs &&
+           (aNow - aDevice.lastSeen).ToMilliseconds() >= sScanDeviceMaxAgeMs;
+}
+
+/*
+ * Empties a slot and shifts the entries probing past it back, so lookups
+ * need no tombstones. Must hold sScanMutex.
+ */
+static void
+RemoveScanDevice(uint32_t aIndex)
+{
+    uint32_t mask = sScanDevices.size() - 1;
+    uint32_t hole = aIndex;
+    for(uint32_t i = (hole + 1) & mask; sScanDevices[i].used; i = (i + 1) & mask)
+    {
+        // Entries whose home lies cyclically in (hole, i] stay put
+        uint32_t home = sScanDevices[i].hash & mask;
+        bool stays = hole <= i ? (hole < home && home <= i) : (hole < home || home <= i);
+        if(!stays)
+        {
+            sScanDevices[hole] = sScanDevices[i];
+            hole = i;
+        }
+    }
+    sScanDevices[hole] = GattScanDevice();
+    --sScanDeviceCount;
+}
+
+/*
+ * Makes room for a new device by evicting the stalest of the next few
+ * occupied slots, an approximation of LRU at constant cost. Must hold
+ * sScanMutex.
+ */
+static void
+EvictStalestScanDevice()
+{
+    uint32_t mask = sScanDevices.size() - 1;
+    int stalest = -1;
+    for(uint32_t n = 0, seen = 0; n <= mask && seen < GATT_SCAN_EVICT_SAMPLES; ++n)
+    {
+        uint32_t i = (sScanEvictCursor + n) & mask;
+        if(!sScanDevices[i].used)
+        {
+            continue;
+        }
+        ++seen;
+        if(stalest < 0 || sScanDevices[i].lastSeen < sScanDevices[stalest].lastSeen)
+        {
+            stalest = i;
+        }
+    }
+    if(stalest >= 0)
+    {
+        sScanEvictCursor = stalest + 1;
+        RemoveScanDevice(stalest);
+    }
+}
+
+/*
+ * Returns the slot of a device, or -1 after dropping it if it expired.
+ * Must hold sScanMutex.
+ */
+static int
+FindScanDevice(const bt_bdaddr_t* bda, uint32_t aHash, const TimeStamp& aNow)
+{
+    uint32_t mask = sScanDevices.size() - 1;
+    for(uint32_t i = aHash & mask; sScanDevices[i].used; i = (i + 1) & mask)
+    {
+        GattScanDevice& device = sScanDevices[i];
+        if(device.hash == aHash && !memcmp(&device.bda, bda, sizeof(*bda)))
+        {
+            if(IsScanDeviceExpired(device, aNow))
+            {
+                RemoveScanDevice(i);
+                return -1;
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Must hold sScanMutex */
+static GattScanDevice&
+InsertScanDevice(const bt_bdaddr_t* bda, uint32_t aHash)
+{
+    if(sScanDevices.empty())
+    {
+        ResetScanDevicesLocked();
+    }
+    if(sScanDeviceCount >= sScanDeviceCapacity)
+    {
+        EvictStalestScanDevice();
+    }
+
+    uint32_t mask = sScanDevices.size() - 1;
+    uint32_t i = aHash & mask;
+    while(sScanDevices[i].used)
+    {
+        i = (i + 1) & mask;
+    }
+
+    GattScanDevice& device = sScanDevices[i];
+    device.used = true;
+    device.hash = aHash;
+    device.bda = *bda;
+    ++sScanDeviceCount;
+    return device;
+}
+
+/* Keeps what an advertisement says about its device */
+static void
+SummarizeScanDevice(GattScanDevice& aDevice, int aRssi, const GattAdvData& aAdv)
+{
+    aDevice.lastRssi = aRssi;
+    ++aDevice.advCount;
+    aDevice.flags = aAdv.flags;
+    aDevice.beaconType = aAdv.beaconType;
+    aDevice.uuidCount = aAdv.uuidCount;
+    if(aAdv.manufacturer.len)
+    {
+        const uint8_t* mfr = aAdv.raw + aAdv.manufacturer.offset;
+        aDevice.companyId = mfr[0] | (mfr[1] << 8);
+    }
+    else
+    {
+        aDevice.companyId = -1;
+    }
+}
+
+/*
+ * Folds one advertisement into its device's state and tells whether it
+ * has to be reported. aRssi is replaced with the smoothed value.
+ */
+static GattScanReport
+TrackScanResult(const bt_bdaddr_t* bda, int& aRssi, const GattAdvData& aAdv)
+{
+    TimeStamp now = TimeStamp::Now();
+    uint32_t hash = ScanDeviceHash(bda);
+
+    StaticMutexAutoLock lock(sScanMutex);
+    int index = sScanDevices.empty() ? -1 : FindScanDevice(bda, hash, now);
+    if(index < 0)
+    {
+        GattScanDevice& device = InsertScanDevice(bda, hash);
+        SummarizeScanDevice(device, aRssi, aAdv);
+        device.smoothedRssi = aRssi * 16;
+        device.reportedRssi = aRssi;
+        device.lastReport = now;
+        device.lastSeen = now;
+        return GATT_SCAN_REPORT_NEW;
+    }
+
+    GattScanDevice& device = sScanDevices[index];
+    SummarizeScanDevice(device, aRssi, aAdv);
+    device.lastSeen = now;
+
+    uint32_t interval = sScanUpdateIntervalMs;
+    if(!interval)
+    {
+        return GATT_SCAN_REPORT_NONE;
+    }
+
+    device.smoothedRssi += (aRssi * 16 - device.smoothedRssi) * (int)sScanRssiWeight / 100;
+    int smoothed = (device.smoothedRssi + (device.smoothedRssi < 0 ? -8 : 8)) / 16;
+
+    double elapsed = (now - device.lastReport).ToMilliseconds();
+    uint32_t delta = abs(smoothed - device.reportedRssi);
+    uint32_t threshold = sScanRssiDelta;
+    if(elapsed < interval &&
+       (!threshold || delta < threshold || elapsed < GATT_SCAN_MIN_UPDATE_MS))
+    {
+        return GATT_SCAN_REPORT_NONE;
+    }
+
+    device.lastReport = now;
+    device.reportedRssi = smoothed;
+    aRssi = smoothed;
+    return GATT_SCAN_REPORT_UPDATE;
+}
+
+/* Sends the devices of the running scan, with what was last heard of each */
+static void
+SendScanDevices()
+{
+    nsAutoString callbackName;
+    callbackName.AssignLiteral(BLEGATT_SCAN_DEVICES_ID);
+
+    InfallibleTArray<BluetoothNamedValue> devices;
+    {
+        TimeStamp now = TimeStamp::Now();
+        StaticMutexAutoLock lock(sScanMutex);
+        for(size_t i = 0; i < sScanDevices.size(); ++i)
+        {
+            GattScanDevice& device = sScanDevices[i];
+            if(!device.used || IsScanDeviceExpired(device, now))
+            {
+                continue;
+            }
+
+            nsString data_bda;
+            BdAddressTypeToString(&device.bda, data_bda);
+            nsString data_rssi;
+            data_rssi.AppendInt(device.lastRssi);
+            nsString data_age;
+            data_age.AppendInt((int)(now - device.lastSeen).ToMilliseconds());
+            nsString data_adv_count;
+            data_adv_count.AppendInt(device.advCount);
+            nsString data_flags;
+            data_flags.AppendInt(device.flags);
+            nsString data_company;
+            if(device.companyId >= 0)
+            {
+                data_company.AppendInt(device.companyId);
+            }
+
+            InfallibleTArray<BluetoothNamedValue> entry;
+            entry.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_BDA), data_bda));
+            entry.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_RSSI), data_rssi));
+            entry.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_AGE_MS), data_age));
+            entry.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_ADV_COUNT), data_adv_count));
+            entry.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_ADV_FLAGS), data_flags));
+            entry.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_MANUFACTURER_ID), data_company));
+            entry.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_BEACON_TYPE),
+                                        NS_ConvertASCIItoUTF16(kGattBeaconNames[device.beaconType])));
+            devices.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DEVICE), entry));
+        }
+    }
+
+    InfallibleTArray<BluetoothNamedValue> data;
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DEVICES), devices));
+
+    DistributeGattSignal(data);
+}
+
+/**
+ * What a client wants its scans to report, checked on the bluedroid
+ * thread before a result costs the main thread anything. Every list that
+ * is not empty needs a match and the RSSI has to reach minRssi, so an
+ * empty filter lets everything through.
+ */
+struct GattScanFilter
+{
+  GattScanFilter() : hasMinRssi(false), minRssi(0) {}
+
+  bool IsEmpty() const
+  {
+    return !hasMinRssi && serviceUuids.empty() && namePrefixes.empty() &&
+           companyIds.empty() && addresses.empty();
+  }
+
+  bool hasMinRssi;
+  int minRssi;
+  std::vector<bt_uuid_t> serviceUuids;
+  // UTF-8
+  std::vector<nsCString> namePrefixes;
+  std::vector<uint16_t> companyIds;
+  // BdAddrKey of each address
+  std::vector<uint64_t> addresses;
+};
+
+struct GattScanFilterClient
+{
+  GattScanFilterClient() : scanning(false) {}
+
+  bool scanning;
+  GattScanFilter filter;
+};
+
+namespace {
+static StaticMutex sScanFilterMutex;
+// Keyed by client_if, guarded by sScanFilterMutex
+static std::map<int, GattScanFilterClient> sScanFilterClients;
+// Set while every scanning client has a filter, so results need checking
+static Atomic<bool> sScanFiltering(false);
+}
+
+/* Must hold sScanFilterMutex */
+static void
+UpdateScanFiltering()
+{
+    bool scanning = false;
+    bool filtering = true;
+    for(std::map<int, GattScanFilterClient>::iterator iter = sScanFilterClients.begin();
+        iter != sScanFilterClients.end(); ++iter)
+    {
+        if(iter->second.scanning)
+        {
+            scanning = true;
+            filtering = filtering && !iter->second.filter.IsEmpty();
+        }
+    }
+    sScanFiltering = scanning && filtering;
+}
+
+static void
+SetScanFilter(int client_if, const GattScanFilter& aFilter)
+{
+    StaticMutexAutoLock lock(sScanFilterMutex);
+    sScanFilterClients[client_if].filter = aFilter;
+    UpdateScanFiltering();
+}
+
+static void
+SetScanFilterScanning(int client_if, bool aScanning)
+{
+    StaticMutexAutoLock lock(sScanFilterMutex);
+    sScanFilterClients[client_if].scanning = aScanning;
+    UpdateScanFiltering();
+}
+
+static void
+RemoveScanFilterClient(int client_if)
+{
+    StaticMutexAutoLock lock(sScanFilterMutex);
+    sScanFilterClients.erase(client_if);
+    UpdateScanFiltering();
+}
+
+static bool
+ScanFilterMatches(const GattScanFilter& aFilter, const bt_bdaddr_t* bda,
+        int rssi, const GattAdvData& aAdv)
+{
+    if(aFilter.hasMinRssi && rssi < aFilter.minRssi)
+    {
+        return false;
+    }
+
+    if(!aFilter.addresses.empty() &&
+       std::find(aFilter.addresses.begin(), aFilter.addresses.end(), BdAddrKey(bda)) ==
+       aFilter.addresses.end())
+    {
+        return false;
+    }
+
+    if(!aFilter.companyIds.empty())
+    {
+        if(aAdv.manufacturer.len < 2)
+        {
+            return false;
+        }
+        const uint8_t* mfr = aAdv.raw + aAdv.manufacturer.offset;
+        uint16_t company = mfr[0] | (mfr[1] << 8);
+        if(std::find(aFilter.companyIds.begin(), aFilter.companyIds.end(), company) ==
+           aFilter.companyIds.end())
+        {
+            return false;
+        }
+    }
+
+    if(!aFilter.namePrefixes.empty())
+    {
+        bool found = false;
+        const char* name = (const char*)aAdv.raw + aAdv.name.offset;
+        for(size_t i = 0; i < aFilter.namePrefixes.size() && !found; ++i)
+        {
+            const nsCString& prefix = aFilter.namePrefixes[i];
+            found = prefix.Length() <= aAdv.name.len &&
+                    !memcmp(name, prefix.get(), prefix.Length());
+        }
+        if(!found)
+        {
+            return false;
+        }
+    }
+
+    if(!aFilter.serviceUuids.empty())
+    {
+        bool found = false;
+        bt_uuid_t uuid;
+        for(int i = 0; i < aAdv.uuidCount && !found; ++i)
+        {
+            AdvUuid(aAdv, aAdv.uuids[i], uuid);
+            for(size_t j = 0; j < aFilter.serviceUuids.size() && !found; ++j)
+            {
+                found = !memcmp(uuid.uu, aFilter.serviceUuids[j].uu, sizeof(uuid.uu));
+            }
+        }
+        if(!found)
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Tells whether a scan result is wanted by any scanning client. rssi is
+ * the raw value, before any smoothing.
+ */
+static bool
+PassesScanFilters(const bt_bdaddr_t* bda, int rssi, const GattAdvData& aAdv)
+{
+    if(!sScanFiltering)
+    {
+        return true;
+    }
+
+    StaticMutexAutoLock lock(sScanFilterMutex);
+    bool scanning = false;
+    for(std::map<int, GattScanFilterClient>::iterator iter = sScanFilterClients.begin();
+        iter != sScanFilterClients.end(); ++iter)
+    {
+        if(!iter->second.scanning)
+        {
+            continue;
+        }
+        scanning = true;
+        if(iter->second.filter.IsEmpty() ||
+           ScanFilterMatches(iter->second.filter, bda, rssi, aAdv))
+        {
+            return true;
+        }
+    }
+    // Results of a scan no client owns, such as a benchmark's, pass
+    return !scanning;
+}
+
+/*
+ * Reads a service UUID of a scan filter, either a full one or the 16-bit
+ * short form such as "180d".
+ */
+static bool
+ParseScanFilterUuid(const nsAString& aStr, bt_uuid_t& aUuid)
+{
+    if(4 == aStr.Length())
+    {
+        nsresult rv;
+        int shortUuid = nsString(aStr).ToInteger(&rv, 16);
+        if(NS_FAILED(rv))
+        {
+            return false;
+        }
+        memcpy(aUuid.uu, kBaseUuid, sizeof(kBaseUuid));
+        aUuid.uu[12] = shortUuid & 0xff;
+        aUuid.uu[13] = shortUuid >> 8;
+        return true;
+    }
+
+    // StringToUuid leaves a malformed UUID untouched, so look for a change
+    nsString str(aStr);
+    memset(aUuid.uu, 0, sizeof(aUuid.uu));
+    StringToUuid(str, &aUuid);
+    static const uint8_t zero[16] = { 0 };
+    return memcmp(aUuid.uu, zero, sizeof(zero)) != 0;
+}
+
+/*
+ * Builds a scan filter from the comma-separated lists of the
+ * setScanFilter parameters. An empty min_rssi means no floor.
+ */
+static bool
+ParseScanFilter(const nsTArray<nsString>& aPara, uint32_t aIndex, GattScanFilter& aFilter)
+{
+    nsresult rv;
+    if(!aPara[aIndex].IsEmpty())
+    {
+        aFilter.minRssi = aPara[aIndex].ToInteger(&rv);
+        if(NS_FAILED(rv))
+        {
+            return false;
+        }
+        aFilter.hasMinRssi = true;
+    }
+
+    nsCharSeparatedTokenizer uuids(aPara[aIndex + 1], ',');
+    while(uuids.hasMoreTokens())
+    {
+        bt_uuid_t uuid;
+        if(!ParseScanFilterUuid(uuids.nextToken(), uuid))
+        {
+            return false;
+        }
+        aFilter.serviceUuids.push_back(uuid);
+    }
+
+    nsCharSeparatedTokenizer names(aPara[aIndex + 2], ',');
+    while(names.hasMoreTokens())
+    {
+        aFilter.namePrefixes.push_back(NS_ConvertUTF16toUTF8(names.nextToken()));
+    }
+
+    nsCharSeparatedTokenizer companies(aPara[aIndex + 3], ',');
+    while(companies.hasMoreTokens())
+    {
+        nsString company(companies.nextToken());
+        bool hex = company.Length() > 2 && '0' == company[0] && 'x' == company[1];
+        int id = hex ? nsString(Substring(company, 2)).ToInteger(&rv, 16) : company.ToInteger(&rv);
+        if(NS_FAILED(rv) || id < 0 || id > 0xffff)
+        {
+            return false;
+        }
+        aFilter.companyIds.push_back(id);
+    }
+
+    nsCharSeparatedTokenizer addresses(aPara[aIndex + 4], ',');
+    while(addresses.hasMoreTokens())
+    {
+        bt_bdaddr_t bdAddr;
+        StringToBdAddressType(nsString(addresses.nextToken()), &bdAddr);
+        aFilter.addresses.push_back(BdAddrKey(&bdAddr));
+    }
+
+    return aFilter.serviceUuids.size() <= MAX_SCAN_FILTER_ENTRIES &&
+           aFilter.namePrefixes.size() <= MAX_SCAN_FILTER_ENTRIES &&
+           aFilter.companyIds.size() <= MAX_SCAN_FILTER_ENTRIES &&
+           aFilter.addresses.size() <= MAX_SCAN_FILTER_ENTRIES;
+}
+
+// Eddystone-URL scheme prefixes and expansion codes
+static const char* const kEddystoneUrlSchemes[] = {
+  "http://www.", "https://www.", "http://", "https://"
+};
+static const char* const kEddystoneUrlCodes[] = {
+  ".com/", ".org/", ".edu/", ".net/", ".info/", ".biz/", ".gov/",
+  ".com", ".org", ".edu", ".net", ".info", ".biz", ".gov"
+};
+
+/* Expands the URL of an Eddystone-URL frame, or leaves aUrl empty if malformed */
+static void
+DecodeEddystoneUrl(const uint8_t* aFrame, int aLen, nsAString& aUrl)
+{
+    aUrl.Truncate();
+    if(aFrame[2] >= MOZ_ARRAY_LENGTH(kEddystoneUrlSchemes))
+    {
+        return;
+    }
+
+    nsAutoCString url(kEddystoneUrlSchemes[aFrame[2]]);
+    for(int i = 3; i < aLen; ++i)
+    {
+        uint8_t c = aFrame[i];
+        if(c < MOZ_ARRAY_LENGTH(kEddystoneUrlCodes))
+        {
+            url.Append(kEddystoneUrlCodes[c]);
+        }
+        else if(c > 0x20 && c < 0x7f)
+        {
+            url.Append((char)c);
+        }
+        else
+        {
+            return;
+        }
+    }
+    CopyASCIItoUTF16(url, aUrl);
+}
+
+/* Sets a number that may be absent, sent as an empty string if so */
+static void
+SetOptionalInt(GattSignalTemplate* aSignal, size_t aIndex, bool aPresent, int aValue)
+{
+    if(aPresent)
+    {
+        aSignal->SetInt(aIndex, aValue);
+    }
+    else
+    {
+        aSignal->StringAt(aIndex).Truncate();
+    }
+}
+
+/* Lays out the decoded advertising data, filled by SetAdvValues */
+static void
+AddAdvLayout(GattSignalTemplate* aSignal)
+{
+    aSignal->AddString(GATT_PARA_ADV_FLAGS);
+    aSignal->AddString(GATT_PARA_TX_POWER);
+    aSignal->AddString(GATT_PARA_APPEARANCE);
+    aSignal->AddValues(GATT_PARA_SERVICE_UUIDS);
+    aSignal->AddValues(GATT_PARA_SERVICE_DATA);
+    aSignal->AddString(GATT_PARA_MANUFACTURER_ID);
+    aSignal->AddBytes(GATT_PARA_MANUFACTURER_DATA);
+    aSignal->AddString(GATT_PARA_BEACON_TYPE);
+    aSignal->AddString(GATT_PARA_BEACON_ID);
+    aSignal->AddString(GATT_PARA_BEACON_MAJOR);
+    aSignal->AddString(GATT_PARA_BEACON_MINOR);
+    aSignal->AddString(GATT_PARA_BEACON_POWER);
+    aSignal->AddString(GATT_PARA_BEACON_URL);
+}
+
+/*
+ * Fills the values laid out by AddAdvLayout from aIndex on. Each service
+ * data entry is named after its UUID. The beacon id is the proximity UUID
+ * of an iBeacon or the namespace and instance of an Eddystone-UID in hex;
+ * the power is the calibrated RSSI at 1m for an iBeacon and at 0m for
+ * Eddystone. A TLM frame is only typed, its fields are in the service data.
+ */
+static void
+SetAdvValues(GattSignalTemplate* aSignal, size_t aIndex, const GattAdvData& aAdv)
+{
+    size_t i = aIndex;
+    SetOptionalInt(aSignal, i++, aAdv.hasFlags, aAdv.flags);
+    SetOptionalInt(aSignal, i++, aAdv.hasTxPower, aAdv.txPower);
+    SetOptionalInt(aSignal, i++, aAdv.hasAppearance, aAdv.appearance);
+
+    // The nested entries are overwritten in place, like the other slots
+    bt_uuid_t uuid;
+    InfallibleTArray<BluetoothNamedValue>& uuids =
+        aSignal->SizeValuesAt(i++, aAdv.uuidCount, BluetoothValue(nsString()));
+    for(int n = 0; n < aAdv.uuidCount; ++n)
+    {
+        AdvUuid(aAdv, aAdv.uuids[n], uuid);
+        uuids[n].name().AssignLiteral(GATT_PARA_UUID);
+        BtUuidToString(&uuid, uuids[n].value().get_nsString());
+    }
+
+    InfallibleTArray<BluetoothNamedValue>& serviceData =
+        aSignal->SizeValuesAt(i++, aAdv.serviceDataCount, BluetoothValue(nsTArray<uint8_t>()));
+    for(int n = 0; n < aAdv.serviceDataCount; ++n)
+    {
+        AdvUuid(aAdv, aAdv.serviceDataUuid[n], uuid);
+        BtUuidToString(&uuid, serviceData[n].name());
+        nsTArray<uint8_t>& bytes = serviceData[n].value().get_ArrayOfuint8_t();
+        bytes.ReplaceElementsAt(0, bytes.Length(),
+                aAdv.raw + aAdv.serviceData[n].offset, aAdv.serviceData[n].len);
+    }
+
+    const uint8_t* mfr = aAdv.raw + aAdv.manufacturer.offset;
+    nsTArray<uint8_t>& mfrData = aSignal->BytesAt(i + 1);
+    if(aAdv.manufacturer.len)
+    {
+        aSignal->SetInt(i, mfr[0] | (mfr[1] << 8));
+        mfrData.ReplaceElementsAt(0, mfrData.Length(), mfr + 2, aAdv.manufacturer.len - 2);
+    }
+    else
+    {
+        aSignal->StringAt(i).Truncate();
+        mfrData.Clear();
+    }
+    i += 2;
+
+    nsString& type = aSignal->StringAt(i++);
+    nsString& id = aSignal->StringAt(i++);
+    size_t major = i++;
+    size_t minor = i++;
+    size_t power = i++;
+    nsString& url = aSignal->StringAt(i++);
+
+    // Only what the beacon type defines is set below
+    const uint8_t* frame = aAdv.raw + aAdv.beacon.offset;
+    id.Truncate();
+    aSignal->StringAt(major).Truncate();
+    aSignal->StringAt(minor).Truncate();
+    url.Truncate();
+
+    type.AssignASCII(kGattBeaconNames[aAdv.beaconType]);
+    switch(aAdv.beaconType)
+    {
+    case GATT_BEACON_IBEACON:
+        AdvBeaconUuid(aAdv, uuid);
+        FormatUuid(uuid, id);
+        aSignal->SetInt(major, (frame[20] << 8) | frame[21]);
+        aSignal->SetInt(minor, (frame[22] << 8) | frame[23]);
+        aSignal->SetInt(power, (int8_t)frame[24]);
+        break;
+    case GATT_BEACON_EDDYSTONE_UID:
+        array2str(frame + 2, 16, id);
+        aSignal->SetInt(power, (int8_t)frame[1]);
+        break;
+    case GATT_BEACON_EDDYSTONE_URL:
+        DecodeEddystoneUrl(frame, aAdv.beacon.len, url);
+        aSignal->SetInt(power, (int8_t)frame[1]);
+        break;
+    case GATT_BEACON_EDDYSTONE_TLM:
+        aSignal->StringAt(power).Truncate();
+        break;
+    default:
+        aSignal->StringAt(power).Truncate();
+        break;
+    }
+}
+
+/* Reports a device first seen by a scan */
+static void
+SendScanResultCallback(const GattEvent& aEvent)
+{
+    GattSignalTemplate* signal = GetSignalTemplate(GATT_SIGNAL_SCAN_RESULT);
+    if(signal->NeedsLayout(0))
+    {
+        signal->AddString(GATT_PARA_CALLBACK_NAME, BLEGATT_SCAN_RESULT_ID);
+        signal->AddString(GATT_PARA_BDA);
+        signal->AddString(GATT_PARA_RSSI);
+        signal->AddString(GATT_PARA_ADVDATA);
+        signal->AddString(GATT_PARA_DEVICE_TYPE);
+        AddAdvLayout(signal);
+    }
+
+    // Copied, sharing the buffers would make the pooled event reallocate
+    signal->StringAt(1).Assign(aEvent.deviceAddr.BeginReading(), aEvent.deviceAddr.Length());
+    signal->SetInt(2, aEvent.rssi);
+    signal->StringAt(3).Assign(aEvent.deviceName.BeginReading(), aEvent.deviceName.Length());
+    signal->SetInt(4, aEvent.deviceType);
+    SetAdvValues(signal, 5, aEvent.adv);
+
+    signal->Send();
+}
+
+/* Reports a device seen again during a streaming scan */
+static void
+SendScanUpdateCallback(const GattEvent& aEvent)
+{
+    GattSignalTemplate* signal = GetSignalTemplate(GATT_SIGNAL_SCAN_UPDATE);
+    if(signal->NeedsLayout(0))
+    {
+        signal->AddString(GATT_PARA_CALLBACK_NAME, BLEGATT_SCAN_UPDATE_ID);
+        signal->AddString(GATT_PARA_BDA);
+        signal->AddString(GATT_PARA_RSSI);
+        signal->AddString(GATT_PARA_RAW_RSSI);
+        signal->AddString(GATT_PARA_ADVDATA);
+        signal->AddString(GATT_PARA_DEVICE_TYPE);
+        AddAdvLayout(signal);
+    }
+
+    signal->StringAt(1).Assign(aEvent.deviceAddr.BeginReading(), aEvent.deviceAddr.Length());
+    signal->SetInt(2, aEvent.rssi);
+    signal->SetInt(3, aEvent.rawRssi);
+    signal->StringAt(4).Assign(aEvent.deviceName.BeginReading(), aEvent.deviceName.Length());
+    signal->SetInt(5, aEvent.deviceType);
+    SetAdvValues(signal, 6, aEvent.adv);
+
+    signal->Send();
+}
+
+/* Reads a service id from its uuid, inst_id and is_primary parameters */
+static void
+ParseSrvcId(const nsTArray<nsString>& aPara, uint32_t aIndex, btgatt_srvc_id_t& aId)
+{
+    nsresult rv;
+    nsString uuid(aPara[aIndex]);
+
+    memset(&aId, 0, sizeof(aId));
+    StringToUuid(uuid, &aId.id.uuid);
+    aId.id.inst_id = aPara[aIndex + 1].ToInteger(&rv);
+    aId.is_primary = aPara[aIndex + 2].ToInteger(&rv);
+}
+
+/* Reads a characteristic or descriptor id from its uuid and inst_id parameters */
+static void
+ParseGattId(const nsTArray<nsString>& aPara, uint32_t aIndex, btgatt_gatt_id_t& aId)
+{
+    nsresult rv;
+    nsString uuid(aPara[aIndex]);
+
+    memset(&aId, 0, sizeof(aId));
+    StringToUuid(uuid, &aId.uuid);
+    aId.inst_id = aPara[aIndex + 1].ToInteger(&rv);
+}
+
+/* Sends the counters, histogram summaries and per-link counts as one signal */
+static void
+SendGattMetrics()
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    nsAutoString callbackName;
+    callbackName.AssignLiteral(BLEGATT_METRICS_ID);
+
+    InfallibleTArray<BluetoothNamedValue> data;
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+    for(int i = 0; i < GATT_COUNTER_COUNT; ++i)
+    {
+        nsString data_counter;
+        data_counter.AppendInt(sGattCounters[i]);
+        data.AppendElement(
+                BluetoothNamedValue(NS_ConvertASCIItoUTF16(kGattCounterNames[i]), data_counter));
+    }
+
+    InfallibleTArray<BluetoothNamedValue> histograms;
+    for(int i = 0; i < GATT_HISTOGRAM_COUNT; ++i)
+    {
+        const GattHistogram& h = sGattHistograms[i];
+        nsString data_count;
+        data_count.AppendInt(h.count);
+        nsString data_p50;
+        data_p50.AppendInt(GattHistogramPercentile(h, 500));
+        nsString data_p90;
+        data_p90.AppendInt(GattHistogramPercentile(h, 900));
+        nsString data_p99;
+        data_p99.AppendInt(GattHistogramPercentile(h, 990));
+        nsString data_max;
+        data_max.AppendInt(h.maxUs);
+
+        InfallibleTArray<BluetoothNamedValue> histogram;
+        histogram.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_NAME),
+                                    NS_ConvertASCIItoUTF16(kGattHistogramNames[i])));
+        histogram.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_EVENTS), data_count));
+        histogram.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LATENCY_P50_US), data_p50));
+        histogram.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LATENCY_P90_US), data_p90));
+        histogram.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LATENCY_P99_US), data_p99));
+        histogram.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LATENCY_MAX_US), data_max));
+        histograms.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_HISTOGRAM), histogram));
+    }
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_HISTOGRAMS), histograms));
+
+    InfallibleTArray<BluetoothNamedValue> conns;
+    for(std::map<int, GattConnContext>::iterator iter = sGattConns.begin();
+        iter != sGattConns.end(); ++iter)
+    {
+        nsString data_conn_id;
+        data_conn_id.AppendInt(iter->first);
+        nsString data_client_if;
+        data_client_if.AppendInt(iter->second.clientIf);
+        nsString data_notifications;
+        data_notifications.AppendInt(iter->second.notifications);
+
+        InfallibleTArray<BluetoothNamedValue> conn;
+        conn.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+        conn.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CLIENTIF), data_client_if));
+        conn.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_NOTIFICATIONS), data_notifications));
+        conns.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONN), conn));
+    }
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNS), conns));
+
+    DistributeGattSignal(data);
+}
+
+/* Writes the same figures as SendGattMetrics to the log */
+static void
+DumpGattMetrics()
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    for(int i = 0; i < GATT_COUNTER_COUNT; ++i)
+    {
+        __android_log_print(ANDROID_LOG_INFO, LOG_TAG, "metrics %s:%u",
+                            kGattCounterNames[i], (uint32_t)sGattCounters[i]);
+    }
+    for(int i = 0; i < GATT_HISTOGRAM_COUNT; ++i)
+    {
+        const GattHistogram& h = sGattHistograms[i];
+        __android_log_print(ANDROID_LOG_INFO, LOG_TAG,
+                            "metrics %s count:%u p50:%uus p90:%uus p99:%uus max:%uus",
+                            kGattHistogramNames[i], (uint32_t)h.count,
+                            GattHistogramPercentile(h, 500), GattHistogramPercentile(h, 900),
+                            GattHistogramPercentile(h, 990), (uint32_t)h.maxUs);
+    }
+    for(std::map<int, GattConnContext>::iterator iter = sGattConns.begin();
+        iter != sGattConns.end(); ++iter)
+    {
+        __android_log_print(ANDROID_LOG_INFO, LOG_TAG,
+                            "metrics conn_id:%d client_if:%d notifications:%u",
+                            iter->first, iter->second.clientIf, iter->second.notifications);
+    }
+}
+
+/**
+ * Benchmark of the callback pipeline. Scan and notify runs measure from
+ * the creation of each GattEvent on the bluedroid thread to the end of its
+ * signal; read and write runs keep one request in flight and measure from
+ * issuing it to the end of its signal. Against the fake stack, scan and
+ * notify runs generate their own traffic, otherwise they time whatever the
+ * stack delivers. A dispatch run involves no stack: it times resolving the
+ * handler of each event on the main thread, see MainThreadTask::MeasureDispatch.
+ * Every run also reports the GATT_COUNTER_EVENT_ALLOCATIONS it caused per event.
+ */
+enum GattBenchWorkload {
+  GATT_BENCH_SCAN,
+  GATT_BENCH_NOTIFY,
+  GATT_BENCH_READ,
+  GATT_BENCH_WRITE,
+  GATT_BENCH_DISPATCH,
+};
+
+struct GattBench
+{
+  GattBench()
+    : workload(GATT_BENCH_SCAN), count(0), generated(0), issued(0),
+      delivered(0), lastDelivered(0),
+      allocationsAtStart(sGattCounters[GATT_COUNTER_EVENT_ALLOCATIONS]),
+      dispatchNs(0), nameLookupNs(0)
+  {
+  }
+
+  int workload;
+  uint32_t count;
+  // Events the fake stack was asked for, 0 when it is not the source
+  uint32_t generated;
+  uint32_t issued;
+  uint32_t delivered;
+  // delivered at the previous idle check
+  uint32_t lastDelivered;
+  // GATT_COUNTER_EVENT_ALLOCATIONS when the run was set up
+  uint32_t allocationsAtStart;
+  TimeStamp start;
+  TimeStamp lastIssue;
+  // Repeated by read and write runs
+  GattOp op;
+  std::vector<uint32_t> latencyUs;
+  // Per event, of a dispatch run
+  double dispatchNs;
+  double nameLookupNs;
+};
+
+namespace {
+// Main thread only
+static StaticAutoPtr<GattBench> sGattBench;
+static StaticRefPtr<nsITimer> sGattBenchTimer;
+}
+
+static const char*
+GattBenchWorkloadName(int aWorkload)
+{
+    switch(aWorkload)
+    {
+    case GATT_BENCH_SCAN:
+        return "scan";
+    case GATT_BENCH_NOTIFY:
+        return "notify";
+    case GATT_BENCH_READ:
+        return "read";
+    case GATT_BENCH_WRITE:
+        return "write";
+    case GATT_BENCH_DISPATCH:
+        return "dispatch";
+    default:
+        return "unknown";
+    }
+}
+
+/* Latency below which aPermille of the samples fall, which must be sorted */
+static uint32_t
+GattBenchPercentile(const std::vector<uint32_t>& aSorted, int aPermille)
+{
+    if(aSorted.empty())
+    {
+        return 0;
+    }
+    size_t index = (aSorted.size() - 1) * aPermille / 1000;
+    return aSorted[index];
+}
+
+/* Reports the run and ends it, with a non-zero aStatus if its requests failed */
+static void
+FinishGattBench(int aStatus)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    sGattBenchActive = false;
+    if(sGattBenchTimer)
+    {
+        sGattBenchTimer->Cancel();
+    }
+
+    GattBench* bench = sGattBench;
+    if(!bench)
+    {
+        return;
+    }
+
+    double elapsedMs = (TimeStamp::Now() - bench->start).ToMilliseconds();
+    uint32_t eventsPerSec = elapsedMs > 0 ? (uint32_t)(bench->delivered * 1000 / elapsedMs) : 0;
+    uint32_t dropped = bench->generated > bench->delivered ?
+                       bench->generated - bench->delivered : 0;
+    std::sort(bench->latencyUs.begin(), bench->latencyUs.end());
+    uint32_t p50 = GattBenchPercentile(bench->latencyUs, 500);
+    uint32_t p99 = GattBenchPercentile(bench->latencyUs, 990);
+    uint32_t p999 = GattBenchPercentile(bench->latencyUs, 999);
+    uint32_t allocations = sGattCounters[GATT_COUNTER_EVENT_ALLOCATIONS] - bench->allocationsAtStart;
+    double allocationsPerEvent = bench->delivered ? (double)allocations / bench->delivered : 0;
+
+    LOGI("Benchmark %s: %u events in %d ms, %u/s, p50:%uus p99:%uus p999:%uus dropped:%u "
+         "allocations:%u status:%d",
+         GattBenchWorkloadName(bench->workload), bench->delivered, (int)elapsedMs,
+         eventsPerSec, p50, p99, p999, dropped, allocations, aStatus);
+
+    nsAutoString callbackName;
+    callbackName.AssignLiteral(BLEGATT_BENCHMARK_ID);
+    nsString data_status;
+    data_status.AppendInt(aStatus);
+    nsString data_workload;
+    data_workload.AssignASCII(GattBenchWorkloadName(bench->workload));
+    nsString data_events;
+    data_events.AppendInt(bench->delivered);
+    nsString data_dropped;
+    data_dropped.AppendInt(dropped);
+    nsString data_elapsed_ms;
+    data_elapsed_ms.AppendInt((uint32_t)elapsedMs);
+    nsString data_events_per_sec;
+    data_events_per_sec.AppendInt(eventsPerSec);
+    nsString data_p50;
+    data_p50.AppendInt(p50);
+    nsString data_p99;
+    data_p99.AppendInt(p99);
+    nsString data_p999;
+    data_p999.AppendInt(p999);
+    nsString data_allocations_per_event;
+    data_allocations_per_event.AppendFloat(allocationsPerEvent);
+
+    InfallibleTArray<BluetoothNamedValue> data;
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_WORKLOAD), data_workload));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_EVENTS), data_events));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DROPPED), data_dropped));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_ELAPSED_MS), data_elapsed_ms));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_EVENTS_PER_SEC), data_events_per_sec));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LATENCY_P50_US), data_p50));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LATENCY_P99_US), data_p99));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LATENCY_P999_US), data_p999));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_ALLOCATIONS_PER_EVENT),
+                                data_allocations_per_event));
+    if(GATT_BENCH_DISPATCH == bench->workload)
+    {
+        LOGI("Benchmark dispatch: %f ns per event, %f ns by name",
+             bench->dispatchNs, bench->nameLookupNs);
+
+        nsString data_dispatch_ns;
+        data_dispatch_ns.AppendFloat(bench->dispatchNs);
+        nsString data_name_lookup_ns;
+        data_name_lookup_ns.AppendFloat(bench->nameLookupNs);
+        data.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DISPATCH_NS), data_dispatch_ns));
+        data.AppendElement(
+                BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_NAME_LOOKUP_NS), data_name_lookup_ns));
+    }
+
+    DistributeGattSignal(data);
+
+    sGattBench = nullptr;
+}
+
+/* Issues the next request of a read or write run */
+static void
+IssueGattBenchOp()
+{
+    GattBench* bench = sGattBench;
+    ++bench->issued;
+    bench->lastIssue = TimeStamp::Now();
+    if(!SubmitGattOp(bench->op))
+    {
+        LOGE("Benchmark request %u failed", bench->issued);
+        FinishGattBench(GATT_STATUS_ERROR);
+    }
+}
+
+/* Ends a run that stopped receiving events */
+static void
+GattBenchTimerCallback(nsITimer* aTimer, void* aClosure)
+{
+    GattBench* bench = sGattBench;
+    if(!bench)
+    {
+        return;
+    }
+    if(bench->delivered == bench->lastDelivered)
+    {
+        LOGW("Benchmark idle, stopping after %u of %u events", bench->delivered, bench->count);
+        FinishGattBench(0);
+        return;
+    }
+    bench->lastDelivered = bench->delivered;
+}
+
+static bool
+StartGattBench(nsAutoPtr<GattBench>& aBench, int aRateHz)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    if(sGattBench)
+    {
+        LOGE("A benchmark is already running");
+        return false;
+    }
+
+    if(!sGattBenchTimer)
+    {
+        nsCOMPtr<nsITimer> timer = do_CreateInstance(NS_TIMER_CONTRACTID);
+        if(!timer)
+        {
+            LOGE("Failed to create benchmark timer");
+            return false;
+        }
+        sGattBenchTimer = timer;
+    }
+
+    aBench->latencyUs.reserve(aBench->count);
+    aBench->start = TimeStamp::Now();
+    sGattBench = aBench.forget();
+    sGattBenchActive = true;
+
+    GattBench* bench = sGattBench;
+    switch(bench->workload)
+    {
+    case GATT_BENCH_SCAN:
+    case GATT_BENCH_NOTIFY:
+#ifdef MOZ_BT_GATT_FAKE
+        if(sBluetoothGattInterface == GetFakeGattInterface())
+        {
+            if(!StartFakeGattFlood(GATT_BENCH_NOTIFY == bench->workload,
+                                   bench->count, aRateHz))
+            {
+                sGattBench = nullptr;
+                sGattBenchActive = false;
+                return false;
+            }
+            bench->generated = bench->count;
+        }
+#endif
+        break;
+    case GATT_BENCH_READ:
+    case GATT_BENCH_WRITE:
+        IssueGattBenchOp();
+        if(!sGattBench)
+        {
+            return false;
+        }
+        break;
+    }
+
+    sGattBenchTimer->InitWithFuncCallback(GattBenchTimerCallback, nullptr,
+                                          GATT_BENCH_IDLE_MS,
+                                          nsITimer::TYPE_REPEATING_SLACK);
+    LOGI("Benchmark %s started, %u events", GattBenchWorkloadName(bench->workload), bench->count);
+    return true;
+}
+
+/* Accounts for an event the main thread just delivered */
+static void
+RecordGattBenchEvent(const GattEvent& aEvent)
+{
+    GattBench* bench = sGattBench;
+    if(!bench)
+    {
+        return;
+    }
+
+    uint32_t events = 0;
+    TimeStamp since = aEvent.created;
+    switch(bench->workload)
+    {
+    case GATT_BENCH_SCAN:
+        if(GATT_EVENT_SCAN_RESULT == aEvent.type || GATT_EVENT_SCAN_UPDATE == aEvent.type)
+        {
+            events = 1;
+        }
+        break;
+    case GATT_BENCH_NOTIFY:
+        if(GATT_EVENT_NOTIFY == aEvent.type)
+        {
+            events = 1;
+        }
+        else if(GATT_EVENT_NOTIFY_BATCH == aEvent.type)
+        {
+            // Timed from the first sample of the batch
+            events = aEvent.samples.size();
+        }
+        break;
+    // Only the answer to the run's own request counts, other apps may be
+    // reading or writing meanwhile
+    case GATT_BENCH_READ:
+        if(GATT_EVENT_READ_CHARACTERISTIC == aEvent.type &&
+           aEvent.connId == bench->op.connId &&
+           SameSrvcId(aEvent.params.read.srvc_id, bench->op.srvcId) &&
+           SameGattId(aEvent.params.read.char_id, bench->op.charId))
+        {
+            events = 1;
+            since = bench->lastIssue;
+        }
+        break;
+    case GATT_BENCH_WRITE:
+        if(GATT_EVENT_WRITE_CHARACTERISTIC == aEvent.type &&
+           aEvent.connId == bench->op.connId &&
+           SameSrvcId(aEvent.params.write.srvc_id, bench->op.srvcId) &&
+           SameGattId(aEvent.params.write.char_id, bench->op.charId))
+        {
+            events = 1;
+            since = bench->lastIssue;
+        }
+        break;
+    }
+    if(!events)
+    {
+        return;
+    }
+
+    // A request that failed, was refused or went down with the link ends the run
+    if((GATT_BENCH_READ == bench->workload || GATT_BENCH_WRITE == bench->workload) &&
+       aEvent.status)
+    {
+        LOGE("Benchmark request %u failed:%d", bench->issued, aEvent.status);
+        FinishGattBench(aEvent.status);
+        return;
+    }
+
+    // Events created before the run started carry no timestamp
+    if(!since.IsNull())
+    {
+        uint32_t latencyUs = (uint32_t)(TimeStamp::Now() - since).ToMicroseconds();
+        for(uint32_t i = 0; i < events; ++i)
+        {
+            bench->latencyUs.push_back(latencyUs);
+        }
+    }
+    bench->delivered += events;
+
+    if(bench->delivered >= bench->count)
+    {
+        FinishGattBench(0);
+    }
+    else if(bench->issued && bench->issued < bench->count)
+    {
+        IssueGattBenchOp();
+    }
+}
+
+#ifdef MOZ_BT_GATT_FAKE
+/**
+ * Checks the runSelfTest operation makes against the fake stack, one
+ * after the other on a link it opens behind the apps' back:
+ *   cache    an attribute database saved and loaded back is unchanged
+ *   order    queued requests reach the stack by priority, in order within one
+ *   chunks   a long Write Command goes out in pieces of ATT_MTU - 3
+ *   timeout  a request never answered fails and the next one goes out
+ * Each result is reported in a BLEGATT_SELF_TEST_ID signal. The checks
+ * expect a script without error or congest directives.
+ */
+enum GattSelfTestCheck {
+  GATT_SELF_TEST_CACHE,
+  GATT_SELF_TEST_ORDER,
+  GATT_SELF_TEST_CHUNKS,
+  GATT_SELF_TEST_TIMEOUT,
+  GATT_SELF_TEST_COUNT
+};
+
+// Signal keys, indexed by GattSelfTestCheck
+static const char* const kGattSelfTestNames[GATT_SELF_TEST_COUNT] = {
+  "cache_round_trip",
+  "op_queue_order",
+  "write_chunks",
+  "op_timeout",
+};
+
+struct GattSelfTest
+{
+  GattSelfTest()
+    : check(GATT_SELF_TEST_CACHE), connId(0), timeoutsAtStart(0)
+  {
+    memset(&srvcId, 0, sizeof(srvcId));
+    memset(&charId, 0, sizeof(charId));
+    memset(passed, 0, sizeof(passed));
+  }
+
+  // GattSelfTestCheck running
+  int check;
+  int connId;
+  // Characteristic the requests go to
+  btgatt_srvc_id_t srvcId;
+  btgatt_gatt_id_t charId;
+  TimeStamp checkStart;
+  // GATT_COUNTER_OP_TIMEOUTS when the timeout check started
+  uint32_t timeoutsAtStart;
+  bool passed[GATT_SELF_TEST_COUNT];
+};
+
+namespace {
+// Main thread only
+static StaticAutoPtr<GattSelfTest> sGattSelfTest;
+static StaticRefPtr<nsITimer> sGattSelfTestTimer;
+}
+
+static bool
+SameGattCacheEntry(const GattCacheEntry& a, const GattCacheEntry& b)
+{
+    if(a.servicesComplete != b.servicesComplete || a.services.size() != b.services.size())
+    {
+        return false;
+    }
+    for(size_t i = 0; i < a.services.size(); ++i)
+    {
+        const GattCacheService& s = a.services[i];
+        const GattCacheService& t = b.services[i];
+        if(!SameSrvcId(s.id, t.id) || s.charsComplete != t.charsComplete ||
+           s.charsEndStatus != t.charsEndStatus || s.chars.size() != t.chars.size())
+        {
+            return false;
+        }
+        for(size_t j = 0; j < s.chars.size(); ++j)
+        {
+            const GattCacheChar& c = s.chars[j];
+            const GattCacheChar& d = t.chars[j];
+            if(!SameGattId(c.id, d.id) || c.prop != d.prop ||
+               c.descrsComplete != d.descrsComplete ||
+               c.descrsEndStatus != d.descrsEndStatus || c.descrs.size() != d.descrs.size())
+            {
+                return false;
+            }
+            for(size_t k = 0; k < c.descrs.size(); ++k)
+            {
+                if(!SameGattId(c.descrs[k], d.descrs[k]))
+                {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+/* Saves a made-up database, loads it back and compares, on the calling thread */
+static bool
+CheckGattCacheRoundTrip()
+{
+    GattCacheEntry saved;
+    saved.servicesComplete = true;
+    for(int i = 0; i < 2; ++i)
+    {
+        GattCacheService service;
+        service.id.id.uuid.uu[0] = 0x10 + i;
+        service.id.id.inst_id = i;
+        service.id.is_primary = !i;
+        service.charsComplete = !i;
+        service.charsEndStatus = GATT_STATUS_ERROR;
+        for(int j = 0; j < 3; ++j)
+        {
+            GattCacheChar ch;
+            ch.id.uuid.uu[0] = 0x20 + j;
+            ch.id.inst_id = j;
+            ch.prop = 0x02 << j;
+            ch.descrsComplete = j % 2;
+            ch.descrsEndStatus = j ? GATT_STATUS_ERROR : 0;
+            for(int k = 0; k < j; ++k)
+            {
+                btgatt_gatt_id_t descr;
+                memset(&descr, 0, sizeof(descr));
+                descr.uuid.uu[0] = 0x30 + k;
+                descr.inst_id = k;
+                ch.descrs.push_back(descr);
+            }
+            service.chars.push_back(ch);
+        }
+        saved.services.push_back(service);
+    }
+
+    // A file left by an earlier run must not pass for this one
+    char path[PATH_MAX];
+    GattCachePath(GATT_SELF_TEST_CACHE_KEY, path, sizeof(path));
+    unlink(path);
+
+    SaveGattCache(GATT_SELF_TEST_CACHE_KEY, saved);
+    GattCacheEntry loaded;
+    bool ok = LoadGattCache(GATT_SELF_TEST_CACHE_KEY, loaded) &&
+              SameGattCacheEntry(saved, loaded);
+    unlink(path);
+    return ok;
+}
+
+/* Whether the self-test's link has nothing in flight or waiting */
+static bool
+IsGattSelfTestIdle(int conn_id)
+{
+    StaticMutexAutoLock lock(sGattOpMutex);
+    std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.find(conn_id);
+    if(iter == sGattOpQueues.end())
+    {
+        return true;
+    }
+    for(int i = 0; i < GATT_OP_PRIORITY_COUNT; ++i)
+    {
+        if(!iter->second.pending[i].empty())
+        {
+            return false;
+        }
+    }
+    return !iter->second.busy;
+}
+
+/*
+ * Writes aLen bytes counting up from aMarker through the typed request
+ * path, as an app would.
+ */
+static bool
+SubmitGattSelfTestWrite(const GattSelfTest& aTest, int aWriteType, int aPriority,
+                        uint8_t aMarker, uint32_t aLen)
+{
+    BluetoothGattRequest request(BleFunType_writeCharacteristic);
+    request.connId = aTest.connId;
+    request.srvcId = aTest.srvcId;
+    request.charId = aTest.charId;
+    request.writeType = aWriteType;
+    request.priority = aPriority;
+    for(uint32_t i = 0; i < aLen; ++i)
+    {
+        request.value.AppendElement((uint8_t)(aMarker + i));
+    }
+    return BluetoothGattSubmitRequest(request);
+}
+
+/* Sets up the current check and makes its requests */
+static bool
+StartGattSelfTestCheck(GattSelfTest& aTest)
+{
+    aTest.checkStart = TimeStamp::Now();
+    switch(aTest.check)
+    {
+    case GATT_SELF_TEST_ORDER:
+    {
+        // Held back until all are queued, markers 1 to 6
+        static const int kPriorities[] = {
+            GATT_OP_PRIORITY_LOW, GATT_OP_PRIORITY_NORMAL, GATT_OP_PRIORITY_HIGH,
+            GATT_OP_PRIORITY_NORMAL, GATT_OP_PRIORITY_LOW, GATT_OP_PRIORITY_HIGH
+        };
+        StartFakeGattJournal(aTest.connId, 0);
+        SetGattOpGate(aTest.connId, true);
+        for(size_t i = 0; i < MOZ_ARRAY_LENGTH(kPriorities); ++i)
+        {
+            if(!SubmitGattSelfTestWrite(aTest, GATT_WRITE_TYPE_DEFAULT, kPriorities[i], i + 1, 1))
+            {
+                return false;
+            }
+        }
+        SetGattOpGate(aTest.connId, false);
+        return true;
+    }
+    case GATT_SELF_TEST_CHUNKS:
+    {
+        GattConnContext& conn = sGattConns[aTest.connId];
+        conn.connId = aTest.connId;
+        conn.mtu = GATT_SELF_TEST_MTU;
+        StartFakeGattJournal(aTest.connId, 0);
+        return SubmitGattSelfTestWrite(aTest, GATT_WRITE_TYPE_NO_RSP, -1, 0,
+                                       GATT_SELF_TEST_CHUNKED_LEN);
+    }
+    case GATT_SELF_TEST_TIMEOUT:
+    {
+        sGattOpTimeoutMs = GATT_SELF_TEST_OP_TIMEOUT_MS;
+        aTest.timeoutsAtStart = sGattCounters[GATT_COUNTER_OP_TIMEOUTS];
+        // The read is dropped, the write behind it has to go out anyway
+        StartFakeGattJournal(aTest.connId, 1);
+        BluetoothGattRequest request(BleFunType_readCharacteristic);
+        request.connId = aTest.connId;
+        request.srvcId = aTest.srvcId;
+        request.charId = aTest.charId;
+        return BluetoothGattSubmitRequest(request) &&
+               SubmitGattSelfTestWrite(aTest, GATT_WRITE_TYPE_DEFAULT, -1, 7, 1);
+    }
+    default:
+        return false;
+    }
+}
+
+/* Undoes what the current check set up and hands over the requests it made */
+static void
+EndGattSelfTestCheck(GattSelfTest& aTest, std::vector<FakeGattAccess>& aAccesses)
+{
+    StopFakeGattJournal(aAccesses);
+    sGattOpTimeoutMs = GATT_OP_TIMEOUT_MS;
+    sGattConns.erase(aTest.connId);
+    // In case the order check failed before releasing it
+    SetGattOpGate(aTest.connId, false);
+}
+
+/* Whether the stack got what the current check expects */
+static bool
+VerifyGattSelfTestCheck(const GattSelfTest& aTest,
+                        const std::vector<FakeGattAccess>& aAccesses)
+{
+    for(size_t i = 0; i < aAccesses.size(); ++i)
+    {
+        if(aAccesses[i].descriptor)
+        {
+            return false;
+        }
+    }
+
+    switch(aTest.check)
+    {
+    case GATT_SELF_TEST_ORDER:
+    {
+        // Both high ones, both normal ones, both low ones
+        static const uint8_t kOrder[] = { 3, 6, 2, 4, 1, 5 };
+        if(aAccesses.size() != MOZ_ARRAY_LENGTH(kOrder))
+        {
+            return false;
+        }
+        for(size_t i = 0; i < aAccesses.size(); ++i)
+        {
+            if(aAccesses[i].value.size() != 1 || aAccesses[i].value[0] != kOrder[i])
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    case GATT_SELF_TEST_CHUNKS:
+    {
+        uint32_t chunk = GATT_SELF_TEST_MTU - 3;
+        if(aAccesses.size() != (GATT_SELF_TEST_CHUNKED_LEN + chunk - 1) / chunk)
+        {
+            return false;
+        }
+        uint32_t offset = 0;
+        for(size_t i = 0; i < aAccesses.size(); ++i)
+        {
+            const std::vector<uint8_t>& value = aAccesses[i].value;
+            uint32_t len = std::min<uint32_t>(chunk, GATT_SELF_TEST_CHUNKED_LEN - offset);
+            if(!aAccesses[i].write || GATT_WRITE_TYPE_NO_RSP != aAccesses[i].writeType ||
+               value.size() != len)
+            {
+                return false;
+            }
+            for(uint32_t j = 0; j < len; ++j, ++offset)
+            {
+                if(value[j] != (uint8_t)offset)
+                {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    case GATT_SELF_TEST_TIMEOUT:
+        return 2 == aAccesses.size() && !aAccesses[0].write && aAccesses[1].write &&
+               1 == aAccesses[1].value.size() && 7 == aAccesses[1].value[0] &&
+               sGattCounters[GATT_COUNTER_OP_TIMEOUTS] - aTest.timeoutsAtStart == 1;
+    default:
+        return false;
+    }
+}
+
+/* Reports the checks and closes the link, ending the run */
+static void
+FinishGattSelfTest()
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    if(sGattSelfTestTimer)
+    {
+        sGattSelfTestTimer->Cancel();
+    }
+
+    GattSelfTest* test = sGattSelfTest;
+    if(!test)
+    {
+        return;
+    }
+
+    std::vector<FakeGattAccess> accesses;
+    EndGattSelfTestCheck(*test, accesses);
+    ResetGattOpQueue(test->connId);
+    DisconnectFakeGattPeripheral(test->connId);
+
+    int status = 0;
+    for(int i = 0; i < GATT_SELF_TEST_COUNT; ++i)
+    {
+        if(!test->passed[i])
+        {
+            LOGE("Self-test check %s failed", kGattSelfTestNames[i]);
+            status = GATT_STATUS_ERROR;
+        }
+    }
+    LOGI("Self-test done, status:%d", status);
+
+    nsAutoString callbackName;
+    callbackName.AssignLiteral(BLEGATT_SELF_TEST_ID);
+    nsString data_status;
+    data_status.AppendInt(status);
+
+    InfallibleTArray<BluetoothNamedValue> data;
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
+    for(int i = 0; i < GATT_SELF_TEST_COUNT; ++i)
+    {
+        nsString data_passed;
+        data_passed.AppendInt(test->passed[i] ? 1 : 0);
+        data.AppendElement(
+                BluetoothNamedValue(NS_ConvertASCIItoUTF16(kGattSelfTestNames[i]), data_passed));
+    }
+
+    DistributeGattSignal(data);
+
+    sGattSelfTest = nullptr;
+}
+
+/* Moves on to the next check that starts, or reports once none is left */
+static void
+AdvanceGattSelfTest(GattSelfTest& aTest)
+{
+    while(++aTest.check < GATT_SELF_TEST_COUNT)
+    {
+        if(StartGattSelfTestCheck(aTest))
+        {
+            return;
+        }
+        LOGE("Self-test check %s could not start", kGattSelfTestNames[aTest.check]);
+        std::vector<FakeGattAccess> accesses;
+        EndGattSelfTestCheck(aTest, accesses);
+    }
+    FinishGattSelfTest();
+}
+
+/* Ends the current check once its requests are through */
+static void
+GattSelfTestTimerCallback(nsITimer* aTimer, void* aClosure)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    GattSelfTest* test = sGattSelfTest;
+    if(!test)
+    {
+        return;
+    }
+
+    bool idle = IsGattSelfTestIdle(test->connId);
+    if(!idle &&
+       (TimeStamp::Now() - test->checkStart).ToMilliseconds() < GATT_SELF_TEST_DEADLINE_MS)
+    {
+        return;
+    }
+
+    std::vector<FakeGattAccess> accesses;
+    EndGattSelfTestCheck(*test, accesses);
+    if(!idle)
+    {
+        // What is still queued would get in the way of the next checks
+        LOGE("Self-test check %s stuck after %d requests",
+             kGattSelfTestNames[test->check], (int)accesses.size());
+        FinishGattSelfTest();
+        return;
+    }
+
+    test->passed[test->check] = VerifyGattSelfTestCheck(*test, accesses);
+    AdvanceGattSelfTest(*test);
+}
+
+static bool
+StartGattSelfTest()
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    if(sBluetoothGattInterface != GetFakeGattInterface())
+    {
+        LOGE("The self-test needs the fake GATT stack");
+        return false;
+    }
+    if(sGattSelfTest)
+    {
+        LOGE("A self-test is already running");
+        return false;
+    }
+
+    if(!sGattSelfTestTimer)
+    {
+        nsCOMPtr<nsITimer> timer = do_CreateInstance(NS_TIMER_CONTRACTID);
+        if(!timer)
+        {
+            LOGE("Failed to create self-test timer");
+            return false;
+        }
+        sGattSelfTestTimer = timer;
+    }
+
+    nsAutoPtr<GattSelfTest> test(new GattSelfTest());
+    test->connId = ConnectFakeGattPeripheral(&test->srvcId, &test->charId);
+    if(!test->connId)
+    {
+        LOGE("No idle fake peripheral to run the self-test on");
+        return false;
+    }
+    LOGI("Self-test started on conn_id:%d", test->connId);
+
+    test->passed[GATT_SELF_TEST_CACHE] = CheckGattCacheRoundTrip();
+    sGattSelfTest = test.forget();
+    sGattSelfTestTimer->InitWithFuncCallback(GattSelfTestTimerCallback, nullptr,
+                                             GATT_SELF_TEST_POLL_MS,
+                                             nsITimer::TYPE_REPEATING_SLACK);
+    AdvanceGattSelfTest(*sGattSelfTest);
+    return true;
+}
+#endif
+
+class BluetoothGatt::MainThreadTask : public nsRunnable
+{
+public:
+  typedef void (BluetoothGatt::*SendCallback)();
+  typedef void (*SendEventCallback)(const GattEvent& aEvent);
+
+  // Exactly one of mSend and mSendEvent is set
+  struct CallbackEntry
+  {
+    const char* mName;
+    SendCallback mSend;
+    SendEventCallback mSendEvent;
+  };
+
+  // Indexed by GattEventType
+  static const CallbackEntry sCallbacks[GATT_EVENT_COUNT];
+
+  explicit MainThreadTask(const int aCommand)
+    : mCommand(aCommand)
+  {
+    GattCount(GATT_COUNTER_EVENT_ALLOCATIONS);
+  }
+
+  nsresult Run()
+  {
+    MOZ_ASSERT(NS_IsMainThread());
+    MOZ_ASSERT(sBluetoothGatt);
+
+    switch (mCommand) {
+      case MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS:
+          DeliverEvents();
+        break;
+      case MainThreadTaskCmd::ARM_NOTIFY_BATCH_TIMER:
+          ArmNotifyBatchTimer();
+        break;
+      default:
+        LOGW("MainThreadTask: Unknown command %d", mCommand);
+        break;
+    }
+
+    return NS_OK;
+  }
+
+  /**
+   * Hands the pending notify batch, if any, to the main thread. Safe to
+   * call from any thread.
+   */
+  static void FlushNotifyBatch()
+  {
+    GattEvent* batch = TakeNotifyBatch();
+    if (batch) {
+      PostEvent(batch);
+    }
+  }
+
+  /**
+   * Queues aEvent for the main thread, which delivers it and returns it to
+   * the pool. One reused task drains the queue, so posting allocates
+   * nothing once the queue has grown to the largest burst. Any thread.
+   */
+  static void PostEvent(GattEvent* aEvent)
+  {
+    nsCOMPtr<nsIRunnable> task;
+    {
+      StaticMutexAutoLock lock(sGattEventQueueMutex);
+      if (sGattEventQueue.size() == sGattEventQueue.capacity()) {
+        GattCount(GATT_COUNTER_EVENT_ALLOCATIONS);
+      }
+      sGattEventQueue.push_back(aEvent);
+      if (sGattEventTaskPosted) {
+        return;
+      }
+      if (!sGattEventTask) {
+        sGattEventTask = new MainThreadTask(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS);
+      }
+      sGattEventTaskPosted = true;
+      task = sGattEventTask.get();
+    }
+
+    if (NS_FAILED(NS_DispatchToMainThread(task))) {
+      LOGE("Failed to dispatch GATT events");
+      StaticMutexAutoLock lock(sGattEventQueueMutex);
+      sGattEventTaskPosted = false;
+    }
+  }
+
+  /**
+   * Times resolving the handler of aBench.count events, cycling through
+   * the event types, through sCallbacks as Run does and through the name
+   * compares NotifyGattCallback still does. Only the lookup is timed: the
+   * handlers would send signals for made-up events.
+   */
+  static void MeasureDispatch(GattBench& aBench)
+  {
+    MOZ_ASSERT(NS_IsMainThread());
+
+    nsString names[GATT_EVENT_COUNT];
+    for (int i = 0; i < GATT_EVENT_COUNT; ++i) {
+      names[i].AssignASCII(sCallbacks[i].mName);
+    }
+
+    // Keeps the lookups from being optimized away
+    volatile uint32_t resolved = 0;
+
+    TimeStamp start = TimeStamp::Now();
+    for (uint32_t n = 0; n < aBench.count; ++n) {
+      const nsString& name = names[n % GATT_EVENT_COUNT];
+      for (int i = 0; i < GATT_EVENT_COUNT; ++i) {
+        if (name.EqualsASCII(sCallbacks[i].mName)) {
+          resolved = resolved + (sCallbacks[i].mSend ? 1 : 2);
+          break;
+        }
+      }
+    }
+    double nameUs = (TimeStamp::Now() - start).ToMicroseconds();
+
+    aBench.start = TimeStamp::Now();
+    for (uint32_t n = 0; n < aBench.count; ++n) {
+      const CallbackEntry& entry = sCallbacks[n % GATT_EVENT_COUNT];
+      resolved = resolved + (entry.mSend ? 1 : 2);
+    }
+    double tableUs = (TimeStamp::Now() - aBench.start).ToMicroseconds();
+
+    aBench.delivered = aBench.count;
+    aBench.dispatchNs = tableUs * 1000 / aBench.count;
+    aBench.nameLookupNs = nameUs * 1000 / aBench.count;
+  }
+
+private:
+  // Delivers what was posted until now, in order
+  void DeliverEvents()
+  {
+    MOZ_ASSERT(sGattEventsDelivering.empty());
+    {
+      StaticMutexAutoLock lock(sGattEventQueueMutex);
+      // Both vectors keep their capacity
+      sGattEventsDelivering.swap(sGattEventQueue);
+      sGattEventTaskPosted = false;
+    }
+
+    for (size_t i = 0; i < sGattEventsDelivering.size(); ++i) {
+      GattEvent* event = sGattEventsDelivering[i];
+      MOZ_ASSERT(event->type < GATT_EVENT_COUNT);
+      if (sCallbacks[event->type].mSendEvent) {
+        sCallbacks[event->type].mSendEvent(*event);
+      } else {
+        StageEvent(*event);
+        (sBluetoothGatt->*sCallbacks[event->type].mSend)();
+      }
+      if (sGattBenchActive) {
+        RecordGattBenchEvent(*event);
+      }
+      ReleaseGattEvent(event);
+    }
+    sGattEventsDelivering.clear();
+  }
+
+  static void NotifyBatchTimerCallback(nsITimer* aTimer, void* aClosure)
+  {
+    FlushNotifyBatch();
+  }
+
+  // Flushes the batch opened by the bluedroid thread once the window ends
+  static void ArmNotifyBatchTimer()
+  {
+    MOZ_ASSERT(NS_IsMainThread());
+
+    if (!sNotifyBatchTimer) {
+      nsCOMPtr<nsITimer> timer = do_CreateInstance(NS_TIMER_CONTRACTID);
+      if (!timer) {
+        LOGE("Failed to create notify batch timer");
+        FlushNotifyBatch();
+        return;
+      }
+      sNotifyBatchTimer = timer;
+    }
+
+    sNotifyBatchTimer->InitWithFuncCallback(NotifyBatchTimerCallback, nullptr,
+                                            sNotifyBatchWindowMs,
+                                            nsITimer::TYPE_ONE_SHOT);
+  }
+
+  /**
+   * Copy the event into the members read by the Send*Callback builders.
+   * This runs on the main thread right before the matching Send*Callback,
+   * so those members are never written by the bluedroid thread.
+   */
+  void StageEvent(GattEvent& aEvent)
+  {
+    BluetoothGatt* gatt = sBluetoothGatt;
+
+    switch (aEvent.type) {
+      case GATT_EVENT_REGISTER_CLIENT:
+        gatt->mStatus = aEvent.status;
+        gatt->mClientIf = aEvent.clientIf;
+        memcpy(&gatt->mBtUuid, &aEvent.appUuid, sizeof(bt_uuid_t));
+        if (BT_STATUS_SUCCESS == aEvent.status) {
+          GattClientContext& client = sGattClients[aEvent.clientIf];
+          client = GattClientContext();
+          client.clientIf = aEvent.clientIf;
+          client.appUuid = aEvent.appUuid;
+        }
+        break;
+      case GATT_EVENT_CONNECT_BLE:
+        gatt->mConnectBleConnCommPara.connId = aEvent.connId;
+        gatt->mConnectBleConnCommPara.status = aEvent.status;
+        gatt->mConnectBleConnCommPara.clientIf = aEvent.clientIf;
+        memcpy(&gatt->mBdaddr, &aEvent.bda, sizeof(bt_bdaddr_t));
+        if (BT_STATUS_SUCCESS == aEvent.status) {
+          GattConnContext& conn = sGattConns[aEvent.connId];
+          conn.connId = aEvent.connId;
+          conn.clientIf = aEvent.clientIf;
+          conn.bda = aEvent.bda;
+          LOGI("conn_id:%d up for client_if:%d, %d links",
+               aEvent.connId, aEvent.clientIf, (int)sGattConns.size());
+        }
+        OnReconnectTargetConnected(aEvent.connId, aEvent.status,
+                                   aEvent.clientIf, &aEvent.bda);
+        break;
+      case GATT_EVENT_DISCONNECT_BLE:
+        gatt->mDisConnectBleConnCommPara.connId = aEvent.connId;
+        gatt->mDisConnectBleConnCommPara.status = aEvent.status;
+        gatt->mDisConnectBleConnCommPara.clientIf = aEvent.clientIf;
+        memcpy(&gatt->mBdaddr, &aEvent.bda, sizeof(bt_bdaddr_t));
+        sGattConns.erase(aEvent.connId);
+        OnReconnectTargetDisconnected(aEvent.connId);
+        break;
+      case GATT_EVENT_BLE_LISTEN:
+        gatt->mListenConnCommPara.status = aEvent.status;
+        gatt->mListenConnCommPara.serverIf = aEvent.serverIf;
+        break;
+      case GATT_EVENT_SEARCH_COMPLETE:
+        gatt->mSearchCompleteConnCommPara.connId = aEvent.connId;
+        gatt->mSearchCompleteConnCommPara.status = aEvent.status;
+        gatt->mGattServiceList.clear();
+        gatt->mGattServiceList.insert(gatt->mGattServiceList.end(),
+                aEvent.services.begin(), aEvent.services.end());
+        break;
+      case GATT_EVENT_GET_CHARACTERISTIC:
+        gatt->mGetCharacteristicConnCommPara.connId = aEvent.connId;
+        gatt->mGetCharacteristicConnCommPara.status = aEvent.status;
+        memcpy(&gatt->mSrvcId, &aEvent.srvcId, sizeof(btgatt_srvc_id_t));
+        memcpy(&gatt->mCharId, &aEvent.charId, sizeof(btgatt_gatt_id_t));
+        gatt->mCharProp = aEvent.charProp;
+        break;
+      case GATT_EVENT_GET_DESCRIPTOR:
+        gatt->mGetDescriptorConnCommPara.connId = aEvent.connId;
+        gatt->mGetDescriptorConnCommPara.status = aEvent.status;
+        memcpy(&gatt->mSrvcId, &aEvent.srvcId, sizeof(btgatt_srvc_id_t));
+        memcpy(&gatt->mCharId, &aEvent.charId, sizeof(btgatt_gatt_id_t));
+        memcpy(&gatt->mDescrId, &aEvent.descrId, sizeof(btgatt_gatt_id_t));
+        break;
+      case GATT_EVENT_GET_INCLUDED_SERVICE:
+        gatt->mGetIncludeServiceConnCommPara.connId = aEvent.connId;
+        gatt->mGetIncludeServiceConnCommPara.status = aEvent.status;
+        memcpy(&gatt->mSrvcId, &aEvent.srvcId, sizeof(btgatt_srvc_id_t));
+        memcpy(&gatt->mInclSrvcId, &aEvent.inclSrvcId, sizeof(btgatt_srvc_id_t));
+        break;
+      case GATT_EVENT_REGISTER_FOR_NOTIFICATION:
+        gatt->mRegForNotiConnCommPara.connId = aEvent.connId;
+        gatt->mRegForNotiConnCommPara.status = aEvent.status;
+        gatt->mRegistered = aEvent.registered;
+        memcpy(&gatt->mSrvcId, &aEvent.srvcId, sizeof(btgatt_srvc_id_t));
+        memcpy(&gatt->mCharId, &aEvent.charId, sizeof(btgatt_gatt_id_t));
+        break;
+      case GATT_EVENT_NOTIFY:
+        CountConnNotification(aEvent.connId);
+        gatt->mNotifyConnCommPara.connId = aEvent.connId;
+        memcpy(&gatt->mNotifyParaData, &aEvent.params.notify,
+                sizeof(btgatt_notify_params_t));
+        break;
+      case GATT_EVENT_READ_CHARACTERISTIC:
+        gatt->mReadCharacteristicConnCommPara.connId = aEvent.connId;
+        gatt->mReadCharacteristicConnCommPara.status = aEvent.status;
+        memcpy(&gatt->mReadParaData, &aEvent.params.read,
+                sizeof(btgatt_read_params_t));
+        break;
+      case GATT_EVENT_WRITE_CHARACTERISTIC:
+        gatt->mWriteCharacteristicConnCommPara.connId = aEvent.connId;
+        gatt->mWriteCharacteristicConnCommPara.status = aEvent.status;
+        memcpy(&gatt->mWriteParaData, &aEvent.params.write,
+                sizeof(btgatt_write_params_t));
+        break;
+      case GATT_EVENT_READ_DESCRIPTOR:
+        gatt->mReadDescriptorConnCommPara.connId = aEvent.connId;
+        gatt->mReadDescriptorConnCommPara.status = aEvent.status;
+        memcpy(&gatt->mReadParaData, &aEvent.params.read,
+                sizeof(btgatt_read_params_t));
+        break;
+      case GATT_EVENT_WRITE_DESCRIPTOR:
+        gatt->mWriteDescriptorConnCommPara.connId = aEvent.connId;
+        gatt->mWriteDescriptorConnCommPara.status = aEvent.status;
+        memcpy(&gatt->mWriteParaData, &aEvent.params.write,
+                sizeof(btgatt_write_params_t));
+        break;
+      case GATT_EVENT_EXECUTE_WRITE:
+        gatt->mExecuteConnCommPara.connId = aEvent.connId;
+        gatt->mExecuteConnCommPara.status = aEvent.status;
+        break;
+      case GATT_EVENT_READ_REMOTE_RSSI:
+        gatt->mReadRssiConnCommPara.clientIf = aEvent.clientIf;
+        gatt->mReadRssiConnCommPara.status = aEvent.status;
+        memcpy(&gatt->mBdaddr, &aEvent.bda, sizeof(bt_bdaddr_t));
+        gatt->mRssi = aEvent.rssi;
+        break;
+      case GATT_EVENT_NOTIFY_BATCH:
+        // Sent straight from the event by SendNotifyBatchCallback
+        break;
+      case GATT_EVENT_SCAN_RESULT:
+      case GATT_EVENT_SCAN_UPDATE:
+        // Sent straight from the event with its advertising data
+        break;
+      case GATT_EVENT_LONG_WRITE:
+        // Sent straight from the event by SendLongWriteCallback
+        break;
+      default:
+        LOGW("MainThreadTask: Unknown event %d", aEvent.type);
+        break;
+    }
+  }
+
+  int mCommand;
+};
+
+const BluetoothGatt::MainThreadTask::CallbackEntry
+BluetoothGatt::MainThreadTask::sCallbacks[GATT_EVENT_COUNT] = {
+  { BLEGATT_REGISTER_CLIENT_ID, &BluetoothGatt::SendRegisterClientCallback, nullptr },
+  { BLEGATT_SCAN_RESULT_ID, nullptr, SendScanResultCallback },
+  { BLEGATT_CONNECT_BLE_ID, &BluetoothGatt::SendConnectBleCallback, nullptr },
+  { BLEGATT_DISCONNECT_BLE_ID, &BluetoothGatt::SendDisconnectBleCallback, nullptr },
+  { BLEGATT_BLE_LISTEN_ID, &BluetoothGatt::SendListenCallback, nullptr },
+  { BLEGATT_SEARCH_COMPLETE_ID, &BluetoothGatt::SendSearchCompleteCallback, nullptr },
+  { BLEGATT_GET_CHRACTERISTIC_ID, &BluetoothGatt::SendGetCharacteristicCallback, nullptr },
+  { BLEGATT_GET_DESCRIPTOR_ID, &BluetoothGatt::SendGetDescriptorCallback, nullptr },
+  { BLEGATT_GET_INCLUDED_SERVICE_ID, &BluetoothGatt::SendGetIncludeServiceCallback, nullptr },
+  { BLEGATT_REGISTER_FOR_NOTIFICATION_ID, &BluetoothGatt::SendRegisterForNotificationCallback, nullptr },
+  { BLEGATT_NOTIFY_ID, &BluetoothGatt::SendNotifyCallback, nullptr },
+  { BLEGATT_READ_CHARACTERISTIC_ID, &BluetoothGatt::SendReadCharacteristicCallback, nullptr },
+  { BLEGATT_WRITER_HARACTERISTIC_ID, &BluetoothGatt::SendWriteCharacteristicCallback, nullptr },
+  { BLEGATT_READ_DESCRIPTOR_ID, &BluetoothGatt::SendReadDescriptorCallback, nullptr },
+  { BLEGATT_WRITE_DESCRIPTOR_ID, &BluetoothGatt::SendWriteDescriptorCallback, nullptr },
+  { BLEGATT_EXECUTE_WRITE_ID, &BluetoothGatt::SendExecuteWriteCallback, nullptr },
+  { BLEGATT_READ_REMOTERSSI_ID, &BluetoothGatt::SendReadRemoteRssiCallback, nullptr },
+  { BLEGATT_NOTIFY_BATCH_ID, nullptr, SendNotifyBatchCallback },
+  { BLEGATT_SCAN_UPDATE_ID, nullptr, SendScanUpdateCallback },
+  { BLEGATT_LONG_WRITE_ID, nullptr, SendLongWriteCallback },
+};
+
+/* Cancels and releases a timer, if it was ever created */
+static void
+ReleaseGattTimer(StaticRefPtr<nsITimer>& aTimer)
+{
+    if(aTimer)
+    {
+        aTimer->Cancel();
+        aTimer = nullptr;
+    }
+}
+
+/*
+ * Forgets the links and clients of a stack that was cleaned up: waiting
+ * requests are failed, the timers cancelled and the per-link state
+ * dropped. Main thread only.
+ */
+static void
+ResetGattState()
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    std::vector<int> connIds;
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        for(std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.begin();
+            iter != sGattOpQueues.end(); ++iter)
+        {
+            connIds.push_back(iter->first);
+        }
+    }
+    for(size_t i = 0; i < connIds.size(); ++i)
+    {
+        ResetGattOpQueue(connIds[i]);
+    }
+    {
+        StaticMutexAutoLock lock(sGattOpMutex);
+        sGattOpQueues.clear();
+    }
+    ReleaseGattTimer(sGattStreamTimer);
+    sGattStreamBackoffArmed = false;
+    ReleaseGattTimer(sGattOpWatchdog);
+    sGattOpWatchdogArmed = false;
+
+    if(sGattBench)
+    {
+        LOGE("Benchmark stopped by the stack going down");
+        FinishGattBench(GATT_STATUS_ERROR);
+    }
+    ReleaseGattTimer(sGattBenchTimer);
+
+#ifdef MOZ_BT_GATT_FAKE
+    if(sGattSelfTest)
+    {
+        LOGE("Self-test stopped by the stack going down");
+        FinishGattSelfTest();
+    }
+    ReleaseGattTimer(sGattSelfTestTimer);
+#endif
+
+    ReleaseGattEvent(TakeNotifyBatch());
+    ReleaseGattTimer(sNotifyBatchTimer);
+    ReleaseGattTimer(sGattConnProfileTimer);
+
+    sReconnectTargets.clear();
+    ReleaseGattTimer(sReconnectTimer);
+    {
+        StaticMutexAutoLock lock(sRestoreMutex);
+        sRestoreSearches.clear();
+        sRestoreRegistrations.clear();
+    }
+
+    // What was learnt over the links is still saved
+    connIds.clear();
+    {
+        StaticMutexAutoLock lock(sGattCacheMutex);
+        for(std::map<int, GattCacheConn>::iterator iter = sGattCacheConns.begin();
+            iter != sGattCacheConns.end(); ++iter)
+        {
+            connIds.push_back(iter->first);
+        }
+    }
+    for(size_t i = 0; i < connIds.size(); ++i)
+    {
+        CloseGattCacheConn(connIds[i]);
+    }
+    sGattConns.clear();
+    sGattClients.clear();
+    sPendingServices.clear();
+}
+
+// static
+void
+BluetoothGatt::InitGattInterface()
+{
+#ifdef MOZ_BT_GATT_FAKE
+    // Serve scripted peripherals instead of the controller
+    if(getenv("OWB_GATT_FAKE"))
+    {
+        LOGI("Using the fake GATT stack");
+        sBluetoothGattInterface = GetFakeGattInterface();
+    }
+    else
+#endif
+    {
+        const bt_interface_t* btInf = GetBluetoothInterface();
+        if(!btInf)
+        {
+            LOGE("GetBluetoothInterface is null");
+            return;
+        }
+
+        sBluetoothGattInterface = (btgatt_interface_t *) btInf->get_profile_interface(BT_PROFILE_GATT_ID);
+    }
+    if(!sBluetoothGattInterface)
+    {
+        LOGE("sBluetoothGattInterface is null");
+        return;
+    }
+
+    StartGattCacheThread();
+    PreallocGattEvents();
+
+    /**register callbacks***/
+#ifdef MOZ_BT_GATT_MTU
+    sBtGattClientCallbacks.configure_mtu_cb = GattConfigureMtuCallback;
+#endif
+    sBtGattCallbacks.client = &sBtGattClientCallbacks;
+    if(BT_STATUS_SUCCESS != sBluetoothGattInterface->init(&sBtGattCallbacks)) //register gatt callback
+    {
+        LOGE("BluetoothGatt register gatt callbacks function failed");
+    }
+}
+
+void
+BluetoothGatt::DeInitGattInterface()
+{
+    if (sBluetoothGattInterface) {
+        sBluetoothGattInterface->cleanup();
+        sBluetoothGattInterface = nullptr;
+    }
+    ResetGattState();
+    StopGattCacheThread();
+}
+
+BluetoothGatt::BluetoothGatt()
+{
+    LOGW("start BluetoothGatt construct");
+    LOGW("end BluetoothGatt construct");
+}
+
+// static
+BluetoothGatt*
+BluetoothGatt::Get()
+{
+    LOGI("start get");
+    MOZ_ASSERT(NS_IsMainThread());
+
+    // If sBluetoothgatt already exists, exit early
+    if (sBluetoothGatt) {
+        LOGI("sBluetoothGatt is not null");
+        return sBluetoothGatt;
+    }
+
+    // If we're in shutdown, don't create a new instance
+    //  NS_ENSURE_FALSE(sInShutdown, nullptr);
+
+    // Create a new instance, register, and return
+    BluetoothGatt* bluetoothGatt = new BluetoothGatt();
+    sBluetoothGatt = bluetoothGatt;
+
+    LOGI("end get");
+    return sBluetoothGatt;
+}
+
+nsString
+BluetoothGatt::getTest()
+{
+    return mTest;
+}
+
+BluetoothGatt::~BluetoothGatt()
+{
+    if (sBluetoothGattInterface) {
+        sBluetoothGattInterface->cleanup();
+    }
+}
+
+void
+BluetoothGatt::NotifyGattCallback(const nsAString& aType)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    // Callbacks from bluedroid are dispatched by event type in
+    // MainThreadTask::Run; this lookup by name is only kept for callers
+    // that still refer to a callback by its string id.
+    for(int i = 0; i < GATT_EVENT_COUNT; ++i)
+    {
+        if(aType.EqualsASCII(MainThreadTask::sCallbacks[i].mName))
+        {
+            // Event-based entries have nothing to send without their event
+            if(MainThreadTask::sCallbacks[i].mSend)
+            {
+                (this->*MainThreadTask::sCallbacks[i].mSend)();
+            }
+            return;
+        }
+    }
+
+    MOZ_ASSERT(false);
+}
+
+/*
+ * Queues the read or write of aRequest on its connection, taking over its
+ * value buffer.
+ */
+static bool
+SubmitGattRequestOp(GattOpType aType, BluetoothGattRequest& aRequest)
+{
+    GattOp op;
+    op.type = aType;
+    op.connId = aRequest.connId;
+    op.srvcId = aRequest.srvcId;
+    op.charId = aRequest.charId;
+    op.descrId = aRequest.descrId;
+    op.writeType = aRequest.writeType;
+    op.authReq = aRequest.authReq;
+    op.value.SwapElements(aRequest.value);
+    if(aRequest.priority < GATT_OP_PRIORITY_HIGH ||
+       aRequest.priority >= GATT_OP_PRIORITY_COUNT)
+    {
+        op.priority = DefaultGattOpPriority(op);
+    }
+    else
+    {
+        op.priority = aRequest.priority;
+    }
+
+    LOGI("GATT operation %d on conn_id:%d len:%d", aType, op.connId, op.value.Length());
+
+    // A Write Command longer than ATT_MTU - 3 would be cut short by the
+    // stack, so it goes out as that many consecutive commands instead
+    uint32_t chunk = GetGattConnMtu(op.connId) - 3;
+    if(GATT_OP_WRITE_CHARACTERISTIC != aType || GATT_WRITE_TYPE_NO_RSP != op.writeType ||
+       op.value.Length() <= chunk)
+    {
+        return SubmitGattOp(op);
+    }
+
+    uint32_t chunks = (op.value.Length() + chunk - 1) / chunk;
+    if(GetGattOpQueueDepth(op.connId) + chunks > MAX_GATT_OP_QUEUE_DEPTH)
+    {
+        GattCount(GATT_COUNTER_OPS_REJECTED);
+        LOGE("No room for %d write commands on conn_id:%d", chunks, op.connId);
+        return false;
+    }
+
+    // The chunks report as one write, see ProcessWriteCharacteristic
+    op.writeId = ++sGattWriteIds;
+    if(!op.writeId)
+    {
+        op.writeId = ++sGattWriteIds;
+    }
+
+    nsTArray<uint8_t> value;
+    value.SwapElements(op.value);
+    for(uint32_t offset = 0; offset < value.Length(); offset += chunk)
+    {
+        uint32_t len = std::min<uint32_t>(chunk, value.Length() - offset);
+        op.value.ReplaceElementsAt(0, op.value.Length(), value.Elements() + offset, len);
+        op.lastChunk = offset + len == value.Length();
+        if(!SubmitGattOp(op))
+        {
+            StaticMutexAutoLock lock(sGattOpMutex);
+            std::map<int, GattOpQueue>::iterator iter = sGattOpQueues.find(op.connId);
+            if(iter != sGattOpQueues.end())
+            {
+                CancelGattWriteChunksLocked(iter->second, op.writeId);
+            }
+            return false;
+        }
+    }
+    return true;
+}
+
+bool
+BluetoothGattSubmitRequest(BluetoothGattRequest& aRequest)
+{
+    MOZ_ASSERT(NS_IsMainThread());
+
+    if(!sBluetoothGattInterface || !sBluetoothGatt)
+    {
+        LOGE("sBluetoothGattInterface is null");
+        return false;
+    }
+
+    bool result = false;
+    switch(aRequest.type)
+    {
+    case BleFunType_scanDevice:
+    {
+        result = sBluetoothGatt->ScanLEDevice(aRequest.clientIf, aRequest.enable);
+
+        std::map<int, GattClientContext>::iterator client = sGattClients.find(aRequest.clientIf);
+        if(result && client != sGattClients.end())
+        {
+            client->second.scanning = aRequest.enable;
+        }
+        break;
+    }
+    case BleFunType_connectBle:
+        result = sBluetoothGatt->ConnectBle(aRequest.clientIf, &aRequest.bdAddr, aRequest.enable);
+        break;
+    case BleFunType_disConnectBle:
+        ForgetReconnectTarget(aRequest.clientIf, &aRequest.bdAddr);
+        result = sBluetoothGatt->DisconnectBle(aRequest.clientIf, &aRequest.bdAddr, aRequest.connId);
+        break;
+    case BleFunType_refresh:
+        // Failing to drop the stack's cache does not fail the request
+        sBluetoothGatt->Refresh(aRequest.clientIf, &aRequest.bdAddr);
+        result = true;
+        break;
+    case BleFunType_searchService:
+        result = sBluetoothGatt->SearchService(aRequest.connId,
+                aRequest.hasUuid ? &aRequest.uuid : NULL);
+        break;
+    case BleFunType_getIncludeService:
+        result = sBluetoothGatt->GetIncludeService(aRequest.connId, &aRequest.srvcId,
+                aRequest.hasInclSrvcId ? &aRequest.inclSrvcId : NULL);
+        break;
+    case BleFunType_getCharacteristic:
+        result = sBluetoothGatt->GetCharacteristic(aRequest.connId, &aRequest.srvcId,
+                aRequest.hasCharId ? &aRequest.charId : NULL);
+        break;
+    case BleFunType_getDescriptor:
+        result = sBluetoothGatt->GetDescriptor(aRequest.connId, &aRequest.srvcId,
+                &aRequest.charId, aRequest.hasDescrId ? &aRequest.descrId : NULL);
+        break;
+    case BleFunType_readCharacteristic:
+        result = SubmitGattRequestOp(GATT_OP_READ_CHARACTERISTIC, aRequest);
+        break;
+    case BleFunType_writeCharacteristic:
+        // Write Commands are split by ATT_MTU, anything else goes out whole
+        if(GATT_WRITE_TYPE_NO_RSP != aRequest.writeType &&
+           aRequest.value.Length() > GATT_MAX_ATTR_VALUE_LEN)
+        {
+            LOGE("Attribute value too long:%d", aRequest.value.Length());
+            break;
+        }
+        result = SubmitGattRequestOp(GATT_OP_WRITE_CHARACTERISTIC, aRequest);
+        break;
+    case BleFunType_readDescriptor:
+        result = SubmitGattRequestOp(GATT_OP_READ_DESCRIPTOR, aRequest);
+        break;
+    case BleFunType_writeDescriptor:
+        if(aRequest.value.Length() > GATT_MAX_ATTR_VALUE_LEN)
+        {
+            LOGE("Attribute value too long:%d", aRequest.value.Length());
+            break;
+        }
+        // Before the value is handed over to the queued operation
+        TrackTargetCccd(aRequest);
+        result = SubmitGattRequestOp(GATT_OP_WRITE_DESCRIPTOR, aRequest);
+        break;
+    case BleFunType_executeWrite:
+        result = sBluetoothGatt->ExecuteWrite(aRequest.connId, aRequest.execute);
+        break;
+    case BleFunType_registerForNotification:
+        result = sBluetoothGatt->RegisterForNotification(aRequest.clientIf, &aRequest.bdAddr,
+                &aRequest.srvcId, &aRequest.charId);
+        if(result)
+        {
+            TrackTargetRegistration(aRequest, true);
+        }
+        break;
+    case BleFunType_deregisterForNotification:
+        result = sBluetoothGatt->DeregisterForNotification(aRequest.clientIf, &aRequest.bdAddr,
+                &aRequest.srvcId, &aRequest.charId);
+        if(result)
+        {
+            TrackTargetRegistration(aRequest, false);
+        }
+        break;
+    case BleFunType_readRemoteRssi:
+        result = sBluetoothGatt->ReadRemoteRssi(aRequest.clientIf, &aRequest.bdAddr);
+        break;
+    default:
+        LOGE("No typed form of GATT request %d", aRequest.type);
+        break;
+    }
+
+    // Queued requests may have made the link busy enough for low latency
+    if(result && aRequest.connId)
+    {
+        NoteGattConnActivity(aRequest.connId);
+    }
+    return result;
+}
+
+bool BluetoothGatt::BluetoothGattOperate(uint32_t gattFunType, const nsTArray<nsString>& bleGattPara)
+{
+    LOGI("BluetoothGatt BluetoothGattOperate, gattFunType : %d", gattFunType);
+
+    bool result = true;
+    nsresult rv;
+
+    if(!sBluetoothGattInterface)
+    {
+        LOGE("sBluetoothGattInterface is null");
+        result = false;
+    }
+    else
+    {
+        //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
+        switch(gattFunType)
+        {
+        case BleFunType_RegisterClient:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::RegisterClient 1
+            if(1 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+            result = RegisterClient(bleGattPara[0]);
+            break;
+        }
+        case BleFunType_unRegisterClient:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::UnRegisterClient 1
+            if(1 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+            int clientIf = bleGattPara[0].ToInteger(&rv);
+
+            // A scan left running by an app that goes away would never stop
+            std::map<int, GattClientContext>::iterator client = sGattClients.find(clientIf);
+            if(client != sGattClients.end())
+            {
+                if(client->second.scanning)
+                {
+                    ScanLEDevice(clientIf, false);
+                }
+                sGattClients.erase(client);
+            }
+            RemoveScanFilterClient(clientIf);
+            RemoveReconnectTargets(clientIf);
+
+            result = UnRegisterClient(clientIf);
+            break;
+        }
+        case BleFunType_scanDevice:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::ScanLEDevice 2
+            if(2 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            BluetoothGattRequest request(gattFunType);
+            request.clientIf = bleGattPara[0].ToInteger(&rv);
+            request.enable = bleGattPara[1].EqualsLiteral("1");
+            result = BluetoothGattSubmitRequest(request);
+            break;
+        }
+        case BleFunType_connectBle:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::ConnectBle 3
+            if(3 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            BluetoothGattRequest request(gattFunType);
+            request.clientIf = bleGattPara[0].ToInteger(&rv);
+            StringToBdAddressType(bleGattPara[1], &request.bdAddr);
+            request.enable = bleGattPara[2].EqualsLiteral("1");
+            result = BluetoothGattSubmitRequest(request);
+            break;
+        }
+        case BleFunType_disConnectBle:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::DisconnectBle 3
+            if(3 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            BluetoothGattRequest request(gattFunType);
+            request.clientIf = bleGattPara[0].ToInteger(&rv);
+            StringToBdAddressType(bleGattPara[1], &request.bdAddr);
+            request.connId = bleGattPara[2].ToInteger(&rv);
+            result = BluetoothGattSubmitRequest(request);
+            break;
+        }
+        case BleFunType_setListen:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::SetListen 2
+            if(2 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            int clientIf = bleGattPara[0].ToInteger(&rv);
+
+            bool is_start = (bleGattPara[1].EqualsLiteral("1")) ? true : false;
+            result = SetListen(clientIf, is_start);
+            break;
+        }
+        case BleFunType_refresh:
+        case BleFunType_readRemoteRssi:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::Refresh, ReadRemoteRssi 2
+            if(2 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            BluetoothGattRequest request(gattFunType);
+            request.clientIf = bleGattPara[0].ToInteger(&rv);
+            StringToBdAddressType(bleGattPara[1], &request.bdAddr);
+            result = BluetoothGattSubmitRequest(request);
+            break;
+        }
+        case BleFunType_searchService:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::SearchService 2
+            if(2 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            BluetoothGattRequest request(gattFunType);
+            request.connId = bleGattPara[0].ToInteger(&rv);
+            nsString filterUuid(bleGattPara[1]);
+            if(!filterUuid.IsEmpty())
+            {
+                request.hasUuid = true;
+                StringToUuid(filterUuid, &request.uuid);
+            }
+            result = BluetoothGattSubmitRequest(request);
+            break;
+        }
+        case BleFunType_getIncludeService:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::GetIncludeService : 7
+            if(7 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            BluetoothGattRequest request(gattFunType);
+            request.connId = bleGattPara[0].ToInteger(&rv);
+            ParseSrvcId(bleGattPara, 1, request.srvcId);
+            if(!bleGattPara[4].IsEmpty())
+            {
+                request.hasInclSrvcId = true;
+                ParseSrvcId(bleGattPara, 4, request.inclSrvcId);
+            }
+            result = BluetoothGattSubmitRequest(request);
+            break;
+        }
+        case BleFunType_getCharacteristic:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::GetCharacteristic : 6
+            if(6 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            BluetoothGattRequest request(gattFunType);
+            request.connId = bleGattPara[0].ToInteger(&rv);
+            ParseSrvcId(bleGattPara, 1, request.srvcId);
+            if(!bleGattPara[4].IsEmpty())
+            {
+                request.hasCharId = true;
+                ParseGattId(bleGattPara, 4, request.charId);
+            }
+            result = BluetoothGattSubmitRequest(request);
+            break;
+        }
+        case BleFunType_getDescriptor:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::GetDescriptor 8
+            if(8 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            BluetoothGattRequest request(gattFunType);
+            request.connId = bleGattPara[0].ToInteger(&rv);
+            ParseSrvcId(bleGattPara, 1, request.srvcId);
+            request.hasCharId = true;
+            ParseGattId(bleGattPara, 4, request.charId);
+            if(!bleGattPara[6].IsEmpty())
+            {
+                request.hasDescrId = true;
+                ParseGattId(bleGattPara, 6, request.descrId);
+            }
+            result = BluetoothGattSubmitRequest(request);
+            break;
+        }
+        case BleFunType_readCharacteristic:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::ReadCharacteristic : 7, priority optional
+            if(7 != bleGattPara.Length() && 8 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            BluetoothGattRequest request(gattFunType);
+            request.connId = bleGattPara[0].ToInteger(&rv);
+            ParseSrvcId(bleGattPara, 1, request.srvcId);
+            ParseGattId(bleGattPara, 4, request.charId);
+            request.authReq = bleGattPara[6].ToInteger(&rv);
+            request.priority = ParseGattOpPriority(bleGattPara, 7);
+            if(!BluetoothGattSubmitRequest(request))
+            {
+                return false;
+            }
+            break;
+        }
+        case BleFunType_writeCharacteristic:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::WriteCharacteristic : 10, priority optional
+            if(10 != bleGattPara.Length() && 11 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            // The length parameter at 7 is implied by the value
+            BluetoothGattRequest request(gattFunType);
+            request.connId = bleGattPara[0].ToInteger(&rv);
+            ParseSrvcId(bleGattPara, 1, request.srvcId);
+            ParseGattId(bleGattPara, 4, request.charId);
+            request.writeType = bleGattPara[6].ToInteger(&rv);
+            request.authReq = bleGattPara[8].ToInteger(&rv);
+            if(!ParseAttrValue(bleGattPara[9], GetConnValueFormat(request.connId),
+                               request.value))
+            {
+                return false;
+            }
+            request.priority = ParseGattOpPriority(bleGattPara, 10);
+            if(!BluetoothGattSubmitRequest(request))
+            {
+                return false;
+            }
+            break;
+        }
+        case BleFunType_readDescriptor:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::ReadDescriptor 9, priority optional
+            if(9 != bleGattPara.Length() && 10 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            BluetoothGattRequest request(gattFunType);
+            request.connId = bleGattPara[0].ToInteger(&rv);
+            ParseSrvcId(bleGattPara, 1, request.srvcId);
+            ParseGattId(bleGattPara, 4, request.charId);
+            ParseGattId(bleGattPara, 6, request.descrId);
+            request.authReq = bleGattPara[8].ToInteger(&rv);
+            request.priority = ParseGattOpPriority(bleGattPara, 9);
+            if(!BluetoothGattSubmitRequest(request))
+            {
+                return false;
+            }
+            break;
+        }
+        case BleFunType_writeDescriptor:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::WriteDescriptor 12, priority optional
+            if(12 != bleGattPara.Length() && 13 != bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
+
+            // The length parameter at 9 is implied by the value
+            BluetoothGattRequest request(gattFunType);
+            request.connId = bleGattPara[0].ToInteger(&rv);
+            ParseSrvcId(bleGattPara, 1, request.srvcId);
+            ParseGattId(bleGattPara, 4, request.charId);
+            ParseGattId(bleGattPara, 6, request.descrId);
+            request.writeType = bleGattPara[8].ToInteger(&rv);
+            request.authReq = bleGattPara[10].ToInteger(&rv);
+            if(!ParseAttrValue(bleGattPara[11], GetConnValueFormat(request.connId),
+                               request.value))
+            {
+                return false;
+            }
+            request.priority = ParseGattOpPriority(bleGattPara, 12);
+            if(!BluetoothGattSubmitRequest(request))
+            {
+                return false;
+            }
+            break;
+        }
+        case BleFunType_executeWrite:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::ExecuteWrite 2
+            if(2 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
-            result = RegisterClient(bleGattPara[0]);
+
+            BluetoothGattRequest request(gattFunType);
+            request.connId = bleGattPara[0].ToInteger(&rv);
+            request.execute = bleGattPara[1].ToInteger(&rv);
+            result = BluetoothGattSubmitRequest(request);
             break;
         }
-        case BleFunType_unRegisterClient:
+        case BleFunType_registerForNotification:
+        case BleFunType_deregisterForNotification:
         {
-            //bleGattPara'size ------ BluetoothBleManager::UnRegisterClient 1
-            if(1 != bleGattPara.Length())
+            //bleGattPara'size ------ BluetoothBleManager::RegisterForNotification, deRegisterForNotification 7
+            if(7 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
-            int curClientIf = bleGattPara[0].ToInteger(&rv);
 
-            if(curClientIf != mClientIf)
+            BluetoothGattRequest request(gattFunType);
+            request.clientIf = bleGattPara[0].ToInteger(&rv);
+            StringToBdAddressType(bleGattPara[1], &request.bdAddr);
+            ParseSrvcId(bleGattPara, 2, request.srvcId);
+            ParseGattId(bleGattPara, 5, request.charId);
+            result = BluetoothGattSubmitRequest(request);
+            break;
+        }
+        case BleFunType_setAdvData:
+        {
+            //bleGattPara'size ------ BluetoothBleManager::SetAdvData 9
+            if(9 != bleGattPara.Length())
             {
-                LOGI("client_if changed!");
-                mClientIf = curClientIf;
+                LOGE("The para size is wrong!");
+                return false;
             }
-            result = UnRegisterClient(mClientIf);
+
+            int server_if = bleGattPara[0].ToInteger(&rv);
+            bool set_scan_rsp = (bleGattPara[1].EqualsLiteral("1")) ? true : false;
+            bool include_name = (bleGattPara[2].EqualsLiteral("1")) ? true : false;
+            bool include_txpower = (bleGattPara[3].EqualsLiteral("1")) ? true : false;
+            int min_interval = bleGattPara[4].ToInteger(&rv);
+            int max_interval = bleGattPara[5].ToInteger(&rv);
+            int appearance = bleGattPara[6].ToInteger(&rv);
+            uint16_t manufacturer_len = bleGattPara[7].ToInteger(&rv);
+
+            NS_ConvertUTF16toUTF8 pDataValue(bleGattPara[11]);
+            int size = sizeof(pDataValue.get());
+            char* manufacturer_data = (char *)calloc(size, sizeof(char));
+            memcpy(manufacturer_data, pDataValue.get(), size * sizeof(char));
+
+            result = SetAdvData(server_if, set_scan_rsp, include_name,
+                    include_txpower, min_interval, max_interval, appearance,
+                    manufacturer_len, manufacturer_data);
+
+            free(manufacturer_data);
             break;
         }
-        case BleFunType_scanDevice:
+        case BleFunType_setNotifyBatching:
         {
-            //bleGattPara'size ------ BluetoothBleManager::ScanLEDevice 2
+            //bleGattPara'size ------ window_ms, max_events 2
             if(2 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int curClientIf = bleGattPara[0].ToInteger(&rv);
-            if(curClientIf != mClientIf)
+            int windowMs = bleGattPara[0].ToInteger(&rv);
+            int maxEvents = bleGattPara[1].ToInteger(&rv);
+            if(windowMs < 0 || maxEvents < 0)
+            {
+                LOGE("Invalid notify batching window:%d max:%d", windowMs, maxEvents);
+                return false;
+            }
+            if(0 == maxEvents || maxEvents > MAX_NOTIFY_BATCH_EVENTS)
             {
-                LOGI("client_if changed! client_if:%d", mClientIf);
-                mClientIf = curClientIf;
-                LOGI("client_if changed! client_if:%d", mClientIf);
+                maxEvents = MAX_NOTIFY_BATCH_EVENTS;
             }
 
-            bool start = (bleGattPara[1].EqualsLiteral("1")) ? true : false;
-            result = ScanLEDevice(mClientIf, start);
+            LOGI("Notify batching window:%d max:%d", windowMs, maxEvents);
+            sNotifyBatchMaxEvents = maxEvents;
+            sNotifyBatchWindowMs = windowMs;
+            if(0 == windowMs)
+            {
+                MainThreadTask::FlushNotifyBatch();
+            }
             break;
         }
-        case BleFunType_connectBle:
+        case BleFunType_setValueFormat:
         {
-            //bleGattPara'size ------ BluetoothBleManager::ConnectBle 3
-            if(3 != bleGattPara.Length())
+            //bleGattPara'size ------ client_if, format 2
+            if(2 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
-            int curClientIf = bleGattPara[0].ToInteger(&rv);
-            if(curClientIf != mClientIf)
+
+            int clientIf = bleGattPara[0].ToInteger(&rv);
+            int format = bleGattPara[1].ToInteger(&rv);
+            if(GATT_VALUE_FORMAT_HEX != format && GATT_VALUE_FORMAT_BINARY != format)
             {
-                LOGI("client_if changed!");
-                mClientIf = curClientIf;
+                LOGE("Unknown value format:%d", format);
+                return false;
             }
 
-            StringToBdAddressType(bleGattPara[1], &mBtBdaddr);
-            bool is_direct = (bleGattPara[2].EqualsLiteral("1")) ? true : false;
-            result = ConnectBle(mClientIf, &mBtBdaddr, is_direct);
+            std::map<int, GattClientContext>::iterator client = sGattClients.find(clientIf);
+            if(client == sGattClients.end())
+            {
+                LOGE("client_if:%d is not registered", clientIf);
+                return false;
+            }
+            client->second.valueFormat = format;
             break;
         }
-        case BleFunType_disConnectBle:
+        case BleFunType_getOpQueueDepth:
         {
-            //bleGattPara'size ------ BluetoothBleManager::DisconnectBle 3
-            if(3 != bleGattPara.Length())
+            //bleGattPara'size ------ conn_id 1
+            if(1 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
-            int curClientIf = bleGattPara[0].ToInteger(&rv);
-            if(curClientIf != mClientIf)
-            {
-                LOGI("client_if changed!");
-                mClientIf = curClientIf;
-            }
 
-            StringToBdAddressType(bleGattPara[1], &mBtBdaddr);
+            int connId = bleGattPara[0].ToInteger(&rv);
 
-            int curConnId = bleGattPara[2].ToInteger(&rv);
-            if(curConnId != mConnId)
-            {
-                LOGI("curConnId changed!");
-                mConnId = curConnId;
-            }
+            nsAutoString callbackName;
+            callbackName.AssignLiteral(BLEGATT_OP_QUEUE_ID);
+            nsString data_conn_id;
+            data_conn_id.AppendInt(connId);
+            nsString data_depth;
+            data_depth.AppendInt(GetGattOpQueueDepth(connId));
+
+            InfallibleTArray<BluetoothNamedValue> data;
+            data.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+            data.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+            data.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_QUEUE_DEPTH), data_depth));
 
-            result = DisconnectBle(mClientIf, &mBtBdaddr, mConnId);
+            DistributeGattSignal(data);
             break;
         }
-        case BleFunType_setListen:
+        case BleFunType_setRefreshPolicy:
         {
-            //bleGattPara'size ------ BluetoothBleManager::SetListen 2
-            if(2 != bleGattPara.Length())
+            //bleGattPara'size ------ policy 1
+            if(1 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int curClientIf = bleGattPara[0].ToInteger(&rv);
-            if(curClientIf != mClientIf)
+            int policy = bleGattPara[0].ToInteger(&rv);
+            if(NS_FAILED(rv) || policy < GATT_REFRESH_ON_DISCONNECT ||
+               policy > GATT_REFRESH_EXPLICIT)
             {
-                LOGI("client_if changed!");
-                mClientIf = curClientIf;
+                LOGE("Unknown refresh policy:%d", policy);
+                return false;
             }
-
-            bool is_start = (bleGattPara[1].EqualsLiteral("1")) ? true : false;
-            result = SetListen(mClientIf, is_start);
+            sRefreshPolicy = policy;
             break;
         }
-        case BleFunType_refresh:
+        case BleFunType_setScanStreaming:
         {
-            //bleGattPara'size ------ BluetoothBleManager::Refresh 2
-            if(2 != bleGattPara.Length())
+            //bleGattPara'size ------ interval_ms, rssi_delta, rssi_weight 3
+            if(3 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int curClientIf = bleGattPara[0].ToInteger(&rv);
-            if(curClientIf != mClientIf)
+            int intervalMs = bleGattPara[0].ToInteger(&rv);
+            int rssiDelta = bleGattPara[1].ToInteger(&rv);
+            int rssiWeight = bleGattPara[2].ToInteger(&rv);
+            if(intervalMs < 0 || rssiDelta < 0 || rssiWeight <= 0 || rssiWeight > 100)
             {
-                LOGI("client_if changed!");
-                mClientIf = curClientIf;
+                LOGE("Invalid scan streaming interval:%d delta:%d weight:%d",
+                     intervalMs, rssiDelta, rssiWeight);
+                return false;
             }
 
-            StringToBdAddressType(bleGattPara[1], &mBtBdaddr);
-
-            Refresh(mClientIf, &mBtBdaddr);
+            LOGI("Scan streaming interval:%d delta:%d weight:%d", intervalMs, rssiDelta, rssiWeight);
+            sScanRssiDelta = rssiDelta;
+            sScanRssiWeight = rssiWeight;
+            sScanUpdateIntervalMs = intervalMs;
             break;
         }
-        case BleFunType_searchService:
+        case BleFunType_setScanFilter:
         {
-            //bleGattPara'size ------ BluetoothBleManager::SearchService 2
-            if(2 != bleGattPara.Length())
+            //bleGattPara'size ------ client_if, min_rssi, service_uuids, name_prefixes, company_ids, addresses 6
+            if(6 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int curConnId = bleGattPara[0].ToInteger(&rv);
-            if(curConnId != mConnId)
+            int clientIf = bleGattPara[0].ToInteger(&rv);
+            GattScanFilter filter;
+            if(!ParseScanFilter(bleGattPara, 1, filter))
             {
-                LOGI("curConnId changed!");
-                mConnId = curConnId;
+                LOGE("Invalid scan filter for client_if:%d", clientIf);
+                return false;
             }
 
-            nsString filterUuid = bleGattPara[1];
-            if(filterUuid.EqualsLiteral(""))
+            LOGI("Scan filter of client_if:%d uuids:%d names:%d companies:%d addresses:%d",
+                 clientIf, (int)filter.serviceUuids.size(), (int)filter.namePrefixes.size(),
+                 (int)filter.companyIds.size(), (int)filter.addresses.size());
+            SetScanFilter(clientIf, filter);
+            break;
+        }
+        case BleFunType_setScanDeviceTable:
+        {
+            //bleGattPara'size ------ capacity, max_age_ms 2
+            if(2 != bleGattPara.Length())
             {
-                LOGI("BluetoothGatt SearchService filter uuid is null");
-                result = SearchService(mConnId, NULL);
+                LOGE("The para size is wrong!");
+                return false;
             }
-            else
-            {
-                LOGI("BluetoothGatt SearchService filter uuid is not null");
 
-                StringToUuid(filterUuid, &mFilterUuid);
-                result = SearchService(mConnId, &mFilterUuid);
+            int capacity = bleGattPara[0].ToInteger(&rv);
+            int maxAgeMs = bleGattPara[1].ToInteger(&rv);
+            if(capacity <= 0 || capacity > MAX_SCAN_DEVICES || maxAgeMs < 0)
+            {
+                LOGE("Invalid scan device table capacity:%d max_age:%d", capacity, maxAgeMs);
+                return false;
             }
 
-
+            LOGI("Scan device table capacity:%d max_age:%d", capacity, maxAgeMs);
+            SetScanDeviceTable(capacity, maxAgeMs);
             break;
         }
-        case BleFunType_getIncludeService:
+        case BleFunType_getScanDevices:
         {
-            //bleGattPara'size ------ BluetoothBleManager::GetIncludeService : 7
-            if(7 != bleGattPara.Length())
+            //bleGattPara'size ------ 0
+            SendScanDevices();
+            break;
+        }
+        case BleFunType_configureMtu:
+        {
+            //bleGattPara'size ------ conn_id, mtu 2
+            if(2 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int curConnId = bleGattPara[0].ToInteger(&rv);
-            if(curConnId != mConnId)
+            int connId = bleGattPara[0].ToInteger(&rv);
+            int mtu = bleGattPara[1].ToInteger(&rv);
+            if(mtu < GATT_DEFAULT_MTU || mtu > GATT_MAX_MTU)
             {
-                LOGI("curConnId changed!");
-                mConnId = curConnId;
+                LOGE("Invalid MTU:%d for conn_id:%d", mtu, connId);
+                return false;
             }
 
-            nsString curUuid = bleGattPara[1];
-
-            StringToUuid(curUuid, &mSrvcId.id.uuid);
-            mSrvcId.id.inst_id = bleGattPara[2].ToInteger(&rv);
-            mSrvcId.is_primary = bleGattPara[3].ToInteger(&rv);
-
-            curUuid = bleGattPara[4];
-
-            if(curUuid.EqualsLiteral(""))
-            {
-                LOGI("BluetoothGatt getIncludeService charid is null");
-                result = GetIncludeService(mConnId, &mSrvcId, NULL);
-            }
-            else
+#ifdef MOZ_BT_GATT_MTU
+            if(BT_STATUS_SUCCESS != sBluetoothGattInterface->client->configure_mtu(connId, mtu))
             {
-                LOGI("BluetoothGatt getIncludeService charid is not null");
-                StringToUuid(curUuid, &mInclSrvcId.id.uuid);
-                mInclSrvcId.id.inst_id = bleGattPara[5].ToInteger(&rv);
-                mInclSrvcId.is_primary = bleGattPara[6].ToInteger(&rv);
-                result = GetIncludeService(mConnId, &mSrvcId, &mInclSrvcId);
+                LOGE("configure_mtu failed for conn_id:%d", connId);
+                return false;
             }
-
+#else
+            // Links stay at GATT_DEFAULT_MTU, as their connect callback says
+            LOGE("MTU exchange is not supported by this stack");
+            return false;
+#endif
             break;
         }
-        case BleFunType_getCharacteristic:
+        case BleFunType_longWriteCharacteristic:
         {
-            //bleGattPara'size ------ BluetoothBleManager::GetCharacteristic : 6
-            if(6 != bleGattPara.Length())
+            //bleGattPara'size ------ conn_id, srvc_id 3, char_id 2, auth_req, value 8, priority optional
+            if(8 != bleGattPara.Length() && 9 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int curConnId = bleGattPara[0].ToInteger(&rv);
-            if(curConnId != mConnId)
+            // Always a Write Request: the stack splits it into prepared
+            // writes, checks every echoed segment and executes the queue
+            // itself, cancelling it if a segment came back altered
+            BluetoothGattRequest request(BleFunType_writeCharacteristic);
+            request.connId = bleGattPara[0].ToInteger(&rv);
+            ParseSrvcId(bleGattPara, 1, request.srvcId);
+            ParseGattId(bleGattPara, 4, request.charId);
+            request.authReq = bleGattPara[6].ToInteger(&rv);
+            if(!ParseAttrValue(bleGattPara[7], GetConnValueFormat(request.connId),
+                               request.value))
             {
-                LOGI("curConnId changed!");
-                mConnId = curConnId;
+                return false;
             }
-
-            nsString curUuid = bleGattPara[1];
-
-            StringToUuid(curUuid, &mSrvcId.id.uuid);
-            mSrvcId.id.inst_id = bleGattPara[2].ToInteger(&rv);
-            mSrvcId.is_primary = bleGattPara[3].ToInteger(&rv);
-
-            curUuid = bleGattPara[4];
-
-            if(curUuid.EqualsLiteral(""))
+            if(request.value.IsEmpty())
             {
-                LOGI("BluetoothGatt getCharacteristic charid is null");
-                result = GetCharacteristic(mConnId, &mSrvcId, NULL);
+                LOGE("Nothing to write on conn_id:%d", request.connId);
+                return false;
             }
-            else
+            request.priority = ParseGattOpPriority(bleGattPara, 8);
+            if(!SubmitGattRequestOp(GATT_OP_LONG_WRITE_CHARACTERISTIC, request))
             {
-                LOGI("BluetoothGatt getCharacteristic charid is not null");
-                StringToUuid(curUuid, &mCharId.uuid);
-                mCharId.inst_id = bleGattPara[5].ToInteger(&rv);
-                result = GetCharacteristic(mConnId, &mSrvcId, &mCharId);
+                return false;
             }
-
+            NoteGattConnActivity(request.connId);
             break;
         }
-        case BleFunType_getDescriptor:
+        case BleFunType_writeStream:
         {
-            //bleGattPara'size ------ BluetoothBleManager::GetDescriptor 8
+            //bleGattPara'size ------ conn_id, srvc_id 3, char_id 2, auth_req, value 8
             if(8 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int curConnId = bleGattPara[0].ToInteger(&rv);
-            if(curConnId != mConnId)
-            {
-                LOGI("curConnId changed!");
-                mConnId = curConnId;
-            }
-
-            nsString curUuid = bleGattPara[1];
-
-            StringToUuid(curUuid, &mSrvcId.id.uuid);
-            mSrvcId.id.inst_id = bleGattPara[2].ToInteger(&rv);
-            mSrvcId.is_primary = bleGattPara[3].ToInteger(&rv);
-
-            curUuid = bleGattPara[4];
-            StringToUuid(curUuid, &mCharId.uuid);
-            mCharId.inst_id = bleGattPara[5].ToInteger(&rv);
-
-            curUuid = bleGattPara[6];
-            if(curUuid.EqualsLiteral(""))
+            int connId = bleGattPara[0].ToInteger(&rv);
+            btgatt_srvc_id_t srvcId;
+            btgatt_gatt_id_t charId;
+            ParseSrvcId(bleGattPara, 1, srvcId);
+            ParseGattId(bleGattPara, 4, charId);
+            int authReq = bleGattPara[6].ToInteger(&rv);
+            nsTArray<uint8_t> value;
+            if(!ParseAttrValue(bleGattPara[7], GetConnValueFormat(connId), value,
+                               GATT_STREAM_MAX_BUFFER))
             {
-                LOGI("BluetoothGatt getDescriptor charid is null");
-                result = GetDescriptor(mConnId, &mSrvcId, &mCharId, NULL);
+                return false;
             }
-            else
+            if(!AppendGattStream(connId, srvcId, charId, authReq, value))
             {
-                LOGI("BluetoothGatt getDescriptor charid is not null");
-                StringToUuid(curUuid, &mDescrId.uuid);
-                mDescrId.inst_id = bleGattPara[7].ToInteger(&rv);
-                result = GetDescriptor(mConnId, &mSrvcId, &mCharId, &mDescrId);
+                return false;
             }
+            NoteGattConnActivity(connId);
             break;
         }
-        case BleFunType_readCharacteristic:
+        case BleFunType_stopStream:
         {
-            //bleGattPara'size ------ BluetoothBleManager::ReadCharacteristic : 7
-            if(7 != bleGattPara.Length())
+            //bleGattPara'size ------ conn_id 1
+            if(1 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int curConnId = bleGattPara[0].ToInteger(&rv);
-            if(curConnId != mConnId)
+            if(!StopGattStream(bleGattPara[0].ToInteger(&rv)))
             {
-                LOGI("curConnId changed!");
-                mConnId = curConnId;
+                return false;
             }
-
-            nsString curUuid = bleGattPara[1];
-
-            StringToUuid(curUuid, &mSrvcId.id.uuid);
-            mSrvcId.id.inst_id = bleGattPara[2].ToInteger(&rv);
-            mSrvcId.is_primary = bleGattPara[3].ToInteger(&rv);
-
-            curUuid = bleGattPara[4];
-            StringToUuid(curUuid, &mCharId.uuid);
-            mCharId.inst_id = bleGattPara[5].ToInteger(&rv);
-
-            int auth_req = bleGattPara[6].ToInteger(&rv);
-
-            result = ReadCharacteristic(mConnId, &mSrvcId, &mCharId, auth_req);
-
             break;
         }
-        case BleFunType_writeCharacteristic:
+        case BleFunType_setConnParams:
         {
-            //bleGattPara'size ------ BluetoothBleManager::WriteCharacteristic : 10
-            if(10 != bleGattPara.Length())
+            //bleGattPara'size ------ conn_id, min_interval, max_interval, latency, timeout 5
+            if(5 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int curConnId = bleGattPara[0].ToInteger(&rv);
-            if(curConnId != mConnId)
+            int connId = bleGattPara[0].ToInteger(&rv);
+            GattConnParams params;
+            params.minInterval = bleGattPara[1].ToInteger(&rv);
+            params.maxInterval = bleGattPara[2].ToInteger(&rv);
+            params.latency = bleGattPara[3].ToInteger(&rv);
+            params.timeout = bleGattPara[4].ToInteger(&rv);
+            if(!ValidGattConnParams(params))
             {
-                LOGI("curConnId changed!");
-                mConnId = curConnId;
+                LOGE("Invalid connection parameters for conn_id:%d", connId);
+                return false;
             }
 
-            nsString curUuid = bleGattPara[1];
-
-            StringToUuid(curUuid, &mSrvcId.id.uuid);
-            mSrvcId.id.inst_id = bleGattPara[2].ToInteger(&rv);
-            mSrvcId.is_primary = bleGattPara[3].ToInteger(&rv);
-
-            curUuid = bleGattPara[4];
-            StringToUuid(curUuid, &mCharId.uuid);
-            mCharId.inst_id = bleGattPara[5].ToInteger(&rv);
-
-            int write_type = bleGattPara[6].ToInteger(&rv);
-            int len = bleGattPara[7].ToInteger(&rv);
-            int auth_req = bleGattPara[8].ToInteger(&rv);
-
-            NS_ConvertUTF16toUTF8 pDataValue(bleGattPara[9]);
-            const char* p_src_value = pDataValue.get();
-
-            uint8_t value[MAX_HEX_VAL_STR_LEN];
-            len = strlen(p_src_value);
-            scan_field(p_src_value, len, value, sizeof(value));
-
-            len = (len + 1) / 2;
-
-            LOGI("WriteCharacteristic src_data:%s dest_data:%s len:%d",p_src_value, value, len);
-
-            result = WriteCharacteristic(mConnId, &mSrvcId, &mCharId,
-                    write_type, len, auth_req, (char *)value);
-
-            break;
-        }
-        case BleFunType_readDescriptor:
-        {
-            //bleGattPara'size ------ BluetoothBleManager::ReadDescriptor 9
-            if(9 != bleGattPara.Length())
+            std::map<int, GattConnContext>::iterator conn = sGattConns.find(connId);
+            if(conn == sGattConns.end())
             {
-                LOGE("The para size is wrong!");
+                LOGE("conn_id:%d is not up", connId);
                 return false;
             }
 
-            int curConnId = bleGattPara[0].ToInteger(&rv);
-            if(curConnId != mConnId)
+            // Explicit parameters stay until the apps pick a profile
+            conn->second.profile = -1;
+            conn->second.autoProfile = false;
+            if(!RequestGattConnParams(conn->second, params, -1))
             {
-                LOGI("curConnId changed!");
-                mConnId = curConnId;
+                return false;
             }
-            nsString curUuid = bleGattPara[1];
-
-            StringToUuid(curUuid, &mSrvcId.id.uuid);
-            mSrvcId.id.inst_id = bleGattPara[2].ToInteger(&rv);
-            mSrvcId.is_primary = bleGattPara[3].ToInteger(&rv);
-
-            curUuid = bleGattPara[4];
-            StringToUuid(curUuid, &mCharId.uuid);
-            mCharId.inst_id = bleGattPara[5].ToInteger(&rv);
-
-            curUuid = bleGattPara[6];
-            StringToUuid(curUuid, &mDescrId.uuid);
-            mDescrId.inst_id = bleGattPara[7].ToInteger(&rv);
-
-            int auth_req = bleGattPara[8].ToInteger(&rv);
-
-            result = ReadDescriptor(mConnId, &mSrvcId, &mCharId, &mDescrId, auth_req);
-
             break;
         }
-        case BleFunType_writeDescriptor:
+        case BleFunType_setConnProfile:
         {
-            //bleGattPara'size ------ BluetoothBleManager::WriteDescriptor 12
-            if(12 != bleGattPara.Length())
+            //bleGattPara'size ------ conn_id, profile, auto 3
+            if(3 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int curConnId = bleGattPara[0].ToInteger(&rv);
-            if(curConnId != mConnId)
+            int connId = bleGattPara[0].ToInteger(&rv);
+            int profile = bleGattPara[1].ToInteger(&rv);
+            bool autoProfile = bleGattPara[2].ToInteger(&rv) != 0;
+            if(profile < 0 || profile >= GATT_CONN_PROFILE_COUNT)
             {
-                LOGI("curConnId changed!");
-                mConnId = curConnId;
+                LOGE("Invalid connection profile:%d", profile);
+                return false;
             }
 
-            nsString curUuid = bleGattPara[1];
-
-            StringToUuid(curUuid, &mSrvcId.id.uuid);
-            mSrvcId.id.inst_id = bleGattPara[2].ToInteger(&rv);
-            mSrvcId.is_primary = bleGattPara[3].ToInteger(&rv);
-
-            curUuid = bleGattPara[4];
-            StringToUuid(curUuid, &mCharId.uuid);
-            mCharId.inst_id = bleGattPara[5].ToInteger(&rv);
-
-            curUuid = bleGattPara[6];
-            StringToUuid(curUuid, &mDescrId.uuid);
-            mDescrId.inst_id = bleGattPara[7].ToInteger(&rv);
-
-            int write_type = bleGattPara[8].ToInteger(&rv);
-            int len = bleGattPara[9].ToInteger(&rv);
-            int auth_req = bleGattPara[10].ToInteger(&rv);
+            std::map<int, GattConnContext>::iterator conn = sGattConns.find(connId);
+            if(conn == sGattConns.end())
+            {
+                LOGE("conn_id:%d is not up", connId);
+                return false;
+            }
 
-            NS_ConvertUTF16toUTF8 pDataValue(bleGattPara[11]);
-            const char* p_src_value = pDataValue.get();
-            LOGI("===== This is a test =====");
-            uint8_t p_tar_value[MAX_HEX_DESCRIPTOR_VAL_STR_LEN];
-            len = strlen(p_src_value);
-            hex2bin(p_src_value, p_tar_value);
-            LOGI("tar: %d,%d", p_tar_value[0], p_tar_value[1]);
-            LOGI("===== This is a test =====");
-
-            len = (len + 1) / 2;
-            LOGI("WriteCharacteristic src_data:%s dest_data:%s len:%d write_type:%d auth_req:%d",p_src_value, p_tar_value, len, write_type, auth_req);
-
-            result = WriteDescriptor(mConnId, &mSrvcId, &mCharId, &mDescrId,
-                    write_type, len, auth_req, (char *)p_tar_value);
-            break;
-        }
-        case BleFunType_executeWrite:
-        {
-            //bleGattPara'size ------ BluetoothBleManager::ExecuteWrite 2
-            if(2 != bleGattPara.Length())
+            GattConnContext& context = conn->second;
+            context.profile = profile;
+            context.autoProfile = autoProfile;
+            context.tickNotifications = context.notifications;
+            if(autoProfile && IsGattConnBusy(connId))
             {
-                LOGE("The para size is wrong!");
+                context.lastBusy = TimeStamp::Now();
+                profile = GATT_CONN_PROFILE_LOW_LATENCY;
+            }
+            if(profile != context.activeProfile &&
+               !RequestGattConnParams(context, kGattConnProfiles[profile], profile))
+            {
+                context.autoProfile = false;
                 return false;
             }
-            int curConnId = bleGattPara[0].ToInteger(&rv);
-            if(curConnId != mConnId)
+            if(autoProfile)
             {
-                LOGI("mConnId changed!");
-                mConnId = curConnId;
+                StartGattConnProfileTimer();
             }
-
-            mExecute = bleGattPara[1].ToInteger(&rv);
-            result = ExecuteWrite(mConnId, mExecute);
-
             break;
         }
-        case BleFunType_registerForNotification:
+        case BleFunType_setAutoReconnect:
         {
-            //bleGattPara'size ------ BluetoothBleManager::RegisterForNotification 7
-            if(7 != bleGattPara.Length())
+            //bleGattPara'size ------ client_if, bd_addr, enable 3
+            if(3 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
-            int curClientIf = bleGattPara[0].ToInteger(&rv);
-            if(curClientIf != mClientIf)
+
+            int clientIf = bleGattPara[0].ToInteger(&rv);
+            bt_bdaddr_t bdAddr;
+            StringToBdAddressType(bleGattPara[1], &bdAddr);
+            bool enable = bleGattPara[2].ToInteger(&rv) != 0;
+            if(sGattClients.find(clientIf) == sGattClients.end())
             {
-                LOGI("client_if changed!");
-                mClientIf = curClientIf;
+                LOGE("client_if:%d is not registered", clientIf);
+                return false;
             }
 
-            StringToBdAddressType(bleGattPara[1], &mBtBdaddr);
-
-            nsString curUuid = bleGattPara[2];
-
-            StringToUuid(curUuid, &mSrvcId.id.uuid);
-            mSrvcId.id.inst_id = bleGattPara[3].ToInteger(&rv);
-            mSrvcId.is_primary = bleGattPara[4].ToInteger(&rv);
-
-            curUuid = bleGattPara[5];
-            StringToUuid(curUuid, &mCharId.uuid);
-            mCharId.inst_id = bleGattPara[6].ToInteger(&rv);
-
-            result = RegisterForNotification(mClientIf, &mBtBdaddr, &mSrvcId, &mCharId);
-
+            result = SetReconnectTarget(clientIf, &bdAddr, enable);
             break;
         }
-        case BleFunType_deregisterForNotification:
+        case BleFunType_getCacheStats:
         {
-            //bleGattPara'size ------ BluetoothBleManager::deRegisterForNotification 7
-            if(7 != bleGattPara.Length())
+            //bleGattPara'size ------ 0
+            nsAutoString callbackName;
+            callbackName.AssignLiteral(BLEGATT_CACHE_STATS_ID);
+            nsString data_cache_hits;
+            data_cache_hits.AppendInt(sCacheHits);
+            nsString data_cache_invalidations;
+            data_cache_invalidations.AppendInt(sCacheInvalidations);
+            nsString data_refresh_issued;
+            data_refresh_issued.AppendInt(sRefreshIssued);
+            nsString data_refresh_avoided;
+            data_refresh_avoided.AppendInt(sRefreshAvoided);
+
+            InfallibleTArray<BluetoothNamedValue> data;
+            data.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
+            data.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CACHE_HITS), data_cache_hits));
+            data.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CACHE_INVALIDATIONS), data_cache_invalidations));
+            data.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_REFRESH_ISSUED), data_refresh_issued));
+            data.AppendElement(
+                    BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_REFRESH_AVOIDED), data_refresh_avoided));
+
+            DistributeGattSignal(data);
+            break;
+        }
+        case BleFunType_runBenchmark:
+        {
+            //bleGattPara'size ------ workload, count, rate_hz 3
+            //  read: + conn_id, srvc uuid, inst_id, is_primary, char uuid, inst_id 9
+            //  write: + value 10
+            if(3 != bleGattPara.Length() && 9 != bleGattPara.Length() &&
+               10 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
-            int curClientIf = bleGattPara[0].ToInteger(&rv);
-            if(curClientIf != mClientIf)
+
+            nsAutoPtr<GattBench> bench(new GattBench());
+            if(bleGattPara[0].EqualsLiteral("scan"))
             {
-                LOGI("client_if changed!");
-                mClientIf = curClientIf;
+                bench->workload = GATT_BENCH_SCAN;
+            }
+            else if(bleGattPara[0].EqualsLiteral("notify"))
+            {
+                bench->workload = GATT_BENCH_NOTIFY;
+            }
+            else if(bleGattPara[0].EqualsLiteral("dispatch"))
+            {
+                bench->workload = GATT_BENCH_DISPATCH;
+            }
+            else if(bleGattPara[0].EqualsLiteral("read") && 9 == bleGattPara.Length())
+            {
+                bench->workload = GATT_BENCH_READ;
+                bench->op.type = GATT_OP_READ_CHARACTERISTIC;
+            }
+            else if(bleGattPara[0].EqualsLiteral("write") && 10 == bleGattPara.Length())
+            {
+                bench->workload = GATT_BENCH_WRITE;
+                bench->op.type = GATT_OP_WRITE_CHARACTERISTIC;
+                if(!ParseAttrValue(bleGattPara[9],
+                                   GetConnValueFormat(bleGattPara[3].ToInteger(&rv)),
+                                   bench->op.value))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                LOGE("Unknown benchmark workload");
+                return false;
             }
 
-            StringToBdAddressType(bleGattPara[1], &mBtBdaddr);
-
-            nsString curUuid = bleGattPara[2];
-
-            StringToUuid(curUuid, &mSrvcId.id.uuid);
-            mSrvcId.id.inst_id = bleGattPara[3].ToInteger(&rv);
-            mSrvcId.is_primary = bleGattPara[4].ToInteger(&rv);
-
-            curUuid = bleGattPara[5];
-            StringToUuid(curUuid, &mCharId.uuid);
-            mCharId.inst_id = bleGattPara[6].ToInteger(&rv);
-
-            result = DeregisterForNotification(mClientIf, &mBtBdaddr, &mSrvcId, &mCharId);
-
-            break;
-        }
-        case BleFunType_readRemoteRssi:
-        {
-            //bleGattPara'size ------ BluetoothBleManager::ReadRemoteRssi 2
-            if(2 != bleGattPara.Length())
+            int count = bleGattPara[1].ToInteger(&rv);
+            int rateHz = bleGattPara[2].ToInteger(&rv);
+            if(count <= 0 || count > MAX_GATT_BENCH_EVENTS || rateHz < 0)
             {
-                LOGE("The para size is wrong!");
+                LOGE("Invalid benchmark count:%d rate:%d", count, rateHz);
                 return false;
             }
+            bench->count = count;
 
-            int curClientIf = bleGattPara[0].ToInteger(&rv);
-            if(curClientIf != mClientIf)
+            if(GATT_BENCH_DISPATCH == bench->workload)
             {
-                LOGI("client_if changed!");
-                mClientIf = curClientIf;
+                // Timed right away, there is no traffic to wait for
+                if(sGattBench)
+                {
+                    LOGE("A benchmark is already running");
+                    return false;
+                }
+                MainThreadTask::MeasureDispatch(*bench);
+                sGattBench = bench.forget();
+                FinishGattBench(0);
+                break;
             }
 
-            StringToBdAddressType(bleGattPara[1], &mBtBdaddr);
+            if(GATT_BENCH_READ == bench->workload || GATT_BENCH_WRITE == bench->workload)
+            {
+                bench->op.connId = bleGattPara[3].ToInteger(&rv);
+                ParseSrvcId(bleGattPara, 4, bench->op.srvcId);
+                ParseGattId(bleGattPara, 7, bench->op.charId);
+            }
 
-            result = ReadRemoteRssi(mClientIf, &mBtBdaddr);
+            if(!StartGattBench(bench, rateHz))
+            {
+                return false;
+            }
             break;
         }
-        case BleFunType_setAdvData:
+        case BleFunType_setTraceFilter:
         {
-            //bleGattPara'size ------ BluetoothBleManager::SetAdvData 9
-            if(9 != bleGattPara.Length())
+            //bleGattPara'size ------ category_mask, level 2
+            if(2 != bleGattPara.Length())
             {
                 LOGE("The para size is wrong!");
                 return false;
             }
 
-            int server_if = bleGattPara[0].ToInteger(&rv);
-            bool set_scan_rsp = (bleGattPara[1].EqualsLiteral("1")) ? true : false;
-            bool include_name = (bleGattPara[2].EqualsLiteral("1")) ? true : false;
-            bool include_txpower = (bleGattPara[3].EqualsLiteral("1")) ? true : false;
-            int min_interval = bleGattPara[4].ToInteger(&rv);
-            int max_interval = bleGattPara[5].ToInteger(&rv);
-            int appearance = bleGattPara[6].ToInteger(&rv);
-            uint16_t manufacturer_len = bleGattPara[7].ToInteger(&rv);
-
-            NS_ConvertUTF16toUTF8 pDataValue(bleGattPara[11]);
-            int size = sizeof(pDataValue.get());
-            char* manufacturer_data = (char *)calloc(size, sizeof(char));
-            memcpy(manufacturer_data, pDataValue.get(), size * sizeof(char));
-
-            result = SetAdvData(server_if, set_scan_rsp, include_name,
-                    include_txpower, min_interval, max_interval, appearance,
-                    manufacturer_len, manufacturer_data);
+            int mask = bleGattPara[0].ToInteger(&rv);
+            int level = bleGattPara[1].ToInteger(&rv);
+            if(level < GATT_TRACE_ERROR || level > GATT_TRACE_VERBOSE)
+            {
+                LOGE("Unknown trace level:%d", level);
+                return false;
+            }
+            sTraceMask = mask;
+            sTraceLevel = level;
+            break;
+        }
+        case BleFunType_flushTrace:
+        {
+            //bleGattPara'size ------ 0
+            FlushGattTrace();
+            break;
+        }
+#ifdef MOZ_BT_GATT_FAKE
+        case BleFunType_runSelfTest:
+        {
+            //bleGattPara'size ------ 0
+            if(!StartGattSelfTest())
+            {
+                return false;
+            }
+            break;
+        }
+#endif
+        case BleFunType_getMetrics:
+        {
+            //bleGattPara'size ------ 0, or reset 1
+            if(1 < bleGattPara.Length())
+            {
+                LOGE("The para size is wrong!");
+                return false;
+            }
 
-            free(manufacturer_data);
+            SendGattMetrics();
+            if(1 == bleGattPara.Length() && bleGattPara[0].ToInteger(&rv))
+            {
+                ResetGattMetrics();
+                for(std::map<int, GattConnContext>::iterator iter = sGattConns.begin();
+                    iter != sGattConns.end(); ++iter)
+                {
+                    iter->second.notifications = 0;
+                }
+            }
+            break;
+        }
+        case BleFunType_dumpMetrics:
+        {
+            //bleGattPara'size ------ 0
+            DumpGattMetrics();
             break;
         }
         default:
@@ -1324,8 +8735,6 @@ bool BluetoothGatt::BluetoothGattOperate(uint32_t gattFunType, const nsTArray<ns
         result = true;
     }
 
-    LOGW("temp line:%d", __LINE__);
-
     return result;
 }
 
@@ -1360,7 +8769,7 @@ BluetoothGatt::RegisterClient(nsString uuid)
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->register_client(&btUuid))
     {
-        LOGE("Start BluetoothGatt RegisterClient success");
+        LOGI("Start BluetoothGatt RegisterClient success");
         result = true;
     }
     else
@@ -1376,12 +8785,15 @@ void
 BluetoothGatt::ProcessRegisterClient(int status, int client_if, bt_uuid_t *app_uuid)
 {
     LOGI("callback registerclient start");
-    mStatus = status;
-    memcpy(&mBtUuid.uu, app_uuid->uu, sizeof(bt_uuid_t));
-    mClientIf = client_if;
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_REGISTER_CLIENT);
+    event->status = status;
+    event->clientIf = client_if;
+    if(app_uuid)
+    {
+        memcpy(&event->appUuid, app_uuid, sizeof(bt_uuid_t));
+    }
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_REGISTER_CLIENT_ID));
+    MainThreadTask::PostEvent(event);
     LOGW("temp line:%d", __LINE__);
     return;
 }
@@ -1428,7 +8840,7 @@ BluetoothGatt::UnRegisterClient(int client_if)
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->unregister_client(client_if))
     {
-        LOGE("Start BluetoothGatt UnRegisterClient success");
+        LOGI("Start BluetoothGatt UnRegisterClient success");
         result = true;
     }
     else
@@ -1440,13 +8852,40 @@ BluetoothGatt::UnRegisterClient(int client_if)
     return result;
 }
 
+/* True if a registered client other than client_if has a scan running */
+static bool
+IsOtherClientScanning(int client_if)
+{
+    for(std::map<int, GattClientContext>::iterator iter = sGattClients.begin();
+        iter != sGattClients.end(); ++iter)
+    {
+        if(iter->first != client_if && iter->second.scanning)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
 /** Start or stop LE device scanning */
 bool
 BluetoothGatt::ScanLEDevice(int client_if, bool start)
 {
     LOGI("BluetoothGatt ScanLEDevice, client_if : %d", client_if);
 
-    mGattDevicesMap.clear(); //reset gatt devices map
+    // scan() is global in this HAL, so while another app scans the
+    // controller keeps scanning and the device table stays as it is
+    if(IsOtherClientScanning(client_if))
+    {
+        SetScanFilterScanning(client_if, start);
+        return true;
+    }
+
+    // Every device is new again to a scan that starts
+    if(start)
+    {
+        ResetScanDevices();
+    }
 
     bool result = true;
 
@@ -1462,7 +8901,8 @@ BluetoothGatt::ScanLEDevice(int client_if, bool start)
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->scan(client_if, start))
     {
-        LOGE("Start BluetoothGatt ScanLEDevice success");
+        LOGI("Start BluetoothGatt ScanLEDevice success");
+        SetScanFilterScanning(client_if, start);
         result = true;
     }
     else
@@ -1478,91 +8918,63 @@ BluetoothGatt::ScanLEDevice(int client_if, bool start)
 void
 BluetoothGatt::ProcessScanLEDevice(bt_bdaddr_t* bda, int rssi, uint8_t* adv_data)
 {
-    LOGI("callback ProcessScanLEDevice start");
-    BdAddressTypeToString(bda, mDeviceAddr);
-    mRssi = rssi;
-    mAdvData = adv_data;
-
-    std::map<nsString, nsString>::iterator iter = mGattDevicesMap.find(mDeviceAddr);
-    if(iter != mGattDevicesMap.end())   //jude the gatt device is existed or not
+    int raw_rssi = rssi;
+    GattCount(GATT_COUNTER_SCAN_RESULTS);
+
+    // Parsed straight into a pooled event, whose strings keep their buffers
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_SCAN_RESULT);
+    GattAdvData& adv = event->adv;
+    ParseAdvData(adv_data, adv);
+    if(!PassesScanFilters(bda, rssi, adv))
     {
-        LOGI("The device is existed");
+        GattCount(GATT_COUNTER_SCAN_FILTERED);
+        ReleaseGattEvent(event);
         return;
     }
 
-    LOGI("^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^adv_data size : %d", sizeof(adv_data));
-
-    uint8_t remote_name_len;
-    uint8_t *p_eir_remote_name=NULL;
-    bt_bdname_t bdname;
-
-    p_eir_remote_name = CheckEirData(adv_data,
-            BT_EIR_COMPLETE_LOCAL_NAME_TYPE, &remote_name_len);
-
-    if(p_eir_remote_name == NULL)
+    GattScanReport report = TrackScanResult(bda, rssi, adv);
+    if(GATT_SCAN_REPORT_NONE == report)
     {
-        p_eir_remote_name = CheckEirData(adv_data,
-                BT_EIR_SHORTENED_LOCAL_NAME_TYPE, &remote_name_len);
+        GattCount(GATT_COUNTER_SCAN_SUPPRESSED);
+        ReleaseGattEvent(event);
+        return;
     }
-    if(p_eir_remote_name == NULL)
+    GattCount(GATT_SCAN_REPORT_NEW == report ? GATT_COUNTER_SCAN_NEW : GATT_COUNTER_SCAN_UPDATES);
+
+    if(GATT_SCAN_REPORT_NEW != report)
     {
-        char str[46] = {0};
-        p_eir_remote_name = CheckBeaconData(adv_data,
-                BT_EIR_MANUFACTURER_SPECIFIC_TYPE, &remote_name_len, str);
+        event->type = GATT_EVENT_SCAN_UPDATE;
     }
+    BdAddressTypeToString(bda, event->deviceAddr);
+    event->rssi = rssi;
+    event->rawRssi = raw_rssi;
 
-    if(p_eir_remote_name)
+    if(adv.name.len)
+    {
+        CopyUTF8toUTF16(
+                nsDependentCSubstring((const char*)adv.raw + adv.name.offset, adv.name.len),
+                event->deviceName);
+    }
+    else if(GATT_BEACON_IBEACON == adv.beaconType)
     {
-        memcpy(bdname.name, p_eir_remote_name, remote_name_len);
-        bdname.name[remote_name_len]='\0';
-        mDeviceName = NS_ConvertUTF8toUTF16(((char*)bdname.name));
+        // Nameless iBeacons are listed under their proximity UUID
+        bt_uuid_t uuid;
+        AdvBeaconUuid(adv, uuid);
+        nsAutoString uuidStr;
+        FormatUuid(uuid, uuidStr);
+        event->deviceName.AssignASCII("iBeacon (");
+        event->deviceName.Append(uuidStr);
+        event->deviceName.Append(')');
     }
     else
     {
-        mDeviceName = NS_ConvertUTF8toUTF16("Unknow");
+        event->deviceName.AssignASCII("Unknow");
     }
 
-    mDeviceType = sBluetoothGattInterface->client->get_device_type(bda);
-
-    LOGI("^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^^send scan call back");
-    mGattDevicesMap.insert(std::map<nsString, nsString>::value_type(mDeviceAddr, mDeviceName));
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-            NS_LITERAL_STRING(BLEGATT_SCAN_RESULT_ID));
-}
-
-void
-BluetoothGatt::SendScanLEDeviceCallback()
-{
-    nsAutoString eventName;
-    eventName.AssignLiteral(BLUETOOTH_GATT_CALLBACKS_ID);
-
-    LOGW("temp line:%d  mRssi:%d", __LINE__, mRssi);
-
-    nsAutoString callbackName;
-    callbackName.AssignLiteral(BLEGATT_SCAN_RESULT_ID);
-    nsString data_bdaddr;
-    data_bdaddr = mDeviceAddr;
-    nsString data_rssi;
-    data_rssi.AppendInt(mRssi);
-    nsString data_device_type;
-    data_device_type.AppendInt(mDeviceType);
-
-    InfallibleTArray<BluetoothNamedValue> data;
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_BDA), data_bdaddr));
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_RSSI), data_rssi));
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_ADVDATA), mDeviceName));
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DEVICE_TYPE), data_device_type));
-
-    BluetoothSignal signal(eventName, NS_LITERAL_STRING(KEY_ADAPTER), data);
-    SendCallbackSignal(signal);
+    event->deviceType = sBluetoothGattInterface->client->get_device_type(bda);
 
-    LOGI("callback ProcessScanLEDevice end");
+    GATT_TRACE(GATT_TRACE_INFO, GATT_TRACE_SCAN_RESULT, raw_rssi, report, event->deviceType);
+    MainThreadTask::PostEvent(event);
 }
 
 /** Create a connection to a remote LE or dual-mode device */
@@ -1576,7 +8988,7 @@ BluetoothGatt::ConnectBle(int client_if, bt_bdaddr_t *bd_addr, bool is_direct)
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->connect(client_if, bd_addr, is_direct))
     {
-        LOGE("Start BluetoothGatt ConnectBle success");
+        LOGI("Start BluetoothGatt ConnectBle success");
         result = true;
     }
     else
@@ -1591,14 +9003,20 @@ void
 BluetoothGatt::ProcessConnectBle(int conn_id, int status, int client_if, bt_bdaddr_t* bda)
 {
     LOGI("callback ProcessConnectBle start");
+    GattCount(GATT_COUNTER_CONNECTS);
 
-    mConnectBleConnCommPara.connId = conn_id;
-    mConnectBleConnCommPara.status = status;
-    mConnectBleConnCommPara.clientIf = client_if;
-    memcpy(&mBdaddr, bda, sizeof(bt_bdaddr_t));
+    if(BT_STATUS_SUCCESS == status && bda)
+    {
+        OpenGattCacheConn(conn_id, client_if, bda);
+    }
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_CONNECT_BLE_ID));
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_CONNECT_BLE);
+    event->connId = conn_id;
+    event->status = status;
+    event->clientIf = client_if;
+    memcpy(&event->bda, bda, sizeof(bt_bdaddr_t));
+
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendConnectBleCallback()
@@ -1618,6 +9036,8 @@ BluetoothGatt::SendConnectBleCallback()
     data_client_if.AppendInt(mConnectBleConnCommPara.clientIf);
     nsString data_bda;
     BdAddressTypeToString(&mBdaddr, data_bda);
+    nsString data_mtu;
+    data_mtu.AppendInt(GetGattConnMtu(mConnectBleConnCommPara.connId));
 
     InfallibleTArray<BluetoothNamedValue> data;
     data.AppendElement(
@@ -1630,6 +9050,8 @@ BluetoothGatt::SendConnectBleCallback()
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CLIENTIF), data_client_if));
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_BDA), data_bda));
+    data.AppendElement(
+            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_MTU), data_mtu));
 
     BluetoothSignal signal(eventName, NS_LITERAL_STRING(KEY_ADAPTER), data);
     SendCallbackSignal(signal);
@@ -1646,12 +9068,24 @@ BluetoothGatt::DisconnectBle(int client_if, bt_bdaddr_t *bd_addr, int conn_id)
 
     bool result = true;
 
-    sBluetoothGattInterface->client->refresh(client_if, bd_addr);
+    // Rediscovering on every reconnect is slow, so by default the stack
+    // keeps its cache across disconnects and is refreshed only when the
+    // peer's database is known to have changed.
+    if(GATT_REFRESH_ON_DISCONNECT == sRefreshPolicy)
+    {
+        InvalidateGattCache(BdAddrKey(bd_addr));
+        sBluetoothGattInterface->client->refresh(client_if, bd_addr);
+        ++sRefreshIssued;
+    }
+    else
+    {
+        ++sRefreshAvoided;
+    }
 
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->disconnect(client_if, bd_addr, conn_id))
     {
-        LOGE("Start BluetoothGatt DisconnectBle success");
+        LOGI("Start BluetoothGatt DisconnectBle success");
         result = true;
     }
     else
@@ -1666,14 +9100,20 @@ void
 BluetoothGatt::ProcessDisconnectBle(int conn_id, int status, int client_if, bt_bdaddr_t* bda)
 {
     LOGI("callback ProcessDisconnectBle start");
+    GattCount(GATT_COUNTER_DISCONNECTS);
+
+    ResetGattOpQueue(conn_id);
+    CloseGattCacheConn(conn_id);
+    DropRestoreState(conn_id);
+    sPendingServices.erase(conn_id);
 
-    mDisConnectBleConnCommPara.connId = conn_id;
-    mDisConnectBleConnCommPara.status = status;
-    mDisConnectBleConnCommPara.clientIf = client_if;
-    memcpy(&mBdaddr, bda, sizeof(bt_bdaddr_t));
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_DISCONNECT_BLE);
+    event->connId = conn_id;
+    event->status = status;
+    event->clientIf = client_if;
+    memcpy(&event->bda, bda, sizeof(bt_bdaddr_t));
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_DISCONNECT_BLE_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendDisconnectBleCallback()
@@ -1723,7 +9163,7 @@ BluetoothGatt::SetListen(int client_if, bool start)
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->listen(client_if, start))
     {
-        LOGE("Start BluetoothGatt Listen success");
+        LOGI("Start BluetoothGatt Listen success");
         result = true;
     }
     else
@@ -1739,11 +9179,11 @@ BluetoothGatt::ProcessListen(int status, int server_if)
 {
     LOGI("callback ProcessListen start");
 
-    mListenConnCommPara.status = status;
-    mListenConnCommPara.serverIf = server_if;
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_BLE_LISTEN);
+    event->status = status;
+    event->serverIf = server_if;
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_BLE_LISTEN_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendListenCallback()
@@ -1782,10 +9222,13 @@ BluetoothGatt::Refresh(int client_if, const bt_bdaddr_t *bd_addr)
 
     bool result = true;
 
+    InvalidateGattCache(BdAddrKey(bd_addr));
+    ++sRefreshIssued;
+
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->refresh(client_if, bd_addr))
     {
-        LOGE("Start BluetoothGatt Refresh success");
+        LOGI("Start BluetoothGatt Refresh success");
         result = true;
     }
     else
@@ -1809,9 +9252,24 @@ BluetoothGatt::SearchService(int conn_id, bt_uuid_t *btUuid) //nsString filterUu
     bool result = true;
     mGattServiceList.clear();
 
+    // A target being rediscovered after a reconnect answers with that search
+    if(JoinRestoreSearch(conn_id, btUuid))
+    {
+        return true;
+    }
+
+    // The stack still needs its own search before it can resolve any
+    // attribute, so reads and writes wait for it while the apps carry on
+    // with the cached services.
+    GattEvent* cached = ReplayCachedServices(conn_id, btUuid);
+    if(cached)
+    {
+        SetGattOpGate(conn_id, true);
+    }
+
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->search_service(conn_id, btUuid))  //sBluetoothGattInterface->client->search_service(conn_id, NULL)
     {
-        LOGE("Start BluetoothGatt SearchService success");
+        LOGI("Start BluetoothGatt SearchService success");
         result = true;
     }
     else
@@ -1820,6 +9278,21 @@ BluetoothGatt::SearchService(int conn_id, bt_uuid_t *btUuid) //nsString filterUu
         result = false;
     }
 
+    if(cached)
+    {
+        if(result)
+        {
+            LOGI("SearchService conn_id:%d answered from cache", conn_id);
+            MainThreadTask::PostEvent(cached);
+        }
+        else
+        {
+            CancelCachedServices(conn_id);
+            SetGattOpGate(conn_id, false);
+            ReleaseGattEvent(cached);
+        }
+    }
+
     return result;
 }
 
@@ -1828,10 +9301,7 @@ BluetoothGatt::ProcessSearchResult(int conn_id, btgatt_srvc_id_t *srvc_id)
 {
     LOGI("callback ProcessSearchResult start");
 
-    mConnId = conn_id;
-    memcpy(&mSrvcId, srvc_id, sizeof(btgatt_srvc_id_t));
-
-    mGattServiceList.push_back(mSrvcId);
+    sPendingServices[conn_id].push_back(*srvc_id);
 }
 
 void
@@ -1839,11 +9309,53 @@ BluetoothGatt::ProcessSearchComplete(int conn_id, int status)
 {
     LOGI("callback ProcessSearchComplete start");
 
-    mSearchCompleteConnCommPara.connId = conn_id;
-    mSearchCompleteConnCommPara.status = status;
+    std::vector<btgatt_srvc_id_t> services;
+    std::map<int, std::vector<btgatt_srvc_id_t> >::iterator pending =
+        sPendingServices.find(conn_id);
+    if(pending != sPendingServices.end())
+    {
+        services.swap(pending->second);
+        sPendingServices.erase(pending);
+    }
+
+    GattRestoreSearch restore;
+    bool restoring = TakeRestoreSearch(conn_id, restore);
+    if(restoring)
+    {
+        NS_DispatchToMainThread(new GattRestoreTask(conn_id, status, true));
+    }
+
+    if(RecordCachedServices(conn_id, status, services) ||
+       (restoring && !restore.appWaiting))
+    {
+        SetGattOpGate(conn_id, false);
+        return;
+    }
+    SetGattOpGate(conn_id, false);
+
+    // The restore search was unfiltered, unlike the one the apps joined it with
+    if(restoring && restore.hasFilter)
+    {
+        std::vector<btgatt_srvc_id_t>::iterator iter = services.begin();
+        while(iter != services.end())
+        {
+            if(memcmp(iter->id.uuid.uu, restore.filter.uu, sizeof(restore.filter.uu)))
+            {
+                iter = services.erase(iter);
+            }
+            else
+            {
+                ++iter;
+            }
+        }
+    }
+
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_SEARCH_COMPLETE);
+    event->connId = conn_id;
+    event->status = status;
+    event->services.swap(services);
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_SEARCH_COMPLETE_ID));
+    MainThreadTask::PostEvent(event);
 }
 
 void
@@ -1864,6 +9376,7 @@ BluetoothGatt::SendSearchCompleteCallback()
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(mSearchCompleteConnCommPara.connId, data);
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
 
@@ -1902,6 +9415,7 @@ BluetoothGatt::SendSearchResultCallback(int conn_id, btgatt_srvc_id_t srvc_id)
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(conn_id, data);
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ID_UUID), data_srvc_id_id_uuid));
     data.AppendElement(
@@ -1930,7 +9444,7 @@ BluetoothGatt::GetIncludeService(int conn_id, btgatt_srvc_id_t *srvc_id,
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->get_included_service(conn_id, srvc_id, start_incl_srvc_id))
     {
-        LOGE("Start BluetoothGatt GetIncludeService success");
+        LOGI("Start BluetoothGatt GetIncludeService success");
         result = true;
     }
     else
@@ -1947,13 +9461,19 @@ BluetoothGatt::ProcessGetIncludeService(int conn_id, int status,
 {
     LOGI("callback ProcessGetIncludeService start");
 
-    mGetIncludeServiceConnCommPara.connId = conn_id;
-    mGetIncludeServiceConnCommPara.status = status;
-    memcpy(&mSrvcId, srvc_id, sizeof(btgatt_srvc_id_t));
-    memcpy(&mInclSrvcId, incl_srvc_id, sizeof(btgatt_srvc_id_t));
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_GET_INCLUDED_SERVICE);
+    event->connId = conn_id;
+    event->status = status;
+    if(srvc_id)
+    {
+        memcpy(&event->srvcId, srvc_id, sizeof(btgatt_srvc_id_t));
+    }
+    if(incl_srvc_id)
+    {
+        memcpy(&event->inclSrvcId, incl_srvc_id, sizeof(btgatt_srvc_id_t));
+    }
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_GET_INCLUDED_SERVICE_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendGetIncludeServiceCallback()
@@ -1991,6 +9511,7 @@ BluetoothGatt::SendGetIncludeServiceCallback()
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(mGetIncludeServiceConnCommPara.connId, data);
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
     data.AppendElement(
@@ -2023,10 +9544,17 @@ BluetoothGatt::GetCharacteristic(int conn_id, btgatt_srvc_id_t *srvc_id, btgatt_
 
     bool result = true;
 
+    GattEvent* cached = ReplayCachedCharacteristic(conn_id, srvc_id, start_char_id);
+    if(cached)
+    {
+        MainThreadTask::PostEvent(cached);
+        return result;
+    }
+
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->get_characteristic(conn_id, srvc_id, start_char_id))
     {
-        LOGE("Start BluetoothGatt GetCharacteristic success");
+        LOGI("Start BluetoothGatt GetCharacteristic success");
         result = true;
     }
     else
@@ -2043,14 +9571,22 @@ BluetoothGatt::ProcessGetCharacteristic(int conn_id, int status,
 {
     LOGI("callback ProcessGetCharacteristic start");
 
-    mGetCharacteristicConnCommPara.connId = conn_id;
-    mGetCharacteristicConnCommPara.status = status;
-    memcpy(&mSrvcId, srvc_id, sizeof(btgatt_srvc_id_t));
-    memcpy(&mCharId, char_id, sizeof(btgatt_gatt_id_t));
-    mCharProp = char_prop;
+    RecordCachedCharacteristic(conn_id, status, srvc_id, char_id, char_prop);
+
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_GET_CHARACTERISTIC);
+    event->connId = conn_id;
+    event->status = status;
+    if(srvc_id)
+    {
+        memcpy(&event->srvcId, srvc_id, sizeof(btgatt_srvc_id_t));
+    }
+    if(char_id)
+    {
+        memcpy(&event->charId, char_id, sizeof(btgatt_gatt_id_t));
+    }
+    event->charProp = char_prop;
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_GET_CHRACTERISTIC_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendGetCharacteristicCallback()
@@ -2085,6 +9621,7 @@ BluetoothGatt::SendGetCharacteristicCallback()
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(mGetCharacteristicConnCommPara.connId, data);
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
     data.AppendElement(
@@ -2118,11 +9655,18 @@ BluetoothGatt::GetDescriptor(int conn_id, btgatt_srvc_id_t *srvc_id, btgatt_gatt
 
     bool result = true;
 
+    GattEvent* cached = ReplayCachedDescriptor(conn_id, srvc_id, char_id, start_descr_id);
+    if(cached)
+    {
+        MainThreadTask::PostEvent(cached);
+        return result;
+    }
+
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->get_descriptor(conn_id, srvc_id, char_id,
                                                              start_descr_id))
     {
-        LOGE("Start BluetoothGatt GetDescriptor success");
+        LOGI("Start BluetoothGatt GetDescriptor success");
         result = true;
     }
     else
@@ -2140,16 +9684,26 @@ BluetoothGatt::ProcessGetDescriptor(int conn_id, int status,
 {
     LOGI("callback ProcessGetDescriptor start");
 
-    mGetDescriptorConnCommPara.connId = conn_id;
-    mGetDescriptorConnCommPara.status = status;
+    RecordCachedDescriptor(conn_id, status, srvc_id, char_id, descr_id);
+
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_GET_DESCRIPTOR);
+    event->connId = conn_id;
+    event->status = status;
     LOGI("############### readdescrip uuid mConnId:%d mStatus:%d", conn_id, status);
-    LOGI("############### readdescrip uuid mConnId:%d mStatus:%d", mGetDescriptorConnCommPara.connId, mGetDescriptorConnCommPara.status);
-    memcpy(&mSrvcId, srvc_id, sizeof(btgatt_srvc_id_t));
-    memcpy(&mCharId, char_id, sizeof(btgatt_gatt_id_t));
-    memcpy(&mDescrId, descr_id, sizeof(btgatt_gatt_id_t));
+    if(srvc_id)
+    {
+        memcpy(&event->srvcId, srvc_id, sizeof(btgatt_srvc_id_t));
+    }
+    if(char_id)
+    {
+        memcpy(&event->charId, char_id, sizeof(btgatt_gatt_id_t));
+    }
+    if(descr_id)
+    {
+        memcpy(&event->descrId, descr_id, sizeof(btgatt_gatt_id_t));
+    }
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_GET_DESCRIPTOR_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendGetDescriptorCallback()
@@ -2188,6 +9742,7 @@ BluetoothGatt::SendGetDescriptorCallback()
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(mGetDescriptorConnCommPara.connId, data);
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
     data.AppendElement(
@@ -2222,7 +9777,7 @@ BluetoothGatt::ReadCharacteristic(int conn_id, btgatt_srvc_id_t *srvc_id, btgatt
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->read_characteristic(conn_id, srvc_id, char_id, auth_req))
     {
-        LOGE("Start BluetoothGatt ReadCharacteristic success");
+        LOGI("Start BluetoothGatt ReadCharacteristic success");
         result = true;
     }
     else
@@ -2236,14 +9791,16 @@ BluetoothGatt::ReadCharacteristic(int conn_id, btgatt_srvc_id_t *srvc_id, btgatt
 void
 BluetoothGatt::ProcessReadCharacteristic(int conn_id, int status, btgatt_read_params_t *p_data)
 {
-    LOGI("callback ProcessReadCharacteristic start");
+    GATT_TRACE(GATT_TRACE_INFO, GATT_TRACE_READ, conn_id, status, p_data->value.len);
+
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_READ_CHARACTERISTIC);
+    event->connId = conn_id;
+    event->status = status;
+    memcpy(&event->params.read, p_data, sizeof(btgatt_read_params_t));
 
-    mReadCharacteristicConnCommPara.connId = conn_id;
-    mReadCharacteristicConnCommPara.status = status;
-    memcpy(&mReadParaData, p_data, sizeof(btgatt_read_params_t));
+    CompleteGattOp(conn_id, status);
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_READ_CHARACTERISTIC_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendReadCharacteristicCallback()
@@ -2277,12 +9834,6 @@ BluetoothGatt::SendReadCharacteristicCallback()
     data_descr_id_inst_id.AppendInt(mReadParaData.descr_id.inst_id);
 
     LOGI("^^^^^^^^^^^^^^^^^^^^^ btgatt_read_params_t len:%d", mReadParaData.value.len);
-    nsString data_value;
-    char strValue[MAX_HEX_VAL_STR_LEN];
-    array2str(mReadParaData.value.value, mReadParaData.value.len, strValue, sizeof(strValue));
-
-    LOGI("############### strValue:%s", strValue);
-    data_value = NS_ConvertUTF8toUTF16(strValue);
 
     nsString data_value_type;
     data_value_type.AppendInt(mReadParaData.descr_id.inst_id);
@@ -2296,6 +9847,7 @@ BluetoothGatt::SendReadCharacteristicCallback()
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(mReadCharacteristicConnCommPara.connId, data);
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ID_UUID), data_srvc_id_id_uuid));
@@ -2314,8 +9866,9 @@ BluetoothGatt::SendReadCharacteristicCallback()
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DESCRID_INSTID), data_descr_id_inst_id));
 
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DESCRID_VALUE), data_value));
+    AppendAttrValue(mReadParaData.value.value, mReadParaData.value.len,
+            sizeof(mReadParaData.value.value),
+            GetConnValueFormat(mReadCharacteristicConnCommPara.connId), data);
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DESCRID_VALUE_TYPE), data_value_type));
@@ -2343,7 +9896,7 @@ BluetoothGatt::WriteCharacteristic(int conn_id, btgatt_srvc_id_t *srvc_id, btgat
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->write_characteristic(conn_id, srvc_id, char_id,
                                                 write_type, len, auth_req, p_value))
     {
-        LOGE("Start BluetoothGatt WriteCharacteristic success");
+        LOGI("Start BluetoothGatt WriteCharacteristic success");
         result = true;
     }
     else
@@ -2357,14 +9910,34 @@ BluetoothGatt::WriteCharacteristic(int conn_id, btgatt_srvc_id_t *srvc_id, btgat
 void
 BluetoothGatt::ProcessWriteCharacteristic(int conn_id, int status, btgatt_write_params_t *p_data)
 {
-    LOGI("callback ProcessWriteCharacteristic start");
+    GATT_TRACE(GATT_TRACE_INFO, GATT_TRACE_WRITE, conn_id, status, 0);
+
+    GattOpDone done = CompleteGattOp(conn_id, status);
+    if(GATT_OP_STREAM_WRITE == done.type)
+    {
+        // Streams report their progress on their own
+        return;
+    }
+    // A split Write Command reports once, after its last chunk or the
+    // first one that failed, which cancelled the rest
+    if(done.writeId && !done.lastChunk && (!status || GATT_STATUS_CONGESTED == status))
+    {
+        return;
+    }
+
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_WRITE_CHARACTERISTIC);
+    event->connId = conn_id;
+    event->status = status;
+    memcpy(&event->params.write, p_data, sizeof(btgatt_write_params_t));
 
-    mWriteCharacteristicConnCommPara.connId = conn_id;
-    mWriteCharacteristicConnCommPara.status = status;
-    memcpy(&mWriteParaData, p_data, sizeof(btgatt_write_params_t));
+    if(GATT_OP_LONG_WRITE_CHARACTERISTIC == done.type)
+    {
+        event->type = GATT_EVENT_LONG_WRITE;
+        event->valueLen = done.len;
+        event->elapsedUs = done.elapsedUs;
+    }
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_WRITER_HARACTERISTIC_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendWriteCharacteristicCallback()
@@ -2408,6 +9981,7 @@ BluetoothGatt::SendWriteCharacteristicCallback()
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(mWriteCharacteristicConnCommPara.connId, data);
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
@@ -2448,7 +10022,7 @@ BluetoothGatt::ReadDescriptor(int conn_id, btgatt_srvc_id_t *srvc_id, btgatt_gat
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->read_descriptor(conn_id, srvc_id, char_id,
                                             descr_id, auth_req))
     {
-        LOGE("Start BluetoothGatt ReadDescriptor success");
+        LOGI("Start BluetoothGatt ReadDescriptor success");
         result = true;
     }
     else
@@ -2464,12 +10038,14 @@ BluetoothGatt::ProcessReadDescriptor(int conn_id, int status, btgatt_read_params
 {
     LOGI("callback ProcessReadDescriptor start");
 
-    mReadDescriptorConnCommPara.connId = conn_id;
-    mReadDescriptorConnCommPara.status = status;
-    memcpy(&mReadParaData, p_data, sizeof(btgatt_read_params_t));
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_READ_DESCRIPTOR);
+    event->connId = conn_id;
+    event->status = status;
+    memcpy(&event->params.read, p_data, sizeof(btgatt_read_params_t));
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_READ_DESCRIPTOR_ID));
+    CompleteGattOp(conn_id, status);
+
+    MainThreadTask::PostEvent(event);
 }
 void BluetoothGatt::SendReadDescriptorCallback()
 {
@@ -2502,12 +10078,6 @@ void BluetoothGatt::SendReadDescriptorCallback()
     data_descr_id_inst_id.AppendInt(mReadParaData.descr_id.inst_id);
 
     LOGI("^^^^^^^^^^^^^^^^^^^^^ btgatt_read_params_t len:%d", mReadParaData.value.len);
-    nsString data_value;
-    char strValue[MAX_HEX_VAL_STR_LEN];
-    array2str(mReadParaData.value.value, mReadParaData.value.len, strValue, sizeof(strValue));
-
-    LOGI("############### readdescrip strValue:%s", strValue);
-    data_value = NS_ConvertUTF8toUTF16(strValue);
 
     nsString data_value_type;
     data_value_type.AppendInt(mReadParaData.descr_id.inst_id);
@@ -2521,6 +10091,7 @@ void BluetoothGatt::SendReadDescriptorCallback()
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(mReadDescriptorConnCommPara.connId, data);
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ID_UUID), data_srvc_id_id_uuid));
@@ -2539,8 +10110,9 @@ void BluetoothGatt::SendReadDescriptorCallback()
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DESCRID_INSTID), data_descr_id_inst_id));
 
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DESCRID_VALUE), data_value));
+    AppendAttrValue(mReadParaData.value.value, mReadParaData.value.len,
+            sizeof(mReadParaData.value.value),
+            GetConnValueFormat(mReadDescriptorConnCommPara.connId), data);
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DESCRID_VALUE_TYPE), data_value_type));
@@ -2569,7 +10141,7 @@ BluetoothGatt::WriteDescriptor(int conn_id, btgatt_srvc_id_t *srvc_id, btgatt_ga
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->write_descriptor(conn_id, srvc_id, char_id, descr_id,
             write_type, len, auth_req, p_value))
     {
-        LOGE("Start BluetoothGatt WriteDescriptor success");
+        LOGI("Start BluetoothGatt WriteDescriptor success");
         result = true;
     }
     else
@@ -2585,12 +10157,23 @@ BluetoothGatt::ProcessWriteDescriptor(int conn_id, int status, btgatt_write_para
 {
     LOGI("callback ProcessWriteDescriptor start");
 
-    mWriteDescriptorConnCommPara.connId = conn_id;
-    mWriteDescriptorConnCommPara.status = status;
-    memcpy(&mWriteParaData, p_data, sizeof(btgatt_write_params_t));
+    // CCCDs restored after a reconnect are no answer to the apps
+    if(GATT_OP_RESTORE_DESCRIPTOR == CompleteGattOp(conn_id, status).type)
+    {
+        if(status)
+        {
+            LOGE("Restoring a CCCD on conn_id:%d failed:%d", conn_id, status);
+        }
+        NS_DispatchToMainThread(new GattRestoreTask(conn_id, status, false));
+        return;
+    }
+
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_WRITE_DESCRIPTOR);
+    event->connId = conn_id;
+    event->status = status;
+    memcpy(&event->params.write, p_data, sizeof(btgatt_write_params_t));
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_WRITE_DESCRIPTOR_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendWriteDescriptorCallback()
@@ -2634,6 +10217,7 @@ BluetoothGatt::SendWriteDescriptorCallback()
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(mWriteDescriptorConnCommPara.connId, data);
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
@@ -2672,7 +10256,7 @@ BluetoothGatt::ExecuteWrite(int conn_id, int execute)
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->execute_write(conn_id, execute))
     {
-        LOGE("Start BluetoothGatt ExecuteWrite success");
+        LOGI("Start BluetoothGatt ExecuteWrite success");
         result = true;
     }
     else
@@ -2688,11 +10272,11 @@ BluetoothGatt::ProcessExecuteWrite(int conn_id, int status)
 {
     LOGI("callback ProcessExecuteWrite start");
 
-    mExecuteConnCommPara.connId = conn_id;
-    mExecuteConnCommPara.status = status;
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_EXECUTE_WRITE);
+    event->connId = conn_id;
+    event->status = status;
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_EXECUTE_WRITE_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendExecuteWriteCallback()
@@ -2714,6 +10298,7 @@ BluetoothGatt::SendExecuteWriteCallback()
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(mExecuteConnCommPara.connId, data);
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_STATUS), data_status));
 
@@ -2739,7 +10324,7 @@ BluetoothGatt::RegisterForNotification(int client_if, const bt_bdaddr_t *bd_addr
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->register_for_notification(client_if, bd_addr, srvc_id,
                                                         char_id))
     {
-        LOGE("Start BluetoothGatt RegisterForNotification success");
+        LOGI("Start BluetoothGatt RegisterForNotification success");
         result = true;
     }
     else
@@ -2756,14 +10341,30 @@ BluetoothGatt::ProcessRegisterForNotification(int conn_id, int registered, int s
 {
     LOGI("callback ProcessRegisterForNotification start");
 
-    mRegForNotiConnCommPara.connId = conn_id;
-    mRegistered = registered;
-    mRegForNotiConnCommPara.status = status;
-    memcpy(&mSrvcId, srvc_id, sizeof(btgatt_srvc_id_t));
-    memcpy(&mCharId, char_id, sizeof(btgatt_gatt_id_t));
+    if(srvc_id && char_id && TakeRestoreRegistration(conn_id, *srvc_id, *char_id))
+    {
+        if(status)
+        {
+            LOGE("Restoring a registration on conn_id:%d failed:%d", conn_id, status);
+        }
+        NS_DispatchToMainThread(new GattRestoreTask(conn_id, status, false));
+        return;
+    }
+
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_REGISTER_FOR_NOTIFICATION);
+    event->connId = conn_id;
+    event->registered = registered;
+    event->status = status;
+    if(srvc_id)
+    {
+        memcpy(&event->srvcId, srvc_id, sizeof(btgatt_srvc_id_t));
+    }
+    if(char_id)
+    {
+        memcpy(&event->charId, char_id, sizeof(btgatt_gatt_id_t));
+    }
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_REGISTER_FOR_NOTIFICATION_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendRegisterForNotificationCallback()
@@ -2801,6 +10402,7 @@ BluetoothGatt::SendRegisterForNotificationCallback()
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
+    AppendConnClientIf(mRegForNotiConnCommPara.connId, data);
 
     data.AppendElement(
             BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_REGISTERED), data_registered));
@@ -2839,7 +10441,7 @@ BluetoothGatt::DeregisterForNotification(int client_if, const bt_bdaddr_t *bd_ad
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->deregister_for_notification(client_if,
                                             bd_addr, srvc_id, char_id))
     {
-        LOGE("Start BluetoothGatt DeregisterForNotification success");
+        LOGI("Start BluetoothGatt DeregisterForNotification success");
         result = true;
     }
     else
@@ -2862,7 +10464,7 @@ BluetoothGatt::ReadRemoteRssi(int client_if, const bt_bdaddr_t *bd_addr)
     //BT_STATUS_SUCCESS-suceess, BT_STATUS_NOMEM-failed
     if(BT_STATUS_SUCCESS == sBluetoothGattInterface->client->read_remote_rssi(client_if, bd_addr))
     {
-        LOGE("Start BluetoothGatt ReadRemoteRssi success");
+        LOGI("Start BluetoothGatt ReadRemoteRssi success");
         result = true;
     }
     else
@@ -2878,13 +10480,13 @@ BluetoothGatt::ProcessReadRemoteRssi(int client_if, bt_bdaddr_t* bda, int rssi,
 {
     LOGI("callback ProcessReadRemoteRssi start");
 
-    mReadRssiConnCommPara.clientIf = client_if;
-    memcpy(&mBdaddr, bda, sizeof(bt_bdaddr_t));
-    mRssi = rssi;
-    mReadRssiConnCommPara.status = status;
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_READ_REMOTE_RSSI);
+    event->clientIf = client_if;
+    memcpy(&event->bda, bda, sizeof(bt_bdaddr_t));
+    event->rssi = rssi;
+    event->status = status;
 
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_READ_REMOTERSSI_ID));
+    MainThreadTask::PostEvent(event);
 }
 void
 BluetoothGatt::SendReadRemoteRssiCallback()
@@ -2945,7 +10547,7 @@ BluetoothGatt::SetAdvData(int server_if, bool set_scan_rsp, bool include_name,
             include_txpower, min_interval, max_interval, appearance,
             manufacturer_len, manufacturer_data))
     {
-        LOGE("Start BluetoothGatt SetAdvData success");
+        LOGI("Start BluetoothGatt SetAdvData success");
         result = true;
     }
     else
@@ -2960,92 +10562,62 @@ BluetoothGatt::SetAdvData(int server_if, bool set_scan_rsp, bool include_name,
 void
 BluetoothGatt::ProcessNotify(int conn_id, btgatt_notify_params_t *p_data)
 {
-    LOGI("callback ProcessNotify start");
-
-    mNotifyConnCommPara.connId = conn_id;
-    memcpy(&mNotifyParaData, p_data, sizeof(btgatt_notify_params_t));
-
-    BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::NOTIFY_GATT_CALLBACKS,
-                            NS_LITERAL_STRING(BLEGATT_NOTIFY_ID));
-}
-void
-BluetoothGatt::SendNotifyCallback()
-{
-    nsAutoString eventName;
-    eventName.AssignLiteral(BLUETOOTH_GATT_CALLBACKS_ID);
-
-    nsAutoString callbackName;
-    callbackName.AssignLiteral(BLEGATT_NOTIFY_ID);
-
-    nsString data_conn_id;
-    data_conn_id.AppendInt(mNotifyConnCommPara.connId);
-
-//    nsString data_value;
-//    data_value.APpendInt(mNotifyParaData);
-
-    nsString data_bdAddr;
-    BdAddressTypeToString(&mNotifyParaData.bda, data_bdAddr);
+    GATT_TRACE(GATT_TRACE_INFO, GATT_TRACE_NOTIFY, conn_id, p_data->len, p_data->is_notify);
+    GattCount(GATT_COUNTER_NOTIFICATIONS);
 
-    nsString data_srvc_id_id_uuid;
-    BtUuidToString(&mNotifyParaData.srvc_id.id.uuid, data_srvc_id_id_uuid);
-    nsString data_srvc_id_id_inst_id;
-    data_srvc_id_id_inst_id.AppendInt(mNotifyParaData.srvc_id.id.inst_id);
-    nsString data_srvc_id_is_primary;
-    data_srvc_id_is_primary.AppendInt(mNotifyParaData.srvc_id.is_primary);
-
-    nsString data_char_id_uuid;
-    BtUuidToString(&mNotifyParaData.char_id.uuid, data_char_id_uuid);
-    nsString data_char_id_inst_id;
-    data_char_id_inst_id.AppendInt(mNotifyParaData.char_id.inst_id);
-
-    nsString data_len;
-    data_len.AppendInt(mNotifyParaData.len);
-
-    nsString data_is_notify;
-    data_is_notify.AppendInt(mNotifyParaData.is_notify);
-
-    LOGI("^^^^^^^^^^^^^^^^^^^^^ btgatt_notify_params_t len:%d", mNotifyParaData.len);
-    nsString data_value;
-    char strValue[MAX_HEX_VAL_STR_LEN];
-    array2str(mNotifyParaData.value, mNotifyParaData.len, strValue, sizeof(strValue));
-
-    LOGI("############### strValue:%s", strValue);
-    data_value = NS_ConvertUTF8toUTF16(strValue);
-
-
-    InfallibleTArray<BluetoothNamedValue> data;
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CALLBACK_NAME), callbackName));
-
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CONNID), data_conn_id));
-
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_DESCRID_VALUE), data_value));
-
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_BDA), data_bdAddr));
+    if(IsServiceChanged(*p_data))
+    {
+        LOGI("Service Changed from conn_id:%d", conn_id);
+        InvalidateGattCacheForConn(conn_id);
+    }
 
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ID_UUID), data_srvc_id_id_uuid));
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ID_INSTID), data_srvc_id_id_inst_id));
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_SRVCID_ISPRIMARY), data_srvc_id_is_primary));
+    if(sNotifyBatchWindowMs)
+    {
+        GattEvent* full = nullptr;
+        bool opened = false;
+        {
+            StaticMutexAutoLock lock(sNotifyBatchMutex);
+            if(!sNotifyBatch)
+            {
+                sNotifyBatch = AcquireGattEvent(GATT_EVENT_NOTIFY_BATCH);
+                opened = true;
+            }
 
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CHARID_UUID), data_char_id_uuid));
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_CHARID_INSTID), data_char_id_inst_id));
+            GattNotifySample sample;
+            sample.connId = conn_id;
+            memcpy(&sample.params, p_data, sizeof(btgatt_notify_params_t));
+            if(sNotifyBatch->samples.size() == sNotifyBatch->samples.capacity())
+            {
+                GattCount(GATT_COUNTER_EVENT_ALLOCATIONS);
+            }
+            sNotifyBatch->samples.push_back(sample);
 
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_LEN), data_len));
+            if(sNotifyBatch->samples.size() >= sNotifyBatchMaxEvents)
+            {
+                full = sNotifyBatch;
+                sNotifyBatch = nullptr;
+            }
+        }
 
-    data.AppendElement(
-            BluetoothNamedValue(NS_LITERAL_STRING(GATT_PARA_IS_NOTIFY), data_is_notify));
+        if(full)
+        {
+            MainThreadTask::PostEvent(full);
+        }
+        else if(opened)
+        {
+            BT_HF_DISPATCH_MAIN(MainThreadTaskCmd::ARM_NOTIFY_BATCH_TIMER);
+        }
+        return;
+    }
 
-    BluetoothSignal signal(eventName, NS_LITERAL_STRING(KEY_ADAPTER), data);
-    SendCallbackSignal(signal);
+    GattEvent* event = AcquireGattEvent(GATT_EVENT_NOTIFY);
+    event->connId = conn_id;
+    memcpy(&event->params.notify, p_data, sizeof(btgatt_notify_params_t));
 
-    LOGI("callback ProcessNotify end");
+    MainThreadTask::PostEvent(event);
+}
+void
+BluetoothGatt::SendNotifyCallback()
+{
+    SendNotifySignal(mNotifyConnCommPara.connId, mNotifyParaData);
 }
@@ -0,0 +1,1511 @@
+#include "BluetoothGattFake.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#define LOG_TAG "BluetoothGattFake"
+
+#ifdef MOZ_WIDGET_GONK
+#include <android/log.h>
+#define LOGI(...) __android_log_print(ANDROID_LOG_INFO, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#else
+#define LOGI(...) do { fprintf(stderr, LOG_TAG ": " __VA_ARGS__); fputc('\n', stderr); } while(0)
+#define LOGE(...) do { fprintf(stderr, LOG_TAG ": " __VA_ARGS__); fputc('\n', stderr); } while(0)
+#endif
+
+// Status the stack reports for a failed request or the end of a list
+#define FAKE_GATT_ERROR 0x85
+#define FAKE_WRITE_TYPE_NO_RSP 1
+// Largest ATT_MTU the fake peripherals accept
+#define FAKE_MAX_MTU 247
+#define FAKE_ADV_DATA_LEN 62
+// Distinct addresses a scan flood cycles through
+#define FAKE_FLOOD_DEVICES 64
+
+namespace {
+
+struct FakeDescr
+{
+  btgatt_gatt_id_t id;
+  std::vector<uint8_t> value;
+};
+
+struct FakeChar
+{
+  FakeChar() : prop(0), notifyMs(0), notifying(false), notifyGen(0), counter(0)
+  {
+    memset(&id, 0, sizeof(id));
+  }
+
+  btgatt_gatt_id_t id;
+  int prop;
+  // Notification period once registered, 0 for none
+  int notifyMs;
+  bool notifying;
+  // Bumped on every [de]registration so stale ticks stop
+  uint32_t notifyGen;
+  uint8_t counter;
+  std::vector<uint8_t> value;
+  std::vector<FakeDescr> descrs;
+};
+
+struct FakeService
+{
+  btgatt_srvc_id_t id;
+  std::vector<FakeChar> chars;
+};
+
+struct FakePeripheral
+{
+  FakePeripheral() : rssi(0), connId(0), clientIf(0)
+  {
+    memset(&bda, 0, sizeof(bda));
+  }
+
+  bt_bdaddr_t bda;
+  int rssi;
+  std::string name;
+  std::vector<FakeService> services;
+  // 0 while disconnected
+  int connId;
+  int clientIf;
+};
+
+enum FakeTaskType {
+  FAKE_REGISTER_CLIENT,
+  FAKE_SCAN_TICK,
+  FAKE_CONNECT,
+  FAKE_DISCONNECT,
+  FAKE_LISTEN,
+  FAKE_SEARCH,
+  FAKE_GET_INCLUDED,
+  FAKE_GET_CHAR,
+  FAKE_GET_DESCR,
+  FAKE_REGISTER_NOTIFY,
+  FAKE_NOTIFY_TICK,
+  FAKE_READ_CHAR,
+  FAKE_WRITE_CHAR,
+  FAKE_READ_DESCR,
+  FAKE_WRITE_DESCR,
+  FAKE_EXECUTE_WRITE,
+  FAKE_READ_RSSI,
+  FAKE_FLOOD_SCAN,
+  FAKE_FLOOD_NOTIFY,
+#ifdef MOZ_BT_GATT_MTU
+  FAKE_CONFIGURE_MTU,
+#endif
+};
+
+// One callback waiting for its time on the fake stack's thread
+struct FakeTask
+{
+  FakeTask(FakeTaskType aType)
+    : type(aType), clientIf(0), connId(0), status(0), flag(0),
+      hasStart(false), generation(0)
+  {
+    memset(&uuid, 0, sizeof(uuid));
+    memset(&bda, 0, sizeof(bda));
+    memset(&srvcId, 0, sizeof(srvcId));
+    memset(&charId, 0, sizeof(charId));
+    memset(&descrId, 0, sizeof(descrId));
+  }
+
+  FakeTaskType type;
+  int clientIf;
+  int connId;
+  int status;
+  // start, registered, execute or "has a filter", depending on type
+  int flag;
+  bool hasStart;
+  uint32_t generation;
+  bt_uuid_t uuid;
+  bt_bdaddr_t bda;
+  btgatt_srvc_id_t srvcId;
+  btgatt_gatt_id_t charId;
+  btgatt_gatt_id_t descrId;
+  std::vector<uint8_t> value;
+};
+
+// Everything below is guarded by sFakeMutex
+static pthread_mutex_t sFakeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sFakeCond;
+static pthread_t sFakeThread;
+static bool sFakeRunning;
+static const btgatt_callbacks_t* sFakeCallbacks;
+// Keyed by due time in ms
+static std::multimap<int64_t, FakeTask> sFakeTasks;
+static std::vector<FakePeripheral> sFakePeripherals;
+static int sFakeLatencyMs = 20;
+static int sFakeErrorPercent = 0;
+static int sFakeCongestPercent = 0;
+static int sFakeAdvMs = 100;
+static int sFakeNextClientIf = 1;
+static int sFakeNextConnId = 1;
+static bool sFakeScanning;
+static uint32_t sFakeScanGen;
+static unsigned int sFakeSeed = 1;
+// Reads and writes of one link recorded for a self-test, 0 for none, and
+// how many more of them to drop
+static int sFakeJournalConnId;
+static std::vector<FakeGattAccess> sFakeJournal;
+static int sFakeDrop;
+
+static btgatt_client_interface_t sFakeClient;
+static btgatt_interface_t sFakeInterface;
+
+} // anonymous namespace
+
+static int64_t
+FakeNowMs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Queues a callback. Must hold sFakeMutex. */
+static void
+FakePostLocked(const FakeTask& aTask, int aDelayMs)
+{
+    sFakeTasks.insert(std::make_pair(FakeNowMs() + aDelayMs, aTask));
+    pthread_cond_signal(&sFakeCond);
+}
+
+static void
+FakePost(const FakeTask& aTask)
+{
+    pthread_mutex_lock(&sFakeMutex);
+    FakePostLocked(aTask, sFakeLatencyMs);
+    pthread_mutex_unlock(&sFakeMutex);
+}
+
+/* Draws whether the next request fails. Must hold sFakeMutex. */
+static int
+FakeStatusLocked()
+{
+    if(sFakeErrorPercent > 0 && (int)(rand_r(&sFakeSeed) % 100) < sFakeErrorPercent)
+    {
+        return FAKE_GATT_ERROR;
+    }
+    return 0;
+}
+
+static bool
+FakeSameGattId(const btgatt_gatt_id_t& a, const btgatt_gatt_id_t& b)
+{
+    return a.inst_id == b.inst_id && !memcmp(a.uuid.uu, b.uuid.uu, sizeof(a.uuid.uu));
+}
+
+static bool
+FakeSameSrvcId(const btgatt_srvc_id_t& a, const btgatt_srvc_id_t& b)
+{
+    return a.is_primary == b.is_primary && FakeSameGattId(a.id, b.id);
+}
+
+static FakePeripheral*
+FakeFindByBda(const bt_bdaddr_t& aBda)
+{
+    for(size_t i = 0; i < sFakePeripherals.size(); ++i)
+    {
+        if(!memcmp(&sFakePeripherals[i].bda, &aBda, sizeof(aBda)))
+        {
+            return &sFakePeripherals[i];
+        }
+    }
+    return NULL;
+}
+
+static FakePeripheral*
+FakeFindByConn(int conn_id)
+{
+    for(size_t i = 0; conn_id && i < sFakePeripherals.size(); ++i)
+    {
+        if(sFakePeripherals[i].connId == conn_id)
+        {
+            return &sFakePeripherals[i];
+        }
+    }
+    return NULL;
+}
+
+static FakeService*
+FakeFindService(FakePeripheral* aPeripheral, const btgatt_srvc_id_t& aId)
+{
+    for(size_t i = 0; aPeripheral && i < aPeripheral->services.size(); ++i)
+    {
+        if(FakeSameSrvcId(aPeripheral->services[i].id, aId))
+        {
+            return &aPeripheral->services[i];
+        }
+    }
+    return NULL;
+}
+
+static FakeChar*
+FakeFindChar(FakeService* aService, const btgatt_gatt_id_t& aId)
+{
+    for(size_t i = 0; aService && i < aService->chars.size(); ++i)
+    {
+        if(FakeSameGattId(aService->chars[i].id, aId))
+        {
+            return &aService->chars[i];
+        }
+    }
+    return NULL;
+}
+
+static FakeDescr*
+FakeFindDescr(FakeChar* aChar, const btgatt_gatt_id_t& aId)
+{
+    for(size_t i = 0; aChar && i < aChar->descrs.size(); ++i)
+    {
+        if(FakeSameGattId(aChar->descrs[i].id, aId))
+        {
+            return &aChar->descrs[i];
+        }
+    }
+    return NULL;
+}
+
+/* Builds the advertisement of a peripheral: just its complete local name */
+static void
+FakeAdvData(const FakePeripheral& aPeripheral, uint8_t* aAdv)
+{
+    memset(aAdv, 0, FAKE_ADV_DATA_LEN);
+    size_t len = aPeripheral.name.size();
+    if(len > FAKE_ADV_DATA_LEN - 3)
+    {
+        len = FAKE_ADV_DATA_LEN - 3;
+    }
+    aAdv[0] = len + 1;
+    aAdv[1] = 0x09;
+    memcpy(aAdv + 2, aPeripheral.name.data(), len);
+}
+
+/* Fills the next notification of a characteristic. Must hold sFakeMutex. */
+static void
+FakeNotifyParamsLocked(const FakeTask& aTask, FakeChar* aChar,
+                       btgatt_notify_params_t& aParams)
+{
+    // The first byte counts notifications so apps can spot gaps
+    std::vector<uint8_t> value = aChar->value;
+    if(value.empty())
+    {
+        value.push_back(0);
+    }
+    value[0] = aChar->counter++;
+
+    aParams.bda = aTask.bda;
+    aParams.srvc_id = aTask.srvcId;
+    aParams.char_id = aTask.charId;
+    aParams.len = value.size() < sizeof(aParams.value) ? value.size() : sizeof(aParams.value);
+    memcpy(aParams.value, &value[0], aParams.len);
+    aParams.is_notify = 1;
+}
+
+static void
+FakeRunTask(FakeTask& aTask)
+{
+    const btgatt_client_callbacks_t* cb = sFakeCallbacks ? sFakeCallbacks->client : NULL;
+    if(!cb)
+    {
+        return;
+    }
+
+    switch(aTask.type)
+    {
+    case FAKE_REGISTER_CLIENT:
+        cb->register_client_cb(aTask.status, aTask.clientIf, &aTask.uuid);
+        break;
+    case FAKE_SCAN_TICK:
+    {
+        std::vector<bt_bdaddr_t> addrs;
+        std::vector<int> rssis;
+        std::vector<std::vector<uint8_t> > advs;
+
+        pthread_mutex_lock(&sFakeMutex);
+        if(!sFakeScanning || aTask.generation != sFakeScanGen)
+        {
+            pthread_mutex_unlock(&sFakeMutex);
+            break;
+        }
+        for(size_t i = 0; i < sFakePeripherals.size(); ++i)
+        {
+            const FakePeripheral& p = sFakePeripherals[i];
+            if(p.connId)
+            {
+                continue;
+            }
+            std::vector<uint8_t> adv(FAKE_ADV_DATA_LEN);
+            FakeAdvData(p, &adv[0]);
+            addrs.push_back(p.bda);
+            rssis.push_back(p.rssi + (int)(rand_r(&sFakeSeed) % 9) - 4);
+            advs.push_back(adv);
+        }
+        FakePostLocked(aTask, sFakeAdvMs);
+        pthread_mutex_unlock(&sFakeMutex);
+
+        for(size_t i = 0; i < addrs.size(); ++i)
+        {
+            cb->scan_result_cb(&addrs[i], rssis[i], &advs[i][0]);
+        }
+        break;
+    }
+    case FAKE_CONNECT:
+    {
+        int conn_id = 0;
+        int status = aTask.status;
+
+        pthread_mutex_lock(&sFakeMutex);
+        FakePeripheral* p = FakeFindByBda(aTask.bda);
+        if(!p)
+        {
+            status = FAKE_GATT_ERROR;
+        }
+        else if(!status)
+        {
+            if(!p->connId)
+            {
+                p->connId = sFakeNextConnId++;
+            }
+            p->clientIf = aTask.clientIf;
+            conn_id = p->connId;
+        }
+        pthread_mutex_unlock(&sFakeMutex);
+
+        cb->open_cb(conn_id, status, aTask.clientIf, &aTask.bda);
+        break;
+    }
+    case FAKE_DISCONNECT:
+    {
+        pthread_mutex_lock(&sFakeMutex);
+        FakePeripheral* p = FakeFindByConn(aTask.connId);
+        if(p)
+        {
+            p->connId = 0;
+            for(size_t i = 0; i < p->services.size(); ++i)
+            {
+                for(size_t j = 0; j < p->services[i].chars.size(); ++j)
+                {
+                    ++p->services[i].chars[j].notifyGen;
+                    p->services[i].chars[j].notifying = false;
+                }
+            }
+        }
+        pthread_mutex_unlock(&sFakeMutex);
+
+        cb->close_cb(aTask.connId, 0, aTask.clientIf, &aTask.bda);
+        break;
+    }
+    case FAKE_LISTEN:
+        cb->listen_cb(aTask.status, aTask.clientIf);
+        break;
+    case FAKE_SEARCH:
+    {
+        std::vector<btgatt_srvc_id_t> found;
+
+        pthread_mutex_lock(&sFakeMutex);
+        FakePeripheral* p = FakeFindByConn(aTask.connId);
+        for(size_t i = 0; p && i < p->services.size(); ++i)
+        {
+            const btgatt_srvc_id_t& id = p->services[i].id;
+            if(!aTask.flag || !memcmp(id.id.uuid.uu, aTask.uuid.uu, sizeof(aTask.uuid.uu)))
+            {
+                found.push_back(id);
+            }
+        }
+        int status = p ? aTask.status : FAKE_GATT_ERROR;
+        pthread_mutex_unlock(&sFakeMutex);
+
+        for(size_t i = 0; !status && i < found.size(); ++i)
+        {
+            cb->search_result_cb(aTask.connId, &found[i]);
+        }
+        cb->search_complete_cb(aTask.connId, status);
+        break;
+    }
+    case FAKE_GET_INCLUDED:
+    {
+        // Scripted services never include others
+        btgatt_srvc_id_t none;
+        memset(&none, 0, sizeof(none));
+        cb->get_included_service_cb(aTask.connId, FAKE_GATT_ERROR, &aTask.srvcId, &none);
+        break;
+    }
+    case FAKE_GET_CHAR:
+    {
+        int status = FAKE_GATT_ERROR;
+        int prop = 0;
+        btgatt_gatt_id_t found;
+        memset(&found, 0, sizeof(found));
+
+        pthread_mutex_lock(&sFakeMutex);
+        FakeService* s = FakeFindService(FakeFindByConn(aTask.connId), aTask.srvcId);
+        if(s)
+        {
+            size_t next = 0;
+            if(aTask.hasStart)
+            {
+                while(next < s->chars.size() && !FakeSameGattId(s->chars[next].id, aTask.charId))
+                {
+                    ++next;
+                }
+                ++next;
+            }
+            if(next < s->chars.size())
+            {
+                status = 0;
+                found = s->chars[next].id;
+                prop = s->chars[next].prop;
+            }
+        }
+        pthread_mutex_unlock(&sFakeMutex);
+
+        cb->get_characteristic_cb(aTask.connId, status, &aTask.srvcId, &found, prop);
+        break;
+    }
+    case FAKE_GET_DESCR:
+    {
+        int status = FAKE_GATT_ERROR;
+        btgatt_gatt_id_t found;
+        memset(&found, 0, sizeof(found));
+
+        pthread_mutex_lock(&sFakeMutex);
+        FakeChar* c = FakeFindChar(FakeFindService(FakeFindByConn(aTask.connId), aTask.srvcId),
+                                   aTask.charId);
+        if(c)
+        {
+            size_t next = 0;
+            if(aTask.hasStart)
+            {
+                while(next < c->descrs.size() && !FakeSameGattId(c->descrs[next].id, aTask.descrId))
+                {
+                    ++next;
+                }
+                ++next;
+            }
+            if(next < c->descrs.size())
+            {
+                status = 0;
+                found = c->descrs[next].id;
+            }
+        }
+        pthread_mutex_unlock(&sFakeMutex);
+
+        cb->get_descriptor_cb(aTask.connId, status, &aTask.srvcId, &aTask.charId, &found);
+        break;
+    }
+    case FAKE_REGISTER_NOTIFY:
+    {
+        int conn_id = 0;
+        int status = aTask.status;
+
+        pthread_mutex_lock(&sFakeMutex);
+        FakePeripheral* p = FakeFindByBda(aTask.bda);
+        FakeChar* c = FakeFindChar(FakeFindService(p, aTask.srvcId), aTask.charId);
+        if(!c || !p->connId)
+        {
+            status = FAKE_GATT_ERROR;
+        }
+        else
+        {
+            conn_id = p->connId;
+            ++c->notifyGen;
+            c->notifying = !status && aTask.flag;
+            if(!status && aTask.flag && c->notifyMs > 0)
+            {
+                FakeTask tick(FAKE_NOTIFY_TICK);
+                tick.bda = aTask.bda;
+                tick.srvcId = aTask.srvcId;
+                tick.charId = aTask.charId;
+                tick.generation = c->notifyGen;
+                FakePostLocked(tick, c->notifyMs);
+            }
+        }
+        pthread_mutex_unlock(&sFakeMutex);
+
+        cb->register_for_notification_cb(conn_id, aTask.flag, status, &aTask.srvcId, &aTask.charId);
+        break;
+    }
+    case FAKE_NOTIFY_TICK:
+    {
+        btgatt_notify_params_t params;
+        memset(&params, 0, sizeof(params));
+        int conn_id = 0;
+
+        pthread_mutex_lock(&sFakeMutex);
+        FakePeripheral* p = FakeFindByBda(aTask.bda);
+        FakeChar* c = FakeFindChar(FakeFindService(p, aTask.srvcId), aTask.charId);
+        if(c && p->connId && c->notifyGen == aTask.generation)
+        {
+            conn_id = p->connId;
+            FakeNotifyParamsLocked(aTask, c, params);
+            FakePostLocked(aTask, c->notifyMs);
+        }
+        pthread_mutex_unlock(&sFakeMutex);
+
+        if(conn_id)
+        {
+            cb->notify_cb(conn_id, &params);
+        }
+        break;
+    }
+    case FAKE_READ_CHAR:
+    case FAKE_READ_DESCR:
+    {
+        btgatt_read_params_t params;
+        memset(&params, 0, sizeof(params));
+        params.srvc_id = aTask.srvcId;
+        params.char_id = aTask.charId;
+        params.descr_id = aTask.descrId;
+        int status = aTask.status;
+
+        pthread_mutex_lock(&sFakeMutex);
+        FakeChar* c = FakeFindChar(FakeFindService(FakeFindByConn(aTask.connId), aTask.srvcId),
+                                   aTask.charId);
+        const std::vector<uint8_t>* value = NULL;
+        if(FAKE_READ_CHAR == aTask.type)
+        {
+            value = c ? &c->value : NULL;
+        }
+        else
+        {
+            FakeDescr* d = FakeFindDescr(c, aTask.descrId);
+            value = d ? &d->value : NULL;
+        }
+        if(!value)
+        {
+            status = FAKE_GATT_ERROR;
+        }
+        else if(!status)
+        {
+            params.value.len = value->size() < sizeof(params.value.value) ?
+                               value->size() : sizeof(params.value.value);
+            if(params.value.len)
+            {
+                memcpy(params.value.value, &(*value)[0], params.value.len);
+            }
+        }
+        pthread_mutex_unlock(&sFakeMutex);
+
+        params.status = status;
+        if(FAKE_READ_CHAR == aTask.type)
+        {
+            cb->read_characteristic_cb(aTask.connId, status, &params);
+        }
+        else
+        {
+            cb->read_descriptor_cb(aTask.connId, status, &params);
+        }
+        break;
+    }
+    case FAKE_WRITE_CHAR:
+    case FAKE_WRITE_DESCR:
+    {
+        btgatt_write_params_t params;
+        memset(&params, 0, sizeof(params));
+        params.srvc_id = aTask.srvcId;
+        params.char_id = aTask.charId;
+        params.descr_id = aTask.descrId;
+        int status = aTask.status;
+
+        pthread_mutex_lock(&sFakeMutex);
+        FakeChar* c = FakeFindChar(FakeFindService(FakeFindByConn(aTask.connId), aTask.srvcId),
+                                   aTask.charId);
+        std::vector<uint8_t>* value = NULL;
+        if(FAKE_WRITE_CHAR == aTask.type)
+        {
+            value = c ? &c->value : NULL;
+        }
+        else
+        {
+            FakeDescr* d = FakeFindDescr(c, aTask.descrId);
+            value = d ? &d->value : NULL;
+        }
+        if(!value)
+        {
+            status = FAKE_GATT_ERROR;
+        }
+        else if(!status)
+        {
+            *value = aTask.value;
+        }
+        pthread_mutex_unlock(&sFakeMutex);
+
+        params.status = status;
+        if(FAKE_WRITE_CHAR == aTask.type)
+        {
+            cb->write_characteristic_cb(aTask.connId, status, &params);
+        }
+        else
+        {
+            cb->write_descriptor_cb(aTask.connId, status, &params);
+        }
+        break;
+    }
+    case FAKE_EXECUTE_WRITE:
+        cb->execute_write_cb(aTask.connId, aTask.status);
+        break;
+    case FAKE_READ_RSSI:
+    {
+        int rssi = 0;
+        int status = aTask.status;
+
+        pthread_mutex_lock(&sFakeMutex);
+        FakePeripheral* p = FakeFindByBda(aTask.bda);
+        if(p)
+        {
+            rssi = p->rssi + (int)(rand_r(&sFakeSeed) % 9) - 4;
+        }
+        else
+        {
+            status = FAKE_GATT_ERROR;
+        }
+        pthread_mutex_unlock(&sFakeMutex);
+
+        cb->read_remote_rssi_cb(aTask.clientIf, &aTask.bda, rssi, status);
+        break;
+    }
+#ifdef MOZ_BT_GATT_MTU
+    case FAKE_CONFIGURE_MTU:
+        // flag is the MTU asked for, the peripherals take up to FAKE_MAX_MTU
+        cb->configure_mtu_cb(aTask.connId, 0, std::min(aTask.flag, FAKE_MAX_MTU));
+        break;
+#endif
+    case FAKE_FLOOD_SCAN:
+    {
+        // generation numbers the result; it picks one of the flood devices
+        int device = aTask.generation % FAKE_FLOOD_DEVICES;
+        bt_bdaddr_t bda;
+        bda.address[0] = 0x0b;
+        bda.address[1] = 0xe7;
+        bda.address[2] = 0x00;
+        bda.address[3] = 0x00;
+        bda.address[4] = 0x00;
+        bda.address[5] = device;
+
+        FakePeripheral p;
+        char name[16];
+        snprintf(name, sizeof(name), "Bench %02d", device);
+        p.name = name;
+        uint8_t adv[FAKE_ADV_DATA_LEN];
+        FakeAdvData(p, adv);
+
+        cb->scan_result_cb(&bda, -40 - (int)(aTask.generation % 40), adv);
+        break;
+    }
+    case FAKE_FLOOD_NOTIFY:
+    {
+        btgatt_notify_params_t params;
+        memset(&params, 0, sizeof(params));
+        int conn_id = 0;
+
+        pthread_mutex_lock(&sFakeMutex);
+        FakePeripheral* p = FakeFindByBda(aTask.bda);
+        FakeChar* c = FakeFindChar(FakeFindService(p, aTask.srvcId), aTask.charId);
+        if(c && p->connId)
+        {
+            conn_id = p->connId;
+            FakeNotifyParamsLocked(aTask, c, params);
+        }
+        pthread_mutex_unlock(&sFakeMutex);
+
+        if(conn_id)
+        {
+            cb->notify_cb(conn_id, &params);
+        }
+        break;
+    }
+    }
+}
+
+static void*
+FakeThreadMain(void*)
+{
+    pthread_mutex_lock(&sFakeMutex);
+    while(sFakeRunning)
+    {
+        if(sFakeTasks.empty())
+        {
+            pthread_cond_wait(&sFakeCond, &sFakeMutex);
+            continue;
+        }
+
+        std::multimap<int64_t, FakeTask>::iterator next = sFakeTasks.begin();
+        int64_t due = next->first;
+        if(due > FakeNowMs())
+        {
+            struct timespec ts;
+            ts.tv_sec = due / 1000;
+            ts.tv_nsec = (due % 1000) * 1000000;
+            pthread_cond_timedwait(&sFakeCond, &sFakeMutex, &ts);
+            continue;
+        }
+
+        FakeTask task = next->second;
+        sFakeTasks.erase(next);
+
+        // Callbacks may call straight back into the interface
+        pthread_mutex_unlock(&sFakeMutex);
+        FakeRunTask(task);
+        pthread_mutex_lock(&sFakeMutex);
+    }
+    pthread_mutex_unlock(&sFakeMutex);
+    return NULL;
+}
+
+/* Parses "2a37" or "00002a37-0000-1000-8000-00805f9b34fb" */
+static bool
+FakeParseUuid(const char* aStr, bt_uuid_t* aUuid)
+{
+    static const uint8_t kBaseUuid[16] = {
+        0xfb, 0x34, 0x9b, 0x5f, 0x80, 0x00, 0x00, 0x80,
+        0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+
+    if(strlen(aStr) == 4)
+    {
+        unsigned int shortUuid;
+        if(sscanf(aStr, "%4x", &shortUuid) != 1)
+        {
+            return false;
+        }
+        memcpy(aUuid->uu, kBaseUuid, sizeof(kBaseUuid));
+        aUuid->uu[12] = shortUuid & 0xff;
+        aUuid->uu[13] = shortUuid >> 8;
+        return true;
+    }
+
+    int n = 0;
+    for(const char* p = aStr; *p && n < 32; ++p)
+    {
+        unsigned int nibble;
+        if(*p == '-')
+        {
+            continue;
+        }
+        if(sscanf(p, "%1x", &nibble) != 1)
+        {
+            return false;
+        }
+        uint8_t& byte = aUuid->uu[15 - n / 2];
+        byte = (n % 2) ? (byte | nibble) : (nibble << 4);
+        ++n;
+    }
+    return n == 32;
+}
+
+static void
+FakeParseHex(const char* aStr, std::vector<uint8_t>& aOut)
+{
+    aOut.clear();
+    for(const char* p = aStr; p[0] && p[1]; p += 2)
+    {
+        unsigned int byte;
+        if(sscanf(p, "%2x", &byte) != 1)
+        {
+            break;
+        }
+        aOut.push_back(byte);
+    }
+}
+
+static int
+FakeNextInt(char** aSave, int aDefault)
+{
+    const char* word = strtok_r(NULL, " \t\r\n", aSave);
+    return word ? atoi(word) : aDefault;
+}
+
+/* Applies one script line. Must hold sFakeMutex. */
+static void
+FakeParseLine(char* aLine)
+{
+    char* save = NULL;
+    char* word = strtok_r(aLine, " \t\r\n", &save);
+    if(!word || word[0] == '#')
+    {
+        return;
+    }
+
+    FakePeripheral* p = sFakePeripherals.empty() ? NULL : &sFakePeripherals.back();
+    FakeService* s = (p && !p->services.empty()) ? &p->services.back() : NULL;
+    FakeChar* c = (s && !s->chars.empty()) ? &s->chars.back() : NULL;
+
+    if(!strcmp(word, "latency"))
+    {
+        sFakeLatencyMs = FakeNextInt(&save, 0);
+    }
+    else if(!strcmp(word, "error"))
+    {
+        sFakeErrorPercent = FakeNextInt(&save, 0);
+    }
+    else if(!strcmp(word, "congest"))
+    {
+        sFakeCongestPercent = FakeNextInt(&save, 0);
+    }
+    else if(!strcmp(word, "adv"))
+    {
+        sFakeAdvMs = FakeNextInt(&save, 100);
+    }
+    else if(!strcmp(word, "device"))
+    {
+        const char* addr = strtok_r(NULL, " \t\r\n", &save);
+        const char* rssi = strtok_r(NULL, " \t\r\n", &save);
+        const char* name = strtok_r(NULL, "\r\n", &save);
+        unsigned int b[6];
+        if(!addr || sscanf(addr, "%02x:%02x:%02x:%02x:%02x:%02x",
+                           &b[0], &b[1], &b[2], &b[3], &b[4], &b[5]) != 6)
+        {
+            LOGE("Bad device line");
+            return;
+        }
+
+        FakePeripheral peripheral;
+        for(int i = 0; i < 6; ++i)
+        {
+            peripheral.bda.address[i] = b[i];
+        }
+        peripheral.rssi = rssi ? atoi(rssi) : -60;
+        peripheral.name = name ? name : "";
+        sFakePeripherals.push_back(peripheral);
+    }
+    else if(!strcmp(word, "service") && p)
+    {
+        const char* uuid = strtok_r(NULL, " \t\r\n", &save);
+        const char* kind = strtok_r(NULL, " \t\r\n", &save);
+
+        FakeService service;
+        memset(&service.id, 0, sizeof(service.id));
+        if(!uuid || !FakeParseUuid(uuid, &service.id.id.uuid))
+        {
+            LOGE("Bad service line");
+            return;
+        }
+        service.id.is_primary = !(kind && !strcmp(kind, "secondary"));
+        p->services.push_back(service);
+    }
+    else if(!strcmp(word, "char") && s)
+    {
+        const char* uuid = strtok_r(NULL, " \t\r\n", &save);
+        const char* prop = strtok_r(NULL, " \t\r\n", &save);
+        const char* notifyMs = strtok_r(NULL, " \t\r\n", &save);
+        const char* value = strtok_r(NULL, " \t\r\n", &save);
+
+        FakeChar ch;
+        if(!uuid || !FakeParseUuid(uuid, &ch.id.uuid))
+        {
+            LOGE("Bad char line");
+            return;
+        }
+        ch.prop = prop ? strtol(prop, NULL, 0) : 0;
+        ch.notifyMs = notifyMs ? atoi(notifyMs) : 0;
+        if(value)
+        {
+            FakeParseHex(value, ch.value);
+        }
+        s->chars.push_back(ch);
+    }
+    else if(!strcmp(word, "descr") && c)
+    {
+        const char* uuid = strtok_r(NULL, " \t\r\n", &save);
+        const char* value = strtok_r(NULL, " \t\r\n", &save);
+
+        FakeDescr descr;
+        memset(&descr.id, 0, sizeof(descr.id));
+        if(!uuid || !FakeParseUuid(uuid, &descr.id.uuid))
+        {
+            LOGE("Bad descr line");
+            return;
+        }
+        if(value)
+        {
+            FakeParseHex(value, descr.value);
+        }
+        c->descrs.push_back(descr);
+    }
+    else
+    {
+        LOGE("Unknown script line: %s", word);
+    }
+}
+
+/* Loads the script, or the built-in heart rate sensor. Must hold sFakeMutex. */
+static void
+FakeLoadScript()
+{
+    static const char* kDefaultScript[] = {
+        "device 11:22:33:44:55:66 -55 OWB Fake HRM",
+        "service 180d",
+        "char 2a37 0x10 1000 0048",
+        "descr 2902 0000",
+        "char 2a38 0x02 0 01",
+        "service 180f",
+        "char 2a19 0x12 5000 64",
+        "descr 2902 0000",
+    };
+
+    sFakePeripherals.clear();
+
+    const char* path = getenv("OWB_GATT_FAKE_SCRIPT");
+    FILE* file = path ? fopen(path, "r") : NULL;
+    if(file)
+    {
+        char line[256];
+        while(fgets(line, sizeof(line), file))
+        {
+            FakeParseLine(line);
+        }
+        fclose(file);
+        LOGI("Loaded %s, %d peripherals", path, (int)sFakePeripherals.size());
+        return;
+    }
+
+    for(size_t i = 0; i < sizeof(kDefaultScript) / sizeof(kDefaultScript[0]); ++i)
+    {
+        char line[256];
+        snprintf(line, sizeof(line), "%s", kDefaultScript[i]);
+        FakeParseLine(line);
+    }
+}
+
+static bt_status_t
+FakeRegisterClient(bt_uuid_t* uuid)
+{
+    FakeTask task(FAKE_REGISTER_CLIENT);
+    task.uuid = *uuid;
+
+    pthread_mutex_lock(&sFakeMutex);
+    task.clientIf = sFakeNextClientIf++;
+    task.status = FakeStatusLocked();
+    FakePostLocked(task, sFakeLatencyMs);
+    pthread_mutex_unlock(&sFakeMutex);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeUnregisterClient(int client_if)
+{
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeScan(int client_if, bool start)
+{
+    pthread_mutex_lock(&sFakeMutex);
+    sFakeScanning = start;
+    ++sFakeScanGen;
+    if(start)
+    {
+        FakeTask task(FAKE_SCAN_TICK);
+        task.generation = sFakeScanGen;
+        FakePostLocked(task, sFakeLatencyMs);
+    }
+    pthread_mutex_unlock(&sFakeMutex);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeConnect(int client_if, const bt_bdaddr_t* bd_addr, bool is_direct)
+{
+    FakeTask task(FAKE_CONNECT);
+    task.clientIf = client_if;
+    task.bda = *bd_addr;
+
+    pthread_mutex_lock(&sFakeMutex);
+    task.status = FakeStatusLocked();
+    FakePostLocked(task, sFakeLatencyMs);
+    pthread_mutex_unlock(&sFakeMutex);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeDisconnect(int client_if, const bt_bdaddr_t* bd_addr, int conn_id)
+{
+    // conn_id 0 cancels a pending connect, which the fake never has
+    if(!conn_id)
+    {
+        return BT_STATUS_SUCCESS;
+    }
+
+    FakeTask task(FAKE_DISCONNECT);
+    task.clientIf = client_if;
+    task.connId = conn_id;
+    task.bda = *bd_addr;
+    FakePost(task);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeListen(int client_if, bool start)
+{
+    FakeTask task(FAKE_LISTEN);
+    task.clientIf = client_if;
+    task.flag = start;
+    FakePost(task);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeRefresh(int client_if, const bt_bdaddr_t* bd_addr)
+{
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeSearchService(int conn_id, bt_uuid_t* filter_uuid)
+{
+    FakeTask task(FAKE_SEARCH);
+    task.connId = conn_id;
+    if(filter_uuid)
+    {
+        task.flag = 1;
+        task.uuid = *filter_uuid;
+    }
+
+    pthread_mutex_lock(&sFakeMutex);
+    task.status = FakeStatusLocked();
+    FakePostLocked(task, sFakeLatencyMs);
+    pthread_mutex_unlock(&sFakeMutex);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeGetIncludedService(int conn_id, btgatt_srvc_id_t* srvc_id,
+                       btgatt_srvc_id_t* start_incl_srvc_id)
+{
+    FakeTask task(FAKE_GET_INCLUDED);
+    task.connId = conn_id;
+    task.srvcId = *srvc_id;
+    FakePost(task);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeGetCharacteristic(int conn_id, btgatt_srvc_id_t* srvc_id,
+                      btgatt_gatt_id_t* start_char_id)
+{
+    FakeTask task(FAKE_GET_CHAR);
+    task.connId = conn_id;
+    task.srvcId = *srvc_id;
+    if(start_char_id)
+    {
+        task.hasStart = true;
+        task.charId = *start_char_id;
+    }
+    FakePost(task);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeGetDescriptor(int conn_id, btgatt_srvc_id_t* srvc_id,
+                  btgatt_gatt_id_t* char_id, btgatt_gatt_id_t* start_descr_id)
+{
+    FakeTask task(FAKE_GET_DESCR);
+    task.connId = conn_id;
+    task.srvcId = *srvc_id;
+    task.charId = *char_id;
+    if(start_descr_id)
+    {
+        task.hasStart = true;
+        task.descrId = *start_descr_id;
+    }
+    FakePost(task);
+    return BT_STATUS_SUCCESS;
+}
+
+/*
+ * Queues a read or write of a characteristic, or of a descriptor if
+ * descr_id is set. aWriteType is 0 for reads.
+ */
+static bt_status_t
+FakeAccess(FakeTaskType aType, int conn_id, btgatt_srvc_id_t* srvc_id,
+           btgatt_gatt_id_t* char_id, btgatt_gatt_id_t* descr_id,
+           int aWriteType, int len, const char* p_value)
+{
+    FakeTask task(aType);
+    task.connId = conn_id;
+    task.srvcId = *srvc_id;
+    task.charId = *char_id;
+    if(descr_id)
+    {
+        task.descrId = *descr_id;
+    }
+    if(p_value && len > 0)
+    {
+        task.value.assign((const uint8_t*)p_value, (const uint8_t*)p_value + len);
+    }
+
+    pthread_mutex_lock(&sFakeMutex);
+    // A Write Command the stack has no buffer for is refused outright
+    if(FAKE_WRITE_TYPE_NO_RSP == aWriteType && sFakeCongestPercent > 0 &&
+       (int)(rand_r(&sFakeSeed) % 100) < sFakeCongestPercent)
+    {
+        pthread_mutex_unlock(&sFakeMutex);
+        return BT_STATUS_BUSY;
+    }
+    if(conn_id && conn_id == sFakeJournalConnId)
+    {
+        FakeGattAccess access;
+        access.write = FAKE_WRITE_CHAR == aType || FAKE_WRITE_DESCR == aType;
+        access.descriptor = descr_id != NULL;
+        access.writeType = aWriteType;
+        access.value = task.value;
+        sFakeJournal.push_back(access);
+        if(sFakeDrop > 0)
+        {
+            --sFakeDrop;
+            pthread_mutex_unlock(&sFakeMutex);
+            return BT_STATUS_SUCCESS;
+        }
+    }
+    task.status = FakeStatusLocked();
+    FakePostLocked(task, sFakeLatencyMs);
+    pthread_mutex_unlock(&sFakeMutex);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeReadCharacteristic(int conn_id, btgatt_srvc_id_t* srvc_id,
+                       btgatt_gatt_id_t* char_id, int auth_req)
+{
+    return FakeAccess(FAKE_READ_CHAR, conn_id, srvc_id, char_id, NULL, 0, 0, NULL);
+}
+
+static bt_status_t
+FakeWriteCharacteristic(int conn_id, btgatt_srvc_id_t* srvc_id,
+                        btgatt_gatt_id_t* char_id, int write_type, int len,
+                        int auth_req, char* p_value)
+{
+    return FakeAccess(FAKE_WRITE_CHAR, conn_id, srvc_id, char_id, NULL, write_type,
+                      len, p_value);
+}
+
+static bt_status_t
+FakeReadDescriptor(int conn_id, btgatt_srvc_id_t* srvc_id,
+                   btgatt_gatt_id_t* char_id, btgatt_gatt_id_t* descr_id,
+                   int auth_req)
+{
+    return FakeAccess(FAKE_READ_DESCR, conn_id, srvc_id, char_id, descr_id, 0, 0, NULL);
+}
+
+static bt_status_t
+FakeWriteDescriptor(int conn_id, btgatt_srvc_id_t* srvc_id,
+                    btgatt_gatt_id_t* char_id, btgatt_gatt_id_t* descr_id,
+                    int write_type, int len, int auth_req, char* p_value)
+{
+    return FakeAccess(FAKE_WRITE_DESCR, conn_id, srvc_id, char_id, descr_id, write_type,
+                      len, p_value);
+}
+
+static bt_status_t
+FakeExecuteWrite(int conn_id, int execute)
+{
+    FakeTask task(FAKE_EXECUTE_WRITE);
+    task.connId = conn_id;
+    task.flag = execute;
+    FakePost(task);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeRegisterNotify(int client_if, const bt_bdaddr_t* bd_addr,
+                   btgatt_srvc_id_t* srvc_id, btgatt_gatt_id_t* char_id,
+                   bool aRegister)
+{
+    FakeTask task(FAKE_REGISTER_NOTIFY);
+    task.clientIf = client_if;
+    task.bda = *bd_addr;
+    task.srvcId = *srvc_id;
+    task.charId = *char_id;
+    task.flag = aRegister;
+
+    pthread_mutex_lock(&sFakeMutex);
+    task.status = FakeStatusLocked();
+    FakePostLocked(task, sFakeLatencyMs);
+    pthread_mutex_unlock(&sFakeMutex);
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeRegisterForNotification(int client_if, const bt_bdaddr_t* bd_addr,
+                            btgatt_srvc_id_t* srvc_id, btgatt_gatt_id_t* char_id)
+{
+    return FakeRegisterNotify(client_if, bd_addr, srvc_id, char_id, true);
+}
+
+static bt_status_t
+FakeDeregisterForNotification(int client_if, const bt_bdaddr_t* bd_addr,
+                              btgatt_srvc_id_t* srvc_id, btgatt_gatt_id_t* char_id)
+{
+    return FakeRegisterNotify(client_if, bd_addr, srvc_id, char_id, false);
+}
+
+static bt_status_t
+FakeReadRemoteRssi(int client_if, const bt_bdaddr_t* bd_addr)
+{
+    FakeTask task(FAKE_READ_RSSI);
+    task.clientIf = client_if;
+    task.bda = *bd_addr;
+    FakePost(task);
+    return BT_STATUS_SUCCESS;
+}
+
+#ifdef MOZ_BT_GATT_MTU
+static bt_status_t
+FakeConfigureMtu(int conn_id, int mtu)
+{
+    FakeTask task(FAKE_CONFIGURE_MTU);
+    task.connId = conn_id;
+    task.flag = mtu;
+    FakePost(task);
+    return BT_STATUS_SUCCESS;
+}
+#endif
+
+#ifdef MOZ_BT_GATT_CONN_PARAMS
+/* The stack reports nothing back, so the fake only checks the peer exists */
+static bt_status_t
+FakeConnParameterUpdate(const bt_bdaddr_t* bd_addr, int min_interval,
+                        int max_interval, int latency, int timeout)
+{
+    pthread_mutex_lock(&sFakeMutex);
+    bool known = FakeFindByBda(*bd_addr) != NULL;
+    pthread_mutex_unlock(&sFakeMutex);
+
+    LOGI("Connection parameters %d-%d/%d/%d", min_interval, max_interval, latency, timeout);
+    return known ? BT_STATUS_SUCCESS : BT_STATUS_FAIL;
+}
+#endif
+
+static int
+FakeGetDeviceType(const bt_bdaddr_t* bd_addr)
+{
+    return BT_DEVICE_DEVTYPE_BLE;
+}
+
+static bt_status_t
+FakeSetAdvData(int server_if, bool set_scan_rsp, bool include_name,
+               bool include_txpower, int min_interval, int max_interval,
+               int appearance, uint16_t manufacturer_len, char* manufacturer_data)
+{
+    return BT_STATUS_SUCCESS;
+}
+
+static bt_status_t
+FakeTestCommand(int command, btgatt_test_params_t* params)
+{
+    return BT_STATUS_UNSUPPORTED;
+}
+
+static bt_status_t
+FakeInit(const btgatt_callbacks_t* callbacks)
+{
+    pthread_mutex_lock(&sFakeMutex);
+    if(sFakeRunning)
+    {
+        pthread_mutex_unlock(&sFakeMutex);
+        return BT_STATUS_DONE;
+    }
+
+    sFakeCallbacks = callbacks;
+    FakeLoadScript();
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sFakeCond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    sFakeRunning = true;
+    pthread_mutex_unlock(&sFakeMutex);
+
+    if(pthread_create(&sFakeThread, NULL, FakeThreadMain, NULL))
+    {
+        LOGE("Failed to start the fake GATT thread");
+        pthread_mutex_lock(&sFakeMutex);
+        sFakeRunning = false;
+        pthread_mutex_unlock(&sFakeMutex);
+        return BT_STATUS_FAIL;
+    }
+    return BT_STATUS_SUCCESS;
+}
+
+static void
+FakeCleanup()
+{
+    pthread_mutex_lock(&sFakeMutex);
+    if(!sFakeRunning)
+    {
+        pthread_mutex_unlock(&sFakeMutex);
+        return;
+    }
+    sFakeRunning = false;
+    pthread_cond_signal(&sFakeCond);
+    pthread_mutex_unlock(&sFakeMutex);
+
+    pthread_join(sFakeThread, NULL);
+
+    pthread_mutex_lock(&sFakeMutex);
+    sFakeTasks.clear();
+    sFakePeripherals.clear();
+    sFakeCallbacks = NULL;
+    sFakeScanning = false;
+    sFakeJournalConnId = 0;
+    sFakeJournal.clear();
+    sFakeDrop = 0;
+    pthread_cond_destroy(&sFakeCond);
+    pthread_mutex_unlock(&sFakeMutex);
+}
+
+bool
+StartFakeGattFlood(bool aNotify, int aCount, int aRateHz)
+{
+    FakeTask task(aNotify ? FAKE_FLOOD_NOTIFY : FAKE_FLOOD_SCAN);
+
+    pthread_mutex_lock(&sFakeMutex);
+    if(!sFakeRunning)
+    {
+        pthread_mutex_unlock(&sFakeMutex);
+        return false;
+    }
+
+    if(aNotify)
+    {
+        // Floods the first characteristic notifications are enabled for
+        bool found = false;
+        for(size_t i = 0; !found && i < sFakePeripherals.size(); ++i)
+        {
+            FakePeripheral& p = sFakePeripherals[i];
+            for(size_t j = 0; !found && p.connId && j < p.services.size(); ++j)
+            {
+                for(size_t k = 0; !found && k < p.services[j].chars.size(); ++k)
+                {
+                    if(p.services[j].chars[k].notifying)
+                    {
+                        task.bda = p.bda;
+                        task.srvcId = p.services[j].id;
+                        task.charId = p.services[j].chars[k].id;
+                        found = true;
+                    }
+                }
+            }
+        }
+        if(!found)
+        {
+            pthread_mutex_unlock(&sFakeMutex);
+            LOGE("No characteristic to flood notifications from");
+            return false;
+        }
+    }
+
+    for(int i = 0; i < aCount; ++i)
+    {
+        task.generation = i;
+        FakePostLocked(task, aRateHz > 0 ? (int)((int64_t)i * 1000 / aRateHz) : 0);
+    }
+    pthread_mutex_unlock(&sFakeMutex);
+    return true;
+}
+
+int
+ConnectFakeGattPeripheral(btgatt_srvc_id_t* aSrvcId, btgatt_gatt_id_t* aCharId)
+{
+    int conn_id = 0;
+
+    pthread_mutex_lock(&sFakeMutex);
+    FakePeripheral* p = sFakePeripherals.empty() ? NULL : &sFakePeripherals[0];
+    if(sFakeRunning && p && !p->connId && !p->services.empty() &&
+       !p->services[0].chars.empty())
+    {
+        p->connId = sFakeNextConnId++;
+        conn_id = p->connId;
+        *aSrvcId = p->services[0].id;
+        *aCharId = p->services[0].chars[0].id;
+    }
+    pthread_mutex_unlock(&sFakeMutex);
+    return conn_id;
+}
+
+void
+DisconnectFakeGattPeripheral(int conn_id)
+{
+    pthread_mutex_lock(&sFakeMutex);
+    FakePeripheral* p = FakeFindByConn(conn_id);
+    if(p)
+    {
+        p->connId = 0;
+    }
+    pthread_mutex_unlock(&sFakeMutex);
+}
+
+void
+StartFakeGattJournal(int conn_id, int aDrop)
+{
+    pthread_mutex_lock(&sFakeMutex);
+    sFakeJournalConnId = conn_id;
+    sFakeJournal.clear();
+    sFakeDrop = aDrop;
+    pthread_mutex_unlock(&sFakeMutex);
+}
+
+void
+StopFakeGattJournal(std::vector<FakeGattAccess>& aAccesses)
+{
+    pthread_mutex_lock(&sFakeMutex);
+    sFakeJournalConnId = 0;
+    sFakeDrop = 0;
+    aAccesses.swap(sFakeJournal);
+    sFakeJournal.clear();
+    pthread_mutex_unlock(&sFakeMutex);
+}
+
+const btgatt_interface_t*
+GetFakeGattInterface()
+{
+    sFakeClient.register_client = FakeRegisterClient;
+    sFakeClient.unregister_client = FakeUnregisterClient;
+    sFakeClient.scan = FakeScan;
+    sFakeClient.connect = FakeConnect;
+    sFakeClient.disconnect = FakeDisconnect;
+    sFakeClient.listen = FakeListen;
+    sFakeClient.refresh = FakeRefresh;
+    sFakeClient.search_service = FakeSearchService;
+    sFakeClient.get_included_service = FakeGetIncludedService;
+    sFakeClient.get_characteristic = FakeGetCharacteristic;
+    sFakeClient.get_descriptor = FakeGetDescriptor;
+    sFakeClient.read_characteristic = FakeReadCharacteristic;
+    sFakeClient.write_characteristic = FakeWriteCharacteristic;
+    sFakeClient.read_descriptor = FakeReadDescriptor;
+    sFakeClient.write_descriptor = FakeWriteDescriptor;
+    sFakeClient.execute_write = FakeExecuteWrite;
+    sFakeClient.register_for_notification = FakeRegisterForNotification;
+    sFakeClient.deregister_for_notification = FakeDeregisterForNotification;
+    sFakeClient.read_remote_rssi = FakeReadRemoteRssi;
+    sFakeClient.get_device_type = FakeGetDeviceType;
+    sFakeClient.set_adv_data = FakeSetAdvData;
+    sFakeClient.test_command = FakeTestCommand;
+#ifdef MOZ_BT_GATT_MTU
+    sFakeClient.configure_mtu = FakeConfigureMtu;
+#endif
+#ifdef MOZ_BT_GATT_CONN_PARAMS
+    sFakeClient.conn_parameter_update = FakeConnParameterUpdate;
+#endif
+
+    sFakeInterface.size = sizeof(sFakeInterface);
+    sFakeInterface.init = FakeInit;
+    sFakeInterface.cleanup = FakeCleanup;
+    sFakeInterface.client = &sFakeClient;
+    sFakeInterface.server = NULL;
+
+    return &sFakeInterface;
+}
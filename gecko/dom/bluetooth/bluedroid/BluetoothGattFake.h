@@ -0,0 +1,72 @@
+#ifndef mozilla_dom_bluetooth_bluedroid_bluetoothgattfake_h__
+#define mozilla_dom_bluetooth_bluedroid_bluetoothgattfake_h__
+
+#include <hardware/bluetooth.h>
+#include <hardware/bt_gatt.h>
+
+#include <vector>
+
+/**
+ * In-process stand-in for bluedroid's GATT client, used to drive
+ * BluetoothGatt without a controller. It serves scripted peripherals and
+ * runs every callback on its own thread, as the real stack does.
+ *
+ * The script is read from $OWB_GATT_FAKE_SCRIPT, one directive per line:
+ *
+ *   latency <ms>                    delay before each callback
+ *   error <percent>                 share of requests that fail
+ *   congest <percent>               share of write commands refused
+ *   adv <ms>                        advertising interval while scanning
+ *   device <bdaddr> <rssi> <name>   starts a peripheral
+ *   service <uuid> [secondary]      starts a service of the last device
+ *   char <uuid> <prop> [notify_ms] [hex value]
+ *   descr <uuid> [hex value]
+ *
+ * UUIDs are either 16-bit ("2a37") or full. A characteristic with a
+ * notify_ms sends a notification that often once registered for. Without
+ * a script a single heart rate sensor is served.
+ */
+const btgatt_interface_t* GetFakeGattInterface();
+
+/**
+ * Queues aCount callbacks for a benchmark, aRateHz per second or all at
+ * once if 0: scan results from a set of synthetic devices, or
+ * notifications of the first characteristic notifications are enabled
+ * for when aNotify. Returns false if the fake is not running or, for
+ * notifications, nothing is registered.
+ */
+bool StartFakeGattFlood(bool aNotify, int aCount, int aRateHz);
+
+// A read or write the fake got while recording, see StartFakeGattJournal
+struct FakeGattAccess
+{
+  bool write;
+  bool descriptor;
+  // 0 for reads
+  int writeType;
+  std::vector<uint8_t> value;
+};
+
+/**
+ * Connects the first peripheral without calling back, for a self-test
+ * that drives the stack on its own, and fills in the first characteristic
+ * of its first service. Returns the conn_id, or 0 if the fake is not
+ * running, the peripheral is connected already or it has no
+ * characteristic.
+ */
+int ConnectFakeGattPeripheral(btgatt_srvc_id_t* aSrvcId, btgatt_gatt_id_t* aCharId);
+
+/* Disconnects a peripheral ConnectFakeGattPeripheral connected, silently too */
+void DisconnectFakeGattPeripheral(int conn_id);
+
+/**
+ * Records the reads and writes of conn_id the fake gets from now on, in
+ * the order it gets them, and leaves the next aDrop of them unanswered as
+ * a stack that lost their callbacks would.
+ */
+void StartFakeGattJournal(int conn_id, int aDrop);
+
+/* Stops recording and hands over what was recorded */
+void StopFakeGattJournal(std::vector<FakeGattAccess>& aAccesses);
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef mozilla_dom_bluetooth_bluedroid_bluetoothgattrequest_h__
+#define mozilla_dom_bluetooth_bluedroid_bluetoothgattrequest_h__
+
+#include <string.h>
+
+#include <hardware/bluetooth.h>
+#include <hardware/bt_gatt.h>
+
+#include "nsTArray.h"
+
+/**
+ * A BluetoothGattOperate request in its parsed form, so a caller holding
+ * binary addresses, UUIDs and values can hand them over as they are rather
+ * than formatting them into strings that are parsed again per call.
+ *
+ * type is the BleFunType of the request. Which fields are read depends on
+ * it, following the string parameters of the same request:
+ *
+ *   scanDevice                 clientIf, enable (start)
+ *   connectBle                 clientIf, bdAddr, enable (direct)
+ *   disConnectBle              clientIf, bdAddr, connId
+ *   refresh, readRemoteRssi    clientIf, bdAddr
+ *   searchService              connId, uuid if hasUuid
+ *   getIncludeService          connId, srvcId, inclSrvcId if hasInclSrvcId
+ *   getCharacteristic          connId, srvcId, charId if hasCharId
+ *   getDescriptor              connId, srvcId, charId, descrId if hasDescrId
+ *   readCharacteristic         connId, srvcId, charId, authReq, priority
+ *   writeCharacteristic        as read, plus writeType and value
+ *   readDescriptor             connId, srvcId, charId, descrId, authReq, priority
+ *   writeDescriptor            as read, plus writeType and value
+ *   executeWrite               connId, execute
+ *   (de)registerForNotification  clientIf, bdAddr, srvcId, charId
+ *
+ * A negative priority picks the default of the operation. A written value
+ * is limited to 512 bytes like in string form, except for a Write Command,
+ * which is split by ATT_MTU.
+ */
+struct BluetoothGattRequest
+{
+  explicit BluetoothGattRequest(uint32_t aType)
+    : type(aType), clientIf(0), connId(0), enable(false), execute(0),
+      hasUuid(false), hasInclSrvcId(false), hasCharId(false),
+      hasDescrId(false), writeType(0), authReq(0), priority(-1)
+  {
+    memset(&bdAddr, 0, sizeof(bdAddr));
+    memset(&uuid, 0, sizeof(uuid));
+    memset(&srvcId, 0, sizeof(srvcId));
+    memset(&inclSrvcId, 0, sizeof(inclSrvcId));
+    memset(&charId, 0, sizeof(charId));
+    memset(&descrId, 0, sizeof(descrId));
+  }
+
+  uint32_t type;
+  int clientIf;
+  int connId;
+  bt_bdaddr_t bdAddr;
+  bool enable;
+  int execute;
+  bool hasUuid;
+  bt_uuid_t uuid;
+  btgatt_srvc_id_t srvcId;
+  bool hasInclSrvcId;
+  btgatt_srvc_id_t inclSrvcId;
+  bool hasCharId;
+  btgatt_gatt_id_t charId;
+  bool hasDescrId;
+  btgatt_gatt_id_t descrId;
+  int writeType;
+  int authReq;
+  int priority;
+  nsTArray<uint8_t> value;
+};
+
+/**
+ * Runs aRequest as BluetoothGattOperate would the same request in string
+ * form. The value buffer of a write is taken over rather than copied, so
+ * it is empty on return. Returns false if the request type is not one of
+ * the above or the stack refused it.
+ */
+bool BluetoothGattSubmitRequest(BluetoothGattRequest& aRequest);
+
+#endif